@@ -16,8 +16,10 @@
 #ifndef CHESS_DETECTOR_H
 #define CHESS_DETECTOR_H
 
+#include <algorithm>
 #include <cassert>
 #include <limits>
+#include <vector>
 
 #include <cv.h>
 #include <highgui.h>
@@ -45,7 +47,10 @@ public:
     m_image_points(NULL),
     m_point_counts(NULL),
     m_count(count),
-    m_curr(0) {
+    m_curr(0),
+    m_coarse(1),
+    m_small(NULL),
+    m_window(cvRect(0, 0, 0, 0)) {
 
     assert(m_skip * m_count < std::numeric_limits<int>::max());
 
@@ -78,6 +83,23 @@ public:
     if(m_object_points) delete [] m_object_points;
     if(m_image_points) delete [] m_image_points;
     if(m_point_counts) delete [] m_point_counts;
+    if(m_small) cvReleaseImage(&m_small);
+  }
+
+  /**
+   * Search the chessboard on the image downsampled by the factor, and
+   * refine the corners at the full resolution only if found (and not
+   * skipped).  The chessboard is tracked, i.e., searched first in the
+   * window around the chessboard of the last image, and then in the
+   * whole image if not found there.
+   *
+   * @param factor [in] 1 (the full resolution, by default), 2 or 4
+   */
+  void set_coarse(int factor) {
+    assert(factor == 1 || factor == 2 || factor == 4);
+    m_coarse = factor;
+    m_window = cvRect(0, 0, 0, 0);
+    if(m_small) cvReleaseImage(&m_small);
   }
 
   int count() const {
@@ -88,6 +110,14 @@ public:
     return count() == m_count;
   }
 
+  /**
+   * @param i [in] index of the chessboard found, in [0:count())
+   * @return the rows*cols corners refined of the chessboard
+   */
+  const CvPoint2D64d * image_points(int i) const {
+    return m_image_points + m_num_points * i;
+  }
+
   enum {
     CHESS_NOTFOUND = 0,
     CHESS_SKIPPED = 1,
@@ -97,9 +127,7 @@ public:
   int find(const IplImage * image) {
     if(is_full()) return CHESS_SKIPPED;
 
-    int corner_count = m_num_points;
-    int ret = cvFindChessboardCorners(image, m_pattern_size, m_corners, &corner_count);
-    if( ret == 0 || corner_count != m_num_points) {
+    if(! (m_coarse > 1 ? search_tracked(image) : search(image, m_pattern_size, m_corners))) {
       return CHESS_NOTFOUND;
     }
 
@@ -108,9 +136,7 @@ public:
       return CHESS_SKIPPED;
     }
 
-    cvFindCornerSubPix(image, m_corners, corner_count,
-                       cvSize(5, 5), cvSize(-1, -1),
-                       cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,10,0.1));
+    refine(image, m_corners, m_num_points);
     
     //fprintf(stdout, "# %d\n", m_curr/m_skip);
     for(int i=0 ; i<m_num_points ; i++) {
@@ -125,6 +151,50 @@ public:
     return CHESS_FOUND;
   }
 
+  /**
+   * Find all the corners of the chessboard in the image
+   *
+   * @param gray [in] grayscale image
+   * @param corners [out] pattern_size.width*pattern_size.height corners
+   * @return true if all the corners are found
+   */
+  static bool search(const IplImage * gray, CvSize pattern_size, CvPoint2D32f * corners) {
+    const int n = pattern_size.width * pattern_size.height;
+    int count = n;
+    return cvFindChessboardCorners(gray, pattern_size, corners, &count) && count == n;
+  }
+
+  /**
+   * Refine the corners found by search() into sub-pixel
+   */
+  static void refine(const IplImage * gray, CvPoint2D32f * corners, int n) {
+    cvFindCornerSubPix(gray, corners, n,
+                       cvSize(5, 5), cvSize(-1, -1),
+                       cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,10,0.1));
+  }
+
+  /**
+   * Coarse check of the chessboard on the image downsampled into
+   * small, which is much faster than search() at the full resolution
+   * and rejects most of the images without the chessboard.  A
+   * chessboard too small to be found in the downsampled image is also
+   * rejected.
+   *
+   * @param gray [in] grayscale image
+   * @param small [in] work image of the downsampled size
+   * @return true if all the corners are found in the downsampled image
+   */
+  static bool precheck(const IplImage * gray, CvSize pattern_size, IplImage * small) {
+    cvResize(gray, small, CV_INTER_AREA);
+    std::vector<CvPoint2D32f> corners(pattern_size.width * pattern_size.height);
+    int count = corners.size();
+    int flags = CV_CALIB_CB_ADAPTIVE_THRESH + CV_CALIB_CB_NORMALIZE_IMAGE;
+#ifdef CV_CALIB_CB_FAST_CHECK
+    flags |= CV_CALIB_CB_FAST_CHECK;
+#endif
+    return cvFindChessboardCorners(small, pattern_size, &corners[0], &count, flags) && count == (int)corners.size();
+  }
+
   void draw_chessboard(IplImage * buf, int retval) const {
     if(retval != CHESS_FOUND) return;
     cvDrawChessboardCorners(buf, m_pattern_size, m_corners, m_pattern_size.width * m_pattern_size.height, retval != CHESS_NOTFOUND);
@@ -188,6 +258,73 @@ private:
   int * m_point_counts;
   const int m_count;
   int m_curr;
+
+  /// downsampling of the search (see set_coarse())
+  int m_coarse;
+  /// the image downsampled
+  IplImage * m_small;
+  /// the window around the last chessboard found, or empty
+  CvRect m_window;
+
+  /**
+   * Search in the window, and then in the whole image if not found.
+   * The corners found are of the full resolution, but not refined.
+   */
+  bool search_tracked(const IplImage * image) {
+    const int W = image->width / m_coarse * m_coarse;
+    const int H = image->height / m_coarse * m_coarse;
+    if(! m_small) {
+      m_small = cvCreateImage(cvSize(W / m_coarse, H / m_coarse), IPL_DEPTH_8U, 1);
+    }
+
+    bool found = m_window.width > 0 && search_coarse(image, m_window);
+    if(! found) {
+      found = search_coarse(image, cvRect(0, 0, W, H));
+    }
+    if(! found) {
+      m_window = cvRect(0, 0, 0, 0);
+      return false;
+    }
+
+    // the window is the bounding box of the corners grown by its size
+    // on each side, which includes the outer squares and the motion
+    float x0 = m_corners[0].x, x1 = x0, y0 = m_corners[0].y, y1 = y0;
+    for(int i=1 ; i<m_num_points ; i++) {
+      x0 = std::min(x0, m_corners[i].x);
+      x1 = std::max(x1, m_corners[i].x);
+      y0 = std::min(y0, m_corners[i].y);
+      y1 = std::max(y1, m_corners[i].y);
+    }
+    const float margin = std::max(x1 - x0, y1 - y0);
+    const int left = std::max(0, (int)(x0 - margin) / m_coarse * m_coarse);
+    const int top = std::max(0, (int)(y0 - margin) / m_coarse * m_coarse);
+    const int right = std::min(W, ((int)(x1 + margin) / m_coarse + 1) * m_coarse);
+    const int bottom = std::min(H, ((int)(y1 + margin) / m_coarse + 1) * m_coarse);
+    m_window = cvRect(left, top, right - left, bottom - top);
+    return true;
+  }
+
+  /**
+   * Search in the rect (of multiples of m_coarse) of the image
+   * downsampled into m_small
+   */
+  bool search_coarse(const IplImage * image, CvRect rect) {
+    CvMat src, dst;
+    cvGetSubRect(image, &src, rect);
+    cvGetSubRect(m_small, &dst, cvRect(0, 0, rect.width / m_coarse, rect.height / m_coarse));
+    cvResize(&src, &dst, CV_INTER_AREA);
+
+    int count = m_num_points;
+    if(! cvFindChessboardCorners(&dst, m_pattern_size, m_corners, &count) || count != m_num_points) {
+      return false;
+    }
+    // the pixel centres of the downsampled image
+    for(int i=0 ; i<m_num_points ; i++) {
+      m_corners[i].x = rect.x + (m_corners[i].x + 0.5f) * m_coarse - 0.5f;
+      m_corners[i].y = rect.y + (m_corners[i].y + 0.5f) * m_coarse - 0.5f;
+    }
+    return true;
+  }
   
   static void draw_mark(IplImage * buf, CvScalar color) {
     cvRectangle(buf, cvPoint(0,0), cvPoint(buf->width-1, buf->height-1), color, 16, 8, 0);
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   image_filter.h
+ *
+ * @brief  In-place correction of the Bayer image of a camera
+ *
+ * A filter given to a reader (e.g., RAWFile::set_filter()) is applied
+ * to every image read, so that the consumers see the corrected images
+ * without knowing the filter (see DefectCorrector of libpfcmu).
+ */
+#ifndef PFCMU_IMAGE_FILTER_H
+#define PFCMU_IMAGE_FILTER_H
+
+#include <cstddef>
+
+#include "pfcmu_config.h"
+
+namespace PFCMU {
+  class ImageFilter {
+  public:
+    virtual ~ImageFilter() {
+    }
+
+    /**
+     * Correct an image in place.  Should be thread-safe, i.e.,
+     * different images can be corrected concurrently.
+     *
+     * @param image [in,out] width*height bytes of the camera
+     * @param camera [in] camera index [0:CAMS-1]
+     */
+    virtual void apply(unsigned char * image, int camera) const = 0;
+
+    /**
+     * Correct all the CAMS images of a frame in place
+     *
+     * @param frame [in,out] CAMS images of width*height bytes
+     * @param bytes [in] width*height
+     */
+    void apply_frame(void * frame, size_t bytes) const {
+      unsigned char * p = static_cast<unsigned char *>(frame);
+      for(int i=0 ; i<PFCMU::CAMS ; i++) {
+        apply(p + bytes * i, i);
+      }
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#ifndef LATEST_VALUE_H
+#define LATEST_VALUE_H
+
+#include <boost/thread.hpp>
+
+/**
+ * Single-slot queue between pipeline stages. put() overwrites the
+ * value not taken yet, so that a slow consumer always gets the latest
+ * one instead of stalling the producer.
+ */
+template<typename T>
+class LatestValue {
+public:
+  typedef T value_t;
+
+  LatestValue() : m_seq(0), m_taken(true), m_dropped(0), m_closed(false) {
+  }
+
+  void put(const value_t & v) {
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      if(! m_taken) {
+        m_dropped++;
+      }
+      m_value = v;
+      m_seq++;
+      m_taken = false;
+    }
+    m_cond.notify_all();
+  }
+
+  /**
+   * Wait for a value newer than *seq
+   *
+   * @param v [out] the latest value
+   * @param seq [in/out] seq of the value already taken (0 = none), updated to that of v
+   * @param timeout_ms [in] timeout in msec (negative = infinite)
+   * @return false on timeout, or if close()d and nothing newer is left
+   */
+  bool get(value_t * v, unsigned long long * seq, int timeout_ms = -1) {
+    boost::mutex::scoped_lock lock(m_mutex);
+    const boost::system_time until = boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+    while(! m_closed && m_seq == *seq) {
+      if(timeout_ms < 0) {
+        m_cond.wait(lock);
+      } else if(! m_cond.timed_wait(lock, until)) {
+        break;
+      }
+    }
+    if(m_seq == *seq) {
+      return false;
+    }
+    *v = m_value;
+    *seq = m_seq;
+    m_taken = true;
+    return true;
+  }
+
+  /// wake up all the waiters, get() fails once the last value is taken
+  void close() {
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_closed = true;
+    }
+    m_cond.notify_all();
+  }
+
+  bool closed() const {
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_closed;
+  }
+
+  /// num of values overwritten before taken
+  unsigned long long dropped() const {
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_dropped;
+  }
+
+private:
+  LatestValue(const LatestValue &); // to disable "object copy"
+
+  value_t m_value;
+  unsigned long long m_seq;
+  bool m_taken;
+  unsigned long long m_dropped;
+  bool m_closed;
+  mutable boost::mutex m_mutex;
+  boost::condition_variable m_cond;
+};
+
+#endif //LATEST_VALUE_H
@@ -7,10 +7,19 @@
 #ifndef LENS_H
 #define LENS_H
 
+#include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <unistd.h>
 
 #include "my_cvundistort.h"
+#include "libpfcmu/remap.h"
+#include "libpfcmu/lens_model.h"
+#include "libpfcmu/checksum.h"
+#include "trace.h"
 
 struct incalib_t {
   double f;
@@ -25,6 +34,9 @@ struct incalib_t {
   CvMat * mapx;
   CvMat * mapy;
 
+  /// fixed-point table set up by setup_cached(), used instead of the maps
+  PFCMU::RemapTable table;
+
   incalib_t() : mapx(NULL), mapy(NULL) {
   }
 
@@ -33,6 +45,7 @@ struct incalib_t {
   }
 
   void clear() {
+    table.clear();
     if(mapx) {
       cvReleaseMat(&mapx);
       mapx = NULL;
@@ -50,41 +63,164 @@ struct incalib_t {
     ifs.close();
   }
 
-  void setup(int width, int height) {
+  /**
+   * @return the parameters for PFCMU::LensModel
+   */
+  PFCMU::lens_t lens() const {
+    PFCMU::lens_t l = { f, f, u0, v0, k1, k2, p1, p2 };
+    return l;
+  }
+
+  /**
+   * Set up the float maps of cvInitUndistortMap
+   *
+   * @param model [in] threads computing the maps (NULL = the calling thread)
+   */
+  void setup(int width, int height, PFCMU::LensModel * model = NULL) {
     clear();
 
     mapx = cvCreateMat(height,width,CV_32FC1);
     mapy = cvCreateMat(height,width,CV_32FC1);
 
-    CvMat * A = cvCreateMat(3,3,CV_32FC1);
-    CvMat * k = cvCreateMat(1,4,CV_32FC1);
-    cvmSet(A, 0, 0, f);
-    cvmSet(A, 0, 1, 0);
-    cvmSet(A, 0, 2, u0);
-    cvmSet(A, 1, 0, 0);
-    cvmSet(A, 1, 1, f);
-    cvmSet(A, 1, 2, v0);
-    cvmSet(A, 2, 0, 0);
-    cvmSet(A, 2, 1, 0);
-    cvmSet(A, 2, 2, 1);
-    cvmSet(k, 0, 0, k1);
-    cvmSet(k, 0, 1, k2);
-    cvmSet(k, 0, 2, p1);
-    cvmSet(k, 0, 3, p2);
-
-    cvInitUndistortMap(A, k, mapx, mapy);
-
-    cvReleaseMat(&A);
-    cvReleaseMat(&k);
+    PFCMU::LensModel local;
+    (model ? model : &local)->forward(lens(), PFCMU::crop_t::whole(width, height), width, height,
+                                      mapx->data.fl, mapy->data.fl, mapx->step / sizeof(float));
+  }
+
+  /**
+   * Load the parameters and set up the fixed-point table instead of
+   * the float maps.  The table is cached in cache_dir, keyed by the
+   * CRC32C of the calibration file, so that the later processes just
+   * mmap it.  The table remaps by bilinear interpolation.
+   *
+   * An output size smaller than the images gives the downscaled
+   * undistorted images, by undistort() of the same size or by
+   * demosaic_undistort() of the Bayer images in one pass.
+   *
+   * @param filename [in] calibration file (see load())
+   * @param width [in] width of the images
+   * @param height [in] height of the images
+   * @param cache_dir [in] directory of the cached tables (NULL = no cache)
+   * @param out_width [in] width of the output (0 = width)
+   * @param out_height [in] height of the output (0 = height)
+   * @param model [in] threads computing the maps (NULL = the calling thread)
+   * @param dst [out] table set up instead of the own one, e.g., of a
+   *                  PFCMU::Remapper of all the cameras (NULL = the own)
+   * @return 0 if the cached table is used, 1 if built, negative on error
+   */
+  int setup_cached(const char * filename, int width, int height, const char * cache_dir, int out_width = 0, int out_height = 0,
+                   PFCMU::LensModel * model = NULL, PFCMU::RemapTable * dst = NULL) {
+    clear();
+    PFCMU::RemapTable & t = dst ? *dst : table;
+    if(out_width <= 0 || out_height <= 0) {
+      out_width = width;
+      out_height = height;
+    }
+
+    std::ifstream ifs(filename, std::ios::binary);
+    if(! ifs) {
+      return -1;
+    }
+    const std::string text((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    ifs.close();
+    const uint32_t key = PFCMU::checksum::crc32c(text.data(), text.size());
+    load(filename);
+
+    std::string cache;
+    if(cache_dir) {
+      char name[96];
+      snprintf(name, sizeof(name), "/incalib-%08x-%dx%d-%dx%d.remap", key, width, height, out_width, out_height);
+      cache = std::string(cache_dir) + name;
+      if(0 == t.load(cache.c_str(), key)) {
+        return 0;
+      }
+    }
+
+    std::vector<float> fx((size_t)out_width * out_height), fy(fx.size());
+    PFCMU::LensModel local;
+    (model ? model : &local)->forward(lens(), PFCMU::crop_t::whole(width, height), out_width, out_height, &fx[0], &fy[0]);
+    t.build(out_width, out_height, &fx[0], &fy[0], width, height);
+
+    if(cache_dir) {
+      // written aside and renamed, as the other processes may read it
+      char suffix[32];
+      snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+      const std::string tmp = cache + suffix;
+      if(0 != t.save(tmp.c_str(), key) || 0 != rename(tmp.c_str(), cache.c_str())) {
+        TRACE(1, "cannot cache %s\n", cache.c_str());
+        unlink(tmp.c_str());
+      }
+    }
+    return 1;
   }
 
   void undistort(const IplImage * src, IplImage * dst) const {
-    if(mapx && mapy) {
+    if(! table.empty()) {
+      undistort_table(src, dst);
+    } else if(mapx && mapy) {
       cvRemap(src, dst, mapx, mapy, CV_INTER_CUBIC+CV_WARP_FILL_OUTLIERS, cvScalarAll(0));
     } else {
       cvCopyImage(src, dst);
     }
   }
+
+  /**
+   * Demosaic, undistort and scale a Bayer image in one pass by the
+   * table of setup_cached(), without the full-size BGR image
+   *
+   * @param bayer [in] Bayer image (CV_BayerGR2BGR) of the size given to setup_cached()
+   * @param bgr [out] BGR image of the output size given to setup_cached()
+   */
+  void demosaic_undistort(const IplImage * bayer, IplImage * bgr) const {
+    ASSERT(! table.empty());
+    ASSERT(bayer->depth == IPL_DEPTH_8U && bayer->nChannels == 1 && bayer->widthStep == bayer->width);
+    ASSERT(bgr->depth == IPL_DEPTH_8U && bgr->nChannels == 3);
+    ASSERT(bayer->width == table.src_width() && bayer->height == table.src_height());
+    ASSERT(bgr->width == table.width() && bgr->height == table.height());
+    table.apply_bayer(reinterpret_cast<const unsigned char *>(bayer->imageData),
+                      reinterpret_cast<unsigned char *>(bgr->imageData), bgr->widthStep, PFCMU::RemapTable::BAYER_GR);
+  }
+
+private:
+  void undistort_table(const IplImage * src, IplImage * dst) const {
+    ASSERT(src->depth == IPL_DEPTH_8U && dst->depth == IPL_DEPTH_8U && src->nChannels == dst->nChannels);
+    ASSERT(src->width == table.src_width() && src->height == table.src_height());
+    ASSERT(dst->width == table.width() && dst->height == table.height());
+
+    if(src->nChannels == 1 && src->widthStep == src->width) {
+      table.apply(reinterpret_cast<const unsigned char *>(src->imageData),
+                  reinterpret_cast<unsigned char *>(dst->imageData), dst->widthStep);
+      return;
+    }
+
+    // plane by plane
+    ASSERT(src->nChannels <= 4);
+    IplImage * s[4] = { NULL, NULL, NULL, NULL };
+    IplImage * d[4] = { NULL, NULL, NULL, NULL };
+    for(int c=0 ; c<src->nChannels ; c++) {
+      s[c] = cvCreateImage(cvGetSize(src), IPL_DEPTH_8U, 1);
+      d[c] = cvCreateImage(cvGetSize(dst), IPL_DEPTH_8U, 1);
+      ASSERT(s[c]->widthStep == s[c]->width);
+    }
+    if(src->nChannels == 1) {
+      cvCopy(src, s[0]);
+    } else {
+      cvSplit(src, s[0], s[1], s[2], s[3]);
+    }
+    for(int c=0 ; c<src->nChannels ; c++) {
+      table.apply(reinterpret_cast<const unsigned char *>(s[c]->imageData),
+                  reinterpret_cast<unsigned char *>(d[c]->imageData), d[c]->widthStep);
+    }
+    if(dst->nChannels == 1) {
+      cvCopy(d[0], dst);
+    } else {
+      cvMerge(d[0], d[1], d[2], d[3], dst);
+    }
+    for(int c=0 ; c<src->nChannels ; c++) {
+      cvReleaseImage(&s[c]);
+      cvReleaseImage(&d[c]);
+    }
+  }
 };
 
 #endif //LENS_H
@@ -10,7 +10,15 @@
 #include <cxmisc.h>
 #include <cvinternal.h>
 
-inline void my_cvInitUndistortMap( const CvMat* A, const CvMat* dist_coeffs, CvArr* mapxarr, CvArr* mapyarr ) {
+#include "libpfcmu/lens_model.h"
+
+/**
+ * cvInitUndistortMap by PFCMU::LensModel
+ *
+ * @param model [in] threads computing the maps (NULL = the calling thread)
+ */
+inline void my_cvInitUndistortMap( const CvMat* A, const CvMat* dist_coeffs, CvArr* mapxarr, CvArr* mapyarr,
+                                   PFCMU::LensModel* model = NULL ) {
     uchar* buffer = 0;
 
     CV_FUNCNAME( "cvInitUndistortMap" );
@@ -24,8 +32,7 @@ inline void my_cvInitUndistortMap( const CvMat* A, const CvMat* dist_coeffs, CvA
     float *mapx, *mapy;
     CvMat _a = cvMat( 3, 3, CV_32F, a ), _k;
     int mapxstep, mapystep;
-    int u, v;
-    float u0, v0, fx, fy, _fx, _fy, k1, k2, p1, p2;
+    float u0, v0, fx, fy, k1, k2, p1, p2;
     CvSize size;
 
     CV_CALL( _mapx = cvGetMat( _mapx, &mapxstub, &coi1 ));
@@ -61,7 +68,6 @@ inline void my_cvInitUndistortMap( const CvMat* A, const CvMat* dist_coeffs, CvA
 
     u0 = a[2]; v0 = a[5];
     fx = a[0]; fy = a[4];
-    _fx = 1.f/fx; _fy = 1.f/fy;
     k1 = k[0]; k2 = k[1];
     p1 = k[2]; p2 = k[3];
 
@@ -88,25 +94,14 @@ inline void my_cvInitUndistortMap( const CvMat* A, const CvMat* dist_coeffs, CvA
     mapxstep /= sizeof(mapx[0]);
     mapystep /= sizeof(mapy[0]);
 
-    for( v = 0; v < size.height; v++, mapx += mapxstep, mapy += mapystep )
-    {
-        float y = (v - v0)*_fy;
-        float y2 = y*y;
-        float _2p1y = 2*p1*y;
-        float _2p1y2 = 2*p1*y2;
-        float p2y2 = p2*y2;
+    if( mapxstep != mapystep )
+        CV_ERROR( CV_StsUnmatchedSizes, "Both maps must have the same step" );
 
-        for( u = 0; u < size.width; u++ )
-        {
-            float x = (u - u0)*_fx;
-            float x2 = x*x;
-            float r2 = x2 + y2;
-            float d = 1 + (k1 + k2*r2)*r2;
-            float _u = fx*(x*(d + _2p1y) + p2y2 + (3*p2)*x2) + u0;
-            float _v = fy*(y*(d + (2*p2)*x) + _2p1y2 + p1*x2) + v0;
-            mapx[u] = _u;
-            mapy[u] = _v;
-        }
+    {
+        PFCMU::lens_t lens = { fx, fy, u0, v0, k1, k2, p1, p2 };
+        PFCMU::LensModel local;
+        (model ? model : &local)->forward( lens, PFCMU::crop_t::whole(size.width, size.height),
+                                           size.width, size.height, mapx, mapy, mapxstep );
     }
 
     __END__;
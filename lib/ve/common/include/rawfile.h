@@ -7,25 +7,37 @@
 #ifndef PFCMU_RAWFILE_H
 #define PFCMU_RAWFILE_H
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <vector>
 #include <inttypes.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <opencv/cxcore.h>
 
 #include "trace.h"
 #include "pfcmu_config.h"
+#include "stripe_layout.h"
+#include "take_volume.h"
+#include "image_filter.h"
 
 namespace PFCMU {
+  /**
+   * Recording of all the cameras, frame by frame
+   *
+   * The filename can be a manifest of a recording striped over several
+   * disks or segmented into several files (see StripeLayout), which is
+   * read as a single recording, or a take of a volume "DEVICE#TAKE" (see
+   * TakeVolume).
+   */
   class RAWFile {
   public:
     class const_iterator {
-      FILE * m_fp;
+      const RAWFile * m_file;
       off64_t m_frame;
-      int m_width;
-      int m_height;
     public:
-      const_iterator(FILE *, off64_t, int, int);
+      const_iterator(const RAWFile *, off64_t);
 
       void extract(int camid, IplImage * bayer_img) const;
       off64_t frame() const {
@@ -61,13 +73,47 @@ namespace PFCMU {
     }
 
     const_iterator at(off64_t index) const {
-      return const_iterator(m_fp, index, m_width, m_height);
+      return const_iterator(this, index);
     }
 
     size_t size() const {
       return m_size;
     }
 
+    /**
+     * Read all the CAMS images of a frame at once
+     *
+     * @param index [in] frame index [0:size()-1]
+     * @param buf [out] width*height*CAMS bytes
+     */
+    void read(off64_t index, void * buf) const;
+
+    /**
+     * @param index [in] frame index [0:size()-1]
+     * @return the framecount embedded in the first image of the frame
+     */
+    timestamp_t framecount_at(off64_t index) const;
+
+    /**
+     * Binary search of a framecount, assuming the framecounts increase monotonically
+     *
+     * @return the index of the first frame whose framecount is not less than fc (size() if none)
+     */
+    off64_t lower_bound(timestamp_t fc) const;
+
+    /**
+     * Let the kernel start reading frames in [index:index+frames) (posix_fadvise)
+     */
+    void prefetch(off64_t index, size_t frames) const;
+
+    /**
+     * Correct every image read by read() and extract() (e.g., by a
+     * DefectCorrector), or not if NULL.  The filter is not owned.
+     */
+    void set_filter(const ImageFilter * filter) {
+      m_filter = filter;
+    }
+
     static size_t framecount(const char * filename, size_t blocksize) {
       struct stat64 buf;
       int ret = stat64(filename, &buf);
@@ -78,58 +124,165 @@ namespace PFCMU {
     }
 
   private:
-    FILE * m_fp;
+    void close();
+
+    /**
+     * Seek to a position in a frame
+     *
+     * @param index [in] frame index
+     * @param offset [in] bytes from the beginning of the frame
+     * @return the file positioned
+     */
+    FILE * seek(off64_t index, off64_t offset) const;
+
+    /// a file per stripe
+    std::vector<FILE *> m_fps;
+    StripeLayout m_layout;
+    /// bytes before the first frame in the file (offset of the take)
+    off64_t m_base;
+    const ImageFilter * m_filter;
     size_t m_size;
     int m_width;
     int m_height;
   };
 }
 
-inline PFCMU::RAWFile::RAWFile() : m_fp(NULL) {
+inline PFCMU::RAWFile::RAWFile() : m_base(0), m_filter(NULL), m_size(0) {
 }
 
 inline PFCMU::RAWFile::~RAWFile() {
-  if(m_fp) {
-    fclose(m_fp);
-    m_fp = NULL;
+  close();
+}
+
+inline void PFCMU::RAWFile::close() {
+  for(unsigned int i=0 ; i<m_fps.size() ; i++) {
+    fclose(m_fps[i]);
   }
+  m_fps.clear();
 }
 
 inline void PFCMU::RAWFile::open(const char * filename, int width, int height) {
-  if(m_fp) {
-    fclose(m_fp);
-    m_fp = NULL;
-  }
+  close();
 
-  m_fp = fopen64(filename, "r");
+  const size_t blocksize = width*height*PFCMU::CAMS;
+  std::string device, take;
+  struct stat64 st;
+  off64_t take_frames = -1;
+  m_base = 0;
+  if(0 == m_layout.load(filename)) {
+    if(m_layout.blocksize != blocksize) {
+      DIE(1, "%s is recorded by %zd bytes/frame, not %zd\n", filename, m_layout.blocksize, blocksize);
+    }
+  } else if(0 != stat64(filename, &st) && TakeVolume::split(filename, &device, &take)) {
+    TakeVolume volume;
+    if(0 != volume.load(device.c_str())) {
+      DIE(1, "%s is not a volume\n", device.c_str());
+    }
+    const int t = volume.find(take);
+    if(t < 0) {
+      DIE(1, "no take %s in %s\n", take.c_str(), device.c_str());
+    }
+    if(volume.takes()[t].blocksize != blocksize) {
+      DIE(1, "%s is recorded by %zd bytes/frame, not %zd\n", filename, volume.takes()[t].blocksize, blocksize);
+    }
+    if(volume.takes()[t].open) {
+      fprintf(stderr, "WARNING: %s is open, the frames after the last recorded are garbage.\n", filename);
+    }
+    m_layout = StripeLayout();
+    m_layout.blocksize = blocksize;
+    m_layout.paths.push_back(device);
+    m_base = volume.takes()[t].offset;
+    take_frames = volume.capacity(t);
+  } else {
+    m_layout = StripeLayout();
+    m_layout.blocksize = blocksize;
+    m_layout.paths.push_back(filename);
+  }
 
-  if(!m_fp) {
-    DIE(1, "cannot open %s\n", filename);
+  std::vector<off64_t> blocks;
+  for(int i=0 ; i<m_layout.stripes() ; i++) {
+    FILE * fp = fopen64(m_layout.paths[i].c_str(), "r");
+    if(!fp) {
+      DIE(1, "cannot open %s\n", m_layout.paths[i].c_str());
+    }
+    m_fps.push_back(fp);
+    blocks.push_back(framecount(m_layout.paths[i].c_str(), blocksize));
   }
 
-  m_size = framecount(filename, width*height*PFCMU::CAMS);
+  m_size = take_frames >= 0 ? take_frames : m_layout.frames(blocks);
   m_width = width;
   m_height = height;
 }
 
-inline PFCMU::RAWFile::const_iterator::const_iterator(FILE * fp, off64_t frame, int w, int h) : m_fp(fp), m_frame(frame), m_width(w), m_height(h) {
+inline FILE * PFCMU::RAWFile::seek(off64_t index, off64_t offset) const {
+  const off64_t bytes = (off64_t)m_width * m_height * PFCMU::CAMS;
+  FILE * fp = m_fps[m_layout.stripe_of(index)];
+  if(fseeko64(fp, m_base + m_layout.offset_of(index) * bytes + offset, SEEK_SET)) {
+    DIE(1, "cannot seek to %zd\n", index);
+  }
+  return fp;
 }
 
-inline void PFCMU::RAWFile::const_iterator::extract(int i, IplImage * img) const {
-  off64_t ret = fseeko64(m_fp, m_frame*m_width*m_height*PFCMU::CAMS+m_width*m_height*i, SEEK_SET);
-  if(ret) {
-    DIE(1, "cannot seek to %zd[%d]\n", m_frame, i);
+inline void PFCMU::RAWFile::read(off64_t index, void * buf) const {
+  const size_t bytes = (size_t)m_width * m_height * PFCMU::CAMS;
+  if(1 != fread(buf, bytes, 1, seek(index, 0))) {
+    DIE(1, "cannot read at %zd\n", index);
+  }
+  if(m_filter) {
+    m_filter->apply_frame(buf, (size_t)m_width * m_height);
+  }
+}
+
+inline PFCMU::timestamp_t PFCMU::RAWFile::framecount_at(off64_t index) const {
+  uint32_t v;
+  if(1 != fread(&v, sizeof(v), 1, seek(index, 0))) {
+    DIE(1, "cannot read at %zd\n", index);
+  }
+  return PFCMU::get_timestamp(&v);
+}
+
+inline off64_t PFCMU::RAWFile::lower_bound(timestamp_t fc) const {
+  off64_t lo = 0, hi = m_size;
+  while(lo < hi) {
+    const off64_t mid = (lo + hi) / 2;
+    if(framecount_at(mid) < fc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
+  return lo;
+}
 
-  ASSERT(img->widthStep == m_width);
-  ASSERT(img->height == m_height);
+inline void PFCMU::RAWFile::prefetch(off64_t index, size_t frames) const {
+  const off64_t bytes = (off64_t)m_width * m_height * PFCMU::CAMS;
+  const off64_t end = std::min(index + (off64_t)frames, (off64_t)m_size);
+  for(off64_t i=index ; i<end ; ) {
+    const off64_t n = std::min(end - i, m_layout.contiguous(i));
+    posix_fadvise(fileno(m_fps[m_layout.stripe_of(i)]), m_base + m_layout.offset_of(i) * bytes, n * bytes, POSIX_FADV_WILLNEED);
+    i += n;
+  }
+}
+
+inline PFCMU::RAWFile::const_iterator::const_iterator(const RAWFile * file, off64_t frame) : m_file(file), m_frame(frame) {
+}
+
+inline void PFCMU::RAWFile::const_iterator::extract(int i, IplImage * img) const {
+  const int W = m_file->m_width;
+  const int H = m_file->m_height;
+
+  ASSERT(img->widthStep == W);
+  ASSERT(img->height == H);
   ASSERT(img->nChannels == 1);
   ASSERT(img->depth == IPL_DEPTH_8U);
 
-  size_t blocks = fread(img->imageData, m_width*m_height, 1, m_fp);
+  size_t blocks = fread(img->imageData, W*H, 1, m_file->seek(m_frame, (off64_t)W*H*i));
   if( blocks != 1 ) {
     DIE(1, "cannot read at %zd[%d]\n", m_frame, i);
   }
+  if(m_file->m_filter) {
+    m_file->m_filter->apply(reinterpret_cast<unsigned char *>(img->imageData), i);
+  }
 }
 
 inline PFCMU::RAWFile::const_iterator & PFCMU::RAWFile::const_iterator::operator+=(const int &i) {
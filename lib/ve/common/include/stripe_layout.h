@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   stripe_layout.h
+ *
+ * @brief  Layout of a recording striped or segmented over several files
+ *
+ * Striped: frames are grouped into chunks of `chunk` frames, and the
+ * chunks are written round-robin to the stripes (disks).
+ *
+ * Segmented: every `segment` frames go to the next file (segment), so
+ * that a recording can grow without knowing its length in advance.
+ *
+ * The layout is stored in a small text file (manifest) in place of the
+ * recording, e.g.,
+ *
+ *   #PFCMU-STRIPE 1
+ *   blocksize 7372800
+ *   chunk 1
+ *   stripe /disks/sdb/out.dat
+ *   stripe /disks/sdc/out.dat
+ *
+ * or
+ *
+ *   #PFCMU-STRIPE 1
+ *   blocksize 7372800
+ *   segment 10000
+ *   stripe out.dat.000000
+ *   stripe out.dat.000001
+ *
+ * Relative stripe paths are relative to the directory of the manifest.
+ * In both cases a file is called a stripe below.
+ */
+#ifndef STRIPE_LAYOUT_H
+#define STRIPE_LAYOUT_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "path_util.h"
+
+namespace PFCMU {
+  struct StripeLayout {
+    /// bytes per frame
+    size_t blocksize;
+    /// frames per chunk
+    int chunk;
+    /// frames per segment, or 0 if striped
+    off64_t segment;
+    std::vector<std::string> paths;
+
+    StripeLayout() : blocksize(0), chunk(1), segment(0) {
+    }
+
+    int stripes() const {
+      return paths.size();
+    }
+
+    /// the stripe of the frame
+    int stripe_of(off64_t index) const {
+      if(segment) {
+        return index / segment;
+      }
+      return (index / chunk) % stripes();
+    }
+
+    /// the block position of the frame in its stripe
+    off64_t offset_of(off64_t index) const {
+      if(segment) {
+        return index % segment;
+      }
+      return (index / chunk / stripes()) * chunk + index % chunk;
+    }
+
+    /// num of frames from index which are contiguous in its stripe
+    off64_t contiguous(off64_t index) const {
+      if(segment) {
+        return segment - index % segment;
+      }
+      return chunk - index % chunk;
+    }
+
+    /**
+     * @param stripe [in] stripe ID
+     * @param count [in] num of frames
+     * @return num of blocks written to the stripe for frames [0:count-1]
+     */
+    off64_t blocks_on(int stripe, off64_t count) const {
+      if(segment) {
+        return std::max((off64_t)0, std::min(segment, count - stripe * segment));
+      }
+      const off64_t chunks = count / chunk;
+      const off64_t rest = count % chunk;
+      off64_t n = (chunks / stripes()) * chunk;
+      if(stripe < chunks % stripes()) {
+        n += chunk;
+      } else if(stripe == chunks % stripes()) {
+        n += rest;
+      }
+      return n;
+    }
+
+    /**
+     * @param blocks [in] num of blocks available in each stripe
+     * @return num of frames readable without a gap
+     */
+    off64_t frames(const std::vector<off64_t> & blocks) const {
+      if(segment) {
+        off64_t n = 0;
+        for(int i=0 ; i<stripes() ; i++) {
+          n += std::min(segment, blocks[i]);
+          if(blocks[i] < segment) {
+            break;
+          }
+        }
+        return n;
+      }
+
+      off64_t n = -1;
+      for(int i=0 ; i<stripes() ; i++) {
+        // the frame which would be the next block of the stripe
+        const off64_t next = ((blocks[i] / chunk) * stripes() + i) * chunk + blocks[i] % chunk;
+        if(n < 0 || next < n) {
+          n = next;
+        }
+      }
+      return n < 0 ? 0 : n;
+    }
+
+    /**
+     * @return 0 on success, negative on error
+     */
+    int save(const char * filename) const {
+      FILE * fp = fopen(filename, "w");
+      if(! fp) {
+        return -1;
+      }
+      fprintf(fp, "#PFCMU-STRIPE 1\nblocksize %zd\n", blocksize);
+      if(segment) {
+        fprintf(fp, "segment %lld\n", (long long)segment);
+      } else {
+        fprintf(fp, "chunk %d\n", chunk);
+      }
+      for(int i=0 ; i<stripes() ; i++) {
+        fprintf(fp, "stripe %s\n", paths[i].c_str());
+      }
+      const int ret = ferror(fp) ? -1 : 0;
+      return (0 == fclose(fp) && ret == 0) ? 0 : -1;
+    }
+
+    /**
+     * @return 0 on success, negative if filename is not a manifest
+     */
+    int load(const char * filename) {
+      FILE * fp = fopen(filename, "r");
+      if(! fp) {
+        return -1;
+      }
+
+      char line[4096];
+      if(! fgets(line, sizeof(line), fp) || 0 != strcmp(line, "#PFCMU-STRIPE 1\n")) {
+        fclose(fp);
+        return -1;
+      }
+
+      const std::string dir = Util::dirname(filename);
+      blocksize = 0;
+      chunk = 1;
+      segment = 0;
+      paths.clear();
+      while(fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if(0 == strncmp(line, "blocksize ", 10)) {
+          blocksize = strtoull(line + 10, NULL, 10);
+        } else if(0 == strncmp(line, "chunk ", 6)) {
+          chunk = atoi(line + 6);
+        } else if(0 == strncmp(line, "segment ", 8)) {
+          segment = strtoll(line + 8, NULL, 10);
+        } else if(0 == strncmp(line, "stripe ", 7)) {
+          std::string path(line + 7);
+          if(! path.empty() && path[0] != '/') {
+            path = dir + "/" + path;
+          }
+          paths.push_back(path);
+        }
+      }
+      fclose(fp);
+
+      return (blocksize > 0 && chunk > 0 && segment >= 0 && ! paths.empty()) ? 0 : -1;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   take_volume.h
+ *
+ * @brief  Recordings (takes) on a raw block device without a filesystem
+ *
+ * A volume is a block device, or a preallocated file used as one.  The
+ * first DATA_OFFSET bytes hold the take directory, and each take is a
+ * contiguous run of frames starting at a DATA_ALIGN boundary after the
+ * previous take.  A take is addressed as "DEVICE#TAKE", e.g.,
+ * /dev/sdb#run01, wherever a recording filename is accepted.
+ *
+ * The directory is a small text, e.g.,
+ *
+ *   PFCMU-VOLUME 1
+ *   bytes 512110190592
+ *   generation 5
+ *   take run01 1048576 7372800 36000 closed 1318912345
+ *   take run02 266338304000 7372800 0 open 1318913000
+ *   end 5 2a9c31f0
+ *
+ * where a take is NAME OFFSET BLOCKSIZE FRAMES STATE CREATED, and the last
+ * line has the generation and the FNV-1a hash of the lines before.  Two
+ * copies are kept at 0 and DIR_BYTES, and each update overwrites the older
+ * one, so that a torn write leaves the previous directory intact.  The
+ * valid copy with the larger generation is used.
+ *
+ * An open take is being recorded and owns the rest of the volume; its
+ * frames are known when it is closed (or recovered after a crash).
+ */
+#ifndef PFCMU_TAKE_VOLUME_H
+#define PFCMU_TAKE_VOLUME_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#include "stringf.h"
+
+namespace PFCMU {
+  class TakeVolume {
+  public:
+    /// bytes of a copy of the directory
+    static const off64_t DIR_BYTES = 512 * 1024;
+    /// offset of the first take
+    static const off64_t DATA_OFFSET = 2 * DIR_BYTES;
+    /// alignment of the takes
+    static const off64_t DATA_ALIGN = 1024 * 1024;
+
+    struct take_t {
+      std::string name;
+      /// bytes from the beginning of the volume
+      off64_t offset;
+      /// bytes per frame
+      size_t blocksize;
+      /// num of frames (0 while open)
+      off64_t frames;
+      bool open;
+      time_t created;
+    };
+
+    TakeVolume() : m_bytes(0), m_generation(0) {
+    }
+
+    /**
+     * Split "DEVICE#TAKE"
+     *
+     * @return true if filename addresses a take
+     */
+    static bool split(const std::string & filename, std::string * device, std::string * take) {
+      const std::string::size_type p = filename.rfind('#');
+      if(p == std::string::npos || p == 0 || p + 1 == filename.size()) {
+        return false;
+      }
+      *device = filename.substr(0, p);
+      *take = filename.substr(p + 1);
+      return true;
+    }
+
+    /**
+     * @return bytes of a block device or a file, negative on error
+     */
+    static off64_t device_bytes(int fd) {
+      struct stat64 st;
+      if(0 != fstat64(fd, &st)) {
+        return -1;
+      }
+      if(S_ISBLK(st.st_mode)) {
+        unsigned long long bytes = 0;
+        if(0 != ioctl(fd, BLKGETSIZE64, &bytes)) {
+          return -1;
+        }
+        return bytes;
+      }
+      return st.st_size;
+    }
+
+    /**
+     * Initialize an empty directory on the device (all the takes are lost)
+     *
+     * @return 0 on success, negative on error
+     */
+    int format(const char * device) {
+      m_device = device;
+      m_takes.clear();
+      m_generation = 0;
+
+      const int fd = open64(device, O_RDWR|O_LARGEFILE);
+      if(fd < 0) {
+        return -1;
+      }
+      m_bytes = device_bytes(fd);
+      ::close(fd);
+      if(m_bytes < DATA_OFFSET + DATA_ALIGN) {
+        return -1;
+      }
+
+      // both the copies, so that a stale directory is never found
+      if(0 != save() || 0 != save()) {
+        return -1;
+      }
+      return 0;
+    }
+
+    /**
+     * @return 0 on success, negative if the device is not formatted
+     */
+    int load(const char * device) {
+      m_device = device;
+      m_takes.clear();
+      m_generation = 0;
+
+      const int fd = open64(device, O_RDONLY|O_LARGEFILE);
+      if(fd < 0) {
+        return -1;
+      }
+
+      bool found = false;
+      std::vector<char> buf(DIR_BYTES + 1);
+      for(int i=0 ; i<2 ; i++) {
+        TakeVolume v;
+        if(DIR_BYTES == pread64(fd, &buf[0], DIR_BYTES, i * DIR_BYTES) && 0 == v.parse(&buf[0])) {
+          if(! found || v.m_generation > m_generation) {
+            m_bytes = v.m_bytes;
+            m_generation = v.m_generation;
+            m_takes = v.m_takes;
+            found = true;
+          }
+        }
+      }
+      ::close(fd);
+      return found ? 0 : -1;
+    }
+
+    /**
+     * Write the directory to the older copy, and flush it to the device
+     *
+     * @return 0 on success, negative on error
+     */
+    int save() {
+      std::string text = Tools::stringf("PFCMU-VOLUME 1\nbytes %lld\ngeneration %llu\n", (long long)m_bytes, m_generation + 1);
+      for(unsigned int i=0 ; i<m_takes.size() ; i++) {
+        const take_t & t = m_takes[i];
+        text += Tools::stringf("take %s %lld %zd %lld %s %lld\n", t.name.c_str(), (long long)t.offset, t.blocksize,
+                               (long long)t.frames, t.open ? "open" : "closed", (long long)t.created);
+      }
+      text += Tools::stringf("end %llu %08x\n", m_generation + 1, hash(text.data(), text.size()));
+      if((off64_t)text.size() >= DIR_BYTES) {
+        return -1;
+      }
+
+      const int fd = open64(m_device.c_str(), O_WRONLY|O_LARGEFILE);
+      if(fd < 0) {
+        return -1;
+      }
+      std::vector<char> buf(DIR_BYTES, 0);
+      memcpy(&buf[0], text.data(), text.size());
+      const off64_t offset = ((m_generation + 1) % 2) * DIR_BYTES;
+      const bool ok = DIR_BYTES == pwrite64(fd, &buf[0], DIR_BYTES, offset) && 0 == fdatasync(fd);
+      ::close(fd);
+      if(! ok) {
+        return -1;
+      }
+      m_generation++;
+      return 0;
+    }
+
+    const std::string & device() const {
+      return m_device;
+    }
+
+    /// bytes of the volume
+    off64_t bytes() const {
+      return m_bytes;
+    }
+
+    const std::vector<take_t> & takes() const {
+      return m_takes;
+    }
+
+    /**
+     * @return index of the take, negative if not found
+     */
+    int find(const std::string & name) const {
+      for(unsigned int i=0 ; i<m_takes.size() ; i++) {
+        if(m_takes[i].name == name) {
+          return i;
+        }
+      }
+      return -1;
+    }
+
+    /**
+     * @return offset of the next take
+     */
+    off64_t next_offset() const {
+      if(m_takes.empty()) {
+        return DATA_OFFSET;
+      }
+      const take_t & t = m_takes.back();
+      const off64_t end = t.offset + t.frames * (off64_t)t.blocksize;
+      return (end + DATA_ALIGN - 1) / DATA_ALIGN * DATA_ALIGN;
+    }
+
+    /**
+     * @return num of frames of blocksize which fit in the rest of the volume
+     */
+    off64_t available(size_t blocksize) const {
+      if(! m_takes.empty() && m_takes.back().open) {
+        return 0;
+      }
+      return std::max((off64_t)0, (m_bytes - next_offset()) / (off64_t)blocksize);
+    }
+
+    /**
+     * Append an open take and save the directory
+     *
+     * @param name [in] name of the take (no spaces)
+     * @param blocksize [in] bytes per frame
+     * @param frames [in] num of frames to be recorded at least (can be 0)
+     * @param error [out] message on error
+     * @return index of the take, negative on error
+     */
+    int begin_take(const std::string & name, size_t blocksize, off64_t frames, std::string * error) {
+      if(name.empty() || name.find_first_of(" \t\n#") != std::string::npos) {
+        *error = "invalid take name \"" + name + "\"";
+        return -1;
+      }
+      if(find(name) >= 0) {
+        *error = "take " + name + " already exists";
+        return -1;
+      }
+      if(! m_takes.empty() && m_takes.back().open) {
+        *error = "take " + m_takes.back().name + " is still open (recover it first)";
+        return -1;
+      }
+      if(available(blocksize) < std::max(frames, (off64_t)1)) {
+        *error = Tools::stringf("%lld frames are available on %s", (long long)available(blocksize), m_device.c_str());
+        return -1;
+      }
+
+      take_t t;
+      t.name = name;
+      t.offset = next_offset();
+      t.blocksize = blocksize;
+      t.frames = 0;
+      t.open = true;
+      t.created = time(NULL);
+      m_takes.push_back(t);
+      if(0 != save()) {
+        m_takes.pop_back();
+        *error = "cannot write the directory of " + m_device;
+        return -1;
+      }
+      return m_takes.size() - 1;
+    }
+
+    /**
+     * Close the take with the num of frames recorded, and save the directory
+     *
+     * @return 0 on success, negative on error
+     */
+    int end_take(int index, off64_t frames) {
+      take_t & t = m_takes[index];
+      t.frames = std::min(frames, (m_bytes - t.offset) / (off64_t)t.blocksize);
+      t.open = false;
+      return save();
+    }
+
+    /**
+     * Remove the take from the directory and save it.  The space is reused
+     * only if it is the last take.
+     *
+     * @return 0 on success, negative on error
+     */
+    int remove(int index) {
+      m_takes.erase(m_takes.begin() + index);
+      return save();
+    }
+
+    /**
+     * @return max num of frames of the take in the volume (the open take owns the rest)
+     */
+    off64_t capacity(int index) const {
+      const take_t & t = m_takes[index];
+      if(! t.open) {
+        return t.frames;
+      }
+      return (m_bytes - t.offset) / (off64_t)t.blocksize;
+    }
+
+  private:
+    /**
+     * FNV-1a, to detect a corrupted copy of the directory
+     */
+    static unsigned int hash(const char * p, size_t n) {
+      unsigned int h = 2166136261u;
+      for(size_t i=0 ; i<n ; i++) {
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+      }
+      return h;
+    }
+
+    /**
+     * @param text [in] a copy of the directory, NUL terminated
+     * @return 0 on success, negative if not a complete directory
+     */
+    int parse(char * text) {
+      text[DIR_BYTES] = '\0';
+      const char * end = strstr(text, "\nend ");
+      unsigned long long g;
+      unsigned int h;
+      if(! end || 2 != sscanf(end + 1, "end %llu %x", &g, &h) || h != hash(text, end + 1 - text)) {
+        return -1;
+      }
+
+      char * save = NULL;
+      char * line = strtok_r(text, "\n", &save);
+      if(! line || 0 != strcmp(line, "PFCMU-VOLUME 1")) {
+        return -1;
+      }
+
+      while((line = strtok_r(NULL, "\n", &save))) {
+        char name[256];
+        char state[16];
+        long long offset, frames, created;
+        size_t blocksize;
+        unsigned long long generation;
+        if(1 == sscanf(line, "bytes %lld", &offset)) {
+          m_bytes = offset;
+        } else if(1 == sscanf(line, "generation %llu", &generation)) {
+          m_generation = generation;
+        } else if(6 == sscanf(line, "take %255s %lld %zu %lld %15s %lld", name, &offset, &blocksize, &frames, state, &created)) {
+          take_t t;
+          t.name = name;
+          t.offset = offset;
+          t.blocksize = blocksize;
+          t.frames = frames;
+          t.open = 0 == strcmp(state, "open");
+          t.created = created;
+          m_takes.push_back(t);
+        } else if(0 == strncmp(line, "end ", 4)) {
+          break;
+        }
+      }
+      return (g == m_generation && m_bytes > 0) ? 0 : -1;
+    }
+
+    TakeVolume(const TakeVolume &); // to disable "object copy"
+
+    std::string m_device;
+    off64_t m_bytes;
+    unsigned long long m_generation;
+    std::vector<take_t> m_takes;
+  };
+}
+
+#endif
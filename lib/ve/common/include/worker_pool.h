@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <deque>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+/**
+ * Fixed number of threads consuming a FIFO of jobs
+ */
+class WorkerPool {
+public:
+  typedef boost::function<void ()> job_t;
+
+  /**
+   * @param n [in] num of threads (0 = num of CPUs)
+   */
+  explicit WorkerPool(int n=0) : m_stop(false) {
+    if(n <= 0) {
+      n = boost::thread::hardware_concurrency();
+    }
+    if(n <= 0) {
+      n = 1;
+    }
+    for(int i=0 ; i<n ; i++) {
+      m_threads.create_thread(boost::bind(&WorkerPool::run, this));
+    }
+  }
+
+  /**
+   * Waits until all the queued jobs are done
+   */
+  ~WorkerPool() {
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    m_threads.join_all();
+  }
+
+  /**
+   * Queue a job. This function does not block.
+   */
+  void post(const job_t & job) {
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_jobs.push_back(job);
+    }
+    m_cond.notify_one();
+  }
+
+  /**
+   * Run f(0), ..., f(n-1) in parallel and wait for all of them.
+   *
+   * Must not be called from a job of this pool.
+   */
+  void parallel_for(int n, const boost::function<void (int)> & f) {
+    latch_t latch(n);
+    for(int i=0 ; i<n ; i++) {
+      post(boost::bind(&WorkerPool::run_one, boost::cref(f), i, &latch));
+    }
+    latch.wait();
+  }
+
+  int size() const {
+    return m_threads.size();
+  }
+
+private:
+  WorkerPool(const WorkerPool &); // to disable "object copy"
+
+  struct latch_t {
+    explicit latch_t(int n) : count(n) {
+    }
+
+    void count_down() {
+      boost::mutex::scoped_lock lock(mutex);
+      if(--count == 0) {
+        cond.notify_all();
+      }
+    }
+
+    void wait() {
+      boost::mutex::scoped_lock lock(mutex);
+      while(count > 0) {
+        cond.wait(lock);
+      }
+    }
+
+    int count;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+  };
+
+  static void run_one(const boost::function<void (int)> & f, int i, latch_t * latch) {
+    f(i);
+    latch->count_down();
+  }
+
+  void run() {
+    for(;;) {
+      job_t job;
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while(m_jobs.empty() && !m_stop) {
+          m_cond.wait(lock);
+        }
+        if(m_jobs.empty()) {
+          return;
+        }
+        job = m_jobs.front();
+        m_jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+  boost::mutex m_mutex;
+  boost::condition_variable m_cond;
+  std::deque<job_t> m_jobs;
+  bool m_stop;
+  boost::thread_group m_threads;
+};
+
+#endif //WORKER_POOL_H
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   bench_writer.cc
+ *
+ * @brief  Compare the recording writers on the same disk
+ *
+ * Writes --num frames of the capture size by each writer, the same way
+ * as capture does (get_available_slot_id(), fill the buffer, write()),
+ * and reports the throughput, the time blocked in
+ * get_available_slot_id() and the CPU time.  With --fps the frames are
+ * paced like the cameras, which shows the stalls in the steady state.
+ * With --spill each writer is put behind a RAM spill pool of that many
+ * frames (see PFCMU::libaio::spill_writer_t).
+ *
+ * The net writer sends the frames to bin/netsink given by --sink
+ * (PFCMU::libaio::net_writer_t); the CPU time is of this process only,
+ * netsink reports its own.
+ *
+ * With --writeback the aio and uring writers manage the writeback by
+ * themselves (see PFCMU::libaio::writeback_t), which matters if the disk
+ * has no O_DIRECT.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "pfcmu_config.h"
+#include "libpfcmu/linux_aio.h"
+#include "libpfcmu/net_writer.h"
+#include "libpfcmu/segmented_writer.h"
+#include "libpfcmu/spill_writer.h"
+#include "libpfcmu/uring_writer.h"
+#include "boost_opt_util.h"
+#include "stringf.h"
+#include "trace.h"
+
+namespace {
+  unsigned long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+  }
+
+  double cpu_sec(const struct timeval & tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+  struct result_t {
+    double mbps;
+    double wait_avg;
+    double wait_p99;
+    double wait_max;
+    double user;
+    double sys;
+    long csw;
+  };
+
+  result_t run(PFCMU::libaio::writer_base_t & writer, size_t blocksize, int num, unsigned int fps) {
+    std::vector<double> wait(num);
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+
+    const unsigned long long t0 = now_usec();
+    for(int i=0 ; i<num ; i++) {
+      if(fps > 0) {
+        const long long next = t0 + (unsigned long long)i * 1000000 / fps;
+        const long long d = next - (long long)now_usec();
+        if(d > 0) {
+          usleep(d);
+        }
+      }
+
+      const unsigned long long t = now_usec();
+      PFCMU::libaio::slot_id_t id = writer.get_available_slot_id();
+      if(id < 0) {
+        DIE(1, "write failed before %d\n", i);
+      }
+      wait[i] = now_usec() - t;
+
+      // same as capture.copy_all(), the data does not matter
+      memset(writer.buf(id), i, blocksize);
+      if(0 != writer.write(id, i)) {
+        DIE(1, "write failed at %d\n", i);
+      }
+    }
+    writer.clean();
+    const unsigned long long t1 = now_usec();
+
+    getrusage(RUSAGE_SELF, &ru1);
+
+    result_t r;
+    r.mbps = (double)blocksize * num / (t1 - t0);
+    double sum = 0;
+    for(int i=0 ; i<num ; i++) {
+      sum += wait[i];
+    }
+    r.wait_avg = sum / num;
+    std::sort(wait.begin(), wait.end());
+    r.wait_p99 = wait[std::min(num - 1, num * 99 / 100)];
+    r.wait_max = wait[num - 1];
+    r.user = cpu_sec(ru1.ru_utime) - cpu_sec(ru0.ru_utime);
+    r.sys = cpu_sec(ru1.ru_stime) - cpu_sec(ru0.ru_stime);
+    r.csw = (ru1.ru_nvcsw + ru1.ru_nivcsw) - (ru0.ru_nvcsw + ru0.ru_nivcsw);
+    return r;
+  }
+
+  result_t run_spilled(PFCMU::libaio::writer_base_t & writer, size_t blocksize, int num, unsigned int fps, int spill, PFCMU::libaio::spill_writer_t::policy_t policy) {
+    if(spill <= 0) {
+      return run(writer, blocksize, num, fps);
+    }
+
+    PFCMU::libaio::spill_writer_t w;
+    w.init(&writer, blocksize, spill, policy);
+    result_t r = run(w, blocksize, num, fps);
+
+    PFCMU::libaio::spill_writer_t::stat_t st;
+    w.stat(&st);
+    printf("  spill: direct %llu, spilled %llu, high water %u / %d, exhausted %llu, dropped %llu, max block %llu us\n",
+           st.direct, st.spilled, st.high_water, spill, st.exhausted, st.dropped, st.max_block_usec);
+    return r;
+  }
+
+  void print_writeback(const PFCMU::libaio::writeback_t::stat_t & st, int interval) {
+    if(interval <= 0) {
+      return;
+    }
+    printf("  writeback: %llu starts (avg %.1f us, max %llu us), %llu waits (avg %.1f us, max %llu us), max %lld / %d frames not dropped\n",
+           st.starts, st.starts ? (double)st.start_total_usec / st.starts : 0.0, st.start_max_usec,
+           st.waits, st.waits ? (double)st.wait_total_usec / st.waits : 0.0, st.wait_max_usec, (long long)st.max_dirty, 2 * interval);
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("out,o",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Output filename on the disk to be tested (/disks/local/bench.dat)")
+    ("num,n",
+     boost::program_options::value<int>()->default_value(2000),
+     "N of frames to write")
+    ("fps,f",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Pace the frames at this FPS (0 = as fast as possible)")
+    ("size",
+     boost::program_options::value<std::string>()->default_value("640x480"),
+     "Image size of a camera")
+    ("writer,w",
+     boost::program_options::value<std::string>()->default_value("aio,uring,uring_sqpoll"),
+     "Writers to be compared (aio, aio_segmented, uring, uring_sqpoll, net)")
+    ("d_ringnum",
+     boost::program_options::value<unsigned int>()->default_value(8),
+     "Ringbuf size for mem -> disk")
+    ("d_align",
+     boost::program_options::value<unsigned int>()->default_value(4096),
+     "Alignment size for disk AIO")
+    ("batch",
+     boost::program_options::value<unsigned int>()->default_value(4),
+     "Num of writes submitted at once by io_uring")
+    ("segment",
+     boost::program_options::value<int>()->default_value(500),
+     "Frames per segment of aio_segmented")
+    ("writeback",
+     boost::program_options::value<int>()->default_value(0),
+     "Writeback interval in frames of the aio and uring writers (0 = left to the kernel)")
+    ("sink",
+     boost::program_options::value<std::string>(),
+     "host:port of netsink for the net writer (the basename of --out is recorded there)")
+    ("spill",
+     boost::program_options::value<int>()->default_value(0),
+     "Frames in the RAM spill pool in front of each writer (0 = none)")
+    ("spill_policy",
+     boost::program_options::value<std::string>()->default_value("block"),
+     "When the spill pool is exhausted: block, drop or abort")
+    ("keep", "Do not remove the output")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::string OUT_FNAME = parameter_map["out"].as<std::string>();
+  const int N = parameter_map["num"].as<int>();
+  const unsigned int FPS = parameter_map["fps"].as<unsigned int>();
+  const unsigned int D_RINGNUM = parameter_map["d_ringnum"].as<unsigned int>();
+  const unsigned int D_ALIGN = parameter_map["d_align"].as<unsigned int>();
+  const unsigned int BATCH = parameter_map["batch"].as<unsigned int>();
+  const int KEEP = parameter_map.count("keep") ? 1 : 0;
+  const int SEGMENT = parameter_map["segment"].as<int>();
+  const std::string SINK = boost_opt_string(parameter_map, "sink");
+  const int WRITEBACK = parameter_map["writeback"].as<int>();
+  const int SPILL = parameter_map["spill"].as<int>();
+  PFCMU::libaio::spill_writer_t::policy_t SPILL_POLICY;
+  if(0 != PFCMU::libaio::spill_writer_t::parse_policy(parameter_map["spill_policy"].as<std::string>(), &SPILL_POLICY)) {
+    DIE(1, "invalid --spill_policy\n");
+  }
+
+  int W, H;
+  if(2 != sscanf(parameter_map["size"].as<std::string>().c_str(), "%dx%d", &W, &H) || W <= 0 || H <= 0 || N <= 0) {
+    DIE(1, "invalid --size or --num\n");
+  }
+  const size_t BLOCKSIZE = (size_t)W * H * PFCMU::CAMS;
+
+  std::string list = parameter_map["writer"].as<std::string>();
+  std::replace(list.begin(), list.end(), ',', ' ');
+  std::istringstream iss(list);
+  std::vector<std::string> writers;
+  for(std::string name ; iss >> name ; ) {
+    writers.push_back(name);
+  }
+
+  printf("%d frames x %zd bytes, %s, d_ringnum=%u, batch=%u, spill=%d\n", N, BLOCKSIZE, FPS ? "paced" : "unpaced", D_RINGNUM, BATCH, SPILL);
+  printf("%-14s %10s %12s %12s %12s %8s %8s %8s\n", "writer", "MB/s", "wait avg us", "wait p99 us", "wait max us", "user s", "sys s", "ctxsw");
+
+  for(unsigned int i=0 ; i<writers.size() ; i++) {
+    result_t r;
+    if(writers[i] == "aio") {
+      PFCMU::libaio::writer_t w;
+      w.init(OUT_FNAME.c_str(), BLOCKSIZE, D_RINGNUM, N, D_ALIGN);
+      w.set_writeback(WRITEBACK);
+      r = run_spilled(w, BLOCKSIZE, N, FPS, SPILL, SPILL_POLICY);
+      print_writeback(w.writeback_stat(), WRITEBACK);
+    } else if(writers[i] == "aio_segmented") {
+      PFCMU::libaio::segmented_writer_t w;
+      w.init(OUT_FNAME.c_str(), BLOCKSIZE, D_RINGNUM, SEGMENT, D_ALIGN);
+      r = run_spilled(w, BLOCKSIZE, N, FPS, SPILL, SPILL_POLICY);
+      printf("  segments: %d, stalls %llu\n", w.segments(), w.stalls());
+      if(! KEEP) {
+        for(int j=0 ; j<w.segments() ; j++) {
+          unlink(Tools::stringf("%s.%06d", OUT_FNAME.c_str(), j).c_str());
+        }
+      }
+    } else if(writers[i] == "uring" || writers[i] == "uring_sqpoll") {
+      PFCMU::uring::writer_t w;
+      w.init(OUT_FNAME.c_str(), BLOCKSIZE, D_RINGNUM, N, BATCH, writers[i] == "uring_sqpoll", D_ALIGN);
+      w.set_writeback(WRITEBACK);
+      r = run_spilled(w, BLOCKSIZE, N, FPS, SPILL, SPILL_POLICY);
+      print_writeback(w.writeback_stat(), WRITEBACK);
+    } else if(writers[i] == "net") {
+      if(SINK.empty()) {
+        DIE(1, "the net writer requires --sink\n");
+      }
+      PFCMU::libaio::net_writer_t w;
+      w.init(SINK, OUT_FNAME, BLOCKSIZE, D_RINGNUM, N, D_ALIGN);
+      r = run_spilled(w, BLOCKSIZE, N, FPS, SPILL, SPILL_POLICY);
+      PFCMU::libaio::net_writer_t::stat_t st;
+      w.stat(&st);
+      printf("  net: %llu frames, %llu zerocopy, %llu copied by the kernel, %llu credit waits, max queue %u\n",
+             st.frames, st.zerocopy, st.copied, st.credit_waits, st.max_queue);
+    } else {
+      DIE(1, "unknown writer '%s'\n", writers[i].c_str());
+    }
+    printf("%-14s %10.1f %12.1f %12.1f %12.1f %8.2f %8.2f %8ld\n",
+           writers[i].c_str(), r.mbps, r.wait_avg, r.wait_p99, r.wait_max, r.user, r.sys, r.csw);
+  }
+
+  if(! KEEP) {
+    unlink(OUT_FNAME.c_str());
+  }
+
+  return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   calibchess.cc
+ *
+ * @brief  Intrinsic calibration of the cameras by the chessboards of a .chs
+ *
+ * Calibrates each camera by all the chessboards found by findchess, and
+ * writes the parameters in the format of incalib_gui.  The cameras are
+ * solved one by one, each by the threads of --threads (see
+ * incalib_solver.h), as a .chs can have thousands of chessboards per
+ * camera.  The key view of the pose written is the first frame where
+ * the chessboard is found by all the cameras, as incalib_gui.
+ */
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "libpfcmu/chess_points.h"
+#include "libpfcmu/incalib_solver.h"
+#include "boost_opt_util.h"
+#include "trace.h"
+#include "pfcmu_config.h"
+
+namespace {
+  double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("src,s",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Input detections by findchess (chess.chs)")
+    ("output,o",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] output filename format. (cam%02d.txt)")
+    ("skip,S",
+     boost::program_options::value<int>()->default_value(1),
+     "use every 'skip' chessboards of each camera only")
+    ("iterations",
+     boost::program_options::value<int>()->default_value(PFCMU::IncalibSolver::ITERATIONS),
+     "max num of the iterations")
+    ("threads",
+     boost::program_options::value<int>()->default_value(0),
+     "Num of threads per camera (0 = num of CPUs)")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::string SRC_FNAME = boost_opt_string(parameter_map, "src");
+  const std::string OFNAME = boost_opt_string(parameter_map, "output");
+  const int SKIP = std::max(1, parameter_map["skip"].as<int>());
+  const int ITERATIONS = parameter_map["iterations"].as<int>();
+
+  PFCMU::chess_points::set_t set;
+  if(0 != PFCMU::chess_points::load(SRC_FNAME.c_str(), &set)) {
+    DIE(1, "cannot load %s\n", SRC_FNAME.c_str());
+  }
+  const PFCMU::chess_points::header_t & header = set.header;
+  const int CAMS = header.cams;
+  const size_t N = header.corners();
+  fprintf(stderr, "%s has %zu chessboards of %ux%u\n", SRC_FNAME.c_str(), set.records.size(), header.cols, header.rows);
+
+  // the first frame found by all the cameras
+  std::map<int64_t, int> cams_of_frame;
+  int64_t key_frame = -1;
+  for(size_t i=0 ; i<set.records.size() && key_frame < 0 ; i++) {
+    if(++cams_of_frame[set.records[i].frame] == CAMS) {
+      key_frame = set.records[i].frame;
+    }
+  }
+  if(key_frame < 0) {
+    fprintf(stderr, "\n\nWARNING: No key-frame found\n");
+  }
+
+  PFCMU::IncalibSolver solver;
+  solver.init(parameter_map["threads"].as<int>());
+  std::vector<double> xy(2 * N);
+  for(int c=0 ; c<CAMS ; c++) {
+    solver.setup(header.width, header.height, header.rows, header.cols, header.square);
+    int key_view = 0, found = 0;
+    for(size_t i=0 ; i<set.records.size() ; i++) {
+      if(set.records[i].camera != c) {
+        continue;
+      }
+      // the key frame is always used
+      const bool is_key = set.records[i].frame == key_frame;
+      if(found++ % SKIP != 0 && ! is_key) {
+        continue;
+      }
+      if(is_key) {
+        key_view = solver.views();
+      }
+      const float * p = set.points_of(i);
+      for(size_t j=0 ; j<2*N ; j++) {
+        xy[j] = p[j];
+      }
+      solver.add_view(&xy[0]);
+    }
+    if(solver.views() < 1) {
+      fprintf(stderr, "\n\nERROR: No chessboards for cam%02d\n\n", c+1);
+      exit(1);
+    }
+
+    const double t0 = now();
+    const double rms = solver.solve(ITERATIONS);
+    const double t = now() - t0;
+    fprintf(stdout, "cam%02d : %d views, rms = %f, %.2f sec\n", c+1, solver.views(), rms, t);
+
+    char buf[65536];
+    snprintf(buf, sizeof(buf), OFNAME.c_str(), c+1);
+    if(0 != solver.save(buf, key_view)) {
+      DIE(1, "cannot write %s\n", buf);
+    }
+  }
+
+  return 0;
+}
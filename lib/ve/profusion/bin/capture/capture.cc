@@ -18,11 +18,23 @@
  *
  */
 
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "libviewplus/PF_EZInterface.h"
 #include "libpfcmu/linux_aio.h"
+#include "libpfcmu/checksum_writer.h"
+#include "libpfcmu/net_writer.h"
+#include "libpfcmu/flight_recorder.h"
+#include "libpfcmu/preflight.h"
+#include "libpfcmu/segmented_writer.h"
+#include "libpfcmu/spill_writer.h"
+#include "libpfcmu/striped_writer.h"
+#include "libpfcmu/uring_writer.h"
 #include "libpfcmu/capture++.h"
 #include "libpfcmu/util.h"
 #include "libpfcmu/mmapped_file.h"
+#include "take_volume.h"
 #include "boost_opt_util.h"
 #include "trace.h"
 #include "my_memcpy.h"
@@ -34,7 +46,28 @@ static void dump_info(const std::string & capture_to_json,
 		      const int total,
 		      const timestamp_t ts,
 		      const int framedrop,
+		      PFCMU::libaio::spill_writer_t * spill,
+		      PFCMU::FlightRecorder * recorder,
 		      PFCMU::MMappedFile * mfile) {
+  std::string spill_json;
+  if(spill) {
+    PFCMU::libaio::spill_writer_t::stat_t st;
+    spill->stat(&st);
+    spill_json = Tools::stringf("\t\"spill_backlog\": %u,\n"
+                                "\t\"spill_high_water\": %u,\n"
+                                "\t\"spill_dropped\": %llu,\n",
+                                st.backlog, st.high_water, st.dropped);
+  }
+  if(recorder) {
+    static const char * STATE[] = { "armed", "recording", "done" };
+    PFCMU::FlightRecorder::stat_t st;
+    recorder->stat(&st);
+    spill_json += Tools::stringf("\t\"flight_state\": \"%s\",\n"
+                                 "\t\"flight_backlog\": %u,\n"
+                                 "\t\"flight_overrun\": %llu,\n",
+                                 STATE[recorder->state()], st.backlog, st.overrun);
+  }
+
   const int sz = mfile->size();
   memset(mfile->buf(), '\n', sz);
   int ret = snprintf((char*)(mfile->buf()),
@@ -44,17 +77,61 @@ static void dump_info(const std::string & capture_to_json,
 		     "\t\"total\": %d,\n"
 		     "\t\"framecount\": %llu,\n"
 		     "\t\"framedrop\": %d,\n"
+		     "%s"
 		     "}\n", 
 		     capture_to_json.c_str(),
 		     curr,
 		     total,
 		     ts,
-		     framedrop);
+		     framedrop,
+		     spill_json.c_str());
   mfile->buf()[ret] = '\n';
   //ASSERT(ret >= sz, "JSON output has been truncated.\n");
   mfile->sync();
 }
 
+static PFCMU::FlightRecorder * s_recorder = NULL;
+
+static void trigger_handler(int sig) {
+  if(s_recorder) {
+    s_recorder->trigger();
+  }
+}
+
+/**
+ * @return non-blocking UDP socket receiving the triggers
+ */
+static int open_trigger_socket(unsigned short port) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sock < 0) {
+    DIE(1, "socket() failed\n");
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if(0 != bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    DIE(1, "Cannot bind the trigger port %u\n", port);
+  }
+  return sock;
+}
+
+/**
+ * @return true if "TRIGGER" has been received
+ */
+static bool poll_trigger_socket(int sock) {
+  bool triggered = false;
+  char buf[64];
+  ssize_t len;
+  while((len = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    if(len >= 7 && 0 == memcmp(buf, "TRIGGER", 7)) {
+      triggered = true;
+    }
+  }
+  return triggered;
+}
+
 int main(int argc, char * argv[]) {
 
   boost::program_options::options_description cmdline("Command line options");
@@ -68,7 +145,46 @@ int main(int argc, char * argv[]) {
      "[MANDATORY] FPS (25 or 100)")
     ("out,o",
      boost::program_options::value<std::string>(),
-     "Output filename (/disks/local/out.dat)")
+     "Output filename (/disks/local/out.dat), or a take of a volume (/dev/sdb#take01, see bin/takevol) to be written in place without a filesystem")
+    ("stripe",
+     boost::program_options::value<std::vector<std::string> >()->composing(),
+     "Stripe the output over these files, one per disk (repeat for each disk). --out is then the manifest read as the recording")
+    ("stripe_chunk",
+     boost::program_options::value<unsigned int>()->default_value(1),
+     "Num of consecutive frames written to a stripe")
+    ("segment",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Roll the output to a new file every N frames (out.dat.000000, ...), preallocated in background. --out is then the manifest read as the recording (0 = a single file)")
+    ("sink",
+     boost::program_options::value<std::string>(),
+     "Send the frames to a storage server (host:port of bin/netsink) instead of the local disk. --out is then the name of the recording on the server")
+    ("writeback",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Start the writeback every N frames and drop the written frames from the page cache (sync_file_range), to keep the dirty memory bounded if O_DIRECT is not available. With --stripe, every N frames of each stripe. Cannot be used with --segment or --sink (0 = left to the kernel)")
+    ("checksum", "Compute the CRC32C of each camera image on a worker thread before writing, into out.dat.crc (verify by bin/scrub). With --sink, it is written locally")
+    ("uring", "Write by io_uring instead of Linux AIO (see bench_writer)")
+    ("uring_batch",
+     boost::program_options::value<unsigned int>()->default_value(4),
+     "Num of writes submitted at once by io_uring")
+    ("uring_sqpoll", "Let a kernel thread submit the writes of io_uring")
+    ("spill_frames",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Frames of RAM (pre-faulted and locked) to absorb disk stalls when all the d_ringnum slots are being written (0 = disabled)")
+    ("spill_policy",
+     boost::program_options::value<std::string>()->default_value("block"),
+     "When the spill RAM is exhausted: block (wait for the disk), drop (discard the frame) or abort")
+    ("pre",
+     boost::program_options::value<double>()->default_value(0),
+     "Flight recorder mode: keep the last SEC seconds in RAM, and record them and the following --num frames when triggered by SIGUSR1, --trigger_port or --trigger_at (0 = disabled)")
+    ("pre_slack",
+     boost::program_options::value<unsigned int>()->default_value(200),
+     "Extra frames of the flight recorder RAM to absorb the backlog after the trigger")
+    ("trigger_port",
+     boost::program_options::value<unsigned short>()->default_value(0),
+     "UDP port to receive \"TRIGGER\" for the flight recorder (0 = disabled)")
+    ("trigger_at",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Trigger the flight recorder at this framecount (0 = disabled)")
     ("live,l",
      boost::program_options::value<std::string>(),
      "Live output dir (/live). Ramdisk (/dev/ram15, for example) is STRONGLY recommended. Export this directory by NFS and mount it remotely to get the live view of the camera. Note: you can use tmpfs as a memory-based filesystem, but tmpfs cannot be exported by NFS since NFS works on top of a block device.")
@@ -96,6 +212,10 @@ int main(int argc, char * argv[]) {
     ("skip",
      boost::program_options::value<unsigned int>()->default_value(400),
      "Skip frames before capture. This will help avoiding frame drops by shifting the HDD in a steady state.")
+    ("preflight", "Check if the disk and the system can sustain this capture (see bin/preflight), and exit with 1 if failed")
+    ("preflight_seconds",
+     boost::program_options::value<double>()->default_value(30),
+     "Length of the paced write run of --preflight")
     ("debug", "Debug mode")
     ;
 
@@ -117,6 +237,55 @@ int main(int argc, char * argv[]) {
   const double CAM_SHUTTER = parameter_map["shutter"].as<double>();
   const double CAM_GAIN = parameter_map["gain"].as<double>();
   const std::string LIVE_DIR=boost_opt_string(parameter_map, "live");
+  const std::vector<std::string> STRIPES = parameter_map.count("stripe") ? parameter_map["stripe"].as<std::vector<std::string> >() : std::vector<std::string>();
+  const unsigned int STRIPE_CHUNK = parameter_map["stripe_chunk"].as<unsigned int>();
+
+  const unsigned int SEGMENT = parameter_map["segment"].as<unsigned int>();
+  const std::string SINK = boost_opt_string(parameter_map, "sink");
+  const unsigned int WRITEBACK = parameter_map["writeback"].as<unsigned int>();
+  const int CHECKSUM = parameter_map.count("checksum") ? 1 : 0;
+  const int USE_URING = parameter_map.count("uring") ? 1 : 0;
+  const unsigned int URING_BATCH = parameter_map["uring_batch"].as<unsigned int>();
+  const bool URING_SQPOLL = parameter_map.count("uring_sqpoll") ? true : false;
+  const unsigned int SPILL_FRAMES = parameter_map["spill_frames"].as<unsigned int>();
+  PFCMU::libaio::spill_writer_t::policy_t SPILL_POLICY;
+  if(0 != PFCMU::libaio::spill_writer_t::parse_policy(parameter_map["spill_policy"].as<std::string>(), &SPILL_POLICY)) {
+    DIE(1, "--spill_policy should be block, drop or abort\n");
+  }
+
+  const unsigned int PRE_FRAMES = (unsigned int)(parameter_map["pre"].as<double>() * FPS + 0.5);
+  const unsigned int PRE_SLACK = parameter_map["pre_slack"].as<unsigned int>();
+  const unsigned short TRIGGER_PORT = parameter_map["trigger_port"].as<unsigned short>();
+  const timestamp_t TRIGGER_AT = parameter_map["trigger_at"].as<unsigned int>();
+  const int FLIGHT_MODE = PRE_FRAMES > 0 ? 1 : 0;
+
+  if(FLIGHT_MODE && OUT_FNAME.empty()) {
+    DIE(1, "--pre requires --out\n");
+  }
+  if(! STRIPES.empty() && OUT_FNAME.empty()) {
+    DIE(1, "--stripe requires --out for the manifest\n");
+  }
+  if(! STRIPES.empty() && USE_URING) {
+    DIE(1, "--stripe and --uring cannot be used together\n");
+  }
+  if(SEGMENT && (! STRIPES.empty() || USE_URING)) {
+    DIE(1, "--segment cannot be used with --stripe or --uring\n");
+  }
+  if(! SINK.empty() && (OUT_FNAME.empty() || ! STRIPES.empty() || SEGMENT || USE_URING)) {
+    DIE(1, "--sink requires --out, and cannot be used with --stripe, --segment or --uring\n");
+  }
+  if(WRITEBACK && (SEGMENT || ! SINK.empty())) {
+    DIE(1, "--writeback cannot be used with --segment or --sink\n");
+  }
+
+  // --out DEVICE#TAKE records a new take of the volume
+  PFCMU::TakeVolume volume;
+  std::string VOLUME_DEVICE, VOLUME_TAKE;
+  const int VOLUME_MODE = SINK.empty() && STRIPES.empty() && PFCMU::TakeVolume::split(OUT_FNAME, &VOLUME_DEVICE, &VOLUME_TAKE) &&
+    0 == volume.load(VOLUME_DEVICE.c_str()) ? 1 : 0;
+  if(VOLUME_MODE && (SEGMENT || USE_URING || CHECKSUM || parameter_map.count("preflight"))) {
+    DIE(1, "a take of a volume cannot be recorded with --segment, --uring, --checksum or --preflight\n");
+  }
 
   TRACE(1, "Max priority\n");
   PFCMU::set_max_priority();
@@ -125,15 +294,119 @@ int main(int argc, char * argv[]) {
   PFCMU::Capture capture;
   capture.init(CAMERA, FPS);
 
+  if(parameter_map.count("preflight")) {
+    if(OUT_FNAME.empty()) {
+      DIE(1, "--preflight requires --out\n");
+    }
+    PFCMU::preflight::config_t config;
+    // the disk of the first stripe (or segment) is used for the test
+    config.out = (STRIPES.empty() ? OUT_FNAME : STRIPES[0]) + ".preflight";
+    config.live = LIVE_DIR;
+    config.width = capture.width();
+    config.height = capture.height();
+    config.fps = FPS;
+    config.c_ringnum = C_RINGNUM;
+    config.d_ringnum = D_RINGNUM;
+    config.d_align = D_ALIGN;
+    config.seconds = parameter_map["preflight_seconds"].as<double>();
+    config.num = STRIPES.empty() ? N + PRE_FRAMES : (N + PRE_FRAMES + STRIPES.size() - 1) / STRIPES.size();
+    config.pre_frames = FLIGHT_MODE ? PRE_FRAMES + PRE_SLACK : 0;
+    config.lock_frames = SPILL_FRAMES + config.pre_frames;
+
+    PFCMU::preflight::report_t report;
+    PFCMU::preflight::run(config, &report);
+    printf("%s", PFCMU::preflight::to_string(report).c_str());
+    return report.status() == PFCMU::preflight::FAIL ? 1 : 0;
+  }
+
 
-  PFCMU::libaio::writer_t writer;
-  if(! OUT_FNAME.empty()) {
+  // frames to be preallocated
+  const int N_OUT = N + PRE_FRAMES;
+
+  PFCMU::libaio::writer_t single_writer;
+  PFCMU::libaio::striped_writer_t striped_writer;
+  PFCMU::libaio::segmented_writer_t segmented_writer;
+  PFCMU::uring::writer_t uring_writer;
+  PFCMU::libaio::net_writer_t net_writer;
+  int volume_take = -1;
+  PFCMU::libaio::writer_base_t & disk_writer = ! STRIPES.empty() ? static_cast<PFCMU::libaio::writer_base_t &>(striped_writer) :
+    SEGMENT ? static_cast<PFCMU::libaio::writer_base_t &>(segmented_writer) :
+    ! SINK.empty() ? static_cast<PFCMU::libaio::writer_base_t &>(net_writer) :
+    USE_URING ? static_cast<PFCMU::libaio::writer_base_t &>(uring_writer) : single_writer;
+  if(! STRIPES.empty()) {
+    TRACE(1, "Output: init %zd stripes, %u frames/chunk\n", STRIPES.size(), STRIPE_CHUNK);
+    striped_writer.init(OUT_FNAME.c_str(), STRIPES, capture.memsize(), D_RINGNUM, N_OUT, STRIPE_CHUNK, D_ALIGN);
+    striped_writer.set_writeback(WRITEBACK);
+  } else if(! OUT_FNAME.empty() && SEGMENT) {
+    TRACE(1, "Output: init segments of %u frames\n", SEGMENT);
+    segmented_writer.init(OUT_FNAME.c_str(), capture.memsize(), D_RINGNUM, SEGMENT, D_ALIGN);
+  } else if(! SINK.empty()) {
+    TRACE(1, "Output: init connection to %s\n", SINK.c_str());
+    net_writer.init(SINK, OUT_FNAME, capture.memsize(), D_RINGNUM, N_OUT, D_ALIGN);
+    TRACE(1, "Output: %s\n", net_writer.zerocopy() ? "zerocopy" : "no zerocopy");
+  } else if(VOLUME_MODE) {
+    std::string error;
+    // the frames skipped at the beginning are written to the take, too
+    volume_take = volume.begin_take(VOLUME_TAKE, capture.memsize(), std::max(N_OUT, (int)(C_RINGNUM + SKIP)), &error);
+    if(volume_take < 0) {
+      DIE(1, "Cannot record %s: %s\n", OUT_FNAME.c_str(), error.c_str());
+    }
+    const PFCMU::TakeVolume::take_t & take = volume.takes()[volume_take];
+    TRACE(1, "Output: init take %s at %lld of %s (%lld frames available)\n", take.name.c_str(), (long long)take.offset,
+          VOLUME_DEVICE.c_str(), (long long)volume.capacity(volume_take));
+    single_writer.init_device(VOLUME_DEVICE.c_str(), take.offset, capture.memsize(), D_RINGNUM, D_ALIGN);
+    single_writer.set_writeback(WRITEBACK);
+  } else if(! OUT_FNAME.empty() && USE_URING) {
+    TRACE(1, "Output: init io_uring (batch=%u%s)\n", URING_BATCH, URING_SQPOLL ? ", sqpoll" : "");
+    uring_writer.init(OUT_FNAME.c_str(), capture.memsize(), D_RINGNUM, N_OUT, URING_BATCH, URING_SQPOLL, D_ALIGN);
+    uring_writer.set_writeback(WRITEBACK);
+  } else if(! OUT_FNAME.empty()) {
     TRACE(1, "Output: init\n");
-    writer.init(OUT_FNAME.c_str(), capture.memsize(), D_RINGNUM, N, D_ALIGN);
+    single_writer.init(OUT_FNAME.c_str(), capture.memsize(), D_RINGNUM, N_OUT, D_ALIGN);
+    single_writer.set_writeback(WRITEBACK);
   } else {
     TRACE(1, "Output: no output (dry run)\n");
   }
 
+  // taken before the writer is clean()ed, as CHECKSUMMED below
+  const bool WRITTEN_BACK = WRITEBACK && disk_writer.is_initialized();
+
+  PFCMU::libaio::checksum_writer_t checksum_writer;
+  if(disk_writer.is_initialized() && CHECKSUM) {
+    const std::string sidecar = PFCMU::checksum::sidecar(OUT_FNAME);
+    TRACE(1, "Output: init checksums into %s (%s)\n", sidecar.c_str(), PFCMU::checksum::hardware() ? "sse4.2" : "no sse4.2");
+    checksum_writer.init(&disk_writer, sidecar.c_str(), capture.width(), capture.height());
+  }
+  // is_initialized() turns false once the writer is clean()ed, e.g., by --pre, --segment or --spill_frames before the summary
+  const bool CHECKSUMMED = checksum_writer.is_initialized();
+  PFCMU::libaio::writer_base_t & checked_writer = CHECKSUMMED ? static_cast<PFCMU::libaio::writer_base_t &>(checksum_writer) : disk_writer;
+
+  PFCMU::libaio::spill_writer_t spill_writer;
+  if(disk_writer.is_initialized() && SPILL_FRAMES > 0) {
+    TRACE(1, "Output: init spill RAM of %u frames (%.1f GB)\n", SPILL_FRAMES, (double)capture.memsize() * SPILL_FRAMES / (1<<30));
+    spill_writer.init(&checked_writer, capture.memsize(), SPILL_FRAMES, SPILL_POLICY);
+  }
+  PFCMU::libaio::spill_writer_t * spill = spill_writer.is_initialized() ? &spill_writer : NULL;
+  PFCMU::libaio::writer_base_t & writer = spill ? static_cast<PFCMU::libaio::writer_base_t &>(spill_writer) : checked_writer;
+
+  PFCMU::FlightRecorder recorder;
+  int trigger_sock = -1;
+  if(FLIGHT_MODE) {
+    TRACE(1, "Flight recorder: init %u + %u frames (%.1f GB)\n", PRE_FRAMES, PRE_SLACK, (double)capture.memsize() * (PRE_FRAMES + PRE_SLACK) / (1<<30));
+    recorder.init(capture.memsize(), PRE_FRAMES, N, PRE_SLACK, &writer);
+    TRACE(1, "Flight recorder: %s\n", recorder.hugepage() ? "huge pages" : "no huge pages (see /proc/sys/vm/nr_hugepages)");
+
+    // overrides the handler of capture.init()
+    s_recorder = &recorder;
+    signal(SIGUSR1, trigger_handler);
+    if(TRIGGER_PORT) {
+      trigger_sock = open_trigger_socket(TRIGGER_PORT);
+    }
+    fprintf(stderr, "Flight recorder: trigger by kill -USR1 %d%s%s\n", getpid(),
+            TRIGGER_PORT ? Tools::stringf(", 'TRIGGER' to UDP port %u", TRIGGER_PORT).c_str() : "",
+            TRIGGER_AT ? Tools::stringf(", or framecount %llu", TRIGGER_AT).c_str() : "");
+  }
+
   PFCMU::MMappedFile mfile[26];
   const int LIVE_P6HEADER_SIZE = 15;
   const int LIVE_WIDTHSTEP_DS = capture.width() / 2 * 3;
@@ -190,6 +463,9 @@ int main(int argc, char * argv[]) {
 
     if(writer.is_initialized()) {
       int id = writer.get_available_slot_id();
+      if(id < 0) {
+        DIE(1, "write failed before %u\n", i);
+      }
       capture.copy_all(writer.buf(id));
       writer.write(id, i);
     }
@@ -201,14 +477,17 @@ int main(int argc, char * argv[]) {
       capture.copy_thumb(mfile[LIVE_THUMB].buf() + LIVE_P6HEADER_SIZE, LIVE_WIDTHSTEP_THUMB);
       mfile[LIVE_THUMB].sync();
 
-      dump_info(json_str, 0, N, ts, 0, &(mfile[LIVE_INFO]));
+      dump_info(json_str, 0, N, ts, 0, spill, FLIGHT_MODE ? &recorder : NULL, &(mfile[LIVE_INFO]));
     }
     ts_prev = ts;
   }
 
   int error_count  = 0;
+  // frames in the recording
+  off64_t recorded = N;
 
-  for(int i=0 ; i<N ; i++) {
+  // the flight recorder runs until the frames after the trigger are given
+  for(int i=0 ; FLIGHT_MODE ? recorder.state() != PFCMU::FlightRecorder::DONE : i<N ; i++) {
     // retrieve the next frame
     capture.grab();
     // get the framecount
@@ -225,10 +504,24 @@ int main(int argc, char * argv[]) {
     // embed the framecount into each images
     capture.embed_framecount();
 
-    // real capture?
-    if(writer.is_initialized()) {
+    // flight recorder or real capture?
+    if(FLIGHT_MODE) {
+      if((trigger_sock >= 0 && poll_trigger_socket(trigger_sock)) || (TRIGGER_AT && ts_curr >= TRIGGER_AT)) {
+        recorder.trigger();
+      }
+      // keep the frame in RAM, the flush thread writes it after the trigger
+      capture.copy_all(recorder.next());
+      if(recorder.commit()) {
+        PFCMU::FlightRecorder::stat_t st;
+        recorder.stat(&st);
+        fprintf(stderr, "\nTriggered at framecount %llu, recording %u frames before and %d frames after\n", st.trigger_framecount, st.pre, N);
+      }
+    } else if(writer.is_initialized()) {
       // get a slot to write
       int id = writer.get_available_slot_id();
+      if(id < 0) {
+        DIE(1, "write failed before %d\n", i);
+      }
       // fprintf(stderr, "Slot %d\n", id);
       // copy all the data into write buffer
       capture.copy_all(writer.buf(id));
@@ -248,7 +541,7 @@ int main(int argc, char * argv[]) {
       mfile[LIVE_THUMB].sync();
 
       // JSON
-      dump_info(json_str, i+1, N, ts_curr, error_count, &(mfile[LIVE_INFO]));
+      dump_info(json_str, i+1, N, ts_curr, error_count, spill, FLIGHT_MODE ? &recorder : NULL, &(mfile[LIVE_INFO]));
     }
     
 #if 0
@@ -261,6 +554,11 @@ int main(int argc, char * argv[]) {
     // check the framecount consistency and give eye-candy outputs
     if(! DEBUG_MODE && i%1000==0) {
       // start new line at every 1000 frames
+      if(spill && i > 0) {
+        PFCMU::libaio::spill_writer_t::stat_t st;
+        spill->stat(&st);
+        fprintf(stderr, " spill %u/%u", st.backlog, st.high_water);
+      }
       fprintf(stderr, "\n%012d : ", i);
     }
     //if(ts_curr - ts_prev != FRAME_INC && i>(int)C_RINGNUM) {
@@ -291,6 +589,87 @@ int main(int argc, char * argv[]) {
   }
   
   fprintf(stderr, "\n\nCapture finished (%d errors, max sg=%d)\n", error_count, max_sg_len);
+
+  if(FLIGHT_MODE) {
+    recorder.finish();
+    PFCMU::FlightRecorder::stat_t st;
+    recorder.stat(&st);
+    fprintf(stderr, "Flight recorder: %llu frames (%u before the trigger), %llu overrun, max backlog %u/%u frames\n",
+            st.flushed, st.pre, st.overrun, st.max_backlog, PRE_FRAMES + PRE_SLACK);
+
+    // cut the preallocation for the frames not recorded
+    writer.clean();
+    const off64_t frames = st.flushed;
+    recorded = frames;
+    if(SEGMENT || ! SINK.empty() || VOLUME_MODE) {
+      // done by the segmented writer, the server, or the take directory
+    } else if(! STRIPES.empty()) {
+      const PFCMU::StripeLayout & layout = striped_writer.get_layout();
+      for(int j=0 ; j<layout.stripes() ; j++) {
+        if(0 != truncate64(layout.paths[j].c_str(), layout.blocks_on(j, frames) * capture.memsize())) {
+          perror("truncate64");
+        }
+      }
+    } else if(0 != truncate64(OUT_FNAME.c_str(), frames * capture.memsize())) {
+      perror("truncate64");
+    }
+    // the records of the killed frames beyond the recording, or scrub takes them as the frames lost at the end
+    if(CHECKSUMMED && 0 != truncate64(PFCMU::checksum::sidecar(OUT_FNAME).c_str(),
+                                      PFCMU::checksum::header_t::SIZE + frames * PFCMU::checksum::record_t::SIZE)) {
+      perror("truncate64");
+    }
+  }
+
+  if(spill) {
+    // drain the spill RAM before reporting
+    spill_writer.clean();
+    PFCMU::libaio::spill_writer_t::stat_t st;
+    spill_writer.stat(&st);
+    fprintf(stderr, "Spill: %llu direct, %llu spilled, high water %u/%u frames, %llu exhausted, %llu dropped, max block %llu us\n",
+            st.direct, st.spilled, st.high_water, SPILL_FRAMES, st.exhausted, st.dropped, st.max_block_usec);
+  }
+
+  if(SEGMENT && ! OUT_FNAME.empty()) {
+    writer.clean();
+    fprintf(stderr, "Segments: %d files, %llu writes waited for a segment\n", segmented_writer.segments(), segmented_writer.stalls());
+  }
+
+  if(CHECKSUMMED) {
+    // checksum the rest
+    writer.clean();
+    PFCMU::libaio::checksum_writer_t::stat_t st;
+    checksum_writer.stat(&st);
+    fprintf(stderr, "Checksum: %llu frames, %llu us/frame (max %llu us), max backlog %u frames\n",
+            st.frames, st.frames ? st.total_usec / st.frames : 0, st.max_usec, st.max_backlog);
+  }
+
+  if(WRITTEN_BACK) {
+    writer.clean();
+    const PFCMU::libaio::writeback_t::stat_t st = ! STRIPES.empty() ? striped_writer.writeback_stat() :
+      USE_URING ? uring_writer.writeback_stat() : single_writer.writeback_stat();
+    fprintf(stderr, "Writeback: %llu starts (max %llu us), %llu waits (avg %llu us, max %llu us), max %lld frames not dropped\n",
+            st.starts, st.start_max_usec, st.waits, st.waits ? st.wait_total_usec / st.waits : 0, st.wait_max_usec, (long long)st.max_dirty);
+  }
+
+  if(VOLUME_MODE) {
+    // close the take after all the frames are on the device
+    writer.clean();
+    if(0 != volume.end_take(volume_take, recorded)) {
+      perror("end_take");
+      fprintf(stderr, "Cannot close %s. Please recover it by bin/takevol.\n", OUT_FNAME.c_str());
+    }
+    fprintf(stderr, "Volume: take %s, %lld frames, %lld frames available\n",
+            VOLUME_TAKE.c_str(), (long long)recorded, (long long)volume.available(capture.memsize()));
+  }
+
+  if(! SINK.empty()) {
+    // waits for the fsync on the server
+    writer.clean();
+    PFCMU::libaio::net_writer_t::stat_t st;
+    net_writer.stat(&st);
+    fprintf(stderr, "Sink: %llu frames sent, %llu zerocopy, %llu copied, %llu credit waits, max queue %u\n",
+            st.frames, st.zerocopy, st.copied, st.credit_waits, st.max_queue);
+  }
   
   capture.stop();
   
@@ -8,8 +8,12 @@
 #include <highgui.h>
 #include <vector>
 #include "libpfcmu/util.h"
+#include "libpfcmu/defect_correction.h"
+#include "libpfcmu/remap.h"
 #include "rawfile.h"
+#include "lens.h"
 #include "boost_opt_util.h"
+#include "stringf.h"
 #include "trace.h"
 #include "pfcmu_config.h"
 
@@ -32,6 +36,21 @@ int main(int argc, char * argv[]) {
     ("out,o",
      boost::program_options::value<std::string>(),
      "[MANDATORY] output filename template ('%08d.png')")
+    ("defects",
+     boost::program_options::value<std::vector<std::string> >()->composing(),
+     "Correct the defects of a .hpx or a .pxs (can be given several times)")
+    ("dark",
+     boost::program_options::value<std::string>()->default_value("fpn"),
+     "Dark frame of --defects .pxs to be subtracted (none, fpn or full)")
+    ("incalib",
+     boost::program_options::value<std::string>(),
+     "Undistort by the intrinsic parameters of each camera (cam%02d.txt, from 1)")
+    ("remap_cache",
+     boost::program_options::value<std::string>()->default_value("/tmp"),
+     "Directory of the cached remap tables of --incalib")
+    ("scale",
+     boost::program_options::value<int>()->default_value(1),
+     "Downscale the output by 1, 2 or 4 (demosaiced and undistorted at once with --incalib)")
     ;
 
   boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
@@ -45,13 +64,64 @@ int main(int argc, char * argv[]) {
   const int HEIGHT = (FPS == 100 ? 240 : 480);
   const int CAMS = PFCMU::CAMS;
   const timestamp_t SKIP = FPS == 100 ? 1 : 4;
+  const int SCALE = parameter_map["scale"].as<int>();
+  if(SCALE != 1 && SCALE != 2 && SCALE != 4) {
+    DIE(1, "invalid --scale %d\n", SCALE);
+  }
+  const int OUT_WIDTH = WIDTH / SCALE;
+  const int OUT_HEIGHT = HEIGHT / SCALE;
 
   PFCMU::RAWFile rawfile;
   rawfile.open(SRC_FNAME.c_str(), WIDTH, HEIGHT);
   fprintf(stdout, "%s has %zd images\n", SRC_FNAME.c_str(), rawfile.size());
 
+  PFCMU::DefectCorrector corrector;
+  if(parameter_map.count("defects")) {
+    PFCMU::DefectCorrector::dark_t dark;
+    if(0 != PFCMU::DefectCorrector::dark_from_string(parameter_map["dark"].as<std::string>(), &dark)) {
+      DIE(1, "invalid --dark '%s'\n", parameter_map["dark"].as<std::string>().c_str());
+    }
+    corrector.init(WIDTH, HEIGHT);
+    const std::vector<std::string> files = parameter_map["defects"].as<std::vector<std::string> >();
+    for(size_t i=0 ; i<files.size() ; i++) {
+      const int n = corrector.load(files[i].c_str(), dark);
+      if(n < 0) {
+        DIE(1, "cannot load %s\n", files[i].c_str());
+      }
+      fprintf(stdout, "%s has %d defects\n", files[i].c_str(), n);
+    }
+    rawfile.set_filter(&corrector);
+  }
+
+  const std::string INCALIB = boost_opt_string(parameter_map, "incalib");
+  incalib_t incalib[PFCMU::CAMS];
+  PFCMU::LensModel lens_model;
+  // the tables of all the cameras, applied at once in parallel over the cameras and the rows
+  PFCMU::Remapper remapper;
+  if(! INCALIB.empty()) {
+    lens_model.init();
+    remapper.init();
+  }
+  for(int i=0 ; ! INCALIB.empty() && i<CAMS ; i++) {
+    const std::string fname = Tools::stringf(INCALIB.c_str(), i+1);
+    const int ret = incalib[i].setup_cached(fname.c_str(), WIDTH, HEIGHT, parameter_map["remap_cache"].as<std::string>().c_str(),
+                                            OUT_WIDTH, OUT_HEIGHT, &lens_model, &remapper.table(i));
+    if(ret < 0) {
+      DIE(1, "cannot load %s\n", fname.c_str());
+    }
+    TRACE(1, "%s: %s\n", fname.c_str(), ret == 0 ? "cached" : "built");
+  }
+
   IplImage * bayer = cvCreateImage(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 1);
   IplImage * bgr = cvCreateImage(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 3);
+  IplImage * out = cvCreateImage(cvSize(OUT_WIDTH, OUT_HEIGHT), IPL_DEPTH_8U, 3);
+  // a camera of the frames read and undistorted by --incalib
+  IplImage * undistorted = cvCreateImageHeader(cvSize(OUT_WIDTH, OUT_HEIGHT), IPL_DEPTH_8U, 3);
+  std::vector<unsigned char> frame, frame_out;
+  if(! INCALIB.empty()) {
+    frame.resize((size_t)WIDTH * HEIGHT * CAMS);
+    frame_out.resize((size_t)OUT_WIDTH * OUT_HEIGHT * 3 * CAMS);
+  }
 
   int error_count = 0;
   std::vector<timestamp_t> ts(CAMS);
@@ -69,19 +139,37 @@ int main(int argc, char * argv[]) {
       continue;
     }
 
-    for(int i=0 ; i<CAMS ; i++) {
-      itr.extract(i, bayer);
-      ts[i] = PFCMU::get_timestamp(bayer->imageData);
+    if(! INCALIB.empty()) {
+      rawfile.read(itr.frame(), &frame[0]);
+      remapper.apply_bayer(&frame[0], &frame_out[0]);
+    }
 
-      cvCvtColor(bayer, bgr, CV_BayerGR2BGR);
+    for(int i=0 ; i<CAMS ; i++) {
+      const char * raw;
+      IplImage * img = out;
+      if(! INCALIB.empty()) {
+        raw = reinterpret_cast<const char *>(&frame[(size_t)WIDTH * HEIGHT * i]);
+        cvSetData(undistorted, &frame_out[(size_t)OUT_WIDTH * OUT_HEIGHT * 3 * i], OUT_WIDTH * 3);
+        img = undistorted;
+      } else {
+        itr.extract(i, bayer);
+        raw = bayer->imageData;
+        if(SCALE != 1) {
+          cvCvtColor(bayer, bgr, CV_BayerGR2BGR);
+          cvResize(bgr, out, CV_INTER_AREA);
+        } else {
+          cvCvtColor(bayer, out, CV_BayerGR2BGR);
+        }
+      }
+      ts[i] = PFCMU::get_timestamp(raw);
 
       for(int b=0 ; b<4 ; b++) {
-        bgr->imageData[b] = bayer->imageData[b];
+        img->imageData[b] = raw[b];
       }
 
       char buf[PATH_MAX];
       snprintf(buf, sizeof(buf), OUT_FNAME.c_str(), i, (int)(itr.frame()));
-      cvSaveImage(buf, bgr);
+      cvSaveImage(buf, img);
     }
     fprintf(stdout, "%08zd : %08llu = %08llu + %llu * %zd\n", itr.frame(), ts[0], ts[0] - itr.frame()*SKIP, SKIP, itr.frame());
 
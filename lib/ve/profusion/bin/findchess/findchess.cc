@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   findchess.cc
+ *
+ * @brief  Offline chessboard detection of a recording
+ *
+ * Scans the frames of a recording and writes all the chessboards found
+ * into a .chs (see chess_points.h), so that the chessboards can be
+ * recorded without calibrating at the same time.
+ *
+ * The frames are read in batches of --batch frames, and the images of
+ * a batch are searched in parallel over the frames and the cameras by
+ * the work-stealing scheduler of TBB, while the next batch is read
+ * ahead.  Each image is first checked on the image downsampled by
+ * --precheck, and searched at the full resolution only if the
+ * chessboard is found there.
+ */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include <cv.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include "libpfcmu/chess_points.h"
+#include "libpfcmu/defect_correction.h"
+#include "libpfcmu/util.h"
+#include "rawfile.h"
+#include "chess_detector.h"
+#include "boost_opt_util.h"
+#include "trace.h"
+#include "pfcmu_config.h"
+
+namespace {
+  double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+
+  enum {
+    RESULT_NOTFOUND,
+    RESULT_REJECTED,
+    RESULT_FOUND,
+  };
+
+  /**
+   * Detection of the images of a batch, one per camera of each frame
+   */
+  struct tbb_detect {
+    const std::vector<unsigned char> & frames;
+    const int width;
+    const int height;
+    const CvSize pattern_size;
+    const int precheck;
+    std::vector<CvPoint2D32f> & corners;
+    std::vector<int> & results;
+
+    tbb_detect(const std::vector<unsigned char> & frames_, int width_, int height_, CvSize pattern_size_, int precheck_,
+               std::vector<CvPoint2D32f> & corners_, std::vector<int> & results_)
+      : frames(frames_), width(width_), height(height_), pattern_size(pattern_size_), precheck(precheck_),
+        corners(corners_), results(results_) {
+    }
+
+    void operator()(const tbb::blocked_range<int> & range) const {
+      const int N = pattern_size.width * pattern_size.height;
+      const size_t bytes = (size_t)width * height;
+      IplImage * bayer = cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, 1);
+      IplImage * bgr = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 3);
+      IplImage * gray = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+      IplImage * small = cvCreateImage(cvSize(width / precheck, height / precheck), IPL_DEPTH_8U, 1);
+
+      for(int i=range.begin() ; i!=range.end() ; i++) {
+        // the image i of the batch is the camera i%CAMS of the frame i/CAMS
+        cvSetData(bayer, const_cast<unsigned char *>(&frames[bytes * i]), width);
+        cvCvtColor(bayer, bgr, CV_BayerGR2BGR);
+        cvCvtColor(bgr, gray, CV_BGR2GRAY);
+
+        if(precheck > 1 && ! ChessboardDetector::precheck(gray, pattern_size, small)) {
+          results[i] = RESULT_REJECTED;
+          continue;
+        }
+        CvPoint2D32f * c = &corners[(size_t)N * i];
+        if(! ChessboardDetector::search(gray, pattern_size, c)) {
+          results[i] = RESULT_NOTFOUND;
+          continue;
+        }
+        ChessboardDetector::refine(gray, c, N);
+        results[i] = RESULT_FOUND;
+      }
+
+      cvReleaseImageHeader(&bayer);
+      cvReleaseImage(&bgr);
+      cvReleaseImage(&gray);
+      cvReleaseImage(&small);
+    }
+  };
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("src,s",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Input filename (/disks/local/out.dat)")
+    ("fps,f",
+     boost::program_options::value<unsigned int>(),
+     "[MANDATORY] FPS (25 or 100)")
+    ("out,o",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Output detections (chess.chs)")
+    ("rows,r",
+     boost::program_options::value<unsigned int>()->default_value(4),
+     "num of rows of the chessboard corners")
+    ("cols,c",
+     boost::program_options::value<unsigned int>()->default_value(5),
+     "num of cols of the chessboard corners")
+    ("size",
+     boost::program_options::value<double>()->default_value(40),
+     "the size of the chess square")
+    ("begin,b",
+     boost::program_options::value<int>()->default_value(0),
+     "scan frames in [begin:end)")
+    ("end,e",
+     boost::program_options::value<int>()->default_value(-1),
+     "scan frames in [begin:end) (-1 = all)")
+    ("step",
+     boost::program_options::value<int>()->default_value(1),
+     "Scan every N-th frame")
+    ("precheck",
+     boost::program_options::value<int>()->default_value(4),
+     "Downsample by 1, 2 or 4 for the coarse check of the chessboard (1 = no check)")
+    ("batch",
+     boost::program_options::value<int>()->default_value(16),
+     "Num of frames searched in parallel")
+    ("defects",
+     boost::program_options::value<std::vector<std::string> >()->composing(),
+     "Correct the defects of a .hpx or a .pxs (can be given several times)")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::string SRC_FNAME = boost_opt_string(parameter_map, "src");
+  const std::string OUT_FNAME = boost_opt_string(parameter_map, "out");
+  const unsigned int FPS = parameter_map["fps"].as<unsigned int>();
+  const int WIDTH = (FPS == 100 ? 320 : 640);
+  const int HEIGHT = (FPS == 100 ? 240 : 480);
+  const int CAMS = PFCMU::CAMS;
+  const CvSize PATTERN_SIZE = cvSize(parameter_map["cols"].as<unsigned int>(), parameter_map["rows"].as<unsigned int>());
+  const int N = PATTERN_SIZE.width * PATTERN_SIZE.height;
+  const int BEGIN = parameter_map["begin"].as<int>();
+  const int STEP = std::max(1, parameter_map["step"].as<int>());
+  const int PRECHECK = parameter_map["precheck"].as<int>();
+  const int BATCH = std::max(1, parameter_map["batch"].as<int>());
+  if(PRECHECK != 1 && PRECHECK != 2 && PRECHECK != 4) {
+    DIE(1, "invalid --precheck %d\n", PRECHECK);
+  }
+
+  PFCMU::RAWFile rawfile;
+  rawfile.open(SRC_FNAME.c_str(), WIDTH, HEIGHT);
+  const int END = parameter_map["end"].as<int>() < 0 ? (int)rawfile.size() : std::min(parameter_map["end"].as<int>(), (int)rawfile.size());
+  fprintf(stderr, "%s has %zd frames\n", SRC_FNAME.c_str(), rawfile.size());
+
+  PFCMU::DefectCorrector corrector;
+  if(parameter_map.count("defects")) {
+    corrector.init(WIDTH, HEIGHT);
+    const std::vector<std::string> files = parameter_map["defects"].as<std::vector<std::string> >();
+    for(size_t i=0 ; i<files.size() ; i++) {
+      if(corrector.load(files[i].c_str()) < 0) {
+        DIE(1, "cannot load %s\n", files[i].c_str());
+      }
+    }
+    rawfile.set_filter(&corrector);
+  }
+
+  PFCMU::chess_points::header_t header;
+  header.cams = CAMS;
+  header.width = WIDTH;
+  header.height = HEIGHT;
+  header.rows = PATTERN_SIZE.height;
+  header.cols = PATTERN_SIZE.width;
+  header.square = parameter_map["size"].as<double>();
+  header.detections = 0;
+  PFCMU::chess_points::writer_t writer;
+  if(0 != writer.open(OUT_FNAME.c_str(), header)) {
+    DIE(1, "cannot open %s\n", OUT_FNAME.c_str());
+  }
+
+  const size_t FRAME_BYTES = (size_t)WIDTH * HEIGHT * CAMS;
+  std::vector<unsigned char> frames(FRAME_BYTES * BATCH);
+  std::vector<off64_t> index(BATCH);
+  std::vector<CvPoint2D32f> corners((size_t)N * CAMS * BATCH);
+  std::vector<int> results(CAMS * BATCH);
+  std::vector<float> points(2 * N);
+  std::vector<int> found(CAMS, 0);
+  size_t scanned = 0, rejected = 0;
+
+  const double t0 = now();
+  for(off64_t f=BEGIN ; f<END ; ) {
+    int n = 0;
+    for( ; n<BATCH && f<END ; n++, f+=STEP) {
+      index[n] = f;
+      rawfile.read(f, &frames[FRAME_BYTES * n]);
+    }
+    // read ahead the next batch while this batch is searched
+    for(int i=0 ; i<BATCH && f+(off64_t)i*STEP<END ; i++) {
+      rawfile.prefetch(f + (off64_t)i * STEP, 1);
+    }
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, n * CAMS, 1),
+                      tbb_detect(frames, WIDTH, HEIGHT, PATTERN_SIZE, PRECHECK, corners, results));
+
+    for(int i=0 ; i<n * CAMS ; i++) {
+      scanned++;
+      if(results[i] == RESULT_REJECTED) {
+        rejected++;
+      }
+      if(results[i] != RESULT_FOUND) {
+        continue;
+      }
+      PFCMU::chess_points::record_t record;
+      record.frame = index[i / CAMS];
+      record.framecount = PFCMU::get_timestamp(&frames[(size_t)WIDTH * HEIGHT * i]);
+      record.camera = i % CAMS;
+      for(int j=0 ; j<N ; j++) {
+        points[2*j+0] = corners[(size_t)N * i + j].x;
+        points[2*j+1] = corners[(size_t)N * i + j].y;
+      }
+      if(0 != writer.write(record, &points[0])) {
+        DIE(1, "cannot write %s\n", OUT_FNAME.c_str());
+      }
+      found[record.camera]++;
+    }
+    fprintf(stderr, "\r%08lld / %08d : %llu detections", (long long)f, END, (unsigned long long)writer.detections());
+  }
+  const double t = now() - t0;
+  fprintf(stderr, "\n");
+
+  if(0 != writer.close()) {
+    DIE(1, "cannot write %s\n", OUT_FNAME.c_str());
+  }
+
+  fprintf(stdout, "%zu images in %.2f sec (%.1f images/sec), %zu rejected by the precheck\n",
+          scanned, t, scanned / std::max(t, 1e-6), rejected);
+  for(int i=0 ; i<CAMS ; i++) {
+    fprintf(stdout, "cam%02d : %d chessboards\n", i+1, found[i]);
+  }
+
+  return 0;
+}
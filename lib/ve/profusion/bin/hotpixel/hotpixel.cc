@@ -8,23 +8,131 @@
 #include <cv.h>
 #include <vector>
 #include <fstream>
+#include <iostream>
+#include <sys/time.h>
 #include "libpfcmu/util.h"
 #include "libpfcmu/capture++.h"
+#include "libpfcmu/hotpixel.h"
 
+#include "rawfile.h"
 #include "boost_opt_util.h"
 #include "trace.h"
 #include "pfcmu_config.h"
 
-void save_hpx(std::ostream & os, const std::vector<IplImage *> & diff) {
-  for(int i=0 ; i<PFCMU::CAMS ; i++) {
-    for(int y=0 ; y<diff[i]->height; y++) {
-      const unsigned char * d = reinterpret_cast<const unsigned char*>(diff[i]->imageData + diff[i]->widthStep * y);
-      for(int x=0 ; x<diff[i]->width; x++, d++) {
-        if(*d) {
-          os << i << "\t" << x << "\t" << y << "\n";
-        }
+namespace {
+  double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+
+  void save(const std::string & filename, const PFCMU::HotPixelDetector & detector) {
+    if(! filename.empty()) {
+      std::ofstream ofs;
+      ofs.open(filename.c_str());
+      detector.save_hpx(ofs);
+    } else {
+      detector.save_hpx(std::cout);
+    }
+  }
+
+  /**
+   * Every step-th frame of [begin:end) of a recording
+   */
+  void survey(const std::string & src, int width, int height, off64_t begin, off64_t end, int step, PFCMU::HotPixelDetector * detector) {
+    PFCMU::RAWFile rawfile;
+    rawfile.open(src.c_str(), width, height);
+    if(end < 0 || end > (off64_t)rawfile.size()) {
+      end = rawfile.size();
+    }
+
+    std::vector<unsigned char> frame((size_t)width * height * PFCMU::CAMS);
+    const double t0 = now();
+    for(off64_t i=begin ; i<end ; i+=step) {
+      rawfile.read(i, &frame[0]);
+      // read ahead the next while the cameras are compared
+      if(i + step < end) {
+        rawfile.prefetch(i + step, 1);
+      }
+      detector->feed(&frame[0]);
+    }
+    const double t = now() - t0;
+
+    int total = 0;
+    for(int i=0 ; i<PFCMU::CAMS ; i++) {
+      total += detector->count(i);
+    }
+    fprintf(stderr, "%llu frames in %.2f sec (%.0f frames/sec, %s), %d hot pixels\n", detector->frames(), t,
+            detector->frames() / std::max(t, 1e-6), PFCMU::HotPixelDetector::avx2() ? "avx2" : "sse2", total);
+  }
+
+  void live(unsigned int device, unsigned int fps, PFCMU::HotPixelDetector * detector) {
+    PFCMU::Capture capture;
+    capture.init(device, fps);
+    capture.start();
+    capture.set_gain(0);
+    capture.set_shutter(30);
+
+    const int WIDTH = capture.width();
+    const int HEIGHT = capture.height();
+    IplImage * mask = cvCreateImageHeader(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 1);
+    IplImage * prev = cvCreateImageHeader(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 1);
+    IplImage * bgr = cvCreateImage(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 3);
+
+    // initial images
+    capture.grab();
+    detector->feed(capture.frame());
+
+    // find 'very low' max diff pixels
+    int cam = 0;
+    cvNamedWindow("main");
+    cvCreateTrackbar("cam", "main", &cam, 23, NULL);
+    CvFont font;
+    cvInitFont(&font, CV_FONT_HERSHEY_SIMPLEX, 1, 1, 0, 1, CV_AA);
+    enum {
+      MODE_HOT,
+      MODE_FG,
+    };
+    int mode = MODE_HOT;
+    int key = 0;
+    while( ((key=cvWaitKey(10)) & 0xff) != 'q' ) {
+      switch(key&0xff) {
+      case 'f':
+        mode = mode == MODE_FG ? MODE_HOT : MODE_FG;
+        break;
+      }
+
+      capture.grab();
+      detector->feed(capture.frame());
+
+      switch(mode) {
+      case MODE_HOT:
+        cvSetData(mask, const_cast<unsigned char *>(detector->mask(cam)), WIDTH);
+        cvCvtColor(mask, bgr, CV_GRAY2BGR);
+        break;
+      case MODE_FG:
+        cvSetData(prev, const_cast<unsigned char *>(detector->previous(cam)), WIDTH);
+        cvCvtColor(prev, bgr, PFCMU::CV_BAYER2BGR);
+        break;
+      }
+
+      int n = detector->count(cam);
+      if(n) {
+        char text[1024];
+        snprintf(text, sizeof(text), "%d hot pixel%s", n, n==1?"":"s");
+        cvPutText(bgr, text, cvPoint(16, HEIGHT-16), &font, CV_RGB(255,0,0));
+      } else {
+        cvPutText(bgr, "No hot pixels", cvPoint(16, HEIGHT-16), &font, CV_RGB(255,0,0));
       }
+
+      cvShowImage("main", bgr);
     }
+
+    capture.stop();
+
+    cvReleaseImage(&bgr);
+    cvReleaseImageHeader(&prev);
+    cvReleaseImageHeader(&mask);
   }
 }
 
@@ -41,6 +149,24 @@ int main(int argc, char * argv[]) {
     ("camera,c",
      boost::program_options::value<unsigned int>()->default_value(0),
      "Device ID (0, 1, ...)")
+    ("src,s",
+     boost::program_options::value<std::string>(),
+     "Survey a recording (/disks/local/out.dat) instead of the live capture")
+    ("step",
+     boost::program_options::value<int>()->default_value(25),
+     "Use every N-th frame of --src")
+    ("begin,b",
+     boost::program_options::value<int>()->default_value(0),
+     "Survey frames in [begin:end) of --src")
+    ("end,e",
+     boost::program_options::value<int>()->default_value(-1),
+     "Survey frames in [begin:end) of --src (-1 = all)")
+    ("threshold",
+     boost::program_options::value<int>()->default_value(10),
+     "A pixel changing more than this between the frames is not hot")
+    ("threads,t",
+     boost::program_options::value<int>()->default_value(0),
+     "Num of threads (0 = num of CPUs)")
     ;
 
   boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
@@ -48,103 +174,32 @@ int main(int argc, char * argv[]) {
   const unsigned int CAMERA = parameter_map["camera"].as<unsigned int>();
   const unsigned int FPS = parameter_map["fps"].as<unsigned int>();
   const std::string OUT_FNAME = boost_opt_string(parameter_map, "out");
+  const std::string SRC_FNAME = boost_opt_string(parameter_map, "src");
+  const int STEP = std::max(1, parameter_map["step"].as<int>());
+  const int BEGIN = parameter_map["begin"].as<int>();
+  const int END = parameter_map["end"].as<int>();
+  const int THRESHOLD = parameter_map["threshold"].as<int>();
+  const int THREADS = parameter_map["threads"].as<int>();
   const int WIDTH = (FPS == 100 ? 320 : 640);
   const int HEIGHT = (FPS == 100 ? 240 : 480);
 
-  PFCMU::Capture capture;
-  capture.init(CAMERA, FPS);
-  capture.start();
-  capture.set_gain(0);
-  capture.set_shutter(30);
-
-  std::vector<IplImage *> diff(PFCMU::CAMS);
-  std::vector<IplImage *> prev(PFCMU::CAMS);
-  for(int i=0 ; i<PFCMU::CAMS ; i++) {
-    diff[i] = cvCreateImage(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 1);
-    prev[i] = cvCreateImage(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 1);
-    cvZero(diff[i]);
-    cvAddS(diff[i], cvScalar(255), diff[i]);
-  }
-  IplImage * buf = cvCreateImage(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 1);
-  IplImage * bgr = cvCreateImage(cvSize(WIDTH, HEIGHT), IPL_DEPTH_8U, 3);
-
-  // initial images
-  capture.grab();
-  for(int i=0 ; i<PFCMU::CAMS ; i++) {
-    capture.copy(prev[i]->imageData, i, prev[i]->widthStep);
+  if(THRESHOLD < 0 || THRESHOLD > 255) {
+    DIE(1, "--threshold should be in [0:255]\n");
   }
 
-  // find 'very low' max diff pixels
-  int cam = 0;
-  CvPoint pt = cvPoint(-1,-1);
-  cvNamedWindow("main");
-  cvCreateTrackbar("cam", "main", &cam, 23, NULL);
-  CvFont font;
-  cvInitFont(&font, CV_FONT_HERSHEY_SIMPLEX, 1, 1, 0, 1, CV_AA);
-  enum {
-    MODE_HOT,
-    MODE_FG,
-  };
-  int mode = MODE_HOT;
-  int key = 0;
-  int THRESHOLD = 10;
-  while( ((key=cvWaitKey(10)) & 0xff) != 'q' ) {
-    switch(key&0xff) {
-    case 'f':
-      mode = mode == MODE_FG ? MODE_HOT : MODE_FG;
-      break;
-    }
-
-    capture.grab();
-    for(int i=0 ; i<PFCMU::CAMS ; i++) {
-      capture.copy(buf->imageData, i, buf->widthStep);
-
-      // check diff
-      for(int y=0 ; y<HEIGHT ; y++) {
-        const unsigned char * p = reinterpret_cast<const unsigned char*>(prev[i]->imageData + prev[i]->widthStep * y);
-        const unsigned char * b = reinterpret_cast<const unsigned char*>(buf->imageData + buf->widthStep * y);
-        unsigned char * d = reinterpret_cast<unsigned char*>(diff[i]->imageData + diff[i]->widthStep * y);
-        for(int x=0 ; x<WIDTH ; x++, p++, b++, d++) {
-          if(abs(*p - *b) > THRESHOLD) {
-            *d = 0;
-          }
-        }
-      }
-
-      cvCopyImage(buf, prev[i]);
-    }
-
-    switch(mode) {
-    case MODE_HOT:
-      cvCvtColor(diff[cam], bgr, CV_GRAY2BGR);
-      break;
-    case MODE_FG:
-      cvCvtColor(prev[cam], bgr, PFCMU::CV_BAYER2BGR);
-      break;
-    }
+  PFCMU::HotPixelDetector detector;
+  detector.init(WIDTH, HEIGHT, THRESHOLD, THREADS);
 
-    int n = cvCountNonZero(diff[cam]);
-    if(n) {
-      char text[1024];
-      snprintf(text, sizeof(text), "%d hot pixel%s", n, n==1?"":"s");
-      cvPutText(bgr, text, cvPoint(16, HEIGHT-16), &font, CV_RGB(255,0,0));
-    } else {
-      cvPutText(bgr, "No hot pixels", cvPoint(16, HEIGHT-16), &font, CV_RGB(255,0,0));
-    }
-
-    cvShowImage("main", bgr);
+  if(! SRC_FNAME.empty()) {
+    survey(SRC_FNAME, WIDTH, HEIGHT, BEGIN, END, STEP, &detector);
+  } else {
+    live(CAMERA, FPS, &detector);
   }
 
-  capture.stop();
-
-  if(! OUT_FNAME.empty()) {
-    std::ofstream ofs;
-    ofs.open(OUT_FNAME.c_str());
-    save_hpx(ofs, diff);
-  } else {
-    save_hpx(std::cout, diff);
+  if(detector.frames() < 2) {
+    DIE(1, "at least 2 frames are required\n");
   }
+  save(OUT_FNAME, detector);
 
   return 0;
 }
-
@@ -14,6 +14,7 @@
 #include <tbb/parallel_for.h>
 
 #include "libpfcmu/capture++.h"
+#include "libpfcmu/incalib_solver.h"
 #include "trace.h"
 #include "my_memcpy.h"
 #include "boost_opt_util.h"
@@ -22,18 +23,23 @@
 #include "pfcmu_config.h"
 
 struct tbb_findchess {
+  /// iterations of the solver per chessboard found
+  static const int ITERATIONS = 3;
+
   std::vector<ChessboardDetector *> & cd;
+  std::vector<PFCMU::IncalibSolver *> & solver;
   std::vector<IplImage *> & buf_mono;
   std::vector<IplImage *> & buf_rgb;
   std::vector<int> & info;
   PF_EZImage * img;
 
   tbb_findchess(std::vector<ChessboardDetector *> & cd_,
+                std::vector<PFCMU::IncalibSolver *> & solver_,
                 std::vector<IplImage *> & buf_mono_,
                 std::vector<IplImage *> & buf_rgb_,
                 std::vector<int> & info_,
                 PF_EZImage * img_)
-    : cd(cd_), buf_mono(buf_mono_), buf_rgb(buf_rgb_), info(info_), img(img_) {
+    : cd(cd_), solver(solver_), buf_mono(buf_mono_), buf_rgb(buf_rgb_), info(info_), img(img_) {
   }
 
   void operator()(const tbb::blocked_range<int> & range) const {
@@ -47,6 +53,13 @@ struct tbb_findchess {
       cd[c]->draw_indicator(buf_rgb[c], ret);
       cd[c]->draw_chessboard(buf_rgb[c], ret);
 
+      // refine the calibration by the new chessboard while capturing
+      if(ret == ChessboardDetector::CHESS_FOUND && ! solver.empty()) {
+        solver[c]->add_view(&cd[c]->image_points(cd[c]->count() - 1)->x);
+        solver[c]->solve(ITERATIONS);
+        TRACE(1, "  cam[%02d] %d views, rms=%f\n", c, solver[c]->views(), solver[c]->rms());
+      }
+
       info[c] = ret;
     }
   }
@@ -89,48 +102,57 @@ struct tbb_incalib {
 
       char buf[65536];
       snprintf(buf, sizeof(buf), ofname_fmt.c_str(), c+1);
-      std::ofstream ofs(buf);
-
-      {
-        double jacobian[27];
-        double rotation[9];
-        double rotvec[3] = { rotation_vectors[key_index[c]*3+0],
-                             rotation_vectors[key_index[c]*3+1],
-                             rotation_vectors[key_index[c]*3+2],
-        };
-        CvMat mat_j = cvMat(9, 3, CV_64FC1, jacobian);
-        CvMat mat_r = cvMat(3, 3, CV_64FC1, rotation);
-        CvMat rv = cvMat(1, 3, CV_64FC1, rotvec);
-        cvRodrigues2(&rv, &mat_r, &mat_j);
-
-        snprintf(buf, sizeof(buf),
-                 "%.16e %.16e %.16e %.16e %.16e\n"
-                 "\n"
-                 "%.16e %.16e %.16e %.16e\n"
-                 "\n"
-                 "%e %e %e\n"
-                 "%e %e %e\n"
-                 "%e %e %e\n"
-                 "%e %e %e\n"
-                 "\n",
-                 intrinsic_matrix[0],
-                 intrinsic_matrix[1],
-                 intrinsic_matrix[4],
-                 intrinsic_matrix[2],
-                 intrinsic_matrix[5],
-                 distortion_coeffs[0],
-                 distortion_coeffs[1],
-                 distortion_coeffs[2],
-                 distortion_coeffs[3],
-                 rotation[0], rotation[1], rotation[2],
-                 rotation[3], rotation[4], rotation[5],
-                 rotation[6], rotation[7], rotation[8],
-                 translation_vectors[key_index[c]*3+0],
-                 translation_vectors[key_index[c]*3+1],
-                 translation_vectors[key_index[c]*3+2]);
-        ofs << buf;
+
+      double jacobian[27];
+      double rotation[9];
+      double rotvec[3] = { rotation_vectors[key_index[c]*3+0],
+                           rotation_vectors[key_index[c]*3+1],
+                           rotation_vectors[key_index[c]*3+2],
+      };
+      CvMat mat_j = cvMat(9, 3, CV_64FC1, jacobian);
+      CvMat mat_r = cvMat(3, 3, CV_64FC1, rotation);
+      CvMat mat_v = cvMat(1, 3, CV_64FC1, rotvec);
+      cvRodrigues2(&mat_v, &mat_r, &mat_j);
+
+      const PFCMU::lens_t lens = { intrinsic_matrix[0], intrinsic_matrix[4], intrinsic_matrix[2], intrinsic_matrix[5],
+                                   distortion_coeffs[0], distortion_coeffs[1], distortion_coeffs[2], distortion_coeffs[3] };
+      const VM::matrix3_t R(rotation[0], rotation[1], rotation[2],
+                            rotation[3], rotation[4], rotation[5],
+                            rotation[6], rotation[7], rotation[8]);
+      const VM::vector3_t T(translation_vectors[key_index[c]*3+0],
+                            translation_vectors[key_index[c]*3+1],
+                            translation_vectors[key_index[c]*3+2]);
+      if(0 != PFCMU::IncalibSolver::save(buf, lens, R, T)) {
+        fprintf(stderr, "cannot write %s\n", buf);
+      }
+    }
+  }
+};
+
+/**
+ * The last iterations of the calibration refined while capturing
+ */
+struct tbb_solve {
+  std::vector<PFCMU::IncalibSolver *> & solver;
+  std::vector<int> & key_index;
+  const std::string ofname_fmt;
+
+  tbb_solve(std::vector<PFCMU::IncalibSolver *> & solver_,
+            std::vector<int> & key_index_,
+            const std::string ofname_fmt_) :
+    solver(solver_), key_index(key_index_), ofname_fmt(ofname_fmt_) {
+  }
+
+  void operator()(const tbb::blocked_range<int> & range) const {
+    for(int c=range.begin() ; c!=range.end() ; c++) {
+      const double rms = solver[c]->solve();
+      fprintf(stderr, "cam%02d : %d views, rms = %f\n", c+1, solver[c]->views(), rms);
+
+      char buf[65536];
+      snprintf(buf, sizeof(buf), ofname_fmt.c_str(), c+1);
+      if(0 != solver[c]->save(buf, key_index[c])) {
+        fprintf(stderr, "cannot write %s\n", buf);
       }
-      ofs.close();
     }
   }
 };
@@ -161,6 +183,12 @@ int main( int argc, char *argv[] ) {
     ("skip,S",
      boost::program_options::value<unsigned int>()->default_value(25),
      "use every 'skip' frames only")
+    ("coarse",
+     boost::program_options::value<int>()->default_value(2),
+     "search the chessboard on the image downsampled by 1, 2 or 4, tracked per camera (1 = full resolution)")
+    ("solver",
+     boost::program_options::value<std::string>()->default_value("native"),
+     "calibration refined while capturing (native), or by cvCalibrateCamera2 after capturing (opencv)")
     ("window,w",
      boost::program_options::value<double>()->default_value(0.5),
      "size of the debug window. use zero to disable")
@@ -191,12 +219,22 @@ int main( int argc, char *argv[] ) {
   const std::string OFNAME = parameter_map["output"].as<std::string>();
   const double CAM_SHUTTER = parameter_map["shutter"].as<double>();
   const double CAM_GAIN = parameter_map["gain"].as<double>();
+  const int COARSE = parameter_map["coarse"].as<int>();
+  if(COARSE != 1 && COARSE != 2 && COARSE != 4) {
+    DIE(1, "invalid --coarse %d\n", COARSE);
+  }
+
+  const std::string SOLVER = parameter_map["solver"].as<std::string>();
+  if(SOLVER != "native" && SOLVER != "opencv") {
+    DIE(1, "invalid --solver %s\n", SOLVER.c_str());
+  }
 
   const int CAMS = PFCMU::CAMS;
 
   std::vector<ChessboardDetector *> cd(CAMS);
   for(unsigned int i=0 ; i<cd.size() ; i++) {
     cd[i] = new ChessboardDetector(CHESS_ROWS, CHESS_COLS, CHESS_SCALE, FRAME_NUM, 1);
+    cd[i]->set_coarse(COARSE);
   }
 
   // GUI 
@@ -213,6 +251,16 @@ int main( int argc, char *argv[] ) {
   assert(IMAGE_SIZE.width > 0);
   assert(IMAGE_SIZE.height > 0);
 
+  // one solver per camera, where the cameras are solved in parallel
+  std::vector<PFCMU::IncalibSolver *> solver;
+  if(SOLVER == "native") {
+    solver.resize(CAMS);
+    for(int i=0 ; i<CAMS ; i++) {
+      solver[i] = new PFCMU::IncalibSolver;
+      solver[i]->setup(IMAGE_SIZE.width, IMAGE_SIZE.height, CHESS_ROWS, CHESS_COLS, CHESS_SCALE);
+    }
+  }
+
   // ֥ХåեѰ
   std::vector<IplImage *> buf_rgb(CAMS);
   std::vector<IplImage *> buf_mono(CAMS);
@@ -281,7 +329,7 @@ int main( int argc, char *argv[] ) {
     
     // multi-thread chess detection
     tbb::parallel_for( tbb::blocked_range<int>(0, CAMS),
-                       tbb_findchess(cd, buf_mono, buf_rgb, info, img));
+                       tbb_findchess(cd, solver, buf_mono, buf_rgb, info, img));
 
     // generate thumbnail image
     for(int c=0 ; c<CAMS ; c++) {
@@ -342,8 +390,16 @@ int main( int argc, char *argv[] ) {
   }
 
   // multi-thread incalib
-  tbb::parallel_for( tbb::blocked_range<int>(0, CAMS),
-                     tbb_incalib(cd, key_index, IMAGE_SIZE, OFNAME));
+  if(solver.empty()) {
+    tbb::parallel_for( tbb::blocked_range<int>(0, CAMS),
+                       tbb_incalib(cd, key_index, IMAGE_SIZE, OFNAME));
+  } else {
+    tbb::parallel_for( tbb::blocked_range<int>(0, CAMS, 1),
+                       tbb_solve(solver, key_index, OFNAME));
+    for(int i=0 ; i<CAMS ; i++) {
+      delete solver[i];
+    }
+  }
 
 
   return 0;
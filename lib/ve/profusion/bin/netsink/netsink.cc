@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   netsink.cc
+ *
+ * @brief  Storage server of the recordings sent by capture --sink
+ *
+ * Each connection is a recording written into --dir by libaio::writer_t,
+ * the same way as capture writes to a local disk.  A credit is granted
+ * to the client for each free slot of the writer, so that the client
+ * sends only what can be written without waiting (see
+ * PFCMU::libaio::net_writer_t for the protocol).  The frames are
+ * received directly into the aligned slots of the writer.  A write
+ * error ends only the session of the recording, and the others go on.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <string>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libpfcmu/net_writer.h"
+#include "boost_opt_util.h"
+#include "path_util.h"
+#include "stringf.h"
+#include "trace.h"
+
+namespace {
+  /// max bytes of a frame accepted from a client (24 cameras of 1920x1080 RGB are 150 MB)
+  const uint64_t MAX_BLOCKSIZE = 1ULL << 30;
+
+  struct session_t {
+    int fd;
+    std::string peer;
+    std::string dir;
+    unsigned int d_ringnum;
+    unsigned int d_align;
+  };
+
+  unsigned long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+  }
+
+  double cpu_sec(const struct timeval & tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+  /**
+   * Reserve the free slots of the writer and grant them to the client
+   *
+   * Blocks for the disk only if the client has no credit left.
+   *
+   * @return 0 on success, negative if the connection is lost, or
+   *         PFCMU::libaio::WRITE_FAILED if a write has failed
+   */
+  int grant(int fd, PFCMU::libaio::writer_t & writer, std::deque<PFCMU::libaio::slot_id_t> & reserved) {
+    unsigned int n = 0;
+    PFCMU::libaio::slot_id_t id;
+    for( ; (id = writer.try_get_available_slot_id()) >= 0 ; n++) {
+      reserved.push_back(id);
+    }
+    if(id == PFCMU::libaio::WRITE_FAILED) {
+      return id;
+    }
+    if(reserved.empty()) {
+      if((id = writer.get_available_slot_id()) < 0) {
+        return id;
+      }
+      reserved.push_back(id);
+      n++;
+    }
+    if(n == 0) {
+      return 0;
+    }
+
+    PFCMU::netsink::message_t m;
+    m.type = PFCMU::netsink::CREDIT;
+    m.value = n;
+    PFCMU::libaio::byte_t b[PFCMU::netsink::message_t::SIZE];
+    m.pack(b);
+    return PFCMU::netsink::send_all(fd, b, sizeof(b));
+  }
+
+  void run_session(const session_t & s) {
+    PFCMU::libaio::byte_t hb[PFCMU::netsink::hello_t::SIZE];
+    PFCMU::netsink::hello_t hello;
+    if(0 != PFCMU::netsink::recv_all(s.fd, hb, sizeof(hb)) || 0 != hello.unpack(hb)) {
+      fprintf(stderr, "%s: not a client of this version\n", s.peer.c_str());
+      return;
+    }
+    const std::string base = Util::basename(hello.name.c_str());
+    // the preallocation of blocksize * count bytes must fit in off64_t
+    if(base.empty() || base == "." || base == ".." || hello.blocksize == 0 || hello.blocksize > MAX_BLOCKSIZE ||
+       hello.count > (uint64_t)std::numeric_limits<off64_t>::max() / hello.blocksize) {
+      fprintf(stderr, "%s: invalid recording '%s' of %llu bytes/frame\n", s.peer.c_str(), hello.name.c_str(), (unsigned long long)hello.blocksize);
+      return;
+    }
+    const std::string path = s.dir + "/" + base;
+    fprintf(stderr, "%s: recording %s, %llu bytes/frame, %llu frames preallocated\n",
+            s.peer.c_str(), path.c_str(), (unsigned long long)hello.blocksize, (unsigned long long)hello.count);
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_THREAD, &ru0);
+    const unsigned long long t0 = now_usec();
+
+    PFCMU::libaio::writer_t writer;
+    if(0 != writer.try_init(path.c_str(), hello.blocksize, s.d_ringnum, hello.count, s.d_align)) {
+      fprintf(stderr, "%s: cannot record %s\n", s.peer.c_str(), path.c_str());
+      unlink(path.c_str());
+      return;
+    }
+
+    std::deque<PFCMU::libaio::slot_id_t> reserved;
+    unsigned long long frames = 0;
+    off64_t blocks = 0;
+    bool ended = false;
+    bool failed = false;
+    int ok = grant(s.fd, writer, reserved);
+    while(ok == 0) {
+      PFCMU::libaio::byte_t b[PFCMU::netsink::message_t::SIZE];
+      PFCMU::netsink::message_t m;
+      if(0 != PFCMU::netsink::recv_all(s.fd, b, sizeof(b))) {
+        break;
+      }
+      m.unpack(b);
+      if(m.type == PFCMU::netsink::END) {
+        ended = true;
+        break;
+      }
+      if(m.type != PFCMU::netsink::FRAME || reserved.empty()) {
+        fprintf(stderr, "%s: protocol error (message %u, %zd credits)\n", s.peer.c_str(), m.type, reserved.size());
+        break;
+      }
+
+      const PFCMU::libaio::slot_id_t id = reserved.front();
+      reserved.pop_front();
+      if(0 != PFCMU::netsink::recv_all(s.fd, writer.buf(id), hello.blocksize)) {
+        break;
+      }
+      const int r = writer.write(id, m.value);
+      if(0 != r) {
+        fprintf(stderr, "%s: write failed at %llu (%s)\n", s.peer.c_str(), (unsigned long long)m.value, strerror(-r));
+        reserved.push_back(id);
+        failed = true;
+        break;
+      }
+      frames++;
+      blocks = std::max(blocks, (off64_t)m.value + 1);
+      ok = grant(s.fd, writer, reserved);
+    }
+
+    // the writes in flight as well, before DONE tells the client that the frames are on the disk
+    if(! failed && (ok == PFCMU::libaio::WRITE_FAILED || 0 != writer.flush())) {
+      fprintf(stderr, "%s: write failed before frame %lld\n", s.peer.c_str(), (long long)blocks);
+      failed = true;
+    }
+    if(failed) {
+      // the client stops sending at once, instead of waiting for the credits
+      shutdown(s.fd, SHUT_RDWR);
+    }
+    // the reserved slots are not written, and go back with the others by clean()
+    reserved.clear();
+
+    // cut the preallocation for the frames not received
+    writer.clean();
+    if(0 != truncate64(path.c_str(), blocks * hello.blocksize)) {
+      perror("truncate64");
+    }
+
+    const unsigned long long t1 = now_usec();
+    getrusage(RUSAGE_THREAD, &ru1);
+    fprintf(stderr, "%s: %s %llu frames, %.1f MB/s, user %.2f s, sys %.2f s\n",
+            s.peer.c_str(), failed ? "WRITE FAILED after" : ended ? "finished" : "CONNECTION LOST after", frames,
+            (double)hello.blocksize * frames / std::max(1ULL, t1 - t0),
+            cpu_sec(ru1.ru_utime) - cpu_sec(ru0.ru_utime), cpu_sec(ru1.ru_stime) - cpu_sec(ru0.ru_stime));
+
+    if(ended && ! failed) {
+      PFCMU::netsink::message_t m;
+      m.type = PFCMU::netsink::DONE;
+      m.value = frames;
+      PFCMU::libaio::byte_t b[PFCMU::netsink::message_t::SIZE];
+      m.pack(b);
+      PFCMU::netsink::send_all(s.fd, b, sizeof(b));
+    }
+  }
+
+  void * session_main(void * arg) {
+    session_t * s = reinterpret_cast<session_t *>(arg);
+    run_session(*s);
+    close(s->fd);
+    delete s;
+    return NULL;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("dir,d",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Output dir of the recordings (/disks/storage)")
+    ("port,p",
+     boost::program_options::value<unsigned short>()->default_value(PFCMU::netsink::DEFAULT_PORT),
+     "TCP port to listen")
+    ("d_ringnum",
+     boost::program_options::value<unsigned int>()->default_value(8),
+     "Ringbuf size for mem -> disk, i.e., the credits of each client")
+    ("d_align",
+     boost::program_options::value<unsigned int>()->default_value(4096),
+     "Alignment size for disk AIO")
+    ("once", "Exit after the first recording")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::string DIR = parameter_map["dir"].as<std::string>();
+  const unsigned short PORT = parameter_map["port"].as<unsigned short>();
+  const unsigned int D_RINGNUM = parameter_map["d_ringnum"].as<unsigned int>();
+  const unsigned int D_ALIGN = parameter_map["d_align"].as<unsigned int>();
+  const int ONCE = parameter_map.count("once") ? 1 : 0;
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if(sock < 0) {
+    DIE(1, "socket() failed\n");
+  }
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(PORT);
+  if(0 != bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || 0 != listen(sock, 16)) {
+    DIE(1, "Cannot listen the port %u\n", PORT);
+  }
+  fprintf(stderr, "netsink: recording into %s, port %u\n", DIR.c_str(), PORT);
+
+  for(;;) {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    int fd = accept(sock, (struct sockaddr *)&peer, &len);
+    if(fd < 0) {
+      continue;
+    }
+
+    session_t * s = new session_t;
+    s->fd = fd;
+    s->peer = Tools::stringf("%s:%u", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+    s->dir = DIR;
+    s->d_ringnum = D_RINGNUM;
+    s->d_align = D_ALIGN;
+
+    if(ONCE) {
+      session_main(s);
+      break;
+    }
+
+    // a thread per recording, so that a node does not wait for another
+    pthread_t thread;
+    if(0 != pthread_create(&thread, NULL, session_main, s)) {
+      DIE(1, "pthread_create failed\n");
+    }
+    pthread_detach(thread);
+  }
+
+  close(sock);
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   pixstat.cc
+ *
+ * @brief  Per-pixel statistics of the cameras (dark frame, FPN, hot/dead pixels)
+ *
+ * Accumulates --num frames of the live capture, or of a recording with
+ * --src, and writes the map (.pxs, see pixel_stats.h) with a summary of
+ * each camera.  Capping the lenses gives the dark frame; a flat field
+ * gives the dead pixels.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "libpfcmu/capture++.h"
+#include "libpfcmu/pixel_stats.h"
+#include "rawfile.h"
+#include "boost_opt_util.h"
+#include "trace.h"
+#include "pfcmu_config.h"
+
+namespace {
+  double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+
+  void print_summary(const PFCMU::pixel_stats::map_t & map) {
+    printf("%llu frames, %ux%u\n", (unsigned long long)map.header.frames, map.header.width, map.header.height);
+    printf("cam   level    dsnu   noise     hot    dead   stuck\n");
+    for(int i=0 ; i<PFCMU::CAMS ; i++) {
+      const PFCMU::pixel_stats::summary_t & s = map.summary[i];
+      printf("%3d %7.2f %7.2f %7.2f %7d %7d %7d\n", i, s.level, s.dsnu, s.noise, s.hot, s.dead, s.stuck);
+    }
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("fps,f",
+     boost::program_options::value<unsigned int>(),
+     "[MANDATORY] FPS (25 or 100)")
+    ("out,o",
+     boost::program_options::value<std::string>(),
+     "Output map (camera.pxs)")
+    ("num,n",
+     boost::program_options::value<int>()->default_value(1000),
+     "Num of frames to be accumulated (-1 = all the frames of --src)")
+    ("src,s",
+     boost::program_options::value<std::string>(),
+     "Use a recording (/disks/local/out.dat) instead of the live capture")
+    ("step",
+     boost::program_options::value<int>()->default_value(1),
+     "Use every N-th frame of --src")
+    ("begin,b",
+     boost::program_options::value<int>()->default_value(0),
+     "The first frame of --src")
+    ("camera,c",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Device ID (0, 1, ...)")
+    ("shutter",
+     boost::program_options::value<double>()->default_value(31),
+     "Shutter speed (ms) of the live capture")
+    ("gain",
+     boost::program_options::value<double>()->default_value(5.5),
+     "Gain (dB) of the live capture")
+    ("hot_level",
+     boost::program_options::value<int>()->default_value(24),
+     "A pixel brighter than the level of the camera by this is hot")
+    ("dead_level",
+     boost::program_options::value<int>()->default_value(24),
+     "A pixel darker than the level of the camera by this is dead")
+    ("stuck_range",
+     boost::program_options::value<int>()->default_value(0),
+     "A pixel whose max - min is not more than this is stuck")
+    ("threads,t",
+     boost::program_options::value<int>()->default_value(0),
+     "Num of threads (0 = num of CPUs)")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const unsigned int FPS = parameter_map["fps"].as<unsigned int>();
+  const std::string OUT_FNAME = boost_opt_string(parameter_map, "out");
+  const std::string SRC_FNAME = boost_opt_string(parameter_map, "src");
+  const int N = parameter_map["num"].as<int>();
+  const int STEP = std::max(1, parameter_map["step"].as<int>());
+  const int BEGIN = parameter_map["begin"].as<int>();
+  const unsigned int CAMERA = parameter_map["camera"].as<unsigned int>();
+  const int THREADS = parameter_map["threads"].as<int>();
+  const int WIDTH = (FPS == 100 ? 320 : 640);
+  const int HEIGHT = (FPS == 100 ? 240 : 480);
+
+  PFCMU::pixel_stats::classify_t classify;
+  classify.hot_level = parameter_map["hot_level"].as<int>();
+  classify.dead_level = parameter_map["dead_level"].as<int>();
+  classify.stuck_range = parameter_map["stuck_range"].as<int>();
+
+  PFCMU::pixel_stats::accumulator_t acc;
+  acc.init(WIDTH, HEIGHT, THREADS);
+
+  const double t0 = now();
+  if(! SRC_FNAME.empty()) {
+    PFCMU::RAWFile rawfile;
+    rawfile.open(SRC_FNAME.c_str(), WIDTH, HEIGHT);
+
+    std::vector<unsigned char> frame((size_t)WIDTH * HEIGHT * PFCMU::CAMS);
+    for(off64_t i=BEGIN ; i<(off64_t)rawfile.size() && (N < 0 || acc.frames() < (unsigned long long)N) ; i+=STEP) {
+      rawfile.read(i, &frame[0]);
+      // read ahead the next while the frame is accumulated
+      rawfile.prefetch(i + STEP, 1);
+      acc.feed(&frame[0]);
+    }
+  } else {
+    if(N < 0) {
+      DIE(1, "--num should be positive for the live capture\n");
+    }
+    PFCMU::Capture capture;
+    capture.init(CAMERA, FPS);
+    capture.start();
+    capture.set_shutter(parameter_map["shutter"].as<double>());
+    capture.set_gain(parameter_map["gain"].as<double>());
+
+    for(int i=0 ; i<N ; i++) {
+      capture.grab();
+      acc.feed(capture.frame());
+      if(i % 25 == 0) {
+        fprintf(stderr, ".");
+      }
+    }
+    fprintf(stderr, "\n");
+    capture.stop();
+  }
+  const double t = now() - t0;
+
+  if(acc.frames() == 0) {
+    DIE(1, "no frames\n");
+  }
+  fprintf(stderr, "%llu frames in %.2f sec (%.0f frames/sec, %s)\n", acc.frames(), t, acc.frames() / std::max(t, 1e-6),
+          PFCMU::pixel_stats::avx2() ? "avx2" : "sse2");
+
+  PFCMU::pixel_stats::map_t map;
+  acc.make_map(classify, &map);
+  print_summary(map);
+
+  if(! OUT_FNAME.empty() && 0 != PFCMU::pixel_stats::save(OUT_FNAME.c_str(), map)) {
+    perror("save");
+    DIE(1, "Cannot write %s\n", OUT_FNAME.c_str());
+  }
+
+  return 0;
+}
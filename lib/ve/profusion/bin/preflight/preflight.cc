@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   preflight.cc
+ *
+ * @brief  Check if this node can capture without frame drops
+ *
+ * Run with the same options as capture, before the take.  See
+ * PFCMU::preflight for what is measured.  The same check is available
+ * as capture --preflight, which uses the image size of the camera.
+ *
+ * Exit status is 0 if no check fails (warnings are allowed), 1 otherwise.
+ */
+
+#include <cstdio>
+#include <string>
+
+#include "libpfcmu/preflight.h"
+#include "pfcmu_config.h"
+#include "boost_opt_util.h"
+#include "trace.h"
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("out,o",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Output filename of capture (/disks/local/out.dat). A test file next to it is written and removed")
+    ("fps,f",
+     boost::program_options::value<unsigned int>(),
+     "[MANDATORY] FPS (25 or 100)")
+    ("num,n",
+     boost::program_options::value<long long>()->default_value(0),
+     "N of frames of the take, to check the free space (0 = not checked)")
+    ("size",
+     boost::program_options::value<std::string>()->default_value("640x480"),
+     "Image size of a camera")
+    ("seconds",
+     boost::program_options::value<double>()->default_value(30),
+     "Length of the paced run")
+    ("live,l",
+     boost::program_options::value<std::string>(),
+     "Live output dir of capture, to add its load")
+    ("c_ringnum",
+     boost::program_options::value<unsigned int>()->default_value(8),
+     "Ringbuf size for cam -> mem")
+    ("d_ringnum",
+     boost::program_options::value<unsigned int>()->default_value(8),
+     "Ringbuf size for mem -> disk")
+    ("d_align",
+     boost::program_options::value<unsigned int>()->default_value(4096),
+     "Alignment size for disk AIO")
+    ("lock_frames",
+     boost::program_options::value<long long>()->default_value(0),
+     "Frames to be locked in RAM by --spill_frames or --pre of capture")
+    ("pre_frames",
+     boost::program_options::value<long long>()->default_value(0),
+     "Frames of --pre of capture (with --pre_slack), on the huge pages")
+    ("min_margin",
+     boost::program_options::value<double>()->default_value(1.2),
+     "Burst throughput required, relative to the fps")
+    ("quick", "Check the prerequisites only, without the benchmarks")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  PFCMU::preflight::config_t config;
+  config.out = parameter_map["out"].as<std::string>() + ".preflight";
+  config.live = boost_opt_string(parameter_map, "live");
+  config.fps = parameter_map["fps"].as<unsigned int>();
+  config.num = parameter_map["num"].as<long long>();
+  config.seconds = parameter_map["seconds"].as<double>();
+  config.c_ringnum = parameter_map["c_ringnum"].as<unsigned int>();
+  config.d_ringnum = parameter_map["d_ringnum"].as<unsigned int>();
+  config.d_align = parameter_map["d_align"].as<unsigned int>();
+  config.lock_frames = parameter_map["lock_frames"].as<long long>();
+  config.pre_frames = parameter_map["pre_frames"].as<long long>();
+  config.min_margin = parameter_map["min_margin"].as<double>();
+  if(2 != sscanf(parameter_map["size"].as<std::string>().c_str(), "%dx%d", &config.width, &config.height) || config.width <= 0 || config.height <= 0 || config.fps == 0) {
+    DIE(1, "invalid --size or --fps\n");
+  }
+
+  PFCMU::preflight::report_t report;
+  if(parameter_map.count("quick")) {
+    PFCMU::preflight::check_system(config, &report);
+  } else {
+    fprintf(stderr, "Preflight: %s, %dx%d x %d cameras at %u fps, %.0f sec\n",
+            config.out.c_str(), config.width, config.height, PFCMU::CAMS, config.fps, config.seconds);
+    PFCMU::preflight::run(config, &report);
+  }
+  printf("%s", PFCMU::preflight::to_string(report).c_str());
+
+  return report.status() == PFCMU::preflight::FAIL ? 1 : 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   scrub.cc
+ *
+ * @brief  Verify recordings against the checksums of capture --checksum
+ *
+ * Each recording (a file, or the manifest of a striped or segmented one)
+ * is read by --threads threads in chunks of frames, and the CRC32C of
+ * each camera image is compared with the sidecar out.dat.crc.  Exit
+ * status is 0 only if all the frames of all the recordings are verified.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libpfcmu/checksum.h"
+#include "rawfile.h"
+#include "boost_opt_util.h"
+#include "stringf.h"
+#include "trace.h"
+
+namespace {
+  struct job_t {
+    std::string src;
+    const PFCMU::checksum::index_reader_t * index;
+    off64_t frames;
+    int chunk;
+    int max_reports;
+
+    pthread_mutex_t mutex;
+    // the following are guarded by mutex
+    off64_t next;
+    unsigned long long bad;
+    unsigned long long missing;
+    int reports;
+  };
+
+  unsigned long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+  }
+
+  void report(job_t * job, off64_t frame, const std::string & msg) {
+    pthread_mutex_lock(&job->mutex);
+    if(job->reports++ < job->max_reports) {
+      fprintf(stdout, "%s: frame %zd: %s\n", job->src.c_str(), frame, msg.c_str());
+    }
+    pthread_mutex_unlock(&job->mutex);
+  }
+
+  void * scrub_main(void * arg) {
+    job_t * job = reinterpret_cast<job_t *>(arg);
+    const PFCMU::checksum::header_t & h = job->index->header();
+
+    // a file per thread, since RAWFile seeks
+    PFCMU::RAWFile rawfile;
+    rawfile.open(job->src.c_str(), h.width, h.height);
+    std::vector<unsigned char> buf((size_t)h.width * h.height * PFCMU::CAMS);
+
+    for(;;) {
+      pthread_mutex_lock(&job->mutex);
+      const off64_t begin = job->next;
+      job->next += job->chunk;
+      pthread_mutex_unlock(&job->mutex);
+      if(begin >= job->frames) {
+        break;
+      }
+      const off64_t end = std::min(begin + job->chunk, job->frames);
+      rawfile.prefetch(begin, end - begin);
+
+      unsigned long long bad = 0, missing = 0;
+      for(off64_t i=begin ; i<end ; i++) {
+        rawfile.read(i, &(buf[0]));
+
+        PFCMU::checksum::record_t expected, actual;
+        if(job->index->get(i, &expected) != PFCMU::checksum::index_reader_t::VALID) {
+          missing++;
+          report(job, i, "no checksum");
+          continue;
+        }
+        PFCMU::checksum::compute(&(buf[0]), h.width, h.height, &actual);
+        bool ok = true;
+        if(actual.framecount != expected.framecount) {
+          report(job, i, Tools::stringf("framecount %llu != %llu", actual.framecount, expected.framecount));
+          ok = false;
+        }
+        for(int c=0 ; c<PFCMU::CAMS ; c++) {
+          if(actual.crc[c] != expected.crc[c]) {
+            report(job, i, Tools::stringf("camera %02d CRC32C %08x != %08x", c, actual.crc[c], expected.crc[c]));
+            ok = false;
+          }
+        }
+        if(! ok) {
+          bad++;
+        }
+      }
+
+      pthread_mutex_lock(&job->mutex);
+      job->bad += bad;
+      job->missing += missing;
+      pthread_mutex_unlock(&job->mutex);
+    }
+    return NULL;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("src,s",
+     boost::program_options::value<std::vector<std::string> >()->composing(),
+     "[MANDATORY] Recording to be verified (/disks/local/out.dat), with out.dat.crc next to it (repeat for each recording)")
+    ("threads,t",
+     boost::program_options::value<int>()->default_value(sysconf(_SC_NPROCESSORS_ONLN)),
+     "Num of threads per recording")
+    ("chunk",
+     boost::program_options::value<int>()->default_value(16),
+     "Num of frames read by a thread at once")
+    ("max_reports",
+     boost::program_options::value<int>()->default_value(100),
+     "Max num of the errors printed per recording")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::vector<std::string> SRCS = parameter_map["src"].as<std::vector<std::string> >();
+  const int THREADS = std::max(1, parameter_map["threads"].as<int>());
+  const int CHUNK = std::max(1, parameter_map["chunk"].as<int>());
+  const int MAX_REPORTS = parameter_map["max_reports"].as<int>();
+
+  int failed = 0;
+  for(unsigned int k=0 ; k<SRCS.size() ; k++) {
+    const std::string sidecar = PFCMU::checksum::sidecar(SRCS[k]);
+    PFCMU::checksum::index_reader_t index;
+    if(0 != index.open(sidecar.c_str())) {
+      fprintf(stdout, "%s: cannot open the checksums %s\n", SRCS[k].c_str(), sidecar.c_str());
+      failed++;
+      continue;
+    }
+
+    PFCMU::RAWFile rawfile;
+    rawfile.open(SRCS[k].c_str(), index.header().width, index.header().height);
+
+    job_t job;
+    job.src = SRCS[k];
+    job.index = &index;
+    job.frames = rawfile.size();
+    job.chunk = CHUNK;
+    job.max_reports = MAX_REPORTS;
+    pthread_mutex_init(&job.mutex, NULL);
+    job.next = 0;
+    job.bad = job.missing = 0;
+    job.reports = 0;
+
+    const unsigned long long t0 = now_usec();
+    std::vector<pthread_t> threads(THREADS);
+    for(int i=0 ; i<THREADS ; i++) {
+      if(0 != pthread_create(&(threads[i]), NULL, scrub_main, &job)) {
+        DIE(1, "pthread_create failed\n");
+      }
+    }
+    for(int i=0 ; i<THREADS ; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    const unsigned long long t1 = now_usec();
+    pthread_mutex_destroy(&job.mutex);
+
+    // checksums of the frames beyond the end, i.e., the recording is truncated
+    off64_t lost = 0;
+    for(off64_t i=job.frames ; i<index.size() ; i++) {
+      PFCMU::checksum::record_t r;
+      if(index.get(i, &r) == PFCMU::checksum::index_reader_t::VALID) {
+        lost++;
+      }
+    }
+
+    const bool ok = job.bad == 0 && job.missing == 0 && lost == 0;
+    fprintf(stdout, "%s: %s, %zd frames, %llu corrupted, %llu without checksum, %zd lost at the end, %.1f MB/s\n",
+            SRCS[k].c_str(), ok ? "OK" : "FAILED", job.frames, job.bad, job.missing, lost,
+            (double)job.frames * index.header().width * index.header().height * PFCMU::CAMS / std::max(1ULL, t1 - t0));
+    if(! ok) {
+      failed++;
+    }
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   aggregator.cc
+ *
+ * @brief  Rig-wide live view aggregating the streaming servers of all the nodes.
+ *
+ * A thread per node keeps a persistent connection to its streaming
+ * server and receives "SUB" pushes (status and thumbnail).  The
+ * compositor thread aligns the nodes by the hardware framecount and
+ * builds a mosaic JPEG and a status JSON once per aligned frame, and
+ * any number of viewers get them by HTTP:
+ *
+ * - /             : HTML page showing the mosaic
+ * - /mosaic.mjpg  : the mosaic pushed as multipart/x-mixed-replace
+ * - /mosaic.jpg   : the latest mosaic
+ * - /status.json  : the latest status of all the nodes
+ * - /node/<i>.jpg : the latest thumbnail of the i-th node as is
+ *
+ * Usage example with two local servers:
+ *
+ *   server -f 25 -p 10001 --synthetic 640x480 &
+ *   server -f 25 -p 10002 --synthetic 640x480 &
+ *   aggregator -n ve01=localhost:10001 -n ve02=localhost:10002 -p 8080
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "pfcmu_config.h"
+#include "libpfcmu/codec.h"
+#include "boost_opt_util.h"
+#include "trace.h"
+#include "frame_store.h"
+
+using boost::asio::ip::tcp;
+
+namespace {
+  typedef PFCMU::codec::byte_t byte_t;
+
+  /**
+   * A push received from a node
+   */
+  struct status_t {
+    PFCMU::timestamp_t framecount;
+    /// node clock
+    unsigned long long usec;
+    double fps;
+    long long dropped;
+    int clients;
+    unsigned long long encoded;
+    unsigned long long cached;
+    /// aggregator clock
+    unsigned long long received;
+    /// thumbnail as received
+    std::vector<byte_t> jpeg;
+    /// thumbnail resized to the tile of the mosaic (RGB)
+    std::vector<byte_t> tile;
+  };
+
+  typedef boost::shared_ptr<const status_t> status_ptr;
+
+  struct node_t {
+    std::string name;
+    std::string host;
+    std::string port;
+
+    // the following are guarded by Rig::m_mutex
+    bool connected;
+    std::string hello;
+    /// recent pushes, the newest at the back
+    std::deque<status_ptr> history;
+  };
+
+  /**
+   * A mosaic and status shared by the viewers
+   */
+  struct mosaic_t {
+    unsigned long long seq;
+    PFCMU::timestamp_t framecount;
+    std::vector<byte_t> jpeg;
+    std::string json;
+  };
+
+  typedef boost::shared_ptr<const mosaic_t> mosaic_ptr;
+
+  struct config_t {
+    unsigned int interval;
+    int tile_w;
+    int tile_h;
+    int cols;
+    int quality;
+    unsigned int timeout;
+  };
+
+  std::string json_escape(const std::string & s) {
+    std::string r;
+    for(unsigned int i=0 ; i<s.length() ; i++) {
+      const char c = s[i];
+      if(c == '"' || c == '\\') {
+        r += '\\';
+        r += c;
+      } else if((unsigned char)c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        r += buf;
+      } else {
+        r += c;
+      }
+    }
+    return r;
+  }
+
+  /**
+   * Area-average resize of an RGB image
+   */
+  void resize_rgb(const byte_t * src, int sw, int sh, byte_t * dst, int dw, int dh) {
+    for(int y=0 ; y<dh ; y++) {
+      const int y0 = y * sh / dh;
+      const int y1 = std::max(y0 + 1, (y + 1) * sh / dh);
+      for(int x=0 ; x<dw ; x++) {
+        const int x0 = x * sw / dw;
+        const int x1 = std::max(x0 + 1, (x + 1) * sw / dw);
+        unsigned int sum[3] = { 0, 0, 0 };
+        for(int v=y0 ; v<y1 ; v++) {
+          const byte_t * p = src + (sw * v + x0) * 3;
+          for(int u=x0 ; u<x1 ; u++, p+=3) {
+            sum[0] += p[0];
+            sum[1] += p[1];
+            sum[2] += p[2];
+          }
+        }
+        const unsigned int n = (y1 - y0) * (x1 - x0);
+        byte_t * q = dst + (dw * y + x) * 3;
+        q[0] = sum[0] / n;
+        q[1] = sum[1] / n;
+        q[2] = sum[2] / n;
+      }
+    }
+  }
+
+  /**
+   * All the nodes and the latest mosaic
+   */
+  class Rig {
+  public:
+    Rig(const std::vector<node_t> & nodes, const config_t & conf) : m_nodes(nodes), m_conf(conf), m_closed(false), m_updated(false) {
+    }
+
+    int size() const {
+      return m_nodes.size();
+    }
+
+    const config_t & config() const {
+      return m_conf;
+    }
+
+    const node_t & node(int i) const {
+      return m_nodes[i];
+    }
+
+    void set_connected(int i, bool connected, const std::string & hello) {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_nodes[i].connected = connected;
+        m_nodes[i].hello = hello;
+        m_updated = true;
+      }
+      m_cond.notify_all();
+    }
+
+    void push(int i, const status_ptr & st) {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        std::deque<status_ptr> & h = m_nodes[i].history;
+        h.push_back(st);
+        while(h.size() > HISTORY) {
+          h.pop_front();
+        }
+        m_updated = true;
+      }
+      m_cond.notify_all();
+    }
+
+    /**
+     * @return the latest push from the i-th node, or NULL
+     */
+    status_ptr latest(int i) const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      const std::deque<status_ptr> & h = m_nodes[i].history;
+      return h.empty() ? status_ptr() : h.back();
+    }
+
+    /**
+     * @return the latest mosaic, or NULL if nothing is composed yet
+     */
+    mosaic_ptr mosaic() const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      return m_mosaic;
+    }
+
+    /**
+     * Blocks until a mosaic newer than seq is composed
+     *
+     * @return the latest mosaic, or NULL if close()d
+     */
+    mosaic_ptr wait_mosaic(unsigned long long seq) const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      while(! m_closed && (! m_mosaic || m_mosaic->seq == seq)) {
+        m_mosaic_cond.wait(lock);
+      }
+      return m_closed ? mosaic_ptr() : m_mosaic;
+    }
+
+    bool closed() const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      return m_closed;
+    }
+
+    void close() {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_closed = true;
+      }
+      m_cond.notify_all();
+      m_mosaic_cond.notify_all();
+    }
+
+    /**
+     * Compose a mosaic every time the aligned framecount advances
+     */
+    void compose_loop() {
+      const int N = m_nodes.size();
+      std::vector<status_ptr> shown(N);
+      unsigned long long seq = 0;
+
+      for(;;) {
+        std::vector<status_ptr> chosen(N);
+        std::vector<bool> connected(N);
+        std::vector<std::string> hello(N);
+        PFCMU::timestamp_t target = 0;
+        {
+          boost::mutex::scoped_lock lock(m_mutex);
+          if(! m_closed && ! m_updated) {
+            // wake up periodically to notice silent nodes
+            m_cond.timed_wait(lock, boost::posix_time::milliseconds(m_conf.timeout / 2 + 1));
+          }
+          if(m_closed) {
+            return;
+          }
+          m_updated = false;
+
+          // the newest framecount that all the alive nodes have reached
+          const unsigned long long now = PFCMU::frame_t::now();
+          bool any = false;
+          for(int i=0 ; i<N ; i++) {
+            connected[i] = m_nodes[i].connected;
+            hello[i] = m_nodes[i].hello;
+            if(alive(i, now)) {
+              const PFCMU::timestamp_t fc = m_nodes[i].history.back()->framecount;
+              target = any ? std::min(target, fc) : fc;
+              any = true;
+            }
+          }
+
+          // the newest push not after the target
+          for(int i=0 ; any && i<N ; i++) {
+            if(! alive(i, now)) {
+              continue;
+            }
+            const std::deque<status_ptr> & h = m_nodes[i].history;
+            for(int j=h.size()-1 ; j>=0 ; j--) {
+              if(h[j]->framecount <= target) {
+                chosen[i] = h[j];
+                break;
+              }
+            }
+          }
+        }
+
+        if(chosen == shown) {
+          continue;
+        }
+        shown = chosen;
+
+        boost::shared_ptr<mosaic_t> m(new mosaic_t);
+        m->seq = ++seq;
+        m->framecount = target;
+        compose(chosen, target, &(m->jpeg));
+        m->json = to_json(chosen, connected, hello, target);
+
+        {
+          boost::mutex::scoped_lock lock(m_mutex);
+          m_mosaic = m;
+        }
+        m_mosaic_cond.notify_all();
+
+        TRACE(2, "mosaic #%llu TS=%llu %zd bytes\n", m->seq, target, m->jpeg.size());
+      }
+    }
+
+  private:
+    Rig(const Rig &); // to disable "object copy"
+
+    static const unsigned int HISTORY = 16;
+
+    /// call with m_mutex locked
+    bool alive(int i, unsigned long long now) const {
+      const node_t & n = m_nodes[i];
+      return n.connected && ! n.history.empty() && now < n.history.back()->received + m_conf.timeout * 1000ULL;
+    }
+
+    void compose(const std::vector<status_ptr> & chosen, PFCMU::timestamp_t target, std::vector<byte_t> * jpeg) const {
+      const int N = chosen.size();
+      const int TW = m_conf.tile_w;
+      const int TH = m_conf.tile_h;
+      const int COLS = std::min(N, m_conf.cols);
+      const int ROWS = (N + COLS - 1) / COLS;
+      const int W = COLS * TW;
+      const int H = ROWS * TH;
+      const int BORDER = 2;
+
+      std::vector<byte_t> rgb(W * H * 3, 0x88);
+      for(int i=0 ; i<N ; i++) {
+        if(! chosen[i]) {
+          continue;
+        }
+        byte_t * tile = &(rgb[(W * TH * (i / COLS) + TW * (i % COLS)) * 3]);
+        const byte_t * src = &(chosen[i]->tile[0]);
+        for(int y=0 ; y<TH ; y++) {
+          memcpy(tile + W * 3 * y, src + TW * 3 * y, TW * 3);
+        }
+
+        // red frame if this node is behind the others
+        if(chosen[i]->framecount != target) {
+          for(int y=0 ; y<TH ; y++) {
+            for(int x=0 ; x<TW ; x++) {
+              if(x < BORDER || x >= TW - BORDER || y < BORDER || y >= TH - BORDER) {
+                byte_t * p = tile + W * 3 * y + x * 3;
+                p[0] = 0xff;
+                p[1] = 0;
+                p[2] = 0;
+              }
+            }
+          }
+        }
+      }
+
+      PFCMU::codec::encode_rgb_jpeg(&(rgb[0]), W, H, W * 3, m_conf.quality, jpeg);
+    }
+
+    std::string to_json(const std::vector<status_ptr> & chosen,
+                        const std::vector<bool> & connected,
+                        const std::vector<std::string> & hello,
+                        PFCMU::timestamp_t target) const {
+      std::ostringstream oss;
+      char buf[1024];
+      snprintf(buf, sizeof(buf), "{\"framecount\":%llu,\"usec\":%llu,\"nodes\":[", target, PFCMU::frame_t::now());
+      oss << buf;
+      for(unsigned int i=0 ; i<chosen.size() ; i++) {
+        oss << (i ? "," : "")
+            << "{\"name\":\"" << json_escape(m_nodes[i].name) << "\""
+            << ",\"connected\":" << (connected[i] ? "true" : "false")
+            << ",\"alive\":" << (chosen[i] ? "true" : "false")
+            << ",\"hello\":\"" << json_escape(hello[i]) << "\"";
+        if(chosen[i]) {
+          const status_t & s = *chosen[i];
+          snprintf(buf, sizeof(buf),
+                   ",\"framecount\":%llu,\"lag\":%llu,\"usec\":%llu,\"fps\":%.2f,\"dropped\":%lld,\"clients\":%d,\"encoded\":%llu,\"cached\":%llu",
+                   s.framecount, target - s.framecount, s.usec, s.fps, s.dropped, s.clients, s.encoded, s.cached);
+          oss << buf;
+        }
+        oss << "}";
+      }
+      oss << "]}\n";
+      return oss.str();
+    }
+
+    std::vector<node_t> m_nodes;
+    const config_t m_conf;
+    bool m_closed;
+    /// something happened since the last composition
+    bool m_updated;
+    mosaic_ptr m_mosaic;
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_cond;
+    mutable boost::condition_variable m_mosaic_cond;
+  };
+
+  /**
+   * Receive the pushes from the i-th node, and reconnect on errors
+   */
+  void node_loop(Rig * rig, int i) {
+    const node_t & node = rig->node(i);
+    const config_t & conf = rig->config();
+
+    while(! rig->closed()) {
+      tcp::iostream stream;
+      stream.expires_after(boost::asio::chrono::milliseconds(conf.timeout));
+      stream.connect(node.host, node.port);
+
+      std::string line;
+      if(! stream || ! std::getline(stream, line) || line.compare(0, 4, "100 ") != 0) {
+        TRACE(2, "%s: cannot connect to %s:%s\n", node.name.c_str(), node.host.c_str(), node.port.c_str());
+        boost::this_thread::sleep(boost::posix_time::seconds(1));
+        continue;
+      }
+      const std::string hello = line.substr(4, line.find_last_not_of("\r") - 3);
+
+      stream << "SUB " << conf.interval << std::endl;
+      if(! std::getline(stream, line) || line.compare(0, 4, "200 ") != 0) {
+        TRACE(1, "%s: SUB failed\n", node.name.c_str());
+        boost::this_thread::sleep(boost::posix_time::seconds(1));
+        continue;
+      }
+
+      TRACE(1, "%s: connected (%s)\n", node.name.c_str(), hello.c_str());
+      rig->set_connected(i, true, hello);
+
+      for(;;) {
+        // the server pushes every interval frames, so silence means trouble
+        stream.expires_after(boost::asio::chrono::milliseconds(conf.timeout));
+
+        boost::shared_ptr<status_t> st(new status_t);
+        if(! std::getline(stream, line) ||
+           7 != sscanf(line.c_str(), "STA %llu %llu %lf %lld %d %llu %llu",
+                       &(st->framecount), &(st->usec), &(st->fps), &(st->dropped),
+                       &(st->clients), &(st->encoded), &(st->cached))) {
+          break;
+        }
+
+        int camera, w, h;
+        char enc[16];
+        unsigned long long fc, ref, usec;
+        size_t bytes;
+        if(! std::getline(stream, line) ||
+           8 != sscanf(line.c_str(), "FRM %d %15s %d %d %llu %llu %llu %zu",
+                       &camera, enc, &w, &h, &fc, &ref, &usec, &bytes) ||
+           strcmp(enc, "jpeg") != 0) {
+          break;
+        }
+        st->jpeg.resize(bytes);
+        if(bytes == 0 || ! stream.read(reinterpret_cast<char *>(&(st->jpeg[0])), bytes)) {
+          break;
+        }
+        st->received = PFCMU::frame_t::now();
+
+        std::vector<byte_t> rgb;
+        if(0 != PFCMU::codec::decode_jpeg(&(st->jpeg[0]), bytes, &w, &h, &rgb)) {
+          break;
+        }
+        st->tile.resize(conf.tile_w * conf.tile_h * 3);
+        resize_rgb(&(rgb[0]), w, h, &(st->tile[0]), conf.tile_w, conf.tile_h);
+
+        TRACE(3, "%s: TS=%llu\n", node.name.c_str(), st->framecount);
+        rig->push(i, st);
+      }
+
+      TRACE(1, "%s: disconnected\n", node.name.c_str());
+      rig->set_connected(i, false, hello);
+      boost::this_thread::sleep(boost::posix_time::seconds(1));
+    }
+  }
+
+  void send_response(tcp::iostream & stream, const char * status, const char * type, const void * data, size_t len) {
+    stream << "HTTP/1.0 " << status << "\r\n"
+           << "Content-Type: " << type << "\r\n"
+           << "Content-Length: " << len << "\r\n"
+           << "Cache-Control: no-cache\r\n"
+           << "\r\n";
+    stream.write(reinterpret_cast<const char *>(data), len);
+    stream << std::flush;
+  }
+
+  void serve(boost::shared_ptr<tcp::iostream> s, const Rig * rig) {
+    tcp::iostream & stream = *s;
+
+    std::string line, method, path;
+    if(! std::getline(stream, line)) {
+      return;
+    }
+    std::istringstream(line) >> method >> path;
+
+    // skip the headers
+    for(std::string h ; std::getline(stream, h) && ! h.empty() && h[0] != '\r' ; ) {
+    }
+
+    TRACE(2, "%s %s\n", method.c_str(), path.c_str());
+
+    int node = -1;
+    char tail[8];
+    if(method != "GET") {
+      const char msg[] = "Method Not Allowed\n";
+      send_response(stream, "405 Method Not Allowed", "text/plain", msg, sizeof(msg)-1);
+    } else if(path == "/" || path == "/index.html") {
+      const char html[] =
+        "<html><head><title>rig</title></head><body>\n"
+        "<img src=\"/mosaic.mjpg\"><br>\n"
+        "<a href=\"/status.json\">status.json</a>\n"
+        "</body></html>\n";
+      send_response(stream, "200 OK", "text/html", html, sizeof(html)-1);
+    } else if(path == "/mosaic.jpg" || path == "/status.json") {
+      mosaic_ptr m = rig->wait_mosaic(0);
+      if(! m) {
+        return;
+      }
+      if(path == "/mosaic.jpg") {
+        send_response(stream, "200 OK", "image/jpeg", &(m->jpeg[0]), m->jpeg.size());
+      } else {
+        send_response(stream, "200 OK", "application/json", m->json.data(), m->json.length());
+      }
+    } else if(path == "/mosaic.mjpg") {
+      stream << "HTTP/1.0 200 OK\r\n"
+             << "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+             << "Cache-Control: no-cache\r\n"
+             << "\r\n";
+      for(mosaic_ptr m = rig->wait_mosaic(0) ; m && stream ; m = rig->wait_mosaic(m->seq)) {
+        stream << "--frame\r\n"
+               << "Content-Type: image/jpeg\r\n"
+               << "Content-Length: " << m->jpeg.size() << "\r\n"
+               << "X-Framecount: " << m->framecount << "\r\n"
+               << "\r\n";
+        stream.write(reinterpret_cast<const char *>(&(m->jpeg[0])), m->jpeg.size());
+        stream << "\r\n" << std::flush;
+      }
+    } else if(2 == sscanf(path.c_str(), "/node/%d.%3s", &node, tail) && strcmp(tail, "jpg") == 0 &&
+              0 <= node && node < rig->size() && rig->latest(node)) {
+      status_ptr st = rig->latest(node);
+      send_response(stream, "200 OK", "image/jpeg", &(st->jpeg[0]), st->jpeg.size());
+    } else {
+      const char msg[] = "Not Found\n";
+      send_response(stream, "404 Not Found", "text/plain", msg, sizeof(msg)-1);
+    }
+  }
+
+  /**
+   * Parse "[name=]host:port"
+   */
+  node_t parse_node(const std::string & s) {
+    node_t n;
+    std::string addr = s;
+    const size_t eq = s.find('=');
+    if(eq != std::string::npos) {
+      n.name = s.substr(0, eq);
+      addr = s.substr(eq + 1);
+    }
+    const size_t colon = addr.rfind(':');
+    if(colon == std::string::npos) {
+      DIE(1, "invalid node '%s', must be [name=]host:port\n", s.c_str());
+    }
+    n.host = addr.substr(0, colon);
+    n.port = addr.substr(colon + 1);
+    if(n.name.empty()) {
+      n.name = addr;
+    }
+    n.connected = false;
+    return n;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("node,n",
+     boost::program_options::value<std::vector<std::string> >(),
+     "[MANDATORY] streaming server as [name=]host:port (repeat for each node, in the order of the mosaic)")
+    ("port,p",
+     boost::program_options::value<unsigned int>()->default_value(8080),
+     "HTTP port for the viewers")
+    ("interval,i",
+     boost::program_options::value<unsigned int>()->default_value(25),
+     "Num of frames between the pushes from each node")
+    ("tile",
+     boost::program_options::value<std::string>()->default_value("160x120"),
+     "Size of each node in the mosaic")
+    ("cols",
+     boost::program_options::value<unsigned int>()->default_value(5),
+     "Num of nodes in a row of the mosaic")
+    ("jpeg_quality",
+     boost::program_options::value<unsigned int>()->default_value(75),
+     "JPEG quality of the mosaic [0:100]")
+    ("timeout",
+     boost::program_options::value<unsigned int>()->default_value(3000),
+     "A node is regarded as dead if silent for this period (ms)")
+    ("verbose,v",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "verbosity")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::vector<std::string> NODES = parameter_map["node"].as<std::vector<std::string> >();
+  const unsigned int PORT = parameter_map["port"].as<unsigned int>();
+  const std::string TILE = parameter_map["tile"].as<std::string>();
+  const unsigned int VERBOSE = parameter_map["verbose"].as<unsigned int>();
+
+  SET_VERBOSITY(VERBOSE);
+
+  config_t conf;
+  conf.interval = std::max(1U, parameter_map["interval"].as<unsigned int>());
+  conf.cols = std::max(1U, parameter_map["cols"].as<unsigned int>());
+  conf.quality = parameter_map["jpeg_quality"].as<unsigned int>();
+  conf.timeout = std::max(100U, parameter_map["timeout"].as<unsigned int>());
+  if(2 != sscanf(TILE.c_str(), "%dx%d", &(conf.tile_w), &(conf.tile_h)) || conf.tile_w <= 0 || conf.tile_h <= 0) {
+    DIE(1, "invalid --tile '%s'\n", TILE.c_str());
+  }
+
+  std::vector<node_t> nodes;
+  for(unsigned int i=0 ; i<NODES.size() ; i++) {
+    nodes.push_back(parse_node(NODES[i]));
+  }
+
+  Rig rig(nodes, conf);
+
+  boost::thread_group threads;
+  for(int i=0 ; i<rig.size() ; i++) {
+    threads.create_thread(boost::bind(node_loop, &rig, i));
+  }
+  threads.create_thread(boost::bind(&Rig::compose_loop, &rig));
+
+  // serve each viewer by a thread
+  try {
+    boost::asio::io_service io_service;
+
+    tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), PORT));
+
+    TRACE(1, "Aggregating %d nodes, ready at port %d\n", rig.size(), PORT);
+
+    for (;;) {
+      boost::shared_ptr<tcp::iostream> stream(new tcp::iostream);
+      acceptor.accept(*(stream->rdbuf()));
+      boost::thread t(boost::bind(serve, stream, &rig));
+      t.detach();
+    }
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
+
+  rig.close();
+  threads.join_all();
+
+  return 0;
+}
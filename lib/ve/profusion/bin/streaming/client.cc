@@ -8,19 +8,356 @@
  * @file   client.cc
  * @author Shohei NOBUHARA <nob@i.kyoto-u.ac.jp>
  * @date   Sun Feb 13 21:25:54 2011
- * 
+ *
  * @brief  Live streaming viewer
- * 
+ *
+ * Three stages linked by LatestValue so that a slow stage drops
+ * frames instead of slowing down the others:
+ *
+ * -# receive thread : requests and decodes the images (cameras in parallel)
+ * -# demosaic thread : demosaics and scales the images (cameras in parallel)
+ * -# main thread : shows the image and handles the keys
+ *
+ * Keys: 'g' toggles the grid of all the cameras, 'q' quits.
+ *
+ * The latency shown is from the grab at the server to the display,
+ * with the server clock offset estimated by "TIME".
  */
 
+#include <cstring>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <cv.h>
 #include <highgui.h>
 
 #include "libpfcmu/util.h"
+#include "libpfcmu/codec.h"
 #include "boost_opt_util.h"
 #include "trace.h"
 #include "pfcmu_config.h"
+#include "ringbuf.h"
+#include "latest_value.h"
+#include "worker_pool.h"
+#include "frame_store.h"
+
+using boost::asio::ip::tcp;
+
+namespace {
+  typedef PFCMU::codec::byte_t byte_t;
+
+  const int GRID_COLS = 6;
+  const int GRID_ROWS = 4;
+
+  /**
+   * Decoded images of a frame
+   */
+  struct bundle_t {
+    PFCMU::timestamp_t framecount;
+    /// grab time at the server in the client clock
+    long long grabbed;
+    /// when all the images are received and decoded
+    long long decoded;
+    int width;
+    int height;
+    /// images are 2x2 downsampled RGB (jpeg) instead of Bayer
+    bool rgb;
+    std::vector<int> cams;
+    std::vector<std::vector<byte_t> > images;
+  };
+
+  typedef boost::shared_ptr<const bundle_t> bundle_ptr;
+
+  /**
+   * A BGR image ready to be shown
+   */
+  struct view_t {
+    PFCMU::timestamp_t framecount;
+    long long grabbed;
+    long long decoded;
+    long long demosaiced;
+    int cams;
+    boost::shared_ptr<IplImage> img;
+  };
+
+  typedef boost::shared_ptr<const view_t> view_ptr;
+
+  /**
+   * What the user wants to see, updated by the main thread
+   */
+  struct control_t {
+    control_t() : camid(0), grid(false), quit(false) {
+    }
+
+    void get(int * c, bool * g, bool * q) const {
+      boost::mutex::scoped_lock lock(mutex);
+      *c = camid;
+      *g = grid;
+      *q = quit;
+    }
+
+    int camid;
+    bool grid;
+    bool quit;
+    mutable boost::mutex mutex;
+  };
+
+  void release_image(IplImage * img) {
+    cvReleaseImage(&img);
+  }
+
+  boost::shared_ptr<IplImage> create_image(int width, int height, int channels) {
+    return boost::shared_ptr<IplImage>(cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, channels), release_image);
+  }
+
+  long long now() {
+    return PFCMU::frame_t::now();
+  }
+
+  /**
+   * Estimate (server clock) - (client clock) in usec by "TIME", using
+   * the reply of the shortest round trip.
+   */
+  long long estimate_clock_offset(tcp::iostream & stream) {
+    long long best_rtt = -1, offset = 0;
+    for(int i=0 ; i<8 ; i++) {
+      const long long t0 = now();
+      stream << "TIME" << std::endl;
+      std::string line;
+      std::getline(stream, line);
+      const long long t1 = now();
+
+      unsigned long long server;
+      if(1 != sscanf(line.c_str(), "200 TIME %llu", &server)) {
+        TRACE(1, "Server does not support TIME, latency assumes synchronized clocks\n");
+        return 0;
+      }
+      if(best_rtt < 0 || t1 - t0 < best_rtt) {
+        best_rtt = t1 - t0;
+        offset = (long long)server - (t0 + t1) / 2;
+      }
+    }
+    TRACE(1, "Clock offset = %lld usec (rtt = %lld usec)\n", offset, best_rtt);
+    return offset;
+  }
+
+  void decode_one(const std::vector<std::vector<byte_t> > * payloads,
+                  const std::vector<PFCMU::codec::encoding_t> * encs,
+                  const std::vector<PFCMU::timestamp_t> * refs,
+                  std::vector<std::vector<byte_t> > * prev,
+                  bundle_t * b,
+                  std::vector<int> * error,
+                  int i) {
+    const int cam = b->cams[i];
+    const std::vector<byte_t> & in = (*payloads)[i];
+    std::vector<byte_t> & out = b->images[i];
+
+    if((*encs)[i] == PFCMU::codec::ENC_JPEG) {
+      int w, h;
+      (*error)[i] = PFCMU::codec::decode_jpeg(&(in[0]), in.size(), &w, &h, &out);
+      return;
+    }
+
+    out.resize(b->width * b->height);
+    const byte_t * ref = NULL;
+    if((*refs)[i] != 0) {
+      if((*prev)[cam].size() != out.size()) {
+        (*error)[i] = -1;
+        return;
+      }
+      ref = &((*prev)[cam][0]);
+    }
+    (*error)[i] = PFCMU::codec::decode_bayer((*encs)[i], &(in[0]), in.size(), ref, b->width, b->height, &(out[0]));
+    if((*error)[i] == 0) {
+      (*prev)[cam] = out;
+    }
+  }
+
+  /**
+   * Request and decode the images of the cameras selected by control
+   */
+  void receive_loop(tcp::iostream * stream, const control_t * control, long long clock_offset, WorkerPool * pool, LatestValue<bundle_ptr> * out) {
+    // the last frame we have for each camera, which the server can
+    // use as the reference of inter-frame encodings.
+    std::vector<std::vector<byte_t> > prev(PFCMU::CAMS);
+    std::vector<PFCMU::timestamp_t> prev_fc(PFCMU::CAMS, 0);
+
+    try {
+      for(;;) {
+        int camid;
+        bool grid, quit;
+        control->get(&camid, &grid, &quit);
+        if(quit) {
+          (*stream) << "BYE" << std::endl;
+          break;
+        }
+
+        boost::shared_ptr<bundle_t> b(new bundle_t);
+        if(grid) {
+          for(int i=0 ; i<PFCMU::CAMS ; i++) {
+            b->cams.push_back(i);
+          }
+        } else {
+          b->cams.push_back(camid);
+        }
+        const int N = b->cams.size();
+
+        // send "FRAME REF CAMID..." command. REF must be available for
+        // all the cameras, which is true unless the selection changed.
+        PFCMU::timestamp_t ref_fc = prev_fc[b->cams[0]];
+        for(int i=1 ; i<N ; i++) {
+          if(prev_fc[b->cams[i]] != ref_fc) {
+            ref_fc = 0;
+          }
+        }
+        std::ostringstream cmd;
+        cmd << "FRAME " << ref_fc;
+        for(int i=0 ; i<N ; i++) {
+          cmd << " " << b->cams[i];
+        }
+        (*stream) << cmd.str() << std::endl;
+
+        // receive "FRM CAMID ENC WIDTH HEIGHT FRAMECOUNT REF USEC BYTES" and the image for each camera
+        std::vector<std::vector<byte_t> > payloads(N);
+        std::vector<PFCMU::codec::encoding_t> encs(N);
+        std::vector<PFCMU::timestamp_t> refs(N);
+        unsigned long long usec = 0;
+        for(int i=0 ; i<N ; i++) {
+          std::string header;
+          std::getline(*stream, header);
+          std::istringstream iss(header);
+          std::string frm, enc_name;
+          int cam = 0;
+          size_t bytes = 0;
+          iss >> frm >> cam >> enc_name >> b->width >> b->height >> b->framecount >> refs[i] >> usec >> bytes;
+          if(! (*stream) || frm != "FRM" || cam != b->cams[i] || 0 != PFCMU::codec::from_string(enc_name, &(encs[i]))) {
+            DIE(1, "Invalid response '%s'\n", header.c_str());
+          }
+          if(refs[i] != 0 && refs[i] != prev_fc[cam]) {
+            DIE(1, "Reference frame %llu of CAM%02d is not available\n", refs[i], cam);
+          }
+          payloads[i].resize(bytes);
+          stream->read(reinterpret_cast<char *>(&(payloads[i][0])), bytes);
+        }
+        if(! (*stream)) {
+          break;
+        }
+        b->grabbed = (long long)usec - clock_offset;
+        b->rgb = encs[0] == PFCMU::codec::ENC_JPEG;
+        b->images.resize(N);
+
+        std::vector<int> error(N, 0);
+        pool->parallel_for(N, boost::bind(decode_one, &payloads, &encs, &refs, &prev, b.get(), &error, _1));
+        for(int i=0 ; i<N ; i++) {
+          if(error[i]) {
+            DIE(1, "Cannot decode CAM%02d (%s)\n", b->cams[i], PFCMU::codec::to_string(encs[i]));
+          }
+          prev_fc[b->cams[i]] = encs[i] == PFCMU::codec::ENC_JPEG ? 0 : b->framecount;
+
+          // the framecount embedded in the image tells which frame we really have
+          if(! b->rgb && PFCMU::get_timestamp(&(b->images[i][0])) != (b->framecount & 0xffffffffULL)) {
+            TRACE(1, "CAM%02d: embedded framecount %llu != %llu\n", b->cams[i], PFCMU::get_timestamp(&(b->images[i][0])), b->framecount);
+          }
+        }
+        b->decoded = now();
+
+        out->put(b);
+      }
+    } catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+
+    out->close();
+  }
+
+  void demosaic_one(const bundle_t * b, IplImage * dst, int i) {
+    const int W = b->width;
+    const int H = b->height;
+
+    if(b->rgb) {
+      // the jpeg is already downsampled
+      IplImage src;
+      cvInitImageHeader(&src, cvSize(W / 2, H / 2), IPL_DEPTH_8U, 3);
+      cvSetData(&src, const_cast<byte_t *>(&(b->images[i][0])), W / 2 * 3);
+      if(src.width == dst->width && src.height == dst->height) {
+        cvCvtColor(&src, dst, CV_RGB2BGR);
+      } else {
+        boost::shared_ptr<IplImage> tmp = create_image(src.width, src.height, 3);
+        cvCvtColor(&src, tmp.get(), CV_RGB2BGR);
+        cvResize(tmp.get(), dst, CV_INTER_AREA);
+      }
+      return;
+    }
+
+    IplImage src;
+    cvInitImageHeader(&src, cvSize(W, H), IPL_DEPTH_8U, 1);
+    cvSetData(&src, const_cast<byte_t *>(&(b->images[i][0])), W);
+    if(W == dst->width && H == dst->height) {
+      cvCvtColor(&src, dst, PFCMU::CV_BAYER2BGR);
+      return;
+    }
+
+    // 2x2 downsample debayer (GB/RG), then scale to the cell
+    boost::shared_ptr<IplImage> tmp = create_image(W / 2, H / 2, 3);
+    for(int y=0 ; y<H/2 ; y++) {
+      unsigned char * p = reinterpret_cast<unsigned char *>(tmp->imageData + tmp->widthStep * y);
+      const byte_t * q0 = &(b->images[i][W * 2 * y]);
+      const byte_t * q1 = q0 + W;
+      for(int x=0 ; x<W/2 ; x++, p+=3, q0+=2, q1+=2) {
+        p[0] = q0[1]; // B
+        p[1] = q0[0]; // G
+        p[2] = q1[0]; // R
+      }
+    }
+    if(tmp->width == dst->width && tmp->height == dst->height) {
+      cvCopy(tmp.get(), dst);
+    } else {
+      cvResize(tmp.get(), dst, CV_INTER_AREA);
+    }
+  }
+
+  void demosaic_cell(const bundle_t * b, IplImage * grid, int cell_w, int cell_h, int i) {
+    const int cam = b->cams[i];
+    IplImage cell;
+    cvInitImageHeader(&cell, cvSize(cell_w, cell_h), IPL_DEPTH_8U, 3);
+    cvSetData(&cell, grid->imageData + grid->widthStep * cell_h * (cam / GRID_COLS) + 3 * cell_w * (cam % GRID_COLS), grid->widthStep);
+    demosaic_one(b, &cell, i);
+  }
+
+  /**
+   * Demosaic and scale the images
+   */
+  void demosaic_loop(float grid_scale, WorkerPool * pool, LatestValue<bundle_ptr> * in, LatestValue<view_ptr> * out) {
+    unsigned long long seq = 0;
+    for(bundle_ptr b ; in->get(&b, &seq) ; ) {
+      boost::shared_ptr<view_t> v(new view_t);
+      v->framecount = b->framecount;
+      v->grabbed = b->grabbed;
+      v->decoded = b->decoded;
+      v->cams = b->cams.size();
+
+      if(b->cams.size() == 1) {
+        const int scale = b->rgb ? 2 : 1;
+        v->img = create_image(b->width / scale, b->height / scale, 3);
+        demosaic_one(b.get(), v->img.get(), 0);
+      } else {
+        // 2 pixels aligned for the 2x2 downsample debayer
+        const int cell_w = std::max(2, (int)(b->width * grid_scale) / 2 * 2);
+        const int cell_h = std::max(2, (int)(b->height * grid_scale) / 2 * 2);
+        v->img = create_image(cell_w * GRID_COLS, cell_h * GRID_ROWS, 3);
+        cvZero(v->img.get());
+        pool->parallel_for(b->cams.size(), boost::bind(demosaic_cell, b.get(), v->img.get(), cell_w, cell_h, _1));
+      }
+      v->demosaiced = now();
+
+      out->put(v);
+    }
+
+    out->close();
+  }
+}
 
 int main(int argc, char * argv[]) {
   boost::program_options::options_description cmdline("Command line options");
@@ -32,78 +369,131 @@ int main(int argc, char * argv[]) {
     ("port,p",
      boost::program_options::value<std::string>()->default_value("10000"),
      "TCP port")
+    ("enc,e",
+     boost::program_options::value<std::string>()->default_value("lz4d,lz4,raw"),
+     "Encodings in the order of preference (raw, lz4, lz4d, jpeg)")
+    ("grid,g", "Start with the grid of all the cameras")
+    ("grid_scale",
+     boost::program_options::value<float>()->default_value(0.25),
+     "Scale of each camera in the grid")
+    ("threads,t",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Num of decoding/demosaicing threads (0 = num of CPUs)")
+    ("verbose,v",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "verbosity")
     ;
 
   boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
 
   const std::string SERVER_NAME = boost_opt_string(parameter_map, "server");
   const std::string PORT = parameter_map["port"].as<std::string>();
+  const std::string ENC = parameter_map["enc"].as<std::string>();
+  const float GRID_SCALE = parameter_map["grid_scale"].as<float>();
+  const unsigned int THREADS = parameter_map["threads"].as<unsigned int>();
+  const unsigned int VERBOSE = parameter_map["verbose"].as<unsigned int>();
+
+  SET_VERBOSITY(VERBOSE);
 
   CvFont font;
   cvInitFont(&font, CV_FONT_HERSHEY_DUPLEX, 1.0, 1.0, 0);
 
+  control_t control;
+  control.grid = parameter_map.count("grid") ? true : false;
+
   int camid = 0;
   cvNamedWindow("main");
   cvCreateTrackbar("CAMID", "main", &camid, 23, NULL);
-  IplImage * buf1 = NULL;
-  IplImage * buf3 = NULL;
 
-  // set up the server which accepts only ONE client (= sync server)
   try {
-    using boost::asio::ip::tcp;
-
     tcp::iostream stream(SERVER_NAME.c_str(), PORT);
     std::string header;
     std::getline(stream, header);
-    //std::cout << header << std::endl;	//hao
+    if(! stream) {
+      DIE(1, "Cannot connect to %s:%s\n", SERVER_NAME.c_str(), PORT.c_str());
+    }
+
+    // negotiate the encoding
+    stream << "ENC " << ENC << std::endl;
+    std::getline(stream, header);
+    TRACE(1, "%s\n", header.c_str());
+    if(header.substr(0, 3) != "200") {
+      DIE(1, "Server does not support '%s'\n", ENC.c_str());
+    }
 
-    PFCMU::timestamp_t ts_prev=0;
+    const long long clock_offset = estimate_clock_offset(stream);
+
+    WorkerPool pool(THREADS);
+    LatestValue<bundle_ptr> bundles;
+    LatestValue<view_ptr> views;
+
+    boost::thread receiver(boost::bind(receive_loop, &stream, &control, clock_offset, &pool, &bundles));
+    boost::thread demosaicer(boost::bind(demosaic_loop, GRID_SCALE, &pool, &bundles, &views));
+
+    ringbuf<double> latency(25, 0);
+    unsigned int latency_num = 0;
+    PFCMU::timestamp_t ts_prev = 0;
+    unsigned long long seq = 0;
+    unsigned long long shown = 0;
+    long long t_stat = now();
     for(;;) {
-      // send "PGM CAMID" command
-      char text[1024];
-      snprintf(text, sizeof(text), "PGM %d", camid);
-      stream << text << std::endl;
-
-      // receive PGM data
-      int width, height, color;
-      stream >> header >> width >> height >> color;
-//std::cout << header << std::endl;	//hao
-      stream.get(); // kill 1-byte ('newline') right after the color
-      //assert(header == "P5");
-
-      // setup the buffer
-      if(NULL == buf1 || buf1->width != width || buf1->height != height) {
-        cvReleaseImage(&buf1);
-        cvReleaseImage(&buf3);
-        buf1 = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
-        buf3 = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 3);
-      }
+      view_ptr v;
+      if(views.get(&v, &seq, 5)) {
+        const long long t_show = now();
+        // glass-to-glass latency of the last frames, latency[-1] is the latest
+        latency.push_back((t_show - v->grabbed) / 1000.0);
+        latency_num = std::min(latency_num + 1, latency.size());
+        double lat_avg = 0, lat_max = 0;
+        for(unsigned int i=1 ; i<=latency_num ; i++) {
+          lat_avg += latency[-i] / latency_num;
+          lat_max = std::max(lat_max, latency[-i]);
+        }
 
-      // receive the image
-      stream.read(buf1->imageData, width*height);
+        // write the timestamp embedded in the image
+        char text[1024];
+        snprintf(text, sizeof(text), "%010llu (%llu) %.0fms", v->framecount, v->framecount - ts_prev, latency[-1]);
+        ts_prev = v->framecount;
+        cvPutText(v->img.get(), text, cvPoint(0,32), &font, CV_RGB(255,0,0));
 
-      // convert to BGR
-      cvCvtColor(buf1, buf3, PFCMU::CV_BAYER2BGR);
+        // show the image
+        cvShowImage("main", v->img.get());
+        shown++;
 
-      // write the timestamp embedded in the image
-      PFCMU::timestamp_t ts_curr = PFCMU::get_timestamp(buf1->imageData);
-      snprintf(text, sizeof(text), "%010llu (%llu)", ts_curr, ts_curr - ts_prev);
-      ts_prev = ts_curr;
-      cvPutText(buf3, text, cvPoint(0,32), &font, CV_RGB(255,0,0));
+        if(t_show - t_stat >= 1000000) {
+          TRACE(1, "TS=%llu, %.1f fps, latency avg=%.1f max=%.1f ms (decode=%.1f, demosaic=%.1f, display=%.1f), dropped: demosaic=%llu display=%llu\n",
+                v->framecount, shown * 1e6 / (t_show - t_stat), lat_avg, lat_max,
+                (v->decoded - v->grabbed) / 1000.0,
+                (v->demosaiced - v->decoded) / 1000.0,
+                (t_show - v->demosaiced) / 1000.0,
+                bundles.dropped(), views.dropped());
+          shown = 0;
+          t_stat = t_show;
+        }
+      } else if(views.closed()) {
+        break;
+      }
 
-      // show the image
-      cvShowImage("main", buf3);
-      int key = cvWaitKey(5);
+      int key = cvWaitKey(1);
+      {
+        boost::mutex::scoped_lock lock(control.mutex);
+        control.camid = camid;
+        if('g' == (key & 0xff)) {
+          control.grid = ! control.grid;
+        }
+        if('q' == (key & 0xff)) {
+          control.quit = true;
+        }
+      }
       if('q' == (key & 0xff)) {
-        stream << "BYE" << std::endl;
         break;
       }
-
     }
+
+    receiver.join();
+    demosaicer.join();
   } catch (std::exception& e) {
     std::cerr << e.what() << std::endl;
   }
 
   return 0;
 }
-
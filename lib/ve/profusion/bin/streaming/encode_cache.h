@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   encode_cache.h
+ *
+ * @brief  Encoded images shared by the clients
+ *
+ * Each (frame, camera, encoding, reference frame) is encoded only once
+ * by a WorkerPool no matter how many clients request it.
+ *
+ * Camera EncodeCache::THUMB denotes the thumbnail of all the cameras
+ * (see PFCMU::make_thumb()), which is available only in ENC_JPEG.
+ */
+#ifndef PFCMU_ENCODE_CACHE_H
+#define PFCMU_ENCODE_CACHE_H
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "libpfcmu/capture++.h"
+#include "libpfcmu/codec.h"
+#include "frame_store.h"
+#include "worker_pool.h"
+
+namespace PFCMU {
+  class EncodeCache {
+  public:
+    /// pseudo camera ID of the thumbnail of all the cameras
+    static const int THUMB = PFCMU::CAMS;
+
+    /**
+     * An encoded image
+     */
+    class entry_t {
+    public:
+      entry_t(codec::encoding_t enc, timestamp_t ref) : m_enc(enc), m_ref(ref), m_ready(false) {
+      }
+
+      /**
+       * Blocks until the encoding finishes
+       *
+       * @return encoded data
+       */
+      const std::vector<codec::byte_t> & wait() const {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while(! m_ready) {
+          m_cond.wait(lock);
+        }
+        return m_data;
+      }
+
+      /// encoding actually used (ENC_LZ4 if ENC_LZ4_DELTA has no reference)
+      codec::encoding_t encoding() const {
+        return m_enc;
+      }
+
+      /// framecount of the reference frame (0 = intra)
+      timestamp_t reference() const {
+        return m_ref;
+      }
+
+    private:
+      friend class EncodeCache;
+
+      void run(frame_ptr frame, frame_ptr ref, int camera, int quality) {
+        if(camera == THUMB) {
+          const unsigned char * images[PFCMU::CAMS];
+          for(int i=0 ; i<PFCMU::CAMS ; i++) {
+            images[i] = frame->image(i);
+          }
+          std::vector<codec::byte_t> rgb(frame->width * frame->height * 3, 0);
+          make_thumb(&(rgb[0]), frame->width * 3, images, frame->width, frame->height, frame->width);
+          codec::encode_rgb_jpeg(&(rgb[0]), frame->width, frame->height, frame->width * 3, quality, &m_data);
+        } else {
+          codec::encode(m_enc,
+                        frame->image(camera),
+                        ref ? ref->image(camera) : NULL,
+                        frame->width,
+                        frame->height,
+                        frame->width,
+                        quality,
+                        &m_data);
+        }
+        {
+          boost::mutex::scoped_lock lock(m_mutex);
+          m_ready = true;
+        }
+        m_cond.notify_all();
+      }
+
+      const codec::encoding_t m_enc;
+      const timestamp_t m_ref;
+      bool m_ready;
+      std::vector<codec::byte_t> m_data;
+      mutable boost::mutex m_mutex;
+      mutable boost::condition_variable m_cond;
+    };
+
+    typedef boost::shared_ptr<const entry_t> entry_ptr;
+
+    EncodeCache(WorkerPool & pool, int quality) : m_pool(pool), m_quality(quality), m_hit(0), m_miss(0) {
+    }
+
+    /**
+     * Get the encoded image, and start encoding if it is not in the cache.
+     *
+     * This function does not block. Call wait() of the returned entry to obtain the data.
+     *
+     * @param frame [in] frame to be encoded
+     * @param camera [in] camera [0:PFCMU::CAMS-1] or THUMB
+     * @param enc [in] encoding
+     * @param ref [in] reference frame for ENC_LZ4_DELTA (can be NULL)
+     */
+    entry_ptr get(const frame_ptr & frame, int camera, codec::encoding_t enc, const frame_ptr & ref) {
+      frame_ptr r;
+      if(camera == THUMB) {
+        enc = codec::ENC_JPEG;
+      } else if(codec::is_inter(enc)) {
+        if(ref && ref->width == frame->width && ref->height == frame->height) {
+          r = ref;
+        } else {
+          enc = codec::ENC_LZ4;
+        }
+      }
+
+      const key_t key(frame->framecount, camera, enc, r ? r->framecount : 0);
+
+      boost::shared_ptr<entry_t> e;
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        map_t::iterator itr = m_entries.find(key);
+        if(itr != m_entries.end()) {
+          m_hit++;
+          return itr->second;
+        }
+        m_miss++;
+        e.reset(new entry_t(enc, key.ref));
+        m_entries.insert(std::make_pair(key, e));
+      }
+
+      m_pool.post(boost::bind(&entry_t::run, e, frame, r, camera, m_quality));
+      return e;
+    }
+
+    /**
+     * Forget the images of the frames not listed in kept
+     *
+     * The framecounts are not always increasing (e.g. seeking in a
+     * recording), so this does not simply drop the older frames.
+     *
+     * @param kept [in] framecounts of the frames still available
+     */
+    void retain(const std::vector<timestamp_t> & kept) {
+      boost::mutex::scoped_lock lock(m_mutex);
+      for(map_t::iterator itr=m_entries.begin() ; itr!=m_entries.end() ; ) {
+        if(std::find(kept.begin(), kept.end(), itr->first.fc) == kept.end()) {
+          m_entries.erase(itr++);
+        } else {
+          ++itr;
+        }
+      }
+    }
+
+    /**
+     * @param hit [out] num of requests served from the cache
+     * @param miss [out] num of requests encoded
+     */
+    void stat(unsigned long long * hit, unsigned long long * miss) const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      *hit = m_hit;
+      *miss = m_miss;
+    }
+
+  private:
+    EncodeCache(const EncodeCache &); // to disable "object copy"
+
+    struct key_t {
+      timestamp_t fc;
+      int camera;
+      codec::encoding_t enc;
+      timestamp_t ref;
+
+      key_t(timestamp_t fc_, int camera_, codec::encoding_t enc_, timestamp_t ref_) : fc(fc_), camera(camera_), enc(enc_), ref(ref_) {
+      }
+
+      bool operator < (const key_t & k) const {
+        if(fc != k.fc) return fc < k.fc;
+        if(camera != k.camera) return camera < k.camera;
+        if(enc != k.enc) return enc < k.enc;
+        return ref < k.ref;
+      }
+    };
+
+    typedef std::map<key_t, boost::shared_ptr<entry_t> > map_t;
+
+    WorkerPool & m_pool;
+    const int m_quality;
+    unsigned long long m_hit;
+    unsigned long long m_miss;
+    map_t m_entries;
+    mutable boost::mutex m_mutex;
+  };
+}
+
+#endif
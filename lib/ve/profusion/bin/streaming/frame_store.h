@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   frame_store.h
+ *
+ * @brief  The latest frames shared between the capture thread and the clients
+ */
+#ifndef PFCMU_FRAME_STORE_H
+#define PFCMU_FRAME_STORE_H
+
+#include <deque>
+#include <vector>
+#include <sys/time.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "pfcmu_config.h"
+
+namespace PFCMU {
+  /**
+   * All the CAMS images captured at a framecount
+   */
+  struct frame_t {
+    timestamp_t framecount;
+    /// num of frames grabbed by the server so far (framecount may skip when frames are dropped)
+    unsigned long long seq;
+    /// wall-clock time (usec since the epoch) when the frame was grabbed
+    unsigned long long usec;
+    int width;
+    int height;
+    /// CAMS images of width*height bytes
+    std::vector<unsigned char> data;
+
+    const unsigned char * image(int camera) const {
+      return &(data[width * height * camera]);
+    }
+
+    unsigned char * image(int camera) {
+      return &(data[width * height * camera]);
+    }
+
+    static unsigned long long now() {
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      return tv.tv_sec * 1000000ULL + tv.tv_usec;
+    }
+  };
+
+  typedef boost::shared_ptr<const frame_t> frame_ptr;
+
+  /**
+   * Keeps the last depth frames. Old frames are kept so that clients can
+   * use them as the reference of inter-frame encodings.
+   */
+  class FrameStore {
+  public:
+    explicit FrameStore(int depth) : m_depth(depth < 1 ? 1 : depth), m_closed(false), m_still(false) {
+    }
+
+    /**
+     * Get a frame buffer to be filled and push()ed.
+     *
+     * The oldest frame is recycled if nobody else refers to it.
+     */
+    boost::shared_ptr<frame_t> acquire(int width, int height) {
+      boost::shared_ptr<frame_t> f;
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if((int)m_frames.size() >= m_depth && m_frames.front().unique()) {
+          f = boost::const_pointer_cast<frame_t>(m_frames.front());
+          m_frames.pop_front();
+        }
+      }
+      if(! f) {
+        f.reset(new frame_t);
+      }
+      f->width = width;
+      f->height = height;
+      f->data.resize(width * height * PFCMU::CAMS);
+      return f;
+    }
+
+    /**
+     * Publish a new frame and wake up the clients waiting for it
+     */
+    void push(const frame_ptr & f) {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_frames.push_back(f);
+        while((int)m_frames.size() > m_depth) {
+          m_frames.pop_front();
+        }
+      }
+      m_cond.notify_all();
+    }
+
+    /**
+     * @return the latest frame, or NULL if nothing has been pushed
+     */
+    frame_ptr latest() const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      return m_frames.empty() ? frame_ptr() : m_frames.back();
+    }
+
+    /**
+     * @return the oldest frame kept, or NULL if nothing has been pushed
+     */
+    frame_ptr oldest() const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      return m_frames.empty() ? frame_ptr() : m_frames.front();
+    }
+
+    /**
+     * @return the framecounts of the frames kept
+     */
+    std::vector<timestamp_t> framecounts() const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      std::vector<timestamp_t> fc(m_frames.size());
+      for(unsigned int i=0 ; i<m_frames.size() ; i++) {
+        fc[i] = m_frames[i]->framecount;
+      }
+      return fc;
+    }
+
+    /**
+     * Blocks until a frame other than framecount fc becomes the latest
+     *
+     * @return the latest frame, or NULL if close()d
+     */
+    frame_ptr wait_newer(timestamp_t fc) {
+      boost::mutex::scoped_lock lock(m_mutex);
+      while(! m_closed && (m_frames.empty() || m_frames.back()->framecount == fc)) {
+        m_cond.wait(lock);
+      }
+      return m_closed ? frame_ptr() : m_frames.back();
+    }
+
+    /**
+     * Same as wait_newer(), but returns the latest frame at once while
+     * it is still (see set_still()), as no other frame is coming
+     *
+     * @return the latest frame, or NULL if close()d
+     */
+    frame_ptr wait_newer_or_still(timestamp_t fc) {
+      boost::mutex::scoped_lock lock(m_mutex);
+      while(! m_closed && (m_frames.empty() || (m_frames.back()->framecount == fc && ! m_still))) {
+        m_cond.wait(lock);
+      }
+      return m_closed ? frame_ptr() : m_frames.back();
+    }
+
+    /**
+     * Mark the latest frame as shown until further notice (e.g., the
+     * playback paused), or not
+     */
+    void set_still(bool still) {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_still = still;
+      }
+      m_cond.notify_all();
+    }
+
+    /**
+     * @return the frame of framecount fc, or NULL if it is not kept anymore
+     */
+    frame_ptr find(timestamp_t fc) const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      for(int i=m_frames.size()-1 ; i>=0 ; i--) {
+        if(m_frames[i]->framecount == fc) {
+          return m_frames[i];
+        }
+      }
+      return frame_ptr();
+    }
+
+    /**
+     * Wake up all the waiters (no frames will be pushed anymore)
+     */
+    void close() {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_closed = true;
+      }
+      m_cond.notify_all();
+    }
+
+    bool closed() const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      return m_closed;
+    }
+
+  private:
+    FrameStore(const FrameStore &); // to disable "object copy"
+
+    const int m_depth;
+    bool m_closed;
+    /// no frame will be pushed until set_still(false)
+    bool m_still;
+    std::deque<frame_ptr> m_frames;
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_cond;
+  };
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   mcast_view.cc
+ *
+ * @brief  Viewer of the previews multicast by "server --mcast"
+ *
+ * Joins the group, reassembles the images and shows them in a window
+ * per node and camera (--show).  The reception statistics are printed
+ * every second, and --drop simulates packet loss to check the FEC, e.g.,
+ *
+ *   server -f 25 --synthetic 640x480 --mcast 239.255.42.1:10001 --mcast_if 127.0.0.1
+ *   mcast_view --mcast 239.255.42.1:10001 --mcast_if 127.0.0.1 --drop 0.02
+ *
+ * (the loopback interface needs "ip link set lo multicast on")
+ */
+
+#include <cstdio>
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include <cv.h>
+#include <highgui.h>
+
+#include "libpfcmu/codec.h"
+#include "libpfcmu/mcast.h"
+#include "boost_opt_util.h"
+#include "trace.h"
+#include "pfcmu_config.h"
+#include "frame_store.h"
+
+namespace {
+  void release_image(IplImage * img) {
+    cvReleaseImage(&img);
+  }
+
+  void show(const PFCMU::mcast::image_t & image, std::map<std::string, boost::shared_ptr<IplImage> > * windows) {
+    if(image.encoding != PFCMU::codec::ENC_JPEG) {
+      return;
+    }
+    int w, h;
+    std::vector<PFCMU::codec::byte_t> rgb;
+    if(0 != PFCMU::codec::decode_jpeg(&(image.data[0]), image.data.size(), &w, &h, &rgb)) {
+      TRACE(1, "broken JPEG from %s\n", image.sender.c_str());
+      return;
+    }
+
+    char name[256];
+    if(image.camera == PFCMU::CAMS) {
+      snprintf(name, sizeof(name), "%s", image.sender.c_str());
+    } else {
+      snprintf(name, sizeof(name), "%s cam%02d", image.sender.c_str(), image.camera);
+    }
+
+    boost::shared_ptr<IplImage> & dst = (*windows)[name];
+    if(! dst || dst->width != w || dst->height != h) {
+      cvNamedWindow(name);
+      dst.reset(cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 3), release_image);
+    }
+
+    IplImage src;
+    cvInitImageHeader(&src, cvSize(w, h), IPL_DEPTH_8U, 3);
+    cvSetData(&src, &(rgb[0]), w * 3);
+    cvCvtColor(&src, dst.get(), CV_RGB2BGR);
+    cvShowImage(name, dst.get());
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("mcast,m",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Multicast GROUP:PORT (e.g. 239.255.42.1:10001)")
+    ("mcast_if",
+     boost::program_options::value<std::string>(),
+     "Address of the interface to join (127.0.0.1 for loopback testing)")
+    ("window",
+     boost::program_options::value<unsigned int>()->default_value(4),
+     "Num of images per node being reassembled at once")
+    ("drop",
+     boost::program_options::value<double>()->default_value(0),
+     "Drop received packets at this rate to simulate loss [0:1]")
+    ("count,n",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Exit after receiving N images (0 = forever)")
+    ("show", "Show the images")
+    ("verbose,v",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "verbosity")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::string ENDPOINT = parameter_map["mcast"].as<std::string>();
+  const unsigned int WINDOW = parameter_map["window"].as<unsigned int>();
+  const double DROP = parameter_map["drop"].as<double>();
+  const unsigned int COUNT = parameter_map["count"].as<unsigned int>();
+  const int SHOW = parameter_map.count("show") ? 1 : 0;
+  const unsigned int VERBOSE = parameter_map["verbose"].as<unsigned int>();
+
+  SET_VERBOSITY(VERBOSE);
+
+  std::string group;
+  int port;
+  if(0 != PFCMU::mcast::parse_endpoint(ENDPOINT, &group, &port)) {
+    DIE(1, "invalid --mcast '%s'\n", ENDPOINT.c_str());
+  }
+
+  PFCMU::mcast::Receiver receiver(group.c_str(),
+                                  port,
+                                  parameter_map.count("mcast_if") ? parameter_map["mcast_if"].as<std::string>().c_str() : NULL,
+                                  WINDOW);
+  receiver.set_drop_rate(DROP);
+
+  std::map<std::string, boost::shared_ptr<IplImage> > windows;
+  PFCMU::mcast::Receiver::stat_t prev;
+  receiver.stat(&prev);
+  unsigned long long t_prev = PFCMU::frame_t::now();
+  unsigned long long bytes = 0;
+
+  for(unsigned int n=0 ; COUNT == 0 || n < COUNT ; ) {
+    PFCMU::mcast::image_t image;
+    const int ret = receiver.receive(&image, SHOW ? 10 : 100);
+    if(ret < 0) {
+      DIE(1, "receive failed\n");
+    }
+    if(ret > 0) {
+      n++;
+      bytes += image.data.size();
+      TRACE(2, "%s cam=%d TS=%llu %s %zd bytes\n",
+            image.sender.c_str(), image.camera, image.framecount,
+            PFCMU::codec::to_string(image.encoding), image.data.size());
+      if(SHOW) {
+        show(image, &windows);
+      }
+    }
+
+    if(SHOW && 'q' == (cvWaitKey(1) & 0xff)) {
+      break;
+    }
+
+    const unsigned long long now = PFCMU::frame_t::now();
+    if(now - t_prev >= 1000000) {
+      PFCMU::mcast::Receiver::stat_t s;
+      receiver.stat(&s);
+      const double sec = (now - t_prev) / 1e6;
+      const unsigned long long expected = s.packets - prev.packets + s.lost - prev.lost;
+      fprintf(stderr, "images %.1f/s (%.0f kB/s), recovered %llu, incomplete %llu, packet loss %.2f%%\n",
+              (s.images - prev.images) / sec, bytes / sec / 1024,
+              s.recovered - prev.recovered, s.incomplete - prev.incomplete,
+              expected ? 100.0 * (s.lost - prev.lost) / expected : 0.0);
+      prev = s;
+      t_prev = now;
+      bytes = 0;
+    }
+  }
+
+  PFCMU::mcast::Receiver::stat_t s;
+  receiver.stat(&s);
+  printf("images=%llu recovered=%llu incomplete=%llu packets=%llu lost=%llu invalid=%llu\n",
+         s.images, s.recovered, s.incomplete, s.packets, s.lost, s.invalid);
+
+  return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   player.h
+ *
+ * @brief  Playback of a recording as the frame source of the streaming server
+ *
+ * The frames are read by a dedicated thread into a small cache.  The
+ * thread reads the frame requested by the playback first, and then
+ * reads ahead in the direction of the playback, so that playing and
+ * scrubbing back and forth do not wait for the disk.
+ */
+#ifndef PFCMU_PLAYER_H
+#define PFCMU_PLAYER_H
+
+#include <cmath>
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "pfcmu_config.h"
+#include "rawfile.h"
+#include "frame_store.h"
+
+namespace PFCMU {
+  class Player {
+  public:
+    /**
+     * @param filename [in] recording (.dat)
+     * @param width [in] width of each image
+     * @param height [in] height of each image
+     * @param cache_frames [in] num of frames kept in memory
+     * @param readahead [in] num of frames read ahead (< cache_frames)
+     * @param filter [in] correction of the frames read (not owned, can be NULL)
+     */
+    Player(const char * filename, int width, int height, int cache_frames, int readahead, const ImageFilter * filter = NULL)
+      : m_width(width),
+        m_height(height),
+        m_cache_frames(std::max(2, cache_frames)),
+        m_readahead(std::max(0, std::min(readahead, m_cache_frames - 1))),
+        m_closed(false),
+        m_pos(0),
+        m_stride(1),
+        m_wanted(-1),
+        m_tick(0),
+        m_rate(0),
+        m_seek(-1),
+        m_step(0),
+        m_pending(true) {
+      m_file.open(filename, width, height);
+      if(m_file.size() == 0) {
+        DIE(1, "%s has no frames\n", filename);
+      }
+      m_file.set_filter(filter);
+      m_reader = boost::thread(boost::bind(&Player::read_loop, this));
+    }
+
+    ~Player() {
+      close();
+      m_reader.join();
+    }
+
+    size_t size() const {
+      return m_file.size();
+    }
+
+    /**
+     * @param rate [in] 1 = real-time, >1 fast-forward, <0 backward, 0 = pause
+     */
+    void play(double rate) {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_rate = rate;
+        m_pending = true;
+      }
+      m_cond.notify_all();
+    }
+
+    /**
+     * Jump to the first frame whose framecount is not less than fc
+     *
+     * @return the frame index, or negative if fc is after the end
+     */
+    off64_t seek(timestamp_t fc) {
+      off64_t index;
+      {
+        boost::mutex::scoped_lock lock(m_file_mutex);
+        index = m_file.lower_bound(fc);
+      }
+      if(index >= (off64_t)m_file.size()) {
+        return -1;
+      }
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_seek = index;
+        m_pending = true;
+      }
+      m_cond.notify_all();
+      return index;
+    }
+
+    /**
+     * Pause and move n frames (n < 0 for backward)
+     */
+    void step(int n) {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_rate = 0;
+        m_step += n;
+        m_pending = true;
+      }
+      m_cond.notify_all();
+    }
+
+    /**
+     * Position after the pending play()/seek()/step() are applied
+     *
+     * @param index [out] current frame index
+     * @param rate [out] current rate
+     */
+    void position(off64_t * index, double * rate) const {
+      boost::mutex::scoped_lock lock(m_mutex);
+      while(! m_closed && m_pending) {
+        m_cond.wait(lock);
+      }
+      *index = m_pos;
+      *rate = m_rate;
+    }
+
+    void close() {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_closed = true;
+      }
+      m_cond.notify_all();
+    }
+
+    /**
+     * Publish the frames to store according to the requests until close()d
+     *
+     * @param publish [in] called for each frame to be shown
+     * @param still [in] called with true when the frame shown stays until
+     *                   the next request (paused), and with false before
+     *                   the request is applied, i.e., before position() returns
+     */
+    template<typename F, typename G>
+    void run(F publish, G still) {
+      const unsigned int COUNTS_PER_SEC = 100; // hardware framecount clock
+      boost::system_time next = boost::get_system_time();
+      off64_t index = 0;
+      frame_ptr prev;
+
+      for(;;) {
+        double rate;
+        {
+          boost::mutex::scoped_lock lock(m_mutex);
+          // wait for requests while paused
+          while(! m_closed && ! m_pending && m_rate == 0) {
+            m_cond.wait(lock);
+          }
+          // wait for the next frame while playing
+          while(! m_closed && ! m_pending && m_rate != 0 && boost::get_system_time() < next) {
+            m_cond.timed_wait(lock, next);
+          }
+          if(m_closed) {
+            break;
+          }
+
+          const off64_t last = m_file.size() - 1;
+          if(m_pending) {
+            if(m_seek >= 0) {
+              index = m_seek;
+            }
+            index += m_step;
+            m_seek = -1;
+            m_step = 0;
+            next = boost::get_system_time();
+          } else if(prev) {
+            // skip frames in fast-forward so that at most fps frames are shown per second
+            index += m_rate < 0 ? -stride(m_rate) : stride(m_rate);
+          }
+          if(index < 0 || index > last) {
+            index = std::max((off64_t)0, std::min(index, last));
+            m_rate = 0;
+          }
+          still(false);
+          m_pending = false;
+          m_pos = index;
+          m_stride = m_rate < 0 ? -stride(m_rate) : stride(m_rate);
+          rate = m_rate;
+        }
+        m_cond.notify_all();
+
+        frame_ptr f = get(index);
+        if(prev != f) {
+          publish(f);
+        }
+        // the clients waiting for a frame get this one, even if not changed by the request
+        if(rate == 0) {
+          still(true);
+        }
+
+        // real-time is given by the framecounts, which skip if frames were dropped in the recording
+        if(rate != 0) {
+          const off64_t n = index + (rate < 0 ? -stride(rate) : stride(rate));
+          if(n >= 0 && n < (off64_t)m_file.size()) {
+            const timestamp_t fc = f->framecount;
+            const timestamp_t fc_next = get_framecount(n);
+            const double counts = fc_next > fc ? fc_next - fc : fc - fc_next;
+            next += boost::posix_time::microseconds((long long)(counts * 1000000 / COUNTS_PER_SEC / std::fabs(rate)));
+          }
+        }
+        prev = f;
+      }
+    }
+
+  private:
+    Player(const Player &); // to disable "object copy"
+
+    struct entry_t {
+      frame_ptr frame;
+      unsigned long long tick;
+    };
+
+    typedef std::map<off64_t, entry_t> cache_t;
+
+    /// frames advanced per shown frame, so that at most fps frames are shown per second
+    int stride(double rate) const {
+      return std::max(1, (int)std::floor(std::fabs(rate) + 0.5));
+    }
+
+    timestamp_t get_framecount(off64_t index) {
+      {
+        boost::mutex::scoped_lock lock(m_mutex);
+        cache_t::const_iterator itr = m_cache.find(index);
+        if(itr != m_cache.end()) {
+          return itr->second.frame->framecount;
+        }
+      }
+      boost::mutex::scoped_lock lock(m_file_mutex);
+      return m_file.framecount_at(index);
+    }
+
+    /**
+     * Get the frame from the cache, or wait for the reader
+     */
+    frame_ptr get(off64_t index) {
+      boost::mutex::scoped_lock lock(m_mutex);
+      for(;;) {
+        cache_t::iterator itr = m_cache.find(index);
+        if(itr != m_cache.end()) {
+          itr->second.tick = ++m_tick;
+          return itr->second.frame;
+        }
+        m_wanted = index;
+        m_cond.notify_all();
+        m_cond.wait(lock);
+      }
+    }
+
+    /// the next frame to be read, or negative if nothing to do. call with m_mutex locked
+    off64_t next_to_read() const {
+      if(m_wanted >= 0 && m_cache.find(m_wanted) == m_cache.end()) {
+        return m_wanted;
+      }
+      for(int i=1 ; i<=m_readahead ; i++) {
+        const off64_t n = m_pos + m_stride * i;
+        if(n < 0 || n >= (off64_t)m_file.size()) {
+          break;
+        }
+        if(m_cache.find(n) == m_cache.end()) {
+          return n;
+        }
+      }
+      return -1;
+    }
+
+    /// make a room for a frame, keeping the current and read-ahead frames. call with m_mutex locked
+    void evict() {
+      while((int)m_cache.size() >= m_cache_frames) {
+        cache_t::iterator victim = m_cache.end();
+        for(cache_t::iterator itr=m_cache.begin() ; itr!=m_cache.end() ; ++itr) {
+          const off64_t d = (itr->first - m_pos) * (m_stride < 0 ? -1 : 1);
+          const bool ahead = 0 <= d && d <= m_readahead * std::abs(m_stride);
+          if(! ahead && (victim == m_cache.end() || itr->second.tick < victim->second.tick)) {
+            victim = itr;
+          }
+        }
+        if(victim == m_cache.end()) {
+          victim = m_cache.begin();
+        }
+        m_cache.erase(victim);
+      }
+    }
+
+    void read_loop() {
+      for(;;) {
+        off64_t index;
+        int stride;
+        {
+          boost::mutex::scoped_lock lock(m_mutex);
+          while(! m_closed && (index = next_to_read()) < 0) {
+            m_cond.wait(lock);
+          }
+          if(m_closed) {
+            return;
+          }
+          stride = m_stride;
+        }
+
+        boost::shared_ptr<frame_t> f(new frame_t);
+        f->width = m_width;
+        f->height = m_height;
+        f->data.resize(m_width * m_height * PFCMU::CAMS);
+        {
+          boost::mutex::scoped_lock lock(m_file_mutex);
+          m_file.read(index, &(f->data[0]));
+          const off64_t ahead = m_readahead * std::abs(stride);
+          if(stride > 0) {
+            m_file.prefetch(index + 1, ahead);
+          } else {
+            m_file.prefetch(std::max((off64_t)0, index - ahead), index - std::max((off64_t)0, index - ahead));
+          }
+        }
+        f->framecount = PFCMU::get_timestamp(f->image(0));
+        f->seq = index + 1;
+        f->usec = frame_t::now();
+
+        {
+          boost::mutex::scoped_lock lock(m_mutex);
+          evict();
+          entry_t e;
+          e.frame = f;
+          e.tick = ++m_tick;
+          m_cache[index] = e;
+          if(m_wanted == index) {
+            m_wanted = -1;
+          }
+        }
+        m_cond.notify_all();
+
+        TRACE(3, "read #%zd TS=%llu\n", index, f->framecount);
+      }
+    }
+
+    const int m_width;
+    const int m_height;
+    const int m_cache_frames;
+    const int m_readahead;
+
+    RAWFile m_file;
+    /// guards m_file
+    mutable boost::mutex m_file_mutex;
+
+    // the following are guarded by m_mutex
+    bool m_closed;
+    off64_t m_pos;
+    int m_stride;
+    off64_t m_wanted;
+    unsigned long long m_tick;
+    cache_t m_cache;
+    double m_rate;
+    off64_t m_seek;
+    int m_step;
+    /// seek/step/rate changed
+    bool m_pending;
+
+    mutable boost::mutex m_mutex;
+    mutable boost::condition_variable m_cond;
+    boost::thread m_reader;
+  };
+}
+
+#endif
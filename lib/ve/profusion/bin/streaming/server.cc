@@ -9,20 +9,402 @@
  * @author Shohei NOBUHARA <nob@i.kyoto-u.ac.jp>
  * @date   Sun Feb 13 21:28:53 2011
  * 
- * @brief  Live streaming server implemented as a blocking/synchronized TCP server.
+ * @brief  Live streaming server implemented as a thread-per-client TCP server.
+ *
+ * A capture thread publishes every frame to a FrameStore, and the
+ * clients receive the images in the encoding negotiated by "ENC".
+ * Encoding is done by a WorkerPool and shared via EncodeCache, so
+ * that N clients watching the same camera cost only one encode.
+ *
+ * "SUB" turns the connection into a push channel of status lines and
+ * thumbnails used by the rig-wide aggregator.  With --synthetic the
+ * server generates test frames instead of capturing, so that several
+ * instances can run on a single host.
+ *
+ * With --play the server plays back a recording instead, controlled by
+ * "PLAY", "SEEK", "STEP" and "POS" from any client.  All the other
+ * commands work as live, except that "FRAME" and "PGM" return the
+ * current frame at once while paused.
+ *
+ * With --mcast the thumbnail (and the JPEG previews of --mcast_cameras)
+ * is also sent to a UDP multicast group every --mcast_interval frames,
+ * so that the bandwidth of the node does not depend on the num of
+ * viewers (see libpfcmu/mcast.h and mcast_view).
+ *
+ * With --defects the hot/dead pixels and the dark frame are corrected
+ * before encoding, live, played back or synthetic (see
+ * libpfcmu/defect_correction.h).
  * 
  */
 
+#include <algorithm>
+#include <sstream>
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 
 #include "pfcmu_config.h"
 #include "libviewplus/PF_EZInterface.h"
 #include "libpfcmu/linux_aio.h"
 #include "libpfcmu/capture++.h"
+#include "libpfcmu/codec.h"
+#include "libpfcmu/defect_correction.h"
+#include "libpfcmu/mcast.h"
 #include "libpfcmu/util.h"
 #include "boost_opt_util.h"
 #include "trace.h"
 #include "my_memcpy.h"
+#include "worker_pool.h"
+#include "frame_store.h"
+#include "encode_cache.h"
+#include "player.h"
+
+using boost::asio::ip::tcp;
+
+namespace {
+  struct server_t {
+    PFCMU::FrameStore * store;
+    PFCMU::EncodeCache * cache;
+    /// NULL if live
+    PFCMU::Player * player;
+    std::string hello;
+    int frame_inc;
+    int debug;
+
+    /// num of connected clients
+    mutable int clients;
+    mutable boost::mutex mutex;
+  };
+
+  void publish(PFCMU::FrameStore * store, PFCMU::EncodeCache * cache, const PFCMU::frame_ptr & f) {
+    store->push(f);
+
+    // the cached images are useless once their frame has gone
+    cache->retain(store->framecounts());
+
+    if(f->seq % 250 == 0) {
+      unsigned long long hit, miss;
+      cache->stat(&hit, &miss);
+      TRACE(1, "TS=%llu, encoded=%llu, served from cache=%llu\n", f->framecount, miss, hit);
+    }
+  }
+
+  void capture_loop(PFCMU::Capture * capture, const PFCMU::DefectCorrector * corrector, PFCMU::FrameStore * store, PFCMU::EncodeCache * cache) {
+    const int W = capture->width();
+    const int H = capture->height();
+
+    for(unsigned long long n=1 ; ! store->closed() ; n++) {
+      PF_EZImage * img = capture->grab();
+      PFCMU::embed_timestamp(img);
+
+      boost::shared_ptr<PFCMU::frame_t> f = store->acquire(W, H);
+      f->framecount = img->timestamp;
+      f->seq = n;
+      f->usec = PFCMU::frame_t::now();
+      for(int i=0 ; i<PFCMU::CAMS ; i++) {
+        capture->copy(f->image(i), i, W);
+        if(corrector) {
+          corrector->apply(f->image(i), i);
+        }
+      }
+      publish(store, cache, f);
+    }
+  }
+
+  /**
+   * Generate moving gradients instead of capturing.
+   *
+   * The framecount is derived from the wall clock in the same unit as
+   * the hardware (100 per second), so that the servers on the same
+   * host behave like hardware-synchronized nodes.
+   */
+  void synthetic_loop(int width, int height, unsigned int fps, unsigned int frame_inc, const PFCMU::DefectCorrector * corrector,
+                      PFCMU::FrameStore * store, PFCMU::EncodeCache * cache) {
+    const unsigned long long PERIOD = 1000000 / fps;
+
+    for(unsigned long long n=1 ; ! store->closed() ; n++) {
+      const unsigned long long now = PFCMU::frame_t::now();
+      const unsigned long long next = (now / PERIOD + 1) * PERIOD;
+      usleep(next - now);
+
+      boost::shared_ptr<PFCMU::frame_t> f = store->acquire(width, height);
+      f->framecount = (next / PERIOD) * frame_inc;
+      f->seq = n;
+      f->usec = PFCMU::frame_t::now();
+      for(int i=0 ; i<PFCMU::CAMS ; i++) {
+        unsigned char * p = f->image(i);
+        for(int y=0 ; y<height ; y++) {
+          memset(p + width * y, (y + f->framecount / frame_inc + i * 10) & 0xff, width);
+        }
+        if(corrector) {
+          corrector->apply(p, i);
+        }
+        *(reinterpret_cast<uint32_t *>(p)) = htobe32( uint32_t(f->framecount) );
+      }
+      publish(store, cache, f);
+    }
+  }
+
+  // FRM <camera> <encoding> <width> <height> <framecount> <reference> <usec> <bytes>
+  void send_frame(tcp::iostream & stream, const PFCMU::frame_ptr & frame, int camera, const PFCMU::EncodeCache::entry_ptr & e) {
+    const std::vector<PFCMU::codec::byte_t> & data = e->wait();
+    char text[1024];
+    snprintf(text, sizeof(text), "FRM %d %s %d %d %llu %llu %llu %zd\n",
+             camera, PFCMU::codec::to_string(e->encoding()),
+             frame->width, frame->height,
+             frame->framecount, e->reference(), frame->usec,
+             data.size());
+    stream << text;
+    stream.write(reinterpret_cast<const char *>(&(data[0])), data.size());
+  }
+
+  void playback_loop(PFCMU::Player * player, PFCMU::FrameStore * store, PFCMU::EncodeCache * cache) {
+    player->run(boost::bind(publish, store, cache, _1), boost::bind(&PFCMU::FrameStore::set_still, store, _1));
+  }
+
+  /**
+   * Multicast the thumbnail and the previews of the cameras every
+   * interval frames until the store is closed.
+   *
+   * The frames are chosen by their framecount as push_status() does.
+   */
+  void mcast_loop(PFCMU::mcast::Publisher * publisher, const server_t * srv, unsigned int interval, std::vector<int> cameras) {
+    const PFCMU::timestamp_t STEP = interval * srv->frame_inc;
+    PFCMU::timestamp_t ts_sent = 0;
+    PFCMU::frame_ptr prev;
+
+    cameras.insert(cameras.begin(), (int)PFCMU::EncodeCache::THUMB);
+
+    for(unsigned long long n=1 ; ; n++) {
+      PFCMU::frame_ptr frame = srv->store->wait_newer(ts_sent);
+      if(! frame) {
+        break;
+      }
+      ts_sent = frame->framecount;
+      if(prev && frame->framecount / STEP == prev->framecount / STEP) {
+        continue;
+      }
+      prev = frame;
+
+      // encode all of them in parallel first
+      std::vector<PFCMU::EncodeCache::entry_ptr> e(cameras.size());
+      for(unsigned int i=0 ; i<cameras.size() ; i++) {
+        e[i] = srv->cache->get(frame, cameras[i], PFCMU::codec::ENC_JPEG, PFCMU::frame_ptr());
+      }
+      for(unsigned int i=0 ; i<cameras.size() ; i++) {
+        const std::vector<PFCMU::codec::byte_t> & data = e[i]->wait();
+        publisher->send(frame->framecount, cameras[i], e[i]->encoding(), frame->width, frame->height, &(data[0]), data.size());
+      }
+
+      if(n % 100 == 0) {
+        unsigned long long images, packets, bytes;
+        publisher->stat(&images, &packets, &bytes);
+        TRACE(1, "multicast: images=%llu, packets=%llu, bytes=%llu\n", images, packets, bytes);
+      }
+    }
+  }
+
+  /**
+   * Push "STA" and the thumbnail of all the cameras every interval
+   * frames until the connection is closed.
+   *
+   * STA <framecount> <usec> <fps> <dropped> <clients> <encoded> <cached>
+   * FRM <camera> jpeg ... (see send_frame())
+   *
+   * The frames are chosen by their framecount, so that all the nodes
+   * push the same frames.
+   */
+  void push_status(tcp::iostream & stream, const server_t * srv, unsigned int interval) {
+    const PFCMU::timestamp_t STEP = interval * srv->frame_inc;
+    PFCMU::timestamp_t ts_sent = 0;
+    PFCMU::frame_ptr prev;
+
+    while(stream) {
+      PFCMU::frame_ptr frame = srv->store->wait_newer(ts_sent);
+      if(! frame) {
+        break;
+      }
+      ts_sent = frame->framecount;
+      if(prev && frame->framecount / STEP == prev->framecount / STEP) {
+        continue;
+      }
+
+      PFCMU::EncodeCache::entry_ptr e = srv->cache->get(frame, PFCMU::EncodeCache::THUMB, PFCMU::codec::ENC_JPEG, PFCMU::frame_ptr());
+
+      double fps = 0;
+      long long dropped = 0;
+      if(prev && frame->usec > prev->usec) {
+        fps = (frame->seq - prev->seq) * 1e6 / (frame->usec - prev->usec);
+        dropped = (long long)((frame->framecount - prev->framecount) / srv->frame_inc) - (long long)(frame->seq - prev->seq);
+      }
+      int clients = 0;
+      {
+        boost::mutex::scoped_lock lock(srv->mutex);
+        clients = srv->clients;
+      }
+      unsigned long long hit, miss;
+      srv->cache->stat(&hit, &miss);
+
+      char text[1024];
+      snprintf(text, sizeof(text), "STA %llu %llu %.2f %lld %d %llu %llu\n",
+               frame->framecount, frame->usec, fps, dropped, clients, miss, hit);
+      stream << text;
+      send_frame(stream, frame, PFCMU::EncodeCache::THUMB, e);
+      stream << std::flush;
+      prev = frame;
+    }
+  }
+
+  void serve(boost::shared_ptr<tcp::iostream> s, const server_t * srv) {
+    tcp::iostream & stream = *s;
+    PFCMU::codec::encoding_t enc = PFCMU::codec::ENC_RAW;
+    PFCMU::timestamp_t ts_sent = 0;
+
+    {
+      boost::mutex::scoped_lock lock(srv->mutex);
+      srv->clients++;
+    }
+
+    // send the first msg
+    stream << "100 " << srv->hello << std::endl;
+
+    // receive inputs
+    for(std::string line ; std::getline(stream, line) ; ) {
+      if(srv->debug) {
+        fprintf(stderr, "line len=%zd :", line.length());
+        for(unsigned int i=0 ; i<line.length() ; i++) {
+          fprintf(stderr, " %02x", (unsigned char)(line[i]));
+        }
+        fprintf(stderr, "\n");
+      }
+
+      // skip if empty
+      if(line.empty() || line[0] == '\r') {
+        continue;
+      }
+
+      // parse the command
+      std::istringstream iss(line);
+      std::string cmd;
+      iss >> cmd;
+      if(cmd == "BYE") {
+        TRACE(1, "BYE\n");
+        break;
+      } else if(cmd == "PGM") {
+        int camid = 0;
+        iss >> camid;
+        if(camid < 0 || camid >= PFCMU::CAMS) {
+          camid = 0;
+        }
+        TRACE(2, "PGM CAMID=%d\n", camid);
+
+        PFCMU::frame_ptr frame = srv->store->wait_newer_or_still(ts_sent);
+        if(! frame) {
+          break;
+        }
+        stream << "P5\n"
+               << frame->width << "\n" << frame->height << "\n"
+               << "255\n";
+        TRACE(2, "Sending CAM%02d, TS=%llu\n", camid, frame->framecount);
+        stream.write(reinterpret_cast<const char *>(frame->image(camid)), frame->width * frame->height);
+        stream << std::flush;
+        ts_sent = frame->framecount;
+      } else if(cmd == "ENC") {
+        // ENC <encoding>[,<encoding>...] in the order of preference
+        std::string list;
+        std::getline(iss, list);
+        if(0 == PFCMU::codec::negotiate(list, &enc)) {
+          TRACE(1, "ENC %s\n", PFCMU::codec::to_string(enc));
+          stream << "200 ENC " << PFCMU::codec::to_string(enc) << std::endl;
+        } else {
+          stream << "400 ENC not supported:" << list << std::endl;
+        }
+      } else if(cmd == "FRAME") {
+        // FRAME <reference framecount> <camera> [<camera> ...]
+        PFCMU::timestamp_t ref_fc = 0;
+        iss >> ref_fc;
+        std::vector<int> cams;
+        for(int c ; iss >> c ; ) {
+          if(0 <= c && c < PFCMU::CAMS) {
+            cams.push_back(c);
+          }
+        }
+
+        PFCMU::frame_ptr frame = srv->store->wait_newer_or_still(ts_sent);
+        if(! frame) {
+          break;
+        }
+        PFCMU::frame_ptr ref = ref_fc ? srv->store->find(ref_fc) : PFCMU::frame_ptr();
+
+        // queue all the cameras first so that the pool encodes them in parallel
+        std::vector<PFCMU::EncodeCache::entry_ptr> e(cams.size());
+        for(unsigned int i=0 ; i<cams.size() ; i++) {
+          e[i] = srv->cache->get(frame, cams[i], enc, ref);
+        }
+        for(unsigned int i=0 ; i<cams.size() ; i++) {
+          send_frame(stream, frame, cams[i], e[i]);
+        }
+        stream << std::flush;
+        ts_sent = frame->framecount;
+      } else if(cmd == "TIME") {
+        // TIME : wall clock of the server (usec) for clients estimating the clock offset
+        stream << "200 TIME " << PFCMU::frame_t::now() << std::endl;
+      } else if(cmd == "PLAY" || cmd == "SEEK" || cmd == "STEP" || cmd == "POS") {
+        // PLAY <rate> : 1 = real-time, 0 = pause, >1 fast-forward, <0 backward
+        // SEEK <framecount> : jump to the first frame at or after framecount
+        // STEP <frames> : pause and move
+        // POS : reply "200 POS <index> <frames> <rate>"
+        if(! srv->player) {
+          stream << "400 " << cmd << " not playing a recording" << std::endl;
+          continue;
+        }
+        if(cmd == "PLAY") {
+          double rate = 1;
+          iss >> rate;
+          srv->player->play(rate);
+        } else if(cmd == "SEEK") {
+          PFCMU::timestamp_t fc = 0;
+          iss >> fc;
+          if(srv->player->seek(fc) < 0) {
+            stream << "404 SEEK " << fc << " is after the end" << std::endl;
+            continue;
+          }
+        } else if(cmd == "STEP") {
+          int n = 1;
+          iss >> n;
+          srv->player->step(n);
+        }
+        off64_t index;
+        double rate;
+        srv->player->position(&index, &rate);
+        char text[1024];
+        snprintf(text, sizeof(text), "200 %s %zd %zd %g", cmd.c_str(), index, srv->player->size(), rate);
+        stream << text << std::endl;
+      } else if(cmd == "SUB") {
+        // SUB <interval> : no more commands are accepted
+        unsigned int interval = 1;
+        iss >> interval;
+        if(interval < 1) {
+          interval = 1;
+        }
+        TRACE(1, "SUB interval=%u\n", interval);
+        stream << "200 SUB " << interval << std::endl;
+        push_status(stream, srv, interval);
+        break;
+      } else {
+        TRACE(1, "unknown command = '%s'\n", line.c_str());
+      }
+    }
+
+    {
+      boost::mutex::scoped_lock lock(srv->mutex);
+      srv->clients--;
+    }
+
+    TRACE(1, "Client disconnected\n");
+  }
+}
 
 int main(int argc, char * argv[]) {
   boost::program_options::options_description cmdline("Command line options");
@@ -46,9 +428,57 @@ int main(int argc, char * argv[]) {
     ("c_ringnum",
      boost::program_options::value<unsigned int>()->default_value(1),
      "Ringbuf size for cam -> mem")
+    ("threads,t",
+     boost::program_options::value<unsigned int>()->default_value(0),
+     "Num of encoding threads (0 = num of CPUs)")
+    ("depth",
+     boost::program_options::value<unsigned int>()->default_value(4),
+     "Num of frames kept as the reference of inter-frame encodings")
+    ("jpeg_quality",
+     boost::program_options::value<unsigned int>()->default_value(75),
+     "JPEG quality for 'jpeg' encoding [0:100]")
     ("verbose,v",
      boost::program_options::value<unsigned int>()->default_value(0),
      "verbosity")
+    ("synthetic",
+     boost::program_options::value<std::string>(),
+     "Generate WxH test frames instead of capturing (e.g. 640x480)")
+    ("play",
+     boost::program_options::value<std::string>(),
+     "Play back a recording (/disks/local/out.dat) instead of capturing")
+    ("defects",
+     boost::program_options::value<std::vector<std::string> >()->composing(),
+     "Correct the defects of a .hpx or a .pxs (can be given several times)")
+    ("dark",
+     boost::program_options::value<std::string>()->default_value("fpn"),
+     "Dark frame of --defects .pxs to be subtracted (none, fpn or full)")
+    ("cache_frames",
+     boost::program_options::value<unsigned int>()->default_value(16),
+     "Num of frames of the recording kept in memory")
+    ("readahead",
+     boost::program_options::value<unsigned int>()->default_value(8),
+     "Num of frames of the recording read ahead")
+    ("mcast",
+     boost::program_options::value<std::string>(),
+     "Multicast the thumbnails to GROUP:PORT (e.g. 239.255.42.1:10001)")
+    ("mcast_if",
+     boost::program_options::value<std::string>(),
+     "Address of the interface for multicast (127.0.0.1 for loopback testing)")
+    ("mcast_interval",
+     boost::program_options::value<unsigned int>()->default_value(5),
+     "Multicast every N frames")
+    ("mcast_cameras",
+     boost::program_options::value<std::string>()->default_value(""),
+     "Cameras multicast also as JPEG previews (e.g. 0,12)")
+    ("mcast_ttl",
+     boost::program_options::value<unsigned int>()->default_value(1),
+     "Multicast TTL")
+    ("mcast_mtu",
+     boost::program_options::value<unsigned int>()->default_value(1500),
+     "Max size of multicast IP packets")
+    ("mcast_fec",
+     boost::program_options::value<unsigned int>()->default_value(8),
+     "Num of fragments per XOR parity (0 = no FEC)")
     ("max_priority", "Set highest priority (only root can do this)")
     ("debug", "Debugging mode")
     ;
@@ -63,110 +493,179 @@ int main(int argc, char * argv[]) {
   const unsigned int FRAME_INC = FPS == 100 ? 1 : 4;
   const double CAM_SHUTTER = parameter_map["shutter"].as<double>();
   const double CAM_GAIN = parameter_map["gain"].as<double>();
+  const unsigned int THREADS = parameter_map["threads"].as<unsigned int>();
+  const unsigned int DEPTH = parameter_map["depth"].as<unsigned int>();
+  const unsigned int JPEG_QUALITY = parameter_map["jpeg_quality"].as<unsigned int>();
   const unsigned int VERBOSE = parameter_map["verbose"].as<unsigned int>();
   const int DEBUG_MODE = parameter_map.count("debug") ? 1 : 0;
 
+  int SYNTHETIC_W = 0, SYNTHETIC_H = 0;
+  if(parameter_map.count("synthetic")) {
+    const std::string size = parameter_map["synthetic"].as<std::string>();
+    if(2 != sscanf(size.c_str(), "%dx%d", &SYNTHETIC_W, &SYNTHETIC_H) ||
+       SYNTHETIC_W <= 0 || SYNTHETIC_H <= 0 || SYNTHETIC_W % 2 || SYNTHETIC_H % 2) {
+      DIE(1, "invalid --synthetic '%s'\n", size.c_str());
+    }
+  }
+
+  std::string MCAST_GROUP;
+  int MCAST_PORT = 0;
+  std::vector<int> MCAST_CAMERAS;
+  if(parameter_map.count("mcast")) {
+    const std::string endpoint = parameter_map["mcast"].as<std::string>();
+    if(0 != PFCMU::mcast::parse_endpoint(endpoint, &MCAST_GROUP, &MCAST_PORT)) {
+      DIE(1, "invalid --mcast '%s'\n", endpoint.c_str());
+    }
+    std::string list = parameter_map["mcast_cameras"].as<std::string>();
+    std::replace(list.begin(), list.end(), ',', ' ');
+    std::istringstream iss(list);
+    for(int c ; iss >> c ; ) {
+      if(c < 0 || c >= PFCMU::CAMS) {
+        DIE(1, "invalid camera %d in --mcast_cameras\n", c);
+      }
+      MCAST_CAMERAS.push_back(c);
+    }
+  }
+
   SET_VERBOSITY(VERBOSE);
 
+  const int WIDTH = (FPS == 100 ? 320 : 640);
+  const int HEIGHT = (FPS == 100 ? 240 : 480);
+  // the size of the frames corrected, as the synthetic ones are not of the fps
+  const int SOURCE_W = SYNTHETIC_W > 0 && ! parameter_map.count("play") ? SYNTHETIC_W : WIDTH;
+  const int SOURCE_H = SYNTHETIC_W > 0 && ! parameter_map.count("play") ? SYNTHETIC_H : HEIGHT;
+  PFCMU::DefectCorrector corrector;
+  bool CORRECT = false;
+  if(parameter_map.count("defects")) {
+    PFCMU::DefectCorrector::dark_t dark;
+    if(0 != PFCMU::DefectCorrector::dark_from_string(parameter_map["dark"].as<std::string>(), &dark)) {
+      DIE(1, "invalid --dark '%s'\n", parameter_map["dark"].as<std::string>().c_str());
+    }
+    corrector.init(SOURCE_W, SOURCE_H);
+    const std::vector<std::string> files = parameter_map["defects"].as<std::vector<std::string> >();
+    for(size_t i=0 ; i<files.size() ; i++) {
+      const int n = corrector.load(files[i].c_str(), dark);
+      if(n < 0) {
+        DIE(1, "cannot load %s\n", files[i].c_str());
+      }
+      TRACE(1, "%s has %d defects\n", files[i].c_str(), n);
+    }
+    CORRECT = true;
+  }
+
   if(ENABLE_MAX_PRIORITY) {
     PFCMU::set_max_priority();
   }
 
-  TRACE(1, "Camera init\n");
   PFCMU::Capture capture;
-  capture.init(CAMERA, FPS);
-
-  const int MEMSIZE = capture.width() * capture.height();
-
-  TRACE(1, "Capture start\n");
-  capture.start(C_RINGNUM);
-
-  // set params
-  TRACE(1, "Camera set shutter = %f\n", CAM_SHUTTER);
-  capture.set_shutter(CAM_SHUTTER);
-  TRACE(1, "Camera set gain = %f\n", CAM_GAIN);
-  capture.set_gain(CAM_GAIN);
-
+  // the cameras are not touched with --play or --synthetic
+  const bool LIVE = ! parameter_map.count("play") && SYNTHETIC_W <= 0;
+  boost::scoped_ptr<PFCMU::Player> player;
+  std::string desc;
+  if(parameter_map.count("play")) {
+    const std::string PLAY = parameter_map["play"].as<std::string>();
+    player.reset(new PFCMU::Player(PLAY.c_str(),
+                                   WIDTH,
+                                   HEIGHT,
+                                   parameter_map["cache_frames"].as<unsigned int>(),
+                                   parameter_map["readahead"].as<unsigned int>(),
+                                   CORRECT ? &corrector : NULL));
+    desc = "playback " + PLAY;
+    TRACE(1, "%s has %zd frames\n", PLAY.c_str(), player->size());
+  } else if(SYNTHETIC_W > 0) {
+    char text[256];
+    snprintf(text, sizeof(text), "synthetic %dx%d %ufps", SYNTHETIC_W, SYNTHETIC_H, FPS);
+    desc = text;
+  } else {
+    TRACE(1, "Camera init\n");
+    capture.init(CAMERA, FPS);
+
+    TRACE(1, "Capture start\n");
+    capture.start(C_RINGNUM);
+
+    // set params
+    TRACE(1, "Camera set shutter = %f\n", CAM_SHUTTER);
+    capture.set_shutter(CAM_SHUTTER);
+    TRACE(1, "Camera set gain = %f\n", CAM_GAIN);
+    capture.set_gain(CAM_GAIN);
+
+
+    // kill old frames
+    for(unsigned int i=0 ; i<C_RINGNUM+1 ; i++) {
+      capture.grab();
+    }
 
-  // kill old frames
-  for(unsigned int i=0 ; i<C_RINGNUM+1 ; i++) {
-    capture.grab();
+    // the device properties cannot be queried once the capture thread runs
+    desc = capture.to_string();
   }
 
-  // set up the server which accepts only ONE client (= sync server)
+  PFCMU::FrameStore store(DEPTH);
+  WorkerPool pool(THREADS);
+  PFCMU::EncodeCache cache(pool, JPEG_QUALITY);
+
+  server_t srv;
+  srv.store = &store;
+  srv.cache = &cache;
+  srv.player = player.get();
+  srv.hello = desc.substr(0, desc.find('\n'));
+  srv.frame_inc = FRAME_INC;
+  srv.debug = DEBUG_MODE;
+  srv.clients = 0;
+
+  TRACE(1, "Encoding threads = %d\n", pool.size());
+  boost::function<void ()> source;
+  if(player) {
+    source = boost::bind(playback_loop, player.get(), &store, &cache);
+  } else if(SYNTHETIC_W > 0) {
+    source = boost::bind(synthetic_loop, SYNTHETIC_W, SYNTHETIC_H, FPS, FRAME_INC, CORRECT ? &corrector : NULL, &store, &cache);
+  } else {
+    source = boost::bind(capture_loop, &capture, CORRECT ? &corrector : NULL, &store, &cache);
+  }
+  boost::thread capture_thread(source);
+
+  boost::scoped_ptr<PFCMU::mcast::Publisher> publisher;
+  boost::thread mcast_thread;
+  if(MCAST_PORT > 0) {
+    publisher.reset(new PFCMU::mcast::Publisher(MCAST_GROUP.c_str(),
+                                                MCAST_PORT,
+                                                parameter_map.count("mcast_if") ? parameter_map["mcast_if"].as<std::string>().c_str() : NULL,
+                                                parameter_map["mcast_ttl"].as<unsigned int>(),
+                                                parameter_map["mcast_mtu"].as<unsigned int>(),
+                                                parameter_map["mcast_fec"].as<unsigned int>()));
+    mcast_thread = boost::thread(boost::bind(mcast_loop, publisher.get(), &srv,
+                                             std::max(1u, parameter_map["mcast_interval"].as<unsigned int>()),
+                                             MCAST_CAMERAS));
+    TRACE(1, "Multicast to %s:%d\n", MCAST_GROUP.c_str(), MCAST_PORT);
+  }
 
+  // set up the server which serves each client by a thread
   try {
-    using boost::asio::ip::tcp;
     boost::asio::io_service io_service;
 
     tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), PORT));
 
     TRACE(1, "Server is ready at port %d\n", PORT);
-std::cout << "Server is Ready" << std::endl;
-
 
     for (;;) {
-      tcp::iostream stream;
-      acceptor.accept(*stream.rdbuf());
-      // send the first msg
-std::string str = capture.to_string();
-      stream << std::string("100 ") + capture.to_string() + "\n";
-//std::cout << std::string("100 ") + capture.to_string() << std::endl;	//hao
-std::cout << std::string("100 ") + str << std::endl;
-
-      // receive inputs
-      for(std::string line ; std::getline(stream, line) ; ) {
-        if(DEBUG_MODE) {
-          fprintf(stderr, "line len=%zd :", line.length());
-          for(unsigned int i=0 ; i<line.length() ; i++) {
-            fprintf(stderr, " %02x", (unsigned char)(line[i]));
-
-          }
-          fprintf(stderr, "\n");
-        }
-
-
-        // skip if empty
-        if(line.empty() || line[0] == '\r') {
-          continue;
-        }
-
-
-        // parse the command
-        std::istringstream iss(line);
-        std::string cmd;
-        iss >> cmd;
-        if(cmd == "BYE") {
-          TRACE(1, "BYE");
-          break;
-        } else if(cmd == "PGM") {
-          int camid = 0;
-          iss >> camid;
-          if(camid < 0 || camid >= 24) {
-            camid = 0;
-          }
-          TRACE(1, "PGM CAMID=%d\n", camid);
-
-          stream << "P5\n"
-                 << capture.width() << "\n" << capture.height() << "\n"
-                 << "255\n"
-                 << std::flush;
-std::cout << "P5\n"<<capture.width() << "\n" << capture.height() << "\n" << "255\n"<<std::flush;
-          PF_EZImage * img = capture.grab();
-          PFCMU::embed_timestamp(img);
-          TRACE(1, "Sending CAM%02d, TS=%llu\n", camid, PFCMU::get_timestamp(img->imageArray[camid]));
-          stream.write(reinterpret_cast<const char *>(img->imageArray[camid]), MEMSIZE);
-std::cout << "sended" <<std::endl;
-        } else {
-          TRACE(1, "unknown command = '%s'\n", line.c_str());
-        }
-      }
+      boost::shared_ptr<tcp::iostream> stream(new tcp::iostream);
+      acceptor.accept(*(stream->rdbuf()));
+      TRACE(1, "Client connected\n");
+      boost::thread t(boost::bind(serve, stream, &srv));
+      t.detach();
     }
   } catch (std::exception& e) {
     std::cerr << e.what() << std::endl;
   }
 
-  capture.stop();
+  store.close();
+  if(player) {
+    player->close();
+  }
+  capture_thread.join();
+  mcast_thread.join();
+  if(LIVE) {
+    capture.stop();
+  }
 
   return 0;
 
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   takevol.cc
+ *
+ * @brief  Format a volume, and list, delete or recover its takes
+ *
+ * A volume (see take_volume.h) is a block device dedicated to capture,
+ * or a preallocated file for testing.  capture --out DEVICE#TAKE records
+ * a take, and DEVICE#TAKE can be read wherever a recording is read.
+ *
+ * A take left open by a crash of capture is recovered by scanning the
+ * framecounts from its beginning; the take ends at the first frame whose
+ * framecount does not increase by 1 to --max_gap from the previous one.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "take_volume.h"
+#include "boost_opt_util.h"
+#include "pfcmu_config.h"
+#include "stringf.h"
+#include "trace.h"
+
+namespace {
+  void list(const PFCMU::TakeVolume & volume) {
+    const std::vector<PFCMU::TakeVolume::take_t> & takes = volume.takes();
+    printf("%s: %.1f GB, %zd takes\n", volume.device().c_str(), volume.bytes() / 1e9, takes.size());
+    for(unsigned int i=0 ; i<takes.size() ; i++) {
+      const PFCMU::TakeVolume::take_t & t = takes[i];
+      char created[64];
+      strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&t.created));
+      if(t.open) {
+        printf("  %-16s %s  at %8.1f GB  OPEN (recording, or crashed)\n", t.name.c_str(), created, t.offset / 1e9);
+      } else {
+        printf("  %-16s %s  at %8.1f GB  %8lld frames  %8.1f GB\n", t.name.c_str(), created, t.offset / 1e9,
+               (long long)t.frames, t.frames * (double)t.blocksize / 1e9);
+      }
+    }
+    const off64_t rest = volume.bytes() - volume.next_offset();
+    printf("  (free)  %.1f GB at the end%s\n", std::max((off64_t)0, rest) / 1e9,
+           ! takes.empty() && takes.back().open ? ", after the open take is closed" : "");
+  }
+
+  /**
+   * @return num of frames recorded in the take
+   */
+  off64_t scan(const PFCMU::TakeVolume & volume, int index, PFCMU::timestamp_t max_gap) {
+    const PFCMU::TakeVolume::take_t & t = volume.takes()[index];
+    const int fd = open64(volume.device().c_str(), O_RDONLY|O_LARGEFILE);
+    if(fd < 0) {
+      perror("open64");
+      DIE(1, "Cannot open %s\n", volume.device().c_str());
+    }
+
+    const off64_t capacity = volume.capacity(index);
+    PFCMU::timestamp_t prev = 0;
+    off64_t i;
+    for(i=0 ; i<capacity ; i++) {
+      uint32_t v;
+      if(sizeof(v) != pread64(fd, &v, sizeof(v), t.offset + i * (off64_t)t.blocksize)) {
+        break;
+      }
+      const PFCMU::timestamp_t fc = PFCMU::get_timestamp(&v);
+      if(i > 0 && (fc <= prev || fc - prev > max_gap)) {
+        break;
+      }
+      prev = fc;
+    }
+    close(fd);
+    return i;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  boost::program_options::options_description cmdline("Command line options");
+  cmdline.add_options()
+    ("help,h", "show help message")
+    ("volume,v",
+     boost::program_options::value<std::string>(),
+     "[MANDATORY] Block device (/dev/sdb) or preallocated file of the volume")
+    ("format", "Create an empty take directory on the volume. ALL THE TAKES ARE LOST")
+    ("size",
+     boost::program_options::value<double>()->default_value(0),
+     "With --format, preallocate the volume file to this size (GB), for testing without a block device")
+    ("delete",
+     boost::program_options::value<std::string>(),
+     "Delete the take (the space is reused only if it is the last take)")
+    ("recover",
+     boost::program_options::value<std::string>(),
+     "Close the take left open by a crash of capture, with the frames found by scanning the framecounts")
+    ("max_gap",
+     boost::program_options::value<unsigned int>()->default_value(1000),
+     "Max increase of the framecount between consecutive frames of a take, for --recover")
+    ;
+
+  boost::program_options::variables_map parameter_map = boost_opt_check(cmdline, argc, argv);
+
+  const std::string VOLUME = boost_opt_string(parameter_map, "volume");
+  const double SIZE_GB = parameter_map["size"].as<double>();
+  const std::string DELETE = boost_opt_string(parameter_map, "delete");
+  const std::string RECOVER = boost_opt_string(parameter_map, "recover");
+  const unsigned int MAX_GAP = parameter_map["max_gap"].as<unsigned int>();
+
+  PFCMU::TakeVolume volume;
+
+  if(parameter_map.count("format")) {
+    if(SIZE_GB > 0) {
+      const int fd = open64(VOLUME.c_str(), O_CREAT|O_WRONLY|O_LARGEFILE, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+      if(fd < 0 || 0 != posix_fallocate64(fd, 0, (off64_t)(SIZE_GB * 1e9))) {
+        perror("posix_fallocate64");
+        DIE(1, "Cannot preallocate %s\n", VOLUME.c_str());
+      }
+      close(fd);
+    }
+    if(0 != volume.format(VOLUME.c_str())) {
+      perror("format");
+      DIE(1, "Cannot format %s (at least %lld bytes are required)\n", VOLUME.c_str(),
+          (long long)(PFCMU::TakeVolume::DATA_OFFSET + PFCMU::TakeVolume::DATA_ALIGN));
+    }
+  } else if(0 != volume.load(VOLUME.c_str())) {
+    DIE(1, "%s is not a volume (see --format)\n", VOLUME.c_str());
+  }
+
+  if(! DELETE.empty()) {
+    const int t = volume.find(DELETE);
+    if(t < 0) {
+      DIE(1, "No take %s in %s\n", DELETE.c_str(), VOLUME.c_str());
+    }
+    if(volume.takes()[t].open) {
+      fprintf(stderr, "WARNING: %s is open. Deleting it while capture is recording corrupts the directory.\n", DELETE.c_str());
+    }
+    if(0 != volume.remove(t)) {
+      perror("remove");
+      DIE(1, "Cannot write the directory of %s\n", VOLUME.c_str());
+    }
+  }
+
+  if(! RECOVER.empty()) {
+    const int t = volume.find(RECOVER);
+    if(t < 0) {
+      DIE(1, "No take %s in %s\n", RECOVER.c_str(), VOLUME.c_str());
+    }
+    if(! volume.takes()[t].open) {
+      DIE(1, "%s is not open\n", RECOVER.c_str());
+    }
+    const off64_t frames = scan(volume, t, MAX_GAP);
+    if(0 != volume.end_take(t, frames)) {
+      perror("end_take");
+      DIE(1, "Cannot write the directory of %s\n", VOLUME.c_str());
+    }
+    fprintf(stderr, "%s: recovered %lld frames\n", RECOVER.c_str(), (long long)frames);
+  }
+
+  list(volume);
+
+  return 0;
+}
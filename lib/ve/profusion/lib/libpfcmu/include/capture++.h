@@ -99,6 +99,15 @@ namespace PFCMU {
       return PFCMU::get_timestamp(m_image->imageArray[idx]);
     }
 
+    /**
+     * All the images given by the last grab(), without copying.
+     *
+     * @return memsize() bytes valid until the next grab()
+     */
+    const void * frame() const {
+      return m_image->imageArray[0];
+    }
+
     /**
      * Copy all the images given by the last grab().
      *
@@ -246,6 +255,22 @@ namespace PFCMU {
     unsigned int m_cue_depth;
     int m_cue_curr;
   };
+
+  /**
+   * Thumbnail of CAMS Bayer images with downsample debayer, the same
+   * layout as Capture::copy_thumb().
+   *
+   * Each camera is downsampled to (width/5)x(height/5) and placed
+   * in 5 columns.
+   *
+   * @param buf [out] width*height*3 bytes array to be written
+   * @param widthStep [in] width step of buf
+   * @param images [in] CAMS Bayer images
+   * @param width [in] width of each image
+   * @param height [in] height of each image
+   * @param src_widthStep [in] width step of images
+   */
+  void make_thumb(void * buf, int widthStep, const unsigned char * const * images, int width, int height, int src_widthStep);
 }
 
 #endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   checksum.h
+ *
+ * @brief  CRC32C of each camera image, and the sidecar index of a recording
+ *
+ * The sidecar (out.dat.crc) has a header_t followed by a record per frame
+ * index of the recording, at a fixed position.  A record has the
+ * framecount and the CRC32C of each camera image, and the CRC32C of the
+ * record itself, so that the frames never written (e.g., dropped) and a
+ * corrupted sidecar are told apart from the corrupted frames.  The
+ * integers are in little endian.
+ */
+#ifndef PFCMU_CHECKSUM_H
+#define PFCMU_CHECKSUM_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "pfcmu_config.h"
+
+namespace PFCMU {
+  namespace checksum {
+    /**
+     * CRC32C (Castagnoli), by the SSE4.2 instruction if available
+     *
+     * @param buf [in] data
+     * @param bytes [in] bytes of buf
+     * @param crc [in] CRC32C of the preceding data, to continue
+     * @return CRC32C of the data
+     */
+    uint32_t crc32c(const void * buf, size_t bytes, uint32_t crc = 0);
+
+    /**
+     * @return true if crc32c() uses the SSE4.2 instruction
+     */
+    bool hardware();
+
+    struct header_t {
+      static const size_t SIZE = 32;
+      uint32_t cams;
+      uint32_t width;
+      uint32_t height;
+    };
+
+    struct record_t {
+      static const size_t SIZE = (2 + PFCMU::CAMS) * 4;
+      timestamp_t framecount;
+      uint32_t crc[PFCMU::CAMS];
+    };
+
+    /**
+     * CRC32C of each camera image of a frame (cams * width * height bytes)
+     */
+    void compute(const void * frame, int width, int height, record_t * r);
+
+    /**
+     * @return the sidecar filename of a recording
+     */
+    inline std::string sidecar(const std::string & filename) {
+      return filename + ".crc";
+    }
+
+    /**
+     * Writer of a sidecar, the records can be put in any order
+     */
+    class index_writer_t {
+    public:
+      index_writer_t();
+      ~index_writer_t();
+
+      /**
+       * Create the sidecar (aborts on error)
+       */
+      void open(const char * filename, int width, int height);
+
+      /**
+       * @return 0 on success, negative on error
+       */
+      int put(off64_t index, const record_t & r);
+
+      /**
+       * fsync and close
+       */
+      void close();
+
+      bool is_open() const {
+        return m_fd >= 0;
+      }
+
+    private:
+      index_writer_t(const index_writer_t &); // to disable "object copy"
+
+      int m_fd;
+    };
+
+    /**
+     * Reader of a sidecar, thread-safe (pread)
+     */
+    class index_reader_t {
+    public:
+      enum status_t {
+        VALID,
+        /// not written, or the record is corrupted
+        MISSING,
+      };
+
+      index_reader_t();
+      ~index_reader_t();
+
+      /**
+       * @return 0 on success, negative if not a sidecar
+       */
+      int open(const char * filename);
+
+      const header_t & header() const {
+        return m_header;
+      }
+
+      /**
+       * @return num of the records
+       */
+      off64_t size() const {
+        return m_size;
+      }
+
+      status_t get(off64_t index, record_t * r) const;
+
+    private:
+      index_reader_t(const index_reader_t &); // to disable "object copy"
+
+      int m_fd;
+      header_t m_header;
+      off64_t m_size;
+    };
+  }
+}
+
+#endif
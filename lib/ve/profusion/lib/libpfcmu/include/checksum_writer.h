@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   checksum_writer.h
+ *
+ * @brief  CRC32C of each camera image on a worker thread before writing
+ *
+ * write() only queues the slot; a worker thread computes the CRC32C of
+ * the images in the slot buffer, puts them into the sidecar (see
+ * checksum.h), and then queues the slot to the writer.  The checksums are
+ * of the data as given to the disk, and the capture thread does not wait
+ * for them unless all the slots of the writer are queued to the worker.
+ */
+#ifndef PFCMU_CHECKSUM_WRITER_H
+#define PFCMU_CHECKSUM_WRITER_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "linux_aio.h"
+#include "checksum.h"
+
+namespace PFCMU {
+  namespace libaio {
+    class checksum_writer_t : public writer_base_t {
+    public:
+      struct stat_t {
+        /// frames checksummed
+        unsigned long long frames;
+        /// frames queued to the worker now
+        unsigned int backlog;
+        /// max of backlog
+        unsigned int max_backlog;
+        /// time of computing the checksums of a frame
+        unsigned long long total_usec;
+        unsigned long long max_usec;
+      };
+
+      checksum_writer_t() : writer(NULL), width(0), height(0), running(false), stop(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&queued, NULL);
+        pthread_cond_init(&forwarded, NULL);
+        memset(&st, 0, sizeof(st));
+      }
+
+      ~checksum_writer_t() {
+        clean();
+        pthread_cond_destroy(&forwarded);
+        pthread_cond_destroy(&queued);
+        pthread_mutex_destroy(&mutex);
+      }
+
+      /**
+       * Checksum the queued frames, finish writing of the writer, and close the sidecar
+       */
+      void clean() {
+        if(running) {
+          pthread_mutex_lock(&mutex);
+          stop = true;
+          pthread_cond_signal(&queued);
+          pthread_mutex_unlock(&mutex);
+          pthread_join(worker, NULL);
+          running = false;
+        }
+
+        if(writer) {
+          writer->clean();
+          writer = NULL;
+        }
+        index.close();
+        queue.clear();
+      }
+
+      int is_initialized() const {
+        return writer ? writer->is_initialized() : 0;
+      }
+
+      /**
+       * @param writer [in] initialized writer (not owned)
+       * @param sidecar [in] filename of the sidecar
+       * @param width [in] width of a camera image
+       * @param height [in] height of a camera image
+       */
+      void init(writer_base_t * writer, const char * sidecar, int width, int height) {
+        clean();
+
+        this->writer = writer;
+        this->width = width;
+        this->height = height;
+        memset(&st, 0, sizeof(st));
+        index.open(sidecar, width, height);
+
+        stop = false;
+        if(0 != pthread_create(&worker, NULL, worker_main, this)) {
+          perror("pthread_create");
+          abort();
+        }
+        running = true;
+      }
+
+      slot_id_t get_available_slot_id() {
+        pthread_mutex_lock(&mutex);
+        slot_id_t id;
+        for(;;) {
+          id = writer->try_get_available_slot_id();
+          if(id >= 0 || id == WRITE_FAILED) {
+            break;
+          }
+          if(queue.empty()) {
+            // all the slots are being written, and the worker does not touch the writer until write()
+            id = writer->get_available_slot_id();
+            break;
+          }
+          pthread_cond_wait(&forwarded, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+        return id;
+      }
+
+      slot_id_t try_get_available_slot_id() {
+        pthread_mutex_lock(&mutex);
+        slot_id_t id = writer->try_get_available_slot_id();
+        pthread_mutex_unlock(&mutex);
+        return id;
+      }
+
+      byte_t * buf(slot_id_t id) {
+        return writer->buf(id);
+      }
+
+      int write(slot_id_t id, int index) {
+        pthread_mutex_lock(&mutex);
+        queue.push_back(std::make_pair(id, index));
+        st.max_backlog = std::max(st.max_backlog, (unsigned int)queue.size());
+        pthread_cond_signal(&queued);
+        pthread_mutex_unlock(&mutex);
+        return 0;
+      }
+
+      void stat(stat_t * s) {
+        pthread_mutex_lock(&mutex);
+        *s = st;
+        s->backlog = queue.size();
+        pthread_mutex_unlock(&mutex);
+      }
+
+    private:
+      checksum_writer_t(const checksum_writer_t &); // to disable "object copy"
+
+      static void * worker_main(void * arg) {
+        reinterpret_cast<checksum_writer_t *>(arg)->worker_loop();
+        return NULL;
+      }
+
+      /**
+       * Checksum and write the queued frames in order
+       */
+      void worker_loop() {
+        pthread_mutex_lock(&mutex);
+        for(;;) {
+          while(queue.empty() && ! stop) {
+            pthread_cond_wait(&queued, &mutex);
+          }
+          if(queue.empty()) {
+            break;
+          }
+
+          // the head stays in the queue until written, so that get_available_slot_id() does not block in the writer
+          const std::pair<slot_id_t, int> e = queue.front();
+          pthread_mutex_unlock(&mutex);
+
+          struct timeval t0, t1;
+          gettimeofday(&t0, NULL);
+          checksum::record_t r;
+          checksum::compute(writer->buf(e.first), width, height, &r);
+          if(0 != index.put(e.second, r)) {
+            perror("pwrite64");
+            fprintf(stderr, "Cannot write the checksums of frame %d.\n", e.second);
+            abort();
+          }
+          gettimeofday(&t1, NULL);
+          const unsigned long long usec = (t1.tv_sec - t0.tv_sec) * 1000000ULL + t1.tv_usec - t0.tv_usec;
+
+          pthread_mutex_lock(&mutex);
+          if(0 != writer->write(e.first, e.second)) {
+            fprintf(stderr, "write failed at %d\n", e.second);
+            abort();
+          }
+          queue.pop_front();
+          st.frames++;
+          st.total_usec += usec;
+          st.max_usec = std::max(st.max_usec, usec);
+          pthread_cond_signal(&forwarded);
+        }
+        pthread_mutex_unlock(&mutex);
+      }
+
+      writer_base_t * writer;
+      int width;
+      int height;
+      checksum::index_writer_t index;
+
+      pthread_t worker;
+      bool running;
+
+      // the following are guarded by mutex
+      bool stop;
+      std::deque<std::pair<slot_id_t, int> > queue;
+      stat_t st;
+
+      pthread_mutex_t mutex;
+      pthread_cond_t queued;
+      pthread_cond_t forwarded;
+    };
+  }
+}
+
+#endif
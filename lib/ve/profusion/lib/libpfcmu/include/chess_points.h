@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   chess_points.h
+ *
+ * @brief  Chessboard corners detected in a recording (.chs)
+ *
+ * A .chs is a header_t followed by the detections, each of which is a
+ * record_t and the rows*cols corners (x, y) in float, in the order of
+ * cvFindChessboardCorners.  Only the images where all the corners are
+ * found are recorded, so that a calibration can use the whole file.
+ * The num of the detections is written into the header when closed.
+ * All in little endian.
+ */
+#ifndef PFCMU_CHESS_POINTS_H
+#define PFCMU_CHESS_POINTS_H
+
+#include <cstdio>
+#include <vector>
+#include <stdint.h>
+
+#include "pfcmu_config.h"
+
+namespace PFCMU {
+  namespace chess_points {
+    struct header_t {
+      static const size_t SIZE = 64;
+
+      uint32_t cams;
+      uint32_t width;
+      uint32_t height;
+      /// corners of the chessboard
+      uint32_t rows;
+      uint32_t cols;
+      /// size of a square
+      float square;
+      uint64_t detections;
+
+      size_t corners() const {
+        return (size_t)rows * cols;
+      }
+    };
+
+    struct record_t {
+      /// frame index in the recording
+      int64_t frame;
+      /// framecount embedded in the image
+      uint32_t framecount;
+      int32_t camera;
+    };
+
+    struct set_t {
+      header_t header;
+      std::vector<record_t> records;
+      /// 2*corners() floats of each record
+      std::vector<float> points;
+
+      const float * points_of(size_t i) const {
+        return &points[2 * header.corners() * i];
+      }
+    };
+
+    /**
+     * @return 0 on success, negative if not a .chs
+     */
+    int load(const char * filename, set_t * set);
+
+    /**
+     * Append the detections to a .chs one by one
+     */
+    class writer_t {
+    public:
+      writer_t();
+      ~writer_t();
+
+      /**
+       * @return 0 on success, negative on error
+       */
+      int open(const char * filename, const header_t & header);
+
+      /**
+       * @param points [in] 2*corners() floats
+       * @return 0 on success, negative on error
+       */
+      int write(const record_t & record, const float * points);
+
+      /**
+       * Write the num of the detections into the header and close
+       *
+       * @return 0 on success, negative on error
+       */
+      int close();
+
+      uint64_t detections() const {
+        return m_header.detections;
+      }
+
+    private:
+      writer_t(const writer_t &); // to disable "object copy"
+
+      FILE * m_fp;
+      header_t m_header;
+    };
+  }
+}
+
+#endif
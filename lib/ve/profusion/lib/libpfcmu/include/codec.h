@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   codec.h
+ *
+ * @brief  Per-frame wire encodings of Bayer images for live streaming
+ *
+ * - raw  : the Bayer image as is (width*height bytes)
+ * - lz4  : the four Bayer planes (G, B, R, G) compressed by LZ4
+ * - lz4d : same as lz4, but the planes are the difference against
+ *          a reference frame of the same camera (lossless inter-frame)
+ * - jpeg : 2x2 downsampled RGB compressed by JPEG (lossy, for preview)
+ */
+#ifndef PFCMU_CODEC_H
+#define PFCMU_CODEC_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace PFCMU {
+  namespace codec {
+    typedef unsigned char byte_t;
+
+    enum encoding_t {
+      ENC_RAW = 0,
+      ENC_LZ4 = 1,
+      ENC_LZ4_DELTA = 2,
+      ENC_JPEG = 3,
+      ENC_NUM,
+    };
+
+    /**
+     * Name of the encoding used in the streaming protocol
+     *
+     * @param enc [in] encoding
+     * @return "raw", "lz4", "lz4d", "jpeg" or "unknown"
+     */
+    const char * to_string(encoding_t enc);
+
+    /**
+     * Parse the name of an encoding
+     *
+     * @param name [in] "raw", "lz4", "lz4d" or "jpeg"
+     * @param enc [out] encoding
+     * @return 0 on success, negative if unknown
+     */
+    int from_string(const std::string & name, encoding_t * enc);
+
+    /**
+     * Choose the first supported encoding from the list given by a client
+     *
+     * @param preferred [in] encoding names separated by spaces or commas, in the order of preference
+     * @param enc [out] chosen encoding
+     * @return 0 on success, negative if nothing is supported
+     */
+    int negotiate(const std::string & preferred, encoding_t * enc);
+
+    /**
+     * Test if the encoding needs a reference frame for decoding
+     */
+    inline bool is_inter(encoding_t enc) {
+      return enc == ENC_LZ4_DELTA;
+    }
+
+    /**
+     * Encode a single Bayer image
+     *
+     * @param enc [in] encoding
+     * @param img [in] Bayer image
+     * @param ref [in] reference frame of the same camera for ENC_LZ4_DELTA (NULL = intra, same as ENC_LZ4)
+     * @param width [in] width in pixels (must be even)
+     * @param height [in] height in pixels (must be even)
+     * @param widthStep [in] width step of img and ref
+     * @param quality [in] JPEG quality [0:100] (ignored by other encodings)
+     * @param out [out] encoded data
+     */
+    void encode(encoding_t enc,
+                const byte_t * img,
+                const byte_t * ref,
+                int width,
+                int height,
+                int widthStep,
+                int quality,
+                std::vector<byte_t> * out);
+
+    /**
+     * Compress an RGB image by JPEG (used for thumbnails and mosaics)
+     *
+     * @param rgb [in] R-G-B ordered image
+     * @param width [in] width in pixels
+     * @param height [in] height in pixels
+     * @param widthStep [in] bytes per row of rgb
+     * @param quality [in] JPEG quality [0:100]
+     * @param out [out] JPEG data
+     */
+    void encode_rgb_jpeg(const byte_t * rgb,
+                         int width,
+                         int height,
+                         int widthStep,
+                         int quality,
+                         std::vector<byte_t> * out);
+
+    /**
+     * Decode a raw/lz4/lz4d image into a Bayer image
+     *
+     * @param enc [in] encoding (must not be ENC_JPEG)
+     * @param in [in] encoded data
+     * @param len [in] bytes of in
+     * @param ref [in] reference frame used by the encoder (ENC_LZ4_DELTA only)
+     * @param width [in] width in pixels
+     * @param height [in] height in pixels
+     * @param out [out] width*height bytes (widthStep = width)
+     * @return 0 on success, negative on error
+     */
+    int decode_bayer(encoding_t enc,
+                     const byte_t * in,
+                     size_t len,
+                     const byte_t * ref,
+                     int width,
+                     int height,
+                     byte_t * out);
+
+    /**
+     * Decode a JPEG image into an RGB image
+     *
+     * @param in [in] encoded data
+     * @param len [in] bytes of in
+     * @param width [out] width of the decoded image
+     * @param height [out] height of the decoded image
+     * @param rgb [out] width*height*3 bytes, R-G-B order
+     * @return 0 on success, negative on error (e.g., corrupt or truncated data)
+     */
+    int decode_jpeg(const byte_t * in,
+                    size_t len,
+                    int * width,
+                    int * height,
+                    std::vector<byte_t> * rgb);
+  }
+}
+
+#endif
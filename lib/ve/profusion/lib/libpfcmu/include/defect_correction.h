@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   defect_correction.h
+ *
+ * @brief  Correction of the hot/dead pixels and the dark frame of the Bayer images
+ *
+ * The defects are given by a .hpx of the hotpixel (cam, x, y per line)
+ * or by the flags of a .pxs of the pixstat (see pixel_stats.h), which
+ * can also give the dark frame to be subtracted.
+ *
+ * The dark frame is subtracted by SSE2 or AVX2 with saturation.  Each
+ * defect is then replaced by the mean of the same-colour neighbours,
+ * i.e., the pixels 2 apart in the Bayer pattern, which are not
+ * defects.  The neighbours of the defects are found when loaded, and
+ * the correction visits the sorted list of the defects only, so that
+ * the cost is proportional to the num of defects.
+ *
+ * The first 4 bytes of each image, where the framecount is embedded,
+ * are never changed nor used as a neighbour.
+ */
+#ifndef PFCMU_DEFECT_CORRECTION_H
+#define PFCMU_DEFECT_CORRECTION_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "image_filter.h"
+#include "pixel_stats.h"
+#include "pfcmu_config.h"
+
+namespace PFCMU {
+  class DefectCorrector : public ImageFilter {
+  public:
+    enum dark_t {
+      /// the dark frame of a .pxs is not used
+      DARK_NONE,
+      /// subtract the fixed pattern noise, i.e., keep the black level of the camera
+      DARK_FPN,
+      /// subtract the whole dark frame
+      DARK_FULL,
+    };
+
+    /**
+     * Parse the name of a dark_t
+     *
+     * @param name [in] "none", "fpn" or "full"
+     * @param dark [out] dark_t
+     * @return 0 on success, negative if unknown
+     */
+    static int dark_from_string(const std::string & name, dark_t * dark);
+
+    DefectCorrector();
+
+    /**
+     * @param width [in] width of a camera image
+     * @param height [in] height of a camera image
+     */
+    void init(int width, int height);
+
+    /**
+     * Add the defects (and the dark frame) of a .hpx or a .pxs
+     *
+     * @param filename [in] .hpx or .pxs (distinguished by the content)
+     * @param dark [in] the dark frame of a .pxs to be subtracted
+     * @param flags [in] pixel_stats::HOT, DEAD and/or STUCK of a .pxs to be corrected
+     * @return num of the defects added, or negative on error
+     */
+    int load(const char * filename, dark_t dark = DARK_FPN,
+             int flags = pixel_stats::HOT | pixel_stats::DEAD | pixel_stats::STUCK);
+
+    /**
+     * Add a defect.  Call done() after adding all the defects.
+     */
+    void add(int camera, int x, int y);
+
+    /**
+     * Sort the defects and find their neighbours.  Called by load().
+     */
+    void done();
+
+    /**
+     * @return num of the defects of the camera
+     */
+    size_t defects(int camera) const {
+      return m_defects[camera].size();
+    }
+
+    /**
+     * @return num of the defects of the camera without any neighbours
+     *         (left as they are)
+     */
+    size_t isolated(int camera) const;
+
+    /**
+     * @return true if a dark frame is subtracted
+     */
+    bool has_dark() const {
+      return ! m_dark_pos.empty();
+    }
+
+    virtual void apply(unsigned char * image, int camera) const;
+
+    /**
+     * Correct all the CAMS images of a frame, as given by
+     * Capture::frame() or RAWFile::read()
+     */
+    void correct(void * frame) const {
+      apply_frame(frame, (size_t)m_width * m_height);
+    }
+
+    /**
+     * @return true if the AVX2 kernel is used
+     */
+    static bool avx2();
+
+  private:
+    DefectCorrector(const DefectCorrector &); // to disable "object copy"
+
+    int load_hpx(const char * filename);
+    int load_pxs(const char * filename, dark_t dark, int flags);
+    void subtract_dark(unsigned char * image, int camera) const;
+
+    struct defect_t {
+      /// y * width + x
+      uint32_t index;
+      /// bit i = m_offsets[i] is a neighbour
+      uint8_t neighbours;
+
+      bool operator < (const defect_t & d) const {
+        return index < d.index;
+      }
+    };
+
+    int m_width;
+    int m_height;
+    /// offsets of the same-colour neighbours, 4 axial and then 4 diagonal
+    int m_offsets[8];
+    std::vector<defect_t> m_defects[PFCMU::CAMS];
+    /// dark frame split into the positive and the negative parts (empty if none)
+    std::vector<uint8_t> m_dark_pos;
+    std::vector<uint8_t> m_dark_neg;
+  };
+}
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   flight_recorder.h
+ *
+ * @brief  Pre-trigger recording of the last frames kept in RAM
+ *
+ * Every frame is copied into a circular buffer holding the last `pre`
+ * frames (and `slack` more).  When trigger() is called, the frames
+ * before the trigger and the following `post` frames are flushed to a
+ * writer by a background thread, while the capture thread keeps filling
+ * the ring.  The capture thread never waits: it only publishes its
+ * position, and the flush thread follows it.
+ *
+ * The ring is backed by huge pages if available, pre-faulted and locked.
+ * If the flush cannot catch up and the ring is full of frames not yet
+ * written, the new frames are discarded (counted as overrun); the gap
+ * can be found by the embedded framecount like the frame drops.
+ */
+#ifndef PFCMU_FLIGHT_RECORDER_H
+#define PFCMU_FLIGHT_RECORDER_H
+
+#include <cstdio>
+#include <cstring>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pfcmu_config.h"
+#include "trace.h"
+#include "linux_aio.h"
+
+namespace PFCMU {
+  class FlightRecorder {
+  public:
+    typedef libaio::byte_t byte_t;
+
+    enum state_t {
+      /// keeping the last frames
+      ARMED,
+      /// triggered, recording the following frames
+      RECORDING,
+      /// all the frames are given, flushing the rest
+      DONE,
+    };
+
+    struct stat_t {
+      /// frames before the trigger in the recording
+      unsigned int pre;
+      /// frames written to the writer
+      unsigned long long flushed;
+      /// frames in the ring not yet written
+      unsigned int backlog;
+      /// max of backlog
+      unsigned int max_backlog;
+      /// frames discarded since the ring was full
+      unsigned long long overrun;
+      /// framecount of the trigger frame
+      timestamp_t trigger_framecount;
+    };
+
+    FlightRecorder() : m_ring(MAP_FAILED), m_ring_bytes(0), m_hugepage(false), m_slots(0), m_blocksize(0), m_pre(0), m_post(0),
+                       m_writer(NULL), m_running(false), m_trigger(0), m_state(ARMED), m_head(0), m_tail(0), m_begin(0),
+                       m_pre_frames(0), m_post_count(0), m_drop(false), m_overrun(0), m_max_backlog(0), m_trigger_framecount(0) {
+    }
+
+    ~FlightRecorder() {
+      finish();
+      if(m_ring != MAP_FAILED) {
+        munlock(m_ring, m_ring_bytes);
+        munmap(m_ring, m_ring_bytes);
+      }
+    }
+
+    /**
+     * Allocate the ring and start the flush thread
+     *
+     * @param blocksize [in] bytes of a frame
+     * @param pre [in] num of frames kept before the trigger
+     * @param post [in] num of frames recorded after the trigger (including the trigger frame)
+     * @param slack [in] num of extra frames in the ring for the backlog after the trigger
+     * @param writer [in] initialized writer (not owned), only used by the flush thread
+     */
+    void init(size_t blocksize, int pre, int post, int slack, libaio::writer_base_t * writer) {
+      ASSERT(m_ring == MAP_FAILED, "FlightRecorder::init() is called twice\n");
+      ASSERT(pre >= 0 && post > 0 && slack >= 0);
+
+      m_blocksize = blocksize;
+      m_pre = pre;
+      m_post = post;
+      m_writer = writer;
+      // +1 for the trigger frame, +1 for the frames discarded by overrun
+      m_slots = pre + slack + 1;
+      m_ring_bytes = blocksize * (m_slots + 1);
+
+      // huge pages reduce the TLB misses of copying GBs, but they have to be reserved (/proc/sys/vm/nr_hugepages)
+      const size_t HUGEPAGE_BYTES = 2 << 20;
+      const size_t huge_bytes = (m_ring_bytes + HUGEPAGE_BYTES - 1) / HUGEPAGE_BYTES * HUGEPAGE_BYTES;
+      m_ring = mmap(NULL, huge_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE|MAP_HUGETLB, -1, 0);
+      if(m_ring != MAP_FAILED) {
+        m_ring_bytes = huge_bytes;
+        m_hugepage = true;
+      } else {
+        m_ring = mmap(NULL, m_ring_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+        if(m_ring == MAP_FAILED) {
+          perror("mmap");
+          DIE(1, "Cannot allocate %zd bytes for the flight recorder. Please check the available memory.\n", m_ring_bytes);
+        }
+        // transparent huge pages, if enabled
+        madvise(m_ring, m_ring_bytes, MADV_HUGEPAGE);
+        m_hugepage = false;
+      }
+      if(0 != mlock(m_ring, m_ring_bytes)) {
+        perror("mlock");
+        fprintf(stderr, "WARNING: Cannot lock %zd bytes of the flight recorder. Please check ulimit -l.\n", m_ring_bytes);
+      }
+
+      if(0 != pthread_create(&m_thread, NULL, flush_main, this)) {
+        DIE(1, "pthread_create failed\n");
+      }
+      m_running = true;
+    }
+
+    /**
+     * Request the recording, async-signal-safe
+     */
+    void trigger() {
+      m_trigger = 1;
+    }
+
+    /**
+     * Buffer for the next frame (capture thread only)
+     *
+     * @return pointer to fill the frame of blocksize bytes, then call commit()
+     */
+    byte_t * next() {
+      const int state = load(&m_state);
+      if(state == DONE || (state == RECORDING && m_head - load(&m_tail) >= m_slots)) {
+        // the flush thread has not written the oldest one yet
+        m_drop = true;
+        return slot(m_slots);
+      }
+      m_drop = false;
+      return slot(m_head % m_slots);
+    }
+
+    /**
+     * Publish the frame filled via next() (capture thread only)
+     *
+     * @return 1 if this frame triggered the recording, 0 otherwise
+     */
+    int commit() {
+      const int state = load(&m_state);
+      if(state == DONE) {
+        return 0;
+      }
+
+      int triggered = 0;
+      if(state == ARMED) {
+        if(! m_trigger) {
+          store(&m_head, m_head + 1);
+          return 0;
+        }
+        // the trigger frame is the first of the post frames
+        m_begin = m_head > m_pre ? m_head - m_pre : 0;
+        m_pre_frames = m_head - m_begin;
+        m_trigger_framecount = get_timestamp(slot(m_head % m_slots));
+        store(&m_tail, m_begin);
+        store(&m_state, (int)RECORDING);
+        triggered = 1;
+      }
+
+      if(m_drop) {
+        m_overrun++;
+      } else {
+        store(&m_head, m_head + 1);
+        const unsigned long long backlog = m_head - load(&m_tail);
+        if(backlog > m_max_backlog) {
+          m_max_backlog = backlog;
+        }
+      }
+
+      if(++m_post_count >= m_post) {
+        store(&m_state, (int)DONE);
+      }
+      return triggered;
+    }
+
+    int is_initialized() const {
+      return m_ring != MAP_FAILED;
+    }
+
+    bool hugepage() const {
+      return m_hugepage;
+    }
+
+    state_t state() const {
+      return (state_t)load(&m_state);
+    }
+
+    /**
+     * Wait until all the frames are written to the writer (capture thread only)
+     *
+     * The writer is not cleaned (call its clean() to wait for the disk).
+     * If not triggered yet, nothing is written.
+     */
+    void finish() {
+      if(m_running) {
+        if(load(&m_state) == ARMED) {
+          m_begin = m_head;
+          store(&m_tail, m_head);
+        }
+        store(&m_state, (int)DONE);
+        pthread_join(m_thread, NULL);
+        m_running = false;
+      }
+    }
+
+    /**
+     * @return num of frames given to the writer so far
+     */
+    unsigned long long frames() const {
+      return load(&m_tail) - m_begin;
+    }
+
+    /**
+     * Statistics, can be called from the capture thread
+     */
+    void stat(stat_t * st) const {
+      const int state = load(&m_state);
+      const unsigned long long tail = load(&m_tail);
+      st->pre = m_pre_frames;
+      st->flushed = state == ARMED ? 0 : tail - m_begin;
+      st->backlog = state == ARMED ? 0 : m_head - tail;
+      st->max_backlog = m_max_backlog;
+      st->overrun = m_overrun;
+      st->trigger_framecount = m_trigger_framecount;
+    }
+
+  private:
+    FlightRecorder(const FlightRecorder &); // to disable "object copy"
+
+    /// interval of polling the capture thread
+    static const int POLL_USEC = 1000;
+
+    static unsigned long long load(const volatile unsigned long long * p) {
+      return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+    static int load(const volatile int * p) {
+      return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+    static void store(volatile unsigned long long * p, unsigned long long v) {
+      __atomic_store_n(p, v, __ATOMIC_RELEASE);
+    }
+    static void store(volatile int * p, int v) {
+      __atomic_store_n(p, v, __ATOMIC_RELEASE);
+    }
+
+    byte_t * slot(unsigned long long k) {
+      return reinterpret_cast<byte_t *>(m_ring) + m_blocksize * k;
+    }
+
+    static void * flush_main(void * arg) {
+      reinterpret_cast<FlightRecorder *>(arg)->flush_loop();
+      return NULL;
+    }
+
+    /**
+     * Write the frames [m_tail, m_head) in order, until DONE
+     */
+    void flush_loop() {
+      int index = 0;
+      for(;;) {
+        const int state = load(&m_state);
+        const unsigned long long head = load(&m_head);
+        unsigned long long tail = load(&m_tail);
+
+        if(state == ARMED || tail >= head) {
+          if(state == DONE && tail >= load(&m_head)) {
+            break;
+          }
+          usleep(POLL_USEC);
+          continue;
+        }
+
+        for( ; tail < head ; tail++) {
+          libaio::slot_id_t id = m_writer->get_available_slot_id();
+          if(id < 0) {
+            DIE(1, "write failed before %d\n", index);
+          }
+          memcpy(m_writer->buf(id), slot(tail % m_slots), m_blocksize);
+          if(0 != m_writer->write(id, index++)) {
+            DIE(1, "write failed at %d\n", index - 1);
+          }
+          // the slot can be reused by the capture thread
+          store(&m_tail, tail + 1);
+        }
+      }
+    }
+
+    void * m_ring;
+    size_t m_ring_bytes;
+    bool m_hugepage;
+    unsigned long long m_slots;
+    size_t m_blocksize;
+    unsigned int m_pre;
+    unsigned int m_post;
+    libaio::writer_base_t * m_writer;
+
+    pthread_t m_thread;
+    bool m_running;
+
+    volatile sig_atomic_t m_trigger;
+
+    // shared by the capture thread (writes) and the flush thread (reads)
+    volatile int m_state;
+    volatile unsigned long long m_head;
+    // written by the flush thread after the trigger
+    volatile unsigned long long m_tail;
+
+    // the following are for the capture thread
+    unsigned long long m_begin;
+    unsigned int m_pre_frames;
+    unsigned int m_post_count;
+    bool m_drop;
+    unsigned long long m_overrun;
+    unsigned long long m_max_backlog;
+    timestamp_t m_trigger_framecount;
+  };
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   hotpixel.h
+ *
+ * @brief  Detection of the hot (stuck) pixels of all the cameras
+ *
+ * A pixel is hot if it never changes by more than the threshold between
+ * the frames fed, e.g., the frames of a live capture or every k-th frame
+ * of a recording with something moving in front of the cameras.  The
+ * frames are compared by SSE2 or AVX2 kernels, a camera per thread.
+ *
+ * The result is saved as .hpx, a line "CAMERA\tX\tY" per hot pixel.
+ */
+#ifndef PFCMU_HOTPIXEL_H
+#define PFCMU_HOTPIXEL_H
+
+#include <ostream>
+#include <vector>
+
+#include "pfcmu_config.h"
+
+class WorkerPool;
+
+namespace PFCMU {
+  class HotPixelDetector {
+  public:
+    HotPixelDetector();
+    ~HotPixelDetector();
+
+    /**
+     * @param width [in] width of a camera image
+     * @param height [in] height of a camera image
+     * @param threshold [in] max change of a hot pixel between the frames
+     * @param threads [in] num of threads (0 = num of CPUs)
+     */
+    void init(int width, int height, int threshold, int threads = 0);
+
+    /**
+     * Compare a frame with the previous one
+     *
+     * @param frame [in] CAMS images of width*height bytes, as given by
+     *                   Capture::frame() or RAWFile::read()
+     */
+    void feed(const void * frame);
+
+    /**
+     * @return num of the frames fed
+     */
+    unsigned long long frames() const {
+      return m_frames;
+    }
+
+    /**
+     * @return width*height bytes, 255 if hot, 0 otherwise
+     */
+    const unsigned char * mask(int camera) const {
+      return &m_mask[(size_t)m_width * m_height * camera];
+    }
+
+    /**
+     * @return the image of the camera in the last frame fed
+     */
+    const unsigned char * previous(int camera) const {
+      return &m_prev[(size_t)m_width * m_height * camera];
+    }
+
+    /**
+     * @return num of the hot pixels of the camera
+     */
+    int count(int camera) const;
+
+    /**
+     * Write the hot pixels in .hpx format
+     */
+    void save_hpx(std::ostream & os) const;
+
+    /**
+     * @return true if the AVX2 kernel is used
+     */
+    static bool avx2();
+
+  private:
+    HotPixelDetector(const HotPixelDetector &); // to disable "object copy"
+
+    void compare(const unsigned char * frame, int camera);
+
+    int m_width;
+    int m_height;
+    int m_threshold;
+    unsigned long long m_frames;
+    std::vector<unsigned char> m_mask;
+    std::vector<unsigned char> m_prev;
+    WorkerPool * m_pool;
+  };
+}
+
+#endif
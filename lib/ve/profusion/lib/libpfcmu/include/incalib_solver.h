@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   incalib_solver.h
+ *
+ * @brief  Intrinsic calibration of a camera by chessboards
+ *
+ * The same model as cvCalibrateCamera2 with CV_CALIB_FIX_ASPECT_RATIO
+ * of incalib_gui, i.e., a focal length f = fx = fy, the principal
+ * point, and k1, k2, p1, p2 of lens_t (lens_model.h), and the rotation
+ * and the translation of each view of the chessboard.
+ *
+ * solve() minimizes the reprojection error by Levenberg-Marquardt with
+ * the analytic Jacobians.  The normal equations are reduced into the 7
+ * intrinsic parameters by the Schur complement of the 6x6 blocks of the
+ * views, and the blocks are computed in parallel over the views by the
+ * threads of init().
+ *
+ * The views can be added after solve(), and the next solve() starts
+ * from the current parameters, so that the calibration is refined
+ * incrementally while the chessboards are captured.  The first solve()
+ * initializes f by the homographies of the views as Zhang's method with
+ * the principal point at the centre of the image, and each new view is
+ * placed by its homography of the undistorted points.
+ */
+#ifndef PFCMU_INCALIB_SOLVER_H
+#define PFCMU_INCALIB_SOLVER_H
+
+#include <vector>
+
+#include "lens_model.h"
+#include "vm.h"
+
+class WorkerPool;
+
+namespace PFCMU {
+  class IncalibSolver {
+  public:
+    /// iterations of solve() by default
+    static const int ITERATIONS = 100;
+
+    IncalibSolver();
+    ~IncalibSolver();
+
+    /**
+     * @param threads [in] num of threads (0 = num of CPUs).  solve()
+     *                     runs in the calling thread if not called.
+     */
+    void init(int threads = 0);
+
+    /**
+     * Remove all the views and the parameters
+     *
+     * @param width [in] width of the images
+     * @param height [in] height of the images
+     * @param rows [in] num of rows of the chessboard corners
+     * @param cols [in] num of cols of the chessboard corners
+     * @param square [in] size of a square
+     */
+    void setup(int width, int height, int rows, int cols, double square);
+
+    /**
+     * @param xy [in] rows*cols corners (x, y) in pixels, in the order of
+     *                cvFindChessboardCorners
+     */
+    void add_view(const double * xy);
+
+    int views() const {
+      return m_views.size();
+    }
+
+    /**
+     * Refine the parameters of all the views added so far
+     *
+     * @param iterations [in] max num of the iterations
+     * @return the RMS reprojection error in pixels
+     */
+    double solve(int iterations = ITERATIONS);
+
+    /**
+     * @return the RMS reprojection error of the last solve()
+     */
+    double rms() const {
+      return m_rms;
+    }
+
+    const lens_t & lens() const {
+      return m_lens;
+    }
+
+    /**
+     * @param view [in] index of the view
+     * @param R [out] rotation of the chessboard to the camera
+     * @param T [out] translation of the chessboard to the camera
+     */
+    void pose(int view, VM::matrix3_t * R, VM::vector3_t * T) const;
+
+    /**
+     * Write the parameters as incalib_gui, with the pose of the key view
+     *
+     * @return 0 on success, negative on error
+     */
+    int save(const char * filename, int key_view) const;
+
+    /**
+     * Write the parameters in the format of incalib_gui, read by
+     * incalib_t (lens.h)
+     *
+     * @return 0 on success, negative on error
+     */
+    static int save(const char * filename, const lens_t & lens, const VM::matrix3_t & R, const VM::vector3_t & T);
+
+  private:
+    IncalibSolver(const IncalibSolver &); // to disable "object copy"
+
+    /// parameters of a view and its blocks of the normal equations
+    struct view_t {
+      /// rotation (row-major) and translation
+      double R[9];
+      double T[3];
+      /// pose tried by the current step
+      double R2[9];
+      double T2[3];
+      /// J^t J of the pose, J^t J between the lens and the pose, J^t e of the pose
+      double V[36];
+      double W[42];
+      double b[6];
+      /// the damped V in Cholesky
+      double L[36];
+    };
+
+    /// sums of a band of the views
+    struct band_t {
+      double U[49];
+      double b[7];
+      double S[49];
+      double s[7];
+      double cost;
+    };
+
+    void place(int view);
+    void initialize();
+    void run(void (IncalibSolver::*fn)(int), int n);
+    void linearize(int band);
+    void reduce(int band);
+    void evaluate(int band);
+
+    int m_width;
+    int m_height;
+    /// the corners of the chessboard (X, Y, 0)
+    std::vector<double> m_X;
+    std::vector<double> m_Y;
+    /// the corners of each view in pixels
+    std::vector<double> m_u;
+    std::vector<double> m_v;
+    std::vector<view_t> m_views;
+    /// num of the views placed by the current parameters
+    int m_placed;
+
+    lens_t m_lens;
+    /// the lens tried by the current step
+    lens_t m_lens2;
+    /// the step of the lens tried
+    double m_delta[7];
+    double m_lambda;
+    double m_rms;
+
+    std::vector<band_t> m_bands;
+    WorkerPool * m_pool;
+  };
+}
+
+#endif
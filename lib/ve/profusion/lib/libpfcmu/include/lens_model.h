@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   lens_model.h
+ *
+ * @brief  Undistortion maps of the lens model of cvInitUndistortMap
+ *
+ * The lens is the intrinsic parameters of incalib_t (lens.h), i.e.,
+ * the focal length, the principal point, and the radial (k1, k2) and
+ * the tangential (p1, p2) distortion of OpenCV.
+ *
+ * forward() gives the maps of cvInitUndistortMap, i.e., the position
+ * in the distorted (captured) image of each pixel of the undistorted
+ * image.  inverse() gives the maps of the other direction, i.e., the
+ * position in the undistorted image of each pixel of the distorted
+ * image, by the fixed-point iteration of cvUndistortPoints.
+ *
+ * The maps can be of any size and cover any rectangle (crop_t) of the
+ * image, e.g., a half-resolution preview or a QVGA of a VGA camera, as
+ * the pixel centres of the map are placed evenly on the rectangle.
+ *
+ * The maps are computed in float by AVX2 for 8 pixels at once, or by
+ * the scalar code of the same arithmetic otherwise, and the rows are
+ * split into bands computed in parallel by the threads of init().
+ *
+ * The points are given as the arrays of each coordinate (SoA), and
+ * distorted, undistorted, projected or unprojected in double by AVX2
+ * for 4 points at once.  Batches of more than PARALLEL_POINTS are split
+ * into the threads.  The rotation and the translation of project() and
+ * unproject() are of vecmath (vm.h), as the calibration files.
+ */
+#ifndef PFCMU_LENS_MODEL_H
+#define PFCMU_LENS_MODEL_H
+
+#include <cstddef>
+
+#include "vm.h"
+
+class WorkerPool;
+
+namespace PFCMU {
+  /**
+   * Intrinsic parameters in pixels
+   */
+  struct lens_t {
+    double fx;
+    double fy;
+    double u0;
+    double v0;
+
+    double k1;
+    double k2;
+    double p1;
+    double p2;
+  };
+
+  /**
+   * Rectangle of an image in pixels, where (x, y) is the top-left corner
+   * of the top-left pixel, i.e., the whole image is (0, 0, width, height)
+   */
+  struct crop_t {
+    double x;
+    double y;
+    double width;
+    double height;
+
+    static crop_t whole(int width, int height) {
+      crop_t c = { 0, 0, (double)width, (double)height };
+      return c;
+    }
+  };
+
+  class LensModel {
+  public:
+    /// iterations of inverse() and undistort() by default, as cvUndistortPoints
+    static const int ITERATIONS = 5;
+    /// points of a batch not split into the threads
+    static const size_t PARALLEL_POINTS = 8192;
+
+    LensModel();
+    ~LensModel();
+
+    /**
+     * @param threads [in] num of threads (0 = num of CPUs).  The maps
+     *                     are computed by the calling thread if not called.
+     */
+    void init(int threads = 0);
+
+    /**
+     * Maps of cvInitUndistortMap, i.e., the position in the distorted
+     * image of each pixel of the undistorted image
+     *
+     * @param lens [in] intrinsic parameters
+     * @param crop [in] rectangle of the undistorted image covered by the maps
+     * @param width [in] width of the maps
+     * @param height [in] height of the maps
+     * @param mapx [out] x in the distorted image of width*height
+     * @param mapy [out] y in the distorted image of width*height
+     * @param step [in] num of floats of a row of the maps (0 = width)
+     */
+    void forward(const lens_t & lens, const crop_t & crop, int width, int height, float * mapx, float * mapy, int step = 0);
+
+    /**
+     * Maps of the position in the undistorted image of each pixel of
+     * the distorted image
+     *
+     * @param crop [in] rectangle of the distorted image covered by the maps
+     * @param iterations [in] num of the fixed-point iterations
+     * (see forward() for the others)
+     */
+    void inverse(const lens_t & lens, const crop_t & crop, int width, int height, float * mapx, float * mapy, int step = 0,
+                 int iterations = ITERATIONS);
+
+    /**
+     * Distort the normalized points, i.e., (X/Z, Y/Z) in the camera, into pixels
+     *
+     * @param x [in] n normalized x
+     * @param y [in] n normalized y
+     * @param u [out] n pixels
+     * @param v [out] n pixels
+     */
+    void distort(const lens_t & lens, const double * x, const double * y, double * u, double * v, size_t n);
+
+    /**
+     * Undistort the pixels into the normalized points, the inverse of distort()
+     *
+     * @param u [in] n pixels
+     * @param v [in] n pixels
+     * @param x [out] n normalized x
+     * @param y [out] n normalized y
+     * @param iterations [in] num of the fixed-point iterations
+     */
+    void undistort(const lens_t & lens, const double * u, const double * v, double * x, double * y, size_t n,
+                   int iterations = ITERATIONS);
+
+    /**
+     * Project the points of the world into pixels, as cvProjectPoints2
+     *
+     * @param R [in] rotation of the world to the camera
+     * @param T [in] translation of the world to the camera, i.e., R * p + T
+     * @param X [in] n points
+     * @param Y [in] n points
+     * @param Z [in] n points (in front of the camera)
+     * @param u [out] n pixels
+     * @param v [out] n pixels
+     */
+    void project(const lens_t & lens, const VM::matrix3_t & R, const VM::vector3_t & T,
+                 const double * X, const double * Y, const double * Z, double * u, double * v, size_t n);
+
+    /**
+     * Unproject the pixels into the rays of the world, the inverse of
+     * project().  The rays start from the camera centre -R^t * T, and
+     * the direction is R^t * (x, y, 1) of the normalized point (x, y).
+     *
+     * @param u [in] n pixels
+     * @param v [in] n pixels
+     * @param dx [out] n directions
+     * @param dy [out] n directions
+     * @param dz [out] n directions
+     * @param iterations [in] num of the fixed-point iterations
+     */
+    void unproject(const lens_t & lens, const VM::matrix3_t & R, const VM::vector3_t & T,
+                   const double * u, const double * v, double * dx, double * dy, double * dz, size_t n,
+                   int iterations = ITERATIONS);
+
+    /**
+     * @return true if the AVX2 kernel is used
+     */
+    static bool avx2();
+
+  private:
+    LensModel(const LensModel &); // to disable "object copy"
+
+    struct job_t;
+    void run(job_t & job);
+    void run_band(const job_t * job, int band);
+
+    struct points_t;
+    void run(points_t & job);
+    void run_points(const points_t * job, int band);
+
+    WorkerPool * m_pool;
+  };
+}
+
+#endif
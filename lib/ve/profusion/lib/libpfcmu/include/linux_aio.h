@@ -15,13 +15,18 @@
 #ifndef PFCMU_AIO_H
 #define PFCMU_AIO_H
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <libaio.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
@@ -34,12 +39,382 @@ namespace PFCMU {
     typedef intptr_t slot_id_t;
     typedef unsigned char byte_t;
 
+    /// returned by get_available_slot_id() of writer_t when a write has failed on the disk
+    const slot_id_t WRITE_FAILED = -2;
+
+    /**
+     * Open a file for AIO writing, with O_DIRECT if available
+     *
+     * @param filename [in] output filename
+     * @param bytes [in] bytes to be preallocated (can be 0)
+     *
+     * @return file descriptor, or negative on error
+     */
+    inline int try_open_output(const char * filename, off64_t bytes) {
+      // try with O_DIRECT first
+      int fd = open64(filename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC|O_DIRECT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+      if(fd < 0) {
+        // try without O_DIRECT
+        fd = open64(filename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+        if(fd < 0) {
+          perror("open64");
+          fprintf(stderr, "Cannot open %s for writing. Please check the path and permission.\n", filename);
+          return -1;
+        } else {
+          fprintf(stderr, "WARNING: O_DIRECT is not available for %s.\n", filename);
+        }
+      }
+
+      // pre-allocate the file space. this is very important for perfomance
+      if(bytes) {
+        // posix_fallocate64 does not set errno
+        const int e = posix_fallocate64(fd, 0, bytes);
+        if( 0 != e ) {
+          fprintf(stderr, "posix_fallocate64: %s\n", strerror(e));
+          fprintf(stderr, "Cannot preallocate %zd bytes for %s. Please check the available size of the disk (man df(1)).\n", bytes, filename);
+          close(fd);
+          return -1;
+        }
+        //fallocate(fd, 0, 0, bytes);
+        if( 0 != posix_fadvise(fd, 0, bytes, POSIX_FADV_SEQUENTIAL)) {
+          perror("posix_fadv_sequential");
+          close(fd);
+          return -1;
+        }
+        if( 0 != posix_fadvise(fd, 0, bytes, POSIX_FADV_NOREUSE)) {
+          perror("posix_fadv_noreuse");
+          close(fd);
+          return -1;
+        }
+      }
+
+      return fd;
+    }
+
+    /**
+     * Same as try_open_output(), but aborts on error
+     *
+     * @return file descriptor
+     */
+    inline int open_output(const char * filename, off64_t bytes) {
+      const int fd = try_open_output(filename, bytes);
+      if(fd < 0) {
+        abort();
+      }
+      return fd;
+    }
+
+    /**
+     * Open a block device (or a preallocated file) for AIO writing in
+     * place, with O_DIRECT if available.  Nothing is truncated or allocated.
+     *
+     * @param filename [in] device filename
+     *
+     * @return file descriptor (aborts on error)
+     */
+    inline int open_device(const char * filename) {
+      int fd = open64(filename, O_WRONLY|O_LARGEFILE|O_DIRECT);
+      if(fd < 0) {
+        fd = open64(filename, O_WRONLY|O_LARGEFILE);
+        if(fd < 0) {
+          perror("open64");
+          fprintf(stderr, "Cannot open %s for writing. Please check the path and permission.\n", filename);
+          abort();
+        } else {
+          fprintf(stderr, "WARNING: O_DIRECT is not available for %s.\n", filename);
+        }
+      }
+      return fd;
+    }
+
+    /**
+     * Interface of the writers, used as
+     *
+     *   id = get_available_slot_id();
+     *   fill buf(id);
+     *   write(id, index);
+     */
+    class writer_base_t {
+    public:
+      virtual ~writer_base_t() {
+      }
+
+      /**
+       * Finish writing (waits until all current writing ends)
+       */
+      virtual void clean() = 0;
+
+      /**
+       * Test if the instance has been initialized (init() has been called).
+       * 
+       * @return 0 if not yet, positive values when initialized.
+       */
+      virtual int is_initialized() const = 0;
+
+      /**
+       * Get a slot willing to serve.
+       *
+       * This function blocks until at least one slot becomes available
+       * (= finishes current writing).
+       *
+       * @return slot ID, or WRITE_FAILED if a write has failed
+       */
+      virtual slot_id_t get_available_slot_id() = 0;
+
+      /**
+       * Get a slot without blocking
+       *
+       * @return slot ID, WRITE_FAILED if a write has failed, or -1 if all the slots are being written
+       */
+      virtual slot_id_t try_get_available_slot_id() = 0;
+
+      /**
+       * Obtain the pointer to the buffer
+       *
+       * This function does not block.
+       *
+       * @param id [in] slot ID given by get_available_slot_id().
+       * 
+       * @return pointer to the buf of get_available_slot_id().
+       */
+      virtual byte_t * buf(slot_id_t id) = 0;
+
+      /**
+       * Queue the slot for writing
+       *
+       * This function does not block.
+       *
+       * @param id [in] slot ID given by get_available_slot_id().
+       * @param index [in] block (frame) index in the output
+       * 
+       * @return 0 on success, negative on error.
+       */
+      virtual int write(slot_id_t id, int index) = 0;
+    };
+
+    /**
+     * Explicit writeback of the blocks behind the write head
+     *
+     * Without O_DIRECT, the written blocks stay dirty in the page cache
+     * until the kernel flushes them in bursts, which stalls the writes.
+     * Every `interval` blocks completed, a background thread starts the
+     * writeback of them by sync_file_range(), and waits for the previous
+     * `interval` blocks (started one interval before) and drops them from
+     * the page cache by posix_fadvise(DONTNEED).  The dirty pages are then
+     * about 2 * interval blocks, and the page cache does not grow by the
+     * recording.  The writer only tells the progress, and never waits for
+     * sync_file_range() which can block while the disk is busy.
+     */
+    class writeback_t {
+    public:
+      struct stat_t {
+        /// num of sync_file_range() to start the writeback
+        unsigned long long starts;
+        unsigned long long start_max_usec;
+        unsigned long long start_total_usec;
+        /// num of the waits for the writeback and the drops
+        unsigned long long waits;
+        unsigned long long wait_max_usec;
+        unsigned long long wait_total_usec;
+        /// max num of blocks completed but not dropped yet
+        off64_t max_dirty;
+      };
+
+      writeback_t() : fd(-1), base(0), blocksize(0), interval(0), head(0), done(0), started(0), dropped(0), running(false), stopping(false) {
+        memset(&st, 0, sizeof(st));
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+      }
+
+      ~writeback_t() {
+        finish();
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+      }
+
+      /**
+       * @param fd [in] file written
+       * @param blocksize [in] bytes of a block
+       * @param slots [in] num of slots of the writer
+       * @param interval [in] num of blocks per sync_file_range() (0 = disabled)
+       * @param base [in] bytes before block 0 in the file
+       */
+      void init(int fd, size_t blocksize, int slots, off64_t interval, off64_t base=0) {
+        finish();
+        this->fd = fd;
+        this->base = base;
+        this->blocksize = blocksize;
+        this->interval = interval;
+        index.assign(slots, -1);
+        head = done = started = dropped = 0;
+        stopping = false;
+        memset(&st, 0, sizeof(st));
+        if(enabled()) {
+          if(0 != pthread_create(&thread, NULL, writeback_main, this)) {
+            perror("pthread_create");
+            abort();
+          }
+          running = true;
+        }
+      }
+
+      int enabled() const {
+        return fd >= 0 && interval > 0;
+      }
+
+      /**
+       * The slot is queued for writing at the block (writer thread)
+       */
+      void submitted(slot_id_t id, off64_t block) {
+        if(! running) {
+          return;
+        }
+        index[id] = block;
+        head = std::max(head, block + 1);
+      }
+
+      /**
+       * The write of the slot is completed (writer thread)
+       */
+      void completed(slot_id_t id) {
+        if(! running) {
+          return;
+        }
+        index[id] = -1;
+
+        // the blocks are written in order, so all the blocks before the oldest in flight are completed
+        off64_t d = head;
+        for(unsigned int i=0 ; i<index.size() ; i++) {
+          if(index[i] >= 0) {
+            d = std::min(d, index[i]);
+          }
+        }
+
+        pthread_mutex_lock(&mutex);
+        done = d;
+        st.max_dirty = std::max(st.max_dirty, done - dropped);
+        if(done - started >= interval) {
+          pthread_cond_signal(&cond);
+        }
+        pthread_mutex_unlock(&mutex);
+      }
+
+      /**
+       * Stop the thread, and drop the rest from the page cache (call after fsync)
+       */
+      void finish() {
+        if(running) {
+          pthread_mutex_lock(&mutex);
+          stopping = true;
+          pthread_cond_signal(&cond);
+          pthread_mutex_unlock(&mutex);
+          pthread_join(thread, NULL);
+          running = false;
+          posix_fadvise(fd, base + dropped * blocksize, 0, POSIX_FADV_DONTNEED);
+        }
+        fd = -1;
+      }
+
+      /**
+       * Statistics, can be called any time
+       */
+      stat_t stat() {
+        pthread_mutex_lock(&mutex);
+        stat_t s = st;
+        pthread_mutex_unlock(&mutex);
+        return s;
+      }
+
+    private:
+      writeback_t(const writeback_t &); // to disable "object copy"
+
+      static unsigned long long now_usec() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000ULL + tv.tv_usec;
+      }
+
+      static void * writeback_main(void * arg) {
+        reinterpret_cast<writeback_t *>(arg)->writeback_loop();
+        return NULL;
+      }
+
+      void writeback_loop() {
+        pthread_mutex_lock(&mutex);
+        for(;;) {
+          while(! stopping && done - started < interval) {
+            pthread_cond_wait(&cond, &mutex);
+          }
+          if(stopping) {
+            break;
+          }
+          const off64_t begin = started;
+          const off64_t prev = dropped;
+          const bool drop = begin + interval - prev >= 2 * interval;
+          pthread_mutex_unlock(&mutex);
+
+          unsigned long long t = now_usec();
+          sync_file_range(fd, base + begin * blocksize, interval * blocksize, SYNC_FILE_RANGE_WRITE);
+          const unsigned long long t_start = now_usec() - t;
+
+          unsigned long long t_wait = 0;
+          if(drop) {
+            t = now_usec();
+            sync_file_range(fd, base + prev * blocksize, interval * blocksize, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, base + prev * blocksize, interval * blocksize, POSIX_FADV_DONTNEED);
+            t_wait = now_usec() - t;
+          }
+
+          pthread_mutex_lock(&mutex);
+          started += interval;
+          st.starts++;
+          st.start_total_usec += t_start;
+          st.start_max_usec = std::max(st.start_max_usec, t_start);
+          if(drop) {
+            dropped += interval;
+            st.waits++;
+            st.wait_total_usec += t_wait;
+            st.wait_max_usec = std::max(st.wait_max_usec, t_wait);
+          }
+        }
+        pthread_mutex_unlock(&mutex);
+      }
+
+      int fd;
+      off64_t base;
+      off64_t blocksize;
+      off64_t interval;
+
+      // the following are for the writer thread
+      /// block index of the slots in flight (-1 if not)
+      std::vector<off64_t> index;
+      /// blocks [0:head) have been submitted
+      off64_t head;
+
+      pthread_t thread;
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+
+      // shared, protected by mutex
+      /// blocks [0:done) have been written
+      off64_t done;
+      /// blocks [0:started) are being written back
+      off64_t started;
+      /// blocks [0:dropped) are on the disk and not in the page cache
+      off64_t dropped;
+      bool running;
+      bool stopping;
+      stat_t st;
+    };
+
     /**
      * Linux AIO wrapper
      */
-    class writer_t {
+    class writer_t : public writer_base_t {
     private:
       int fd;
+      /// bytes before block 0 in the file
+      off64_t base;
       io_context_t ctx;
       int n_slots;
 
@@ -47,9 +422,13 @@ namespace PFCMU {
       byte_t ** buf_aligned;
       size_t buf_size;
       int buf_count;
+      /// num of the writes submitted and not completed
+      int inflight;
+
+      writeback_t wb;
 
     public:
-      writer_t() : fd(-1), n_slots(0), obj(NULL), buf_aligned(NULL) {
+      writer_t() : fd(-1), base(0), n_slots(0), obj(NULL), buf_aligned(NULL), buf_count(0), inflight(0) {
       }
 
       ~writer_t() {
@@ -62,6 +441,7 @@ namespace PFCMU {
       void clean() {
         if(fd != -1) {
           fsync(fd);
+          wb.finish();
           io_destroy(ctx);
           close(fd);
           fd = -1;
@@ -79,6 +459,7 @@ namespace PFCMU {
             }
           }
           free(buf_aligned);
+          buf_aligned = NULL;
         }
 
         n_slots = 0;
@@ -103,68 +484,83 @@ namespace PFCMU {
        * @param align [in] memory alignment for O_DIRECT (do not modify unless you know what you are doing)
        */
       void init(const char * filename, off64_t blocksize, off64_t bufnum, off64_t count, off64_t align=4096) {
-        clean();
-
-        this->n_slots = bufnum;
-        this->buf_size = blocksize;
-        // try with O_DIRECT first
-        this->fd = open64(filename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC|O_DIRECT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-        if(this->fd < 0) {
-          // try without O_DIRECT
-          this->fd = open64(filename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-          if(this->fd < 0) {
-            perror("open64");
-	    fprintf(stderr, "Cannot open %s for writing. Please check the path and permission.\n", filename);
-            abort();
-          } else {
-            fprintf(stderr, "WARNING: O_DIRECT is not available for %s.\n", filename);
-          }
+        if(0 != try_init(filename, blocksize, bufnum, count, align)) {
+          abort();
         }
+      }
 
-        // pre-allocate the file space. this is very important for perfomance
-        if(count) {
-          if( 0 != posix_fallocate64(fd, 0, blocksize*count) ) {
-            perror("posix_fallocate64");
-	    fprintf(stderr, "Cannot preallocate %zd bytes for %s. Please check the available size of the disk (man df(1)).\n", blocksize * count, filename);
-            abort();
-          }
-          //fallocate(fd, 0, 0, blocksize*count);
-          if( 0 != posix_fadvise(fd, 0, blocksize*count, POSIX_FADV_SEQUENTIAL)) {
-            perror("posix_fadv_sequential");
-            abort();
-          }
-          if( 0 != posix_fadvise(fd, 0, blocksize*count, POSIX_FADV_NOREUSE)) {
-            perror("posix_fadv_noreuse");
-            abort();
-          }
+      /**
+       * Same as init(), but returns an error instead of aborting, for the
+       * blocksize and the count not trusted (see bin/netsink)
+       *
+       * @return 0 on success, negative on error (the instance is clean()ed)
+       */
+      int try_init(const char * filename, off64_t blocksize, off64_t bufnum, off64_t count, off64_t align=4096) {
+        clean();
+        const int fd = try_open_output(filename, blocksize*count);
+        if(fd < 0) {
+          return -1;
         }
+        return setup(fd, 0, blocksize, bufnum, align);
+      }
 
-        // init the io_context_t
-        memset(&ctx, 0, sizeof(io_context_t));
-        if( 0 != io_setup(n_slots, &ctx) ) {
-          perror("io_setup");
+      /**
+       * Initialize to write the blocks in place from an offset of a device
+       * (see TakeVolume), without truncating or allocating it
+       *
+       * @param device [in] block device or preallocated file
+       * @param base [in] bytes before block 0 (multiple of 4096 for O_DIRECT)
+       * @param blocksize [in] bytes in a single write
+       * @param bufnum [in] ring buffer depth
+       * @param align [in] memory alignment for O_DIRECT
+       */
+      void init_device(const char * device, off64_t base, off64_t blocksize, off64_t bufnum, off64_t align=4096) {
+        clean();
+        if(0 != setup(open_device(device), base, blocksize, bufnum, align)) {
           abort();
         }
+      }
 
-        obj = (struct iocb *)malloc(sizeof(struct iocb) * n_slots);
-        if(obj == NULL) {
-          fprintf(stderr, "posix_memalign returned error\n"); // posix_memalign does not set errno.
-        }
+      /**
+       * Start the writeback every `blocks` blocks and drop them from the page cache (see writeback_t)
+       *
+       * Call after init().  Effective without O_DIRECT, and harmless with it.
+       *
+       * @param blocks [in] interval in blocks (0 = leave it to the kernel)
+       */
+      void set_writeback(off64_t blocks) {
+        wb.init(fd, buf_size, n_slots, blocks, base);
+      }
 
-        buf_aligned = (byte_t **)malloc(sizeof(byte_t *) * n_slots);
-        if(NULL == buf_aligned) {
-          perror("malloc");
-        }
+      writeback_t::stat_t writeback_stat() {
+        return wb.stat();
+      }
 
-        for(int i=0 ; i<n_slots ; i++) {
-          void * p = NULL;
-          if(0 != posix_memalign(&p, align, blocksize)) {
-            fprintf(stderr, "posix_memalign returned error\n"); // posix_memalign does not set errno.
+      /**
+       * Wait for all the writes submitted, to know if they have succeeded
+       * before clean() (which does not tell).  No slot is available after
+       * this, except by clean() and init().
+       *
+       * @return 0 on success, WRITE_FAILED if any of the writes has failed
+       */
+      int flush() {
+        int r = 0;
+        while(inflight > 0) {
+          struct io_event event;
+          const int n = io_getevents(ctx, 1, 1, &event, NULL);
+          if(n == -EINTR) {
+            continue;
+          }
+          if(n != 1) {
+            return WRITE_FAILED;
+          }
+          slot_id_t id = ((intptr_t)(event.obj) - (intptr_t)(obj)) / sizeof(struct iocb);
+          assert(event.obj == &(obj[id]));
+          if(completed(id, event) < 0) {
+            r = WRITE_FAILED;
           }
-          buf_aligned[i] = reinterpret_cast<byte_t *>(p);
         }
-
-        buf_count = 0;
+        return r;
       }
 
       /**
@@ -173,7 +569,7 @@ namespace PFCMU {
        * This function blocks until at least one slot becomes available
        * (= finishes current writing).
        *
-       * @return slot ID
+       * @return slot ID, or WRITE_FAILED if the write of the slot has failed
        */
       slot_id_t get_available_slot_id() {
         if(buf_count < n_slots) {
@@ -190,10 +586,23 @@ namespace PFCMU {
         //fprintf(stderr, "slot[%zd] is available\n", id);
         //fprintf(stderr, "event.obj = %tx, slots[%zd].obj=%tx\n", (intptr_t)event.obj, id, (intptr_t)(obj+id));
         assert(event.obj == &(obj[id]));
-        assert(event.res == buf_size);
-        assert(event.res2 == 0);
+        return completed(id, event);
+      }
 
-        return id;
+      slot_id_t try_get_available_slot_id() {
+        if(buf_count < n_slots) {
+          return get_available_slot_id();
+        }
+
+        struct io_event event;
+        struct timespec zero = { 0, 0 };
+        int r = io_getevents(ctx, 0, 1, &event, &zero);
+        if(r != 1) {
+          return -1;
+        }
+        slot_id_t id = ((intptr_t)(event.obj) - (intptr_t)(obj)) / sizeof(struct iocb);
+        assert(event.obj == &(obj[id]));
+        return completed(id, event);
       }
 
       /**
@@ -221,14 +630,81 @@ namespace PFCMU {
        */
       int write(slot_id_t id, int index) {
         struct iocb * cb[1] = { &(obj[id]) };
-        io_prep_pwrite(cb[0], fd, buf(id), buf_size, index*buf_size);
+        io_prep_pwrite(cb[0], fd, buf(id), buf_size, base + index*buf_size);
         int r = io_submit(ctx, 1, cb);
         if( r == 1 ) {
+          wb.submitted(id, index);
+          inflight++;
           return 0;
         } else {
           return r;
         }
       }
+
+    private:
+      writer_t(const writer_t &); // to disable "object copy"
+
+      /**
+       * @return the slot of the event, or WRITE_FAILED if its write has failed
+       */
+      slot_id_t completed(slot_id_t id, const struct io_event & event) {
+        inflight--;
+        // res is the bytes written, or -errno
+        if(event.res != buf_size || event.res2 != 0) {
+          const long res = event.res;
+          if(res < 0) {
+            fprintf(stderr, "write failed: %s\n", strerror(-res));
+          } else {
+            fprintf(stderr, "write failed: %ld of %zu bytes written\n", res, buf_size);
+          }
+          return WRITE_FAILED;
+        }
+        wb.completed(id);
+        return id;
+      }
+
+      /**
+       * @return 0 on success, negative on error (the instance is clean()ed)
+       */
+      int setup(int fd, off64_t base, off64_t blocksize, off64_t bufnum, off64_t align) {
+        this->fd = fd;
+        this->base = base;
+        this->n_slots = bufnum;
+        this->buf_size = blocksize;
+
+        // init the io_context_t
+        memset(&ctx, 0, sizeof(io_context_t));
+        if( 0 != io_setup(n_slots, &ctx) ) {
+          perror("io_setup");
+          close(fd);
+          this->fd = -1;
+          clean();
+          return -1;
+        }
+
+        obj = (struct iocb *)malloc(sizeof(struct iocb) * n_slots);
+        // zeroed, so that clean() frees the buffers allocated so far
+        buf_aligned = (byte_t **)calloc(n_slots, sizeof(byte_t *));
+        if(NULL == obj || NULL == buf_aligned) {
+          perror("malloc");
+          clean();
+          return -1;
+        }
+
+        for(int i=0 ; i<n_slots ; i++) {
+          void * p = NULL;
+          if(0 != posix_memalign(&p, align, blocksize)) {
+            fprintf(stderr, "posix_memalign returned error\n"); // posix_memalign does not set errno.
+            clean();
+            return -1;
+          }
+          buf_aligned[i] = reinterpret_cast<byte_t *>(p);
+        }
+
+        buf_count = 0;
+        inflight = 0;
+        return 0;
+      }
     };
   }
 }
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   mcast.h
+ *
+ * @brief  UDP multicast distribution of preview images
+ *
+ * An encoded image (e.g. a JPEG thumbnail) is split into fragments that
+ * fit in a single datagram.  Every fec_group data fragments are followed
+ * by a parity fragment (XOR of the group), so that the receiver can
+ * recover one lost fragment per group without retransmission.  The cost
+ * on the sender is independent of the num of viewers.
+ *
+ * Each datagram starts with a header_t in network byte order.  The
+ * packet sequence number counts every datagram of the publisher, so
+ * that the receiver can tell the loss rate of the network.
+ *
+ * Several publishers can share a group; the receiver reassembles the
+ * images of each sender independently.
+ */
+#ifndef PFCMU_MCAST_H
+#define PFCMU_MCAST_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "pfcmu_config.h"
+#include "codec.h"
+
+namespace PFCMU {
+  namespace mcast {
+    typedef unsigned char byte_t;
+
+    /// "PFMC"
+    const uint32_t MAGIC = 0x50464d43;
+    const uint8_t VERSION = 1;
+    /// header_t::flags, the payload is the parity of the group header_t::index
+    const uint8_t FLAG_PARITY = 0x01;
+
+    /**
+     * Header of each datagram (serialized in network byte order, 40 bytes)
+     */
+    struct header_t {
+      static const size_t SIZE = 40;
+
+      uint8_t version;
+      uint8_t flags;
+      /// num of data fragments per parity fragment (0 = no FEC)
+      uint8_t fec_group;
+      /// codec::encoding_t of the image
+      uint8_t encoding;
+      /// sequence number of this datagram
+      uint32_t packet_seq;
+      /// sequence number of the image
+      uint32_t image_seq;
+      uint32_t framecount;
+      /// bytes of the whole image
+      uint32_t image_bytes;
+      uint16_t width;
+      uint16_t height;
+      /// camera ID, or PFCMU::CAMS for the thumbnail of all the cameras
+      uint16_t camera;
+      /// fragment index, or group index if FLAG_PARITY
+      uint16_t index;
+      /// num of data fragments of the image
+      uint16_t count;
+      /// bytes of every fragment but the last one
+      uint16_t fragment_bytes;
+
+      /**
+       * @param buf [out] SIZE bytes
+       */
+      void pack(byte_t * buf) const;
+
+      /**
+       * @param buf [in] received datagram
+       * @param len [in] bytes of buf
+       * @return 0 on success, negative if buf is not a valid datagram
+       */
+      int unpack(const byte_t * buf, size_t len);
+    };
+
+    /**
+     * A reassembled image
+     */
+    struct image_t {
+      /// "address:port" of the publisher
+      std::string sender;
+      uint32_t image_seq;
+      timestamp_t framecount;
+      int camera;
+      codec::encoding_t encoding;
+      int width;
+      int height;
+      std::vector<byte_t> data;
+    };
+
+    /**
+     * Parse "group:port" (e.g. "239.255.42.1:10001")
+     *
+     * @return 0 on success, negative on error
+     */
+    int parse_endpoint(const std::string & text, std::string * group, int * port);
+
+    /**
+     * Sends images to a multicast group
+     */
+    class Publisher {
+    public:
+      /**
+       * @param group [in] multicast address (e.g. "239.255.42.1")
+       * @param port [in] UDP port
+       * @param iface [in] address of the outgoing interface (NULL = default, "127.0.0.1" for loopback testing)
+       * @param ttl [in] multicast TTL (1 = local network only)
+       * @param mtu [in] max size of IP packets
+       * @param fec_group [in] num of data fragments per parity fragment (0 = no FEC)
+       */
+      Publisher(const char * group, int port, const char * iface, int ttl, int mtu, int fec_group);
+      ~Publisher();
+
+      /**
+       * Send an encoded image
+       *
+       * @param framecount [in] framecount of the image
+       * @param camera [in] camera ID, or PFCMU::CAMS for the thumbnail
+       * @param enc [in] encoding of data
+       * @param width [in] width of the image
+       * @param height [in] height of the image
+       * @param data [in] encoded image
+       * @param len [in] bytes of data
+       * @return 0 on success, negative if some datagrams were not sent
+       */
+      int send(timestamp_t framecount, int camera, codec::encoding_t enc, int width, int height, const byte_t * data, size_t len);
+
+      /**
+       * @param images [out] num of images sent
+       * @param packets [out] num of datagrams sent (including parity)
+       * @param bytes [out] num of bytes sent (including headers)
+       */
+      void stat(unsigned long long * images, unsigned long long * packets, unsigned long long * bytes) const;
+
+    private:
+      Publisher(const Publisher &); // to disable "object copy"
+
+      int send_packet(header_t & h, const byte_t * payload, size_t len);
+
+      int m_fd;
+      struct sockaddr_in m_addr;
+      const int m_fragment_bytes;
+      const int m_fec_group;
+      uint32_t m_packet_seq;
+      uint32_t m_image_seq;
+      unsigned long long m_images;
+      unsigned long long m_packets;
+      unsigned long long m_bytes;
+      std::vector<byte_t> m_packet;
+    };
+
+    /**
+     * Receives and reassembles the images sent by Publishers
+     */
+    class Receiver {
+    public:
+      struct stat_t {
+        /// images delivered by receive()
+        unsigned long long images;
+        /// images delivered thanks to the parity fragments
+        unsigned long long recovered;
+        /// images given up (fragments lost beyond the FEC capability, or too late)
+        unsigned long long incomplete;
+        /// datagrams received
+        unsigned long long packets;
+        /// datagrams missing in the packet sequence numbers
+        unsigned long long lost;
+        /// datagrams ignored (not ours, or broken)
+        unsigned long long invalid;
+      };
+
+      /**
+       * @param group [in] multicast address
+       * @param port [in] UDP port
+       * @param iface [in] address of the interface to join (NULL = default, "127.0.0.1" for loopback testing)
+       * @param window [in] num of images per sender being reassembled at once
+       */
+      Receiver(const char * group, int port, const char * iface, int window);
+      ~Receiver();
+
+      /**
+       * Wait for the next complete image
+       *
+       * Images are delivered in order for each sender.  An incomplete
+       * image is given up when window newer images of the same sender
+       * are under reassembly, or a newer one is delivered.
+       *
+       * @param image [out] reassembled image
+       * @param timeout_ms [in] timeout in ms (negative = infinite)
+       * @return 1 if an image is received, 0 on timeout, negative on error
+       */
+      int receive(image_t * image, int timeout_ms);
+
+      /**
+       * Simulate packet loss for testing
+       *
+       * @param rate [in] probability to drop each received datagram [0:1]
+       */
+      void set_drop_rate(double rate);
+
+      void stat(stat_t * s) const;
+
+    private:
+      Receiver(const Receiver &); // to disable "object copy"
+
+      struct partial_t {
+        header_t header;
+        std::vector<byte_t> data;
+        /// received data fragments
+        std::vector<bool> have;
+        int remaining;
+        /// parity payloads of each group (empty if not received)
+        std::vector<std::vector<byte_t> > parity;
+        bool recovered;
+      };
+
+      struct sender_t {
+        bool started;
+        uint32_t next_packet;
+        bool delivered;
+        uint32_t last_image;
+        std::map<uint32_t, partial_t> images;
+      };
+
+      /// @return 1 if the image of h is completed
+      int feed(sender_t & s, const header_t & h, const byte_t * payload, size_t len);
+      void recover(partial_t & p, int group);
+
+      int m_fd;
+      const int m_window;
+      double m_drop_rate;
+      unsigned int m_seed;
+      std::vector<byte_t> m_packet;
+      std::map<std::string, sender_t> m_senders;
+      stat_t m_stat;
+    };
+  }
+}
+
+#endif
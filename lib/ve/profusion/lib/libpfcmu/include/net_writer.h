@@ -0,0 +1,690 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   net_writer.h
+ *
+ * @brief  Recording to a storage server over TCP (see bin/netsink)
+ *
+ * The frames are sent from the slot buffers by MSG_ZEROCOPY, i.e., the
+ * kernel transmits the pages of the buffer without copying them, and
+ * the slot becomes available again when the kernel notifies the
+ * completion on the error queue of the socket.  If SO_ZEROCOPY is not
+ * supported, the frames are sent by an ordinary copy.
+ *
+ * Flow control is credit-based: the server grants a credit for each
+ * free slot of its AIO writer, and a frame is sent only with a credit.
+ * The capture thread never touches the socket; get_available_slot_id()
+ * and write() only exchange slots with a sender thread, so the network
+ * is seen by the capture thread as a disk with bufnum slots (and can be
+ * put behind a spill_writer_t the same way).
+ *
+ * Protocol (network byte order):
+ *
+ *   client -> server : hello_t, then (message_t of FRAME + blocksize bytes) per frame, then message_t of END
+ *   server -> client : message_t of CREDIT (n frames) any time, then DONE (frames written) after fsync
+ */
+#ifndef PFCMU_NET_WRITER_H
+#define PFCMU_NET_WRITER_H
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <unistd.h>
+
+#include "linux_aio.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+namespace PFCMU {
+  namespace netsink {
+    /// "PFNS"
+    const uint32_t MAGIC = 0x50464e53;
+    const uint32_t VERSION = 1;
+    const unsigned short DEFAULT_PORT = 7300;
+
+    enum type_t {
+      FRAME = 1,
+      END = 2,
+      CREDIT = 3,
+      DONE = 4,
+    };
+
+    inline void put32(libaio::byte_t * p, uint32_t v) {
+      v = htonl(v);
+      memcpy(p, &v, 4);
+    }
+    inline uint32_t get32(const libaio::byte_t * p) {
+      uint32_t v;
+      memcpy(&v, p, 4);
+      return ntohl(v);
+    }
+    inline void put64(libaio::byte_t * p, uint64_t v) {
+      put32(p, v >> 32);
+      put32(p + 4, v & 0xffffffffU);
+    }
+    inline uint64_t get64(const libaio::byte_t * p) {
+      return ((uint64_t)get32(p) << 32) | get32(p + 4);
+    }
+
+    /**
+     * First message of the client (serialized in network byte order)
+     */
+    struct hello_t {
+      static const size_t SIZE = 4 + 4 + 8 + 8 + 256;
+
+      uint64_t blocksize;
+      /// frames to be preallocated by the server
+      uint64_t count;
+      /// name of the recording, the basename is used in the dir of the server
+      std::string name;
+
+      void pack(libaio::byte_t * buf) const {
+        memset(buf, 0, SIZE);
+        put32(buf, MAGIC);
+        put32(buf + 4, VERSION);
+        put64(buf + 8, blocksize);
+        put64(buf + 16, count);
+        strncpy(reinterpret_cast<char *>(buf) + 24, name.c_str(), 255);
+      }
+
+      /**
+       * @return 0 on success, negative if not a hello_t of this version
+       */
+      int unpack(const libaio::byte_t * buf) {
+        if(get32(buf) != MAGIC || get32(buf + 4) != VERSION) {
+          return -1;
+        }
+        blocksize = get64(buf + 8);
+        count = get64(buf + 16);
+        name = std::string(reinterpret_cast<const char *>(buf) + 24, strnlen(reinterpret_cast<const char *>(buf) + 24, 255));
+        return 0;
+      }
+    };
+
+    /**
+     * FRAME (value = frame index, followed by the frame) or END sent by
+     * the client, CREDIT (value = num of frames) or DONE (value = frames
+     * written) sent by the server
+     */
+    struct message_t {
+      static const size_t SIZE = 12;
+
+      uint32_t type;
+      uint64_t value;
+
+      void pack(libaio::byte_t * buf) const {
+        put32(buf, type);
+        put64(buf + 4, value);
+      }
+
+      void unpack(const libaio::byte_t * buf) {
+        type = get32(buf);
+        value = get64(buf + 4);
+      }
+    };
+
+    /**
+     * @return 0 on success, negative if the connection is lost
+     */
+    inline int send_all(int fd, const void * buf, size_t bytes) {
+      const char * p = reinterpret_cast<const char *>(buf);
+      while(bytes > 0) {
+        ssize_t r = send(fd, p, bytes, MSG_NOSIGNAL);
+        if(r < 0 && errno == EINTR) {
+          continue;
+        }
+        if(r <= 0) {
+          return -1;
+        }
+        p += r;
+        bytes -= r;
+      }
+      return 0;
+    }
+
+    /**
+     * @return 0 on success, negative if the connection is lost
+     */
+    inline int recv_all(int fd, void * buf, size_t bytes) {
+      char * p = reinterpret_cast<char *>(buf);
+      while(bytes > 0) {
+        ssize_t r = recv(fd, p, bytes, MSG_WAITALL);
+        if(r < 0 && errno == EINTR) {
+          continue;
+        }
+        if(r <= 0) {
+          return -1;
+        }
+        p += r;
+        bytes -= r;
+      }
+      return 0;
+    }
+
+    /**
+     * @param hostport [in] "host:port" or "host" (DEFAULT_PORT)
+     * @return connected socket, negative on error
+     */
+    inline int connect_to(const std::string & hostport) {
+      char port[16];
+      snprintf(port, sizeof(port), "%u", DEFAULT_PORT);
+      std::string host = hostport;
+      const std::string::size_type colon = hostport.rfind(':');
+      if(colon != std::string::npos) {
+        host = hostport.substr(0, colon);
+        snprintf(port, sizeof(port), "%s", hostport.substr(colon + 1).c_str());
+      }
+
+      struct addrinfo hints, * res = NULL;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if(0 != getaddrinfo(host.c_str(), port, &hints, &res)) {
+        return -1;
+      }
+      int fd = -1;
+      for(struct addrinfo * ai = res ; ai ; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0) {
+          continue;
+        }
+        if(0 == connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+          break;
+        }
+        close(fd);
+        fd = -1;
+      }
+      freeaddrinfo(res);
+      return fd;
+    }
+  }
+
+  namespace libaio {
+    class net_writer_t : public writer_base_t {
+    public:
+      struct stat_t {
+        /// frames sent
+        unsigned long long frames;
+        /// sends completed without copy
+        unsigned long long zerocopy;
+        /// sends the kernel had to copy (e.g., loopback)
+        unsigned long long copied;
+        /// times the queued frames waited for a credit of the server
+        unsigned long long credit_waits;
+        /// max num of frames queued for the sender thread
+        unsigned int max_queue;
+      };
+
+      net_writer_t() : fd(-1), wake(-1), n_slots(0), buf_size(0), headers(NULL), use_zerocopy(false),
+                       stopping(false), credit(0), msg_bytes(0), zc_next(0), zc_done(0) {
+        memset(&st, 0, sizeof(st));
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond_free, NULL);
+      }
+
+      ~net_writer_t() {
+        clean();
+        pthread_cond_destroy(&cond_free);
+        pthread_mutex_destroy(&mutex);
+      }
+
+      /**
+       * Wait until the server has written all the frames (fsync), and disconnect
+       */
+      void clean() {
+        if(n_slots == 0) {
+          return;
+        }
+
+        pthread_mutex_lock(&mutex);
+        stopping = true;
+        pthread_mutex_unlock(&mutex);
+        notify();
+        pthread_join(thread, NULL);
+
+        netsink::message_t end;
+        end.type = netsink::END;
+        end.value = st.frames;
+        byte_t b[netsink::message_t::SIZE];
+        end.pack(b);
+        if(0 != netsink::send_all(fd, b, sizeof(b))) {
+          fprintf(stderr, "Connection to the storage server is lost.\n");
+          abort();
+        }
+        // the rest of a CREDIT partly received by the sender thread, to read the messages from their heads
+        if(msg_bytes > 0) {
+          if(0 != netsink::recv_all(fd, msg + msg_bytes, sizeof(msg) - msg_bytes)) {
+            fprintf(stderr, "Connection to the storage server is lost before the recording is closed.\n");
+            abort();
+          }
+          msg_bytes = 0;
+        }
+        for(;;) {
+          netsink::message_t m;
+          if(0 != netsink::recv_all(fd, b, sizeof(b))) {
+            fprintf(stderr, "Connection to the storage server is lost before the recording is closed.\n");
+            abort();
+          }
+          m.unpack(b);
+          if(m.type == netsink::DONE) {
+            if(m.value != st.frames) {
+              fprintf(stderr, "WARNING: the storage server wrote %llu frames of %llu sent.\n", (unsigned long long)m.value, st.frames);
+            }
+            break;
+          }
+        }
+
+        close(fd);
+        close(wake);
+        fd = wake = -1;
+        for(int i=0 ; i<n_slots ; i++) {
+          free(slots[i]);
+        }
+        slots.clear();
+        free(headers);
+        headers = NULL;
+        free_slots.clear();
+        n_slots = 0;
+      }
+
+      int is_initialized() const {
+        return n_slots;
+      }
+
+      /**
+       * Connect to the server and start the sender thread
+       *
+       * @param hostport [in] "host:port" of the server
+       * @param name [in] name of the recording on the server
+       * @param blocksize [in] bytes in a single write
+       * @param bufnum [in] num of slots (frames being sent)
+       * @param count [in] num of frames to be preallocated by the server
+       * @param align [in] memory alignment of the slots
+       */
+      void init(const std::string & hostport, const std::string & name, off64_t blocksize, off64_t bufnum, off64_t count, off64_t align=4096) {
+        clean();
+
+        fd = netsink::connect_to(hostport);
+        if(fd < 0) {
+          perror("connect");
+          fprintf(stderr, "Cannot connect to the storage server %s.\n", hostport.c_str());
+          abort();
+        }
+        int one = 1;
+        use_zerocopy = 0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+        if(! use_zerocopy) {
+          fprintf(stderr, "WARNING: SO_ZEROCOPY is not available, the frames are copied to the socket.\n");
+        }
+
+        netsink::hello_t hello;
+        hello.blocksize = blocksize;
+        hello.count = count;
+        hello.name = name;
+        byte_t b[netsink::hello_t::SIZE];
+        hello.pack(b);
+        if(0 != netsink::send_all(fd, b, sizeof(b))) {
+          perror("send");
+          abort();
+        }
+
+        wake = eventfd(0, EFD_NONBLOCK);
+        if(wake < 0) {
+          perror("eventfd");
+          abort();
+        }
+
+        n_slots = bufnum;
+        buf_size = blocksize;
+        slots.resize(n_slots);
+        headers = reinterpret_cast<byte_t *>(malloc(netsink::message_t::SIZE * n_slots));
+        for(int i=0 ; i<n_slots ; i++) {
+          void * p = NULL;
+          if(0 != posix_memalign(&p, align, blocksize)) {
+            fprintf(stderr, "posix_memalign returned error\n"); // posix_memalign does not set errno.
+            abort();
+          }
+          slots[i] = reinterpret_cast<byte_t *>(p);
+          free_slots.push_back(i);
+        }
+
+        memset(&st, 0, sizeof(st));
+        stopping = false;
+        credit = 0;
+        msg_bytes = 0;
+        zc_next = zc_done = 0;
+        if(0 != pthread_create(&thread, NULL, sender_main, this)) {
+          perror("pthread_create");
+          abort();
+        }
+      }
+
+      slot_id_t get_available_slot_id() {
+        pthread_mutex_lock(&mutex);
+        while(free_slots.empty()) {
+          pthread_cond_wait(&cond_free, &mutex);
+        }
+        slot_id_t id = free_slots.back();
+        free_slots.pop_back();
+        pthread_mutex_unlock(&mutex);
+        return id;
+      }
+
+      slot_id_t try_get_available_slot_id() {
+        slot_id_t id = -1;
+        pthread_mutex_lock(&mutex);
+        if(! free_slots.empty()) {
+          id = free_slots.back();
+          free_slots.pop_back();
+        }
+        pthread_mutex_unlock(&mutex);
+        return id;
+      }
+
+      byte_t * buf(slot_id_t id) {
+        return slots[id];
+      }
+
+      int write(slot_id_t id, int index) {
+        pthread_mutex_lock(&mutex);
+        send_queue.push_back(std::make_pair(id, index));
+        if(send_queue.size() > st.max_queue) {
+          st.max_queue = send_queue.size();
+        }
+        pthread_mutex_unlock(&mutex);
+        notify();
+        return 0;
+      }
+
+      bool zerocopy() const {
+        return use_zerocopy;
+      }
+
+      /**
+       * Statistics, valid after clean() (frames and max_queue any time)
+       */
+      void stat(stat_t * s) {
+        pthread_mutex_lock(&mutex);
+        *s = st;
+        pthread_mutex_unlock(&mutex);
+      }
+
+    private:
+      net_writer_t(const net_writer_t &); // to disable "object copy"
+
+      struct inflight_t {
+        slot_id_t id;
+        /// the last zerocopy ID of the sends of this slot (valid if zc)
+        uint32_t last;
+        bool zc;
+      };
+
+      void notify() {
+        uint64_t one = 1;
+        if(sizeof(one) != ::write(wake, &one, sizeof(one))) {
+          // the counter is saturated, the sender is awake anyway
+        }
+      }
+
+      void release(slot_id_t id) {
+        pthread_mutex_lock(&mutex);
+        free_slots.push_back(id);
+        pthread_cond_signal(&cond_free);
+        pthread_mutex_unlock(&mutex);
+      }
+
+      static void * sender_main(void * arg) {
+        reinterpret_cast<net_writer_t *>(arg)->sender_loop();
+        return NULL;
+      }
+
+      void sender_loop() {
+        bool waiting_credit = false;
+        for(;;) {
+          receive_credits();
+          reap_completions();
+
+          pthread_mutex_lock(&mutex);
+          const bool stop = stopping;
+          std::pair<slot_id_t, int> next(-1, 0);
+          if(! send_queue.empty() && credit > 0) {
+            next = send_queue.front();
+            send_queue.pop_front();
+          }
+          const bool pending = ! send_queue.empty();
+          pthread_mutex_unlock(&mutex);
+
+          if(next.first >= 0) {
+            credit--;
+            waiting_credit = false;
+            send_frame(next.first, next.second);
+            continue;
+          }
+
+          if(pending && ! waiting_credit) {
+            waiting_credit = true;
+            pthread_mutex_lock(&mutex);
+            st.credit_waits++;
+            pthread_mutex_unlock(&mutex);
+          }
+          if(stop && ! pending && inflight.empty()) {
+            break;
+          }
+
+          // wakes up by a credit (POLLIN), a completion (POLLERR) or write() (wake)
+          struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wake, POLLIN, 0 } };
+          if(poll(fds, 2, 100) > 0 && (fds[1].revents & POLLIN)) {
+            uint64_t v;
+            if(sizeof(v) != read(wake, &v, sizeof(v))) {
+              // already cleared
+            }
+          }
+        }
+      }
+
+      void receive_credits() {
+        for(;;) {
+          ssize_t r = recv(fd, msg + msg_bytes, sizeof(msg) - msg_bytes, MSG_DONTWAIT);
+          if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+          }
+          if(r <= 0) {
+            fprintf(stderr, "Connection to the storage server is lost.\n");
+            abort();
+          }
+          msg_bytes += r;
+          if(msg_bytes < sizeof(msg)) {
+            continue;
+          }
+          msg_bytes = 0;
+          netsink::message_t m;
+          m.unpack(msg);
+          if(m.type != netsink::CREDIT) {
+            fprintf(stderr, "Unexpected message %u from the storage server.\n", m.type);
+            abort();
+          }
+          credit += m.value;
+        }
+      }
+
+      void send_frame(slot_id_t id, int index) {
+        netsink::message_t h;
+        h.type = netsink::FRAME;
+        h.value = index;
+        byte_t * header = headers + netsink::message_t::SIZE * id;
+        h.pack(header);
+
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = netsink::message_t::SIZE;
+        iov[1].iov_base = slots[id];
+        iov[1].iov_len = buf_size;
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = 2;
+
+        inflight_t f;
+        f.id = id;
+        f.zc = false;
+        while(mh.msg_iovlen > 0) {
+          // MSG_ZEROCOPY fails with ENOBUFS if too many sends are pending the notification
+          int flags = MSG_NOSIGNAL | (use_zerocopy ? MSG_ZEROCOPY : 0);
+          ssize_t r = sendmsg(fd, &mh, flags);
+          if(r < 0 && errno == ENOBUFS && use_zerocopy) {
+            r = sendmsg(fd, &mh, MSG_NOSIGNAL);
+            flags = MSG_NOSIGNAL;
+          }
+          if(r < 0 && errno == EINTR) {
+            continue;
+          }
+          if(r < 0) {
+            perror("sendmsg");
+            fprintf(stderr, "Connection to the storage server is lost.\n");
+            abort();
+          }
+          if(flags & MSG_ZEROCOPY) {
+            f.last = zc_next++;
+            f.zc = true;
+          }
+          // skip the bytes sent
+          while(mh.msg_iovlen > 0 && (size_t)r >= mh.msg_iov[0].iov_len) {
+            r -= mh.msg_iov[0].iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+          }
+          if(mh.msg_iovlen > 0) {
+            mh.msg_iov[0].iov_base = reinterpret_cast<char *>(mh.msg_iov[0].iov_base) + r;
+            mh.msg_iov[0].iov_len -= r;
+          }
+        }
+
+        pthread_mutex_lock(&mutex);
+        st.frames++;
+        pthread_mutex_unlock(&mutex);
+
+        inflight.push_back(f);
+        release_completed();
+      }
+
+      /**
+       * Read the zerocopy notifications from the error queue
+       */
+      void reap_completions() {
+        if(inflight.empty()) {
+          return;
+        }
+        for(;;) {
+          char control[128];
+          struct msghdr mh;
+          memset(&mh, 0, sizeof(mh));
+          mh.msg_control = control;
+          mh.msg_controllen = sizeof(control);
+          if(recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+          }
+          for(struct cmsghdr * cm = CMSG_FIRSTHDR(&mh) ; cm ; cm = CMSG_NXTHDR(&mh, cm)) {
+            if(! ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+              continue;
+            }
+            const struct sock_extended_err * e = reinterpret_cast<const struct sock_extended_err *>(CMSG_DATA(cm));
+            if(e->ee_errno != 0 || e->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+              continue;
+            }
+            // IDs [ee_info, ee_data] are completed
+            for(uint32_t i=e->ee_info ; i != e->ee_data + 1 ; i++) {
+              zc_completed.insert(i);
+            }
+            pthread_mutex_lock(&mutex);
+            if(e->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+              st.copied += e->ee_data - e->ee_info + 1;
+            } else {
+              st.zerocopy += e->ee_data - e->ee_info + 1;
+            }
+            pthread_mutex_unlock(&mutex);
+          }
+        }
+        while(! zc_completed.empty() && *zc_completed.begin() == zc_done) {
+          zc_completed.erase(zc_completed.begin());
+          zc_done++;
+        }
+        release_completed();
+      }
+
+      /**
+       * Give back the slots whose sends are all completed, in order
+       */
+      void release_completed() {
+        while(! inflight.empty()) {
+          const inflight_t & f = inflight.front();
+          // (int32_t) for the wrap around of the IDs
+          if(f.zc && (int32_t)(f.last - zc_done) >= 0) {
+            break;
+          }
+          release(f.id);
+          inflight.pop_front();
+        }
+      }
+
+      int fd;
+      /// eventfd to wake up the sender thread
+      int wake;
+      int n_slots;
+      size_t buf_size;
+      std::vector<byte_t *> slots;
+      /// message_t of FRAME of each slot, kept until the send is completed
+      byte_t * headers;
+      bool use_zerocopy;
+
+      pthread_t thread;
+      pthread_mutex_t mutex;
+      pthread_cond_t cond_free;
+
+      // shared, protected by mutex
+      std::vector<slot_id_t> free_slots;
+      std::deque<std::pair<slot_id_t, int> > send_queue;
+      bool stopping;
+      stat_t st;
+
+      // the following are for the sender thread
+      unsigned long long credit;
+      byte_t msg[netsink::message_t::SIZE];
+      size_t msg_bytes;
+      std::deque<inflight_t> inflight;
+      uint32_t zc_next;
+      uint32_t zc_done;
+      std::set<uint32_t> zc_completed;
+    };
+  }
+}
+
+#endif
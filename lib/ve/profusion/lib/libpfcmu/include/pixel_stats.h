@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   pixel_stats.h
+ *
+ * @brief  Per-pixel statistics of all the cameras over a stream of frames
+ *
+ * The accumulator keeps the mean, variance, min and max of each pixel
+ * over any num of frames in a fixed memory (16 bytes per pixel).  Each
+ * frame is added to 16-bit sums and 32-bit sums of squares by SSE2 or
+ * AVX2 kernels, which cannot overflow within a block of BLOCK frames.
+ * Every block is then merged into the float mean and M2 by the formula
+ * of Chan et al., a camera per thread.
+ *
+ * The result is a map (.pxs) of each pixel:
+ *
+ *   dark   mean, i.e., the dark frame if the lens is capped
+ *   fpn    mean - level of the camera (median of the means), i.e., the
+ *          fixed pattern noise
+ *   noise  standard deviation over the frames (temporal noise)
+ *   min, max
+ *   flags  HOT, DEAD or STUCK (see classify_t)
+ *
+ * dark, fpn and noise are fixed point of 1/SCALE.  The file has a
+ * header_t followed by the planes of each camera in the order above,
+ * in little endian.
+ */
+#ifndef PFCMU_PIXEL_STATS_H
+#define PFCMU_PIXEL_STATS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "pfcmu_config.h"
+
+class WorkerPool;
+
+namespace PFCMU {
+  namespace pixel_stats {
+    /// frames summed before merged into the float statistics
+    const int BLOCK = 256;
+    /// dark, fpn and noise of a map are in 1/SCALE
+    const int SCALE = 16;
+
+    enum flag_t {
+      /// brighter than the level by hot_level
+      HOT = 1,
+      /// darker than the level by dead_level
+      DEAD = 2,
+      /// max - min is not more than stuck_range
+      STUCK = 4,
+    };
+
+    struct classify_t {
+      int hot_level;
+      int dead_level;
+      int stuck_range;
+
+      classify_t() : hot_level(24), dead_level(24), stuck_range(0) {
+      }
+    };
+
+    struct header_t {
+      static const size_t SIZE = 64;
+      uint32_t cams;
+      uint32_t width;
+      uint32_t height;
+      uint64_t frames;
+      classify_t classify;
+    };
+
+    /**
+     * Per-camera summary of a map
+     */
+    struct summary_t {
+      /// median of the means
+      float level;
+      /// standard deviation of the means (DSNU)
+      float dsnu;
+      /// RMS of the temporal noise
+      float noise;
+      int hot;
+      int dead;
+      int stuck;
+    };
+
+    struct map_t {
+      header_t header;
+      /// planes of width*height per camera
+      std::vector<uint16_t> dark;
+      std::vector<int16_t> fpn;
+      std::vector<uint16_t> noise;
+      std::vector<uint8_t> min;
+      std::vector<uint8_t> max;
+      std::vector<uint8_t> flags;
+      summary_t summary[PFCMU::CAMS];
+
+      size_t pixels() const {
+        return (size_t)header.width * header.height;
+      }
+    };
+
+    /**
+     * @return 0 on success, negative on error
+     */
+    int save(const char * filename, const map_t & map);
+
+    /**
+     * @return 0 on success, negative if not a map
+     */
+    int load(const char * filename, map_t * map);
+
+    /**
+     * @return true if the AVX2 kernel is used
+     */
+    bool avx2();
+
+    class accumulator_t {
+    public:
+      accumulator_t();
+      ~accumulator_t();
+
+      /**
+       * @param width [in] width of a camera image
+       * @param height [in] height of a camera image
+       * @param threads [in] num of threads (0 = num of CPUs)
+       */
+      void init(int width, int height, int threads = 0);
+
+      /**
+       * Add a frame
+       *
+       * @param frame [in] CAMS images of width*height bytes, as given by
+       *                   Capture::frame() or RAWFile::read()
+       */
+      void feed(const void * frame);
+
+      /**
+       * @return num of the frames fed
+       */
+      unsigned long long frames() const {
+        return m_frames;
+      }
+
+      /**
+       * Make the map of the frames fed so far
+       */
+      void make_map(const classify_t & classify, map_t * map);
+
+    private:
+      accumulator_t(const accumulator_t &); // to disable "object copy"
+
+      void add(const unsigned char * frame, int camera);
+      /**
+       * Merge the sums of the last `block` frames into the mean and M2
+       */
+      void merge(int camera, int block);
+      void make_camera_map(map_t * map, int camera);
+
+      int m_width;
+      int m_height;
+      unsigned long long m_frames;
+      /// frames in the current block
+      int m_block;
+
+      // the sums and squares of the current block, and the statistics of the rest
+      std::vector<uint16_t> m_sum;
+      std::vector<uint32_t> m_sq;
+      std::vector<uint8_t> m_min;
+      std::vector<uint8_t> m_max;
+      std::vector<float> m_mean;
+      std::vector<float> m_m2;
+
+      WorkerPool * m_pool;
+    };
+  }
+}
+
+#endif
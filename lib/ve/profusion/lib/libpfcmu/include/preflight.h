@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   preflight.h
+ *
+ * @brief  Check if the disk and the system can sustain a capture
+ *
+ * Replays the write pattern of capture (block size, d_ringnum, d_align,
+ * O_DIRECT and fallocate by libaio::writer_t) with the copy from the
+ * camera and the live output, first as fast as possible (burst) and
+ * then paced at the fps by a virtual camera clock.  The paced run counts
+ * the frames which would be dropped, i.e., processed after the camera
+ * ring of c_ringnum frames overwrote them.
+ *
+ * It also checks the prerequisites (SCHED_FIFO, rlimits, huge pages,
+ * O_DIRECT and fallocate on the disk, and free space for the take).
+ */
+#ifndef PFCMU_PREFLIGHT_H
+#define PFCMU_PREFLIGHT_H
+
+#include <string>
+#include <vector>
+
+namespace PFCMU {
+  namespace preflight {
+    enum status_t {
+      OK,
+      WARN,
+      FAIL,
+    };
+
+    struct config_t {
+      /// test file on the disk to be used (removed afterwards)
+      std::string out;
+      /// live output dir (empty = no live output)
+      std::string live;
+      int width;
+      int height;
+      unsigned int fps;
+      unsigned int c_ringnum;
+      unsigned int d_ringnum;
+      unsigned int d_align;
+      /// length of the paced run
+      double seconds;
+      /// frames of the take, for the free space (0 = not checked)
+      long long num;
+      /// frames locked in RAM by --spill_frames or --pre
+      long long lock_frames;
+      /// frames of them on the huge pages, i.e., by --pre only
+      long long pre_frames;
+      /// burst throughput / required throughput to pass without a warning
+      double min_margin;
+
+      config_t() : width(640), height(480), fps(25), c_ringnum(8), d_ringnum(8), d_align(4096),
+                   seconds(30), num(0), lock_frames(0), pre_frames(0), min_margin(1.2) {
+      }
+    };
+
+    struct check_t {
+      std::string name;
+      status_t status;
+      std::string detail;
+    };
+
+    struct report_t {
+      /// MB/s to be written at the fps
+      double required_mbps;
+      /// MB/s written as fast as possible
+      double burst_mbps;
+      /// burst_mbps / required_mbps
+      double margin;
+      /// MB/s written in the paced run
+      double sustained_mbps;
+      /// MB/s of memcpy of frames
+      double memcpy_mbps;
+
+      /// time blocked for a free slot in the paced run (usec)
+      double wait_p50;
+      double wait_p99;
+      double wait_p999;
+      double wait_max;
+
+      /// frames processed later than a frame period after the arrival
+      int late_frames;
+      /// frames which would be dropped by the camera
+      int dropped_frames;
+      int frames;
+
+      std::vector<check_t> checks;
+
+      report_t() : required_mbps(0), burst_mbps(0), margin(0), sustained_mbps(0), memcpy_mbps(0),
+                   wait_p50(0), wait_p99(0), wait_p999(0), wait_max(0), late_frames(0), dropped_frames(0), frames(0) {
+      }
+
+      /// the worst status of the checks
+      status_t status() const;
+    };
+
+    /**
+     * Check the prerequisites only (quick)
+     */
+    void check_system(const config_t & config, report_t * report);
+
+    /**
+     * Check the prerequisites and run the benchmarks (takes config.seconds and more)
+     */
+    void run(const config_t & config, report_t * report);
+
+    std::string to_string(const report_t & report);
+
+    const char * status2str(status_t s);
+  }
+}
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   remap.h
+ *
+ * @brief  Fixed-point remap tables and the bilinear remap of the cameras
+ *
+ * A RemapTable is a compact form of the float maps of cvRemap: the
+ * integer source position (int16 x, y) and the bilinear weights
+ * (uint8 wx, wy in 1/ONE) of each output pixel, i.e., 6 bytes per
+ * pixel instead of 8.  The pixels mapped outside of the source are
+ * marked by wx = OUTLIER and filled with 0, as CV_WARP_FILL_OUTLIERS.
+ *
+ * The table is applied by an AVX2 kernel which gathers the 2x2 source
+ * pixels of 8 output pixels at once, or by the scalar code of the same
+ * arithmetic otherwise, so that both give the same result.
+ *
+ * The same table can also demosaic a Bayer image and remap it at once
+ * (apply_bayer()).  Each colour of an output pixel is interpolated
+ * bilinearly from the pixels of the colour around the source position,
+ * i.e., on the lattice of R or B, and on the 45-degree lattice of G.
+ * At the integer positions this is the bilinear demosaic of cvCvtColor,
+ * and a table of a smaller output gives the downscaled image directly,
+ * without the full-size BGR and remapped intermediates.
+ *
+ * A table can be saved to and mmapped from a file, so that a cached
+ * table costs nothing at startup.  The file is a 64-byte header and
+ * the x, y, wx and wy planes in the byte order of the host.
+ */
+#ifndef PFCMU_REMAP_H
+#define PFCMU_REMAP_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+#include "pfcmu_config.h"
+
+class WorkerPool;
+
+namespace PFCMU {
+  class RemapTable {
+  public:
+    /// weights are in 1/ONE
+    static const int ONE = 128;
+    /// wx of the pixels mapped outside of the source
+    static const uint8_t OUTLIER = 255;
+
+    /// Bayer patterns named after the codes of cvCvtColor (e.g., CV_BayerGR2BGR)
+    enum bayer_t {
+      BAYER_BG,
+      BAYER_GB,
+      BAYER_RG,
+      BAYER_GR,
+    };
+
+    RemapTable();
+    ~RemapTable();
+
+    /**
+     * Build the table from the float maps (as given by cvInitUndistortMap)
+     *
+     * @param width [in] width of the maps and the output
+     * @param height [in] height of the maps and the output
+     * @param mapx [in] source x of each output pixel (width*height)
+     * @param mapy [in] source y of each output pixel (width*height)
+     * @param src_width [in] width of the source
+     * @param src_height [in] height of the source
+     */
+    void build(int width, int height, const float * mapx, const float * mapy, int src_width, int src_height);
+
+    /**
+     * @param key [in] stored in the file to be checked by load()
+     * @return 0 on success, negative on error
+     */
+    int save(const char * filename, uint32_t key) const;
+
+    /**
+     * mmap a table saved by save()
+     *
+     * @param key [in] should be the key given to save()
+     * @return 0 on success, negative if not found or not of the key
+     */
+    int load(const char * filename, uint32_t key);
+
+    void clear();
+
+    bool empty() const {
+      return m_x == NULL;
+    }
+
+    int width() const {
+      return m_width;
+    }
+
+    int height() const {
+      return m_height;
+    }
+
+    int src_width() const {
+      return m_src_width;
+    }
+
+    int src_height() const {
+      return m_src_height;
+    }
+
+    /**
+     * Remap rows [row_begin:row_end) of the output
+     *
+     * @param src [in] src_width*src_height bytes
+     * @param dst [out] width*height, each row is dst_step bytes
+     */
+    void apply(const unsigned char * src, unsigned char * dst, int dst_step, int row_begin, int row_end) const;
+
+    void apply(const unsigned char * src, unsigned char * dst, int dst_step) const {
+      apply(src, dst, dst_step, 0, m_height);
+    }
+
+    /**
+     * Demosaic and remap rows [row_begin:row_end) of the output
+     *
+     * @param src [in] Bayer image of src_width*src_height bytes
+     * @param dst [out] BGR of width*height, each row is dst_step bytes
+     * @param pattern [in] Bayer pattern of src (BAYER_GR for PF-CMU, see CV_BAYER2BGR)
+     */
+    void apply_bayer(const unsigned char * src, unsigned char * dst, int dst_step, bayer_t pattern, int row_begin, int row_end) const;
+
+    void apply_bayer(const unsigned char * src, unsigned char * dst, int dst_step, bayer_t pattern = BAYER_GR) const {
+      apply_bayer(src, dst, dst_step, pattern, 0, m_height);
+    }
+
+    /**
+     * @return true if the AVX2 kernel is used
+     */
+    static bool avx2();
+
+  private:
+    RemapTable(const RemapTable &); // to disable "object copy"
+
+    int m_width;
+    int m_height;
+    int m_src_width;
+    int m_src_height;
+
+    // planes of width*height, in m_buf or in m_map
+    const int16_t * m_x;
+    const int16_t * m_y;
+    const uint8_t * m_wx;
+    const uint8_t * m_wy;
+
+    std::vector<unsigned char> m_buf;
+    void * m_map;
+    size_t m_map_bytes;
+  };
+
+  /**
+   * Remap of all the cameras of a frame, parallel over the cameras and the rows
+   */
+  class Remapper {
+  public:
+    Remapper();
+    ~Remapper();
+
+    /**
+     * @param threads [in] num of threads (0 = num of CPUs)
+     */
+    void init(int threads = 0);
+
+    RemapTable & table(int camera) {
+      return m_tables[camera];
+    }
+
+    const RemapTable & table(int camera) const {
+      return m_tables[camera];
+    }
+
+    /**
+     * Remap each camera by its table.  All the tables should have been
+     * set up for the same source and output size.
+     *
+     * @param frame [in] CAMS images of src_width*src_height, as given by
+     *                   Capture::frame() or RAWFile::read()
+     * @param out [out] CAMS images of width*height
+     */
+    void apply(const void * frame, void * out);
+
+    /**
+     * Demosaic and remap each camera by its table (see RemapTable::apply_bayer())
+     *
+     * @param frame [in] CAMS Bayer images of src_width*src_height
+     * @param out [out] CAMS BGR images of width*height*3
+     */
+    void apply_bayer(const void * frame, void * out, RemapTable::bayer_t pattern = RemapTable::BAYER_GR);
+
+  private:
+    Remapper(const Remapper &); // to disable "object copy"
+
+    void check() const;
+    /**
+     * @param bayer [in] pattern for apply_bayer(), or negative for apply()
+     */
+    void apply_band(const unsigned char * frame, unsigned char * out, int bayer, int job);
+
+    RemapTable m_tables[PFCMU::CAMS];
+    WorkerPool * m_pool;
+  };
+}
+
+#endif
@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   segmented_writer.h
+ *
+ * @brief  Linux AIO writer rolling to a new file every K frames
+ *
+ * writer_t needs the number of frames in advance to preallocate the
+ * file.  This writer instead splits the recording into segments of K
+ * frames (out.dat.000000, out.dat.000001, ...), each preallocated when
+ * it is created.  A background thread creates the next segment ahead of
+ * time and closes the finished ones, so that the capture thread does not
+ * stall at the boundaries.  The manifest (see PFCMU::StripeLayout) lists
+ * the segments, and lets PFCMU::RAWFile read them as a single recording.
+ *
+ * clean() truncates the last segment to the frames written and removes
+ * the segments prepared but not used.
+ */
+#ifndef PFCMU_SEGMENTED_WRITER_H
+#define PFCMU_SEGMENTED_WRITER_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "linux_aio.h"
+#include "stripe_layout.h"
+
+namespace PFCMU {
+  namespace libaio {
+    class segmented_writer_t : public writer_base_t {
+    private:
+      std::string manifest;
+      io_context_t ctx;
+      int n_slots;
+
+      struct iocb * obj;
+      byte_t ** buf_aligned;
+      size_t buf_size;
+
+      /// slots not in use
+      std::vector<slot_id_t> free_slots;
+      /// segment of each slot in flight, or -1
+      std::vector<int> segment_of_slot;
+      /// num of writes in flight of each segment
+      std::vector<int> inflight;
+      /// max index written + 1
+      off64_t written;
+      /// the segment written last, the ones before it are closed when finished
+      int current;
+
+      pthread_t thread;
+      bool running;
+
+      // the following are shared with the thread, and guarded by mutex
+      StripeLayout layout;
+      /// fd of each segment, or -1 if closed
+      std::vector<int> fds;
+      /// num of segments created
+      int prepared;
+      /// num of segments to be created
+      int wanted;
+      /// fds of the finished segments
+      std::vector<int> to_close;
+      /// the manifest does not list all the segments
+      bool dirty;
+      bool stop;
+      /// num of writes waited for the creation of the segment
+      unsigned long long n_stalls;
+
+      pthread_mutex_t mutex;
+      pthread_cond_t request;
+      pthread_cond_t ready;
+
+    public:
+      segmented_writer_t() : n_slots(0), obj(NULL), buf_aligned(NULL), buf_size(0), written(0), current(0), running(false),
+                             prepared(0), wanted(0), dirty(false), stop(false), n_stalls(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&request, NULL);
+        pthread_cond_init(&ready, NULL);
+      }
+
+      ~segmented_writer_t() {
+        clean();
+        pthread_cond_destroy(&ready);
+        pthread_cond_destroy(&request);
+        pthread_mutex_destroy(&mutex);
+      }
+
+      void clean() {
+        if(! n_slots) {
+          return;
+        }
+
+        // wait for all the writes
+        for(;;) {
+          int n = 0;
+          for(unsigned int i=0 ; i<inflight.size() ; i++) {
+            n += inflight[i];
+          }
+          if(n == 0) {
+            break;
+          }
+          reap(1);
+        }
+
+        if(running) {
+          pthread_mutex_lock(&mutex);
+          stop = true;
+          pthread_cond_signal(&request);
+          pthread_mutex_unlock(&mutex);
+          pthread_join(thread, NULL);
+          running = false;
+        }
+
+        for(unsigned int i=0 ; i<to_close.size() ; i++) {
+          fsync(to_close[i]);
+          close(to_close[i]);
+        }
+        to_close.clear();
+
+        // cut the preallocation of the last segment, and remove the ones not used
+        const int last = written > 0 ? (written - 1) / layout.segment : 0;
+        for(int i=0 ; i<prepared ; i++) {
+          if(i == last) {
+            const off64_t bytes = (written - last * layout.segment) * buf_size;
+            if(0 != (fds[i] != -1 ? ftruncate64(fds[i], bytes) : truncate64(path(i).c_str(), bytes))) {
+              perror("truncate64");
+            }
+          }
+          if(fds[i] != -1) {
+            fsync(fds[i]);
+            close(fds[i]);
+            fds[i] = -1;
+          }
+          if(i > last) {
+            unlink(path(i).c_str());
+          }
+        }
+        if(prepared > last + 1) {
+          layout.paths.resize(last + 1);
+          prepared = last + 1;
+        }
+        save_manifest(layout);
+        fds.clear();
+
+        io_destroy(ctx);
+
+        if(obj) {
+          free(obj);
+          obj = NULL;
+        }
+
+        if(buf_aligned) {
+          for(int i=0 ; i<n_slots ; i++) {
+            if(buf_aligned[i]) {
+              free(buf_aligned[i]);
+            }
+          }
+          free(buf_aligned);
+          buf_aligned = NULL;
+        }
+
+        free_slots.clear();
+        segment_of_slot.clear();
+        inflight.clear();
+        n_slots = 0;
+      }
+
+      int is_initialized() const {
+        return n_slots;
+      }
+
+      /**
+       * Initialize and make the instance be ready to write
+       *
+       * @param manifest [in] filename of the manifest (read by RAWFile as the recording). The segments are manifest.000000, manifest.000001, ...
+       * @param blocksize [in] bytes in a single write (= a frame)
+       * @param bufnum [in] ring buffer depth
+       * @param segment [in] number of blocks in a segment
+       * @param align [in] memory alignment for O_DIRECT (do not modify unless you know what you are doing)
+       */
+      void init(const char * manifest, off64_t blocksize, off64_t bufnum, off64_t segment, off64_t align=4096) {
+        clean();
+
+        if(segment < 1) {
+          fprintf(stderr, "Invalid segment size %lld for %s.\n", (long long)segment, manifest);
+          abort();
+        }
+
+        this->manifest = manifest;
+        this->n_slots = bufnum;
+        this->buf_size = blocksize;
+
+        layout = StripeLayout();
+        layout.blocksize = blocksize;
+        layout.segment = segment;
+
+        memset(&ctx, 0, sizeof(io_context_t));
+        if( 0 != io_setup(n_slots, &ctx) ) {
+          perror("io_setup");
+          abort();
+        }
+
+        obj = (struct iocb *)malloc(sizeof(struct iocb) * n_slots);
+        buf_aligned = (byte_t **)malloc(sizeof(byte_t *) * n_slots);
+        if(NULL == obj || NULL == buf_aligned) {
+          perror("malloc");
+          abort();
+        }
+
+        for(int i=0 ; i<n_slots ; i++) {
+          void * p = NULL;
+          if(0 != posix_memalign(&p, align, blocksize)) {
+            fprintf(stderr, "posix_memalign returned error\n"); // posix_memalign does not set errno.
+            abort();
+          }
+          buf_aligned[i] = reinterpret_cast<byte_t *>(p);
+        }
+
+        segment_of_slot.assign(n_slots, -1);
+        for(int i=n_slots-1 ; i>=0 ; i--) {
+          free_slots.push_back(i);
+        }
+        written = 0;
+        current = 0;
+
+        fds.clear();
+        to_close.clear();
+        prepared = 0;
+        wanted = 1 + LOOKAHEAD;
+        dirty = false;
+        stop = false;
+        n_stalls = 0;
+        if(0 != pthread_create(&thread, NULL, prepare_main, this)) {
+          perror("pthread_create");
+          abort();
+        }
+        running = true;
+
+        // the first segment should be ready before the capture starts
+        pthread_mutex_lock(&mutex);
+        while(prepared < 1) {
+          pthread_cond_wait(&ready, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+      }
+
+      /**
+       * @return num of writes waited for the creation of the segment (should be 0)
+       */
+      unsigned long long stalls() {
+        pthread_mutex_lock(&mutex);
+        const unsigned long long n = n_stalls;
+        pthread_mutex_unlock(&mutex);
+        return n;
+      }
+
+      /**
+       * @return num of segments created so far
+       */
+      int segments() {
+        pthread_mutex_lock(&mutex);
+        const int n = prepared;
+        pthread_mutex_unlock(&mutex);
+        return n;
+      }
+
+      slot_id_t get_available_slot_id() {
+        if(free_slots.empty()) {
+          reap(0);
+        }
+        while(free_slots.empty()) {
+          reap(1);
+        }
+
+        slot_id_t id = free_slots.back();
+        free_slots.pop_back();
+        return id;
+      }
+
+      slot_id_t try_get_available_slot_id() {
+        if(free_slots.empty()) {
+          reap(0);
+          if(free_slots.empty()) {
+            return -1;
+          }
+        }
+        slot_id_t id = free_slots.back();
+        free_slots.pop_back();
+        return id;
+      }
+
+      byte_t * buf(slot_id_t id) {
+        return buf_aligned[id];
+      }
+
+      int write(slot_id_t id, int index) {
+        const int s = index / layout.segment;
+
+        pthread_mutex_lock(&mutex);
+        if(s + 1 + LOOKAHEAD > wanted) {
+          wanted = s + 1 + LOOKAHEAD;
+          pthread_cond_signal(&request);
+        }
+        if(s >= prepared) {
+          n_stalls++;
+          while(s >= prepared) {
+            pthread_cond_wait(&ready, &mutex);
+          }
+        }
+        if(fds[s] == -1) {
+          // written again after closed (e.g., capture restarts from the index 0)
+          fds[s] = reopen(path(s).c_str());
+        }
+        const int fd = fds[s];
+        pthread_mutex_unlock(&mutex);
+
+        struct iocb * cb[1] = { &(obj[id]) };
+        io_prep_pwrite(cb[0], fd, buf(id), buf_size, layout.offset_of(index) * buf_size);
+        int r = io_submit(ctx, 1, cb);
+        if( r != 1 ) {
+          free_slots.push_back(id);
+          return r;
+        }
+
+        if((int)inflight.size() <= s) {
+          inflight.resize(s + 1, 0);
+        }
+        inflight[s]++;
+        segment_of_slot[id] = s;
+        written = std::max(written, (off64_t)index + 1);
+        if(s > current) {
+          current = s;
+          close_finished();
+        } else if(s < current) {
+          // the index went back (e.g., capture restarts from the index 0), so that the segment
+          // written now is not closed by close_finished() and reopened by every write
+          current = s;
+        }
+        return 0;
+      }
+
+    private:
+      segmented_writer_t(const segmented_writer_t &); // to disable "object copy"
+
+      /// num of segments created ahead of the current one
+      static const int LOOKAHEAD = 2;
+
+      /// filename of a segment relative to the manifest
+      std::string relative_path(int segment) const {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), ".%06d", segment);
+        return Util::basename(manifest.c_str()) + suffix;
+      }
+
+      std::string path(int segment) const {
+        return Util::dirname(manifest.c_str()) + "/" + relative_path(segment);
+      }
+
+      /// replace the manifest atomically, for the readers during the recording
+      void save_manifest(const StripeLayout & l) const {
+        const std::string tmp = manifest + ".tmp";
+        if(0 != l.save(tmp.c_str()) || 0 != rename(tmp.c_str(), manifest.c_str())) {
+          perror("rename");
+          fprintf(stderr, "Cannot write the manifest %s.\n", manifest.c_str());
+          abort();
+        }
+      }
+
+      static int reopen(const char * filename) {
+        int fd = open64(filename, O_WRONLY|O_LARGEFILE|O_DIRECT);
+        if(fd < 0) {
+          fd = open64(filename, O_WRONLY|O_LARGEFILE);
+        }
+        if(fd < 0) {
+          perror("open64");
+          fprintf(stderr, "Cannot reopen %s.\n", filename);
+          abort();
+        }
+        return fd;
+      }
+
+      /**
+       * Return the finished slots to free_slots
+       *
+       * @param min_nr [in] num of events to wait for (0 = non-blocking)
+       */
+      void reap(int min_nr) {
+        struct io_event events[64];
+        struct timespec zero = { 0, 0 };
+        int r = io_getevents(ctx, min_nr, 64, events, min_nr ? NULL : &zero);
+        assert(r >= min_nr);
+        bool finished = false;
+        for(int i=0 ; i<r ; i++) {
+          slot_id_t id = ((intptr_t)(events[i].obj) - (intptr_t)(obj)) / sizeof(struct iocb);
+          assert(events[i].obj == &(obj[id]));
+          assert(events[i].res == buf_size);
+          assert(events[i].res2 == 0);
+          const int s = segment_of_slot[id];
+          segment_of_slot[id] = -1;
+          free_slots.push_back(id);
+          if(--inflight[s] == 0 && s < current) {
+            finished = true;
+          }
+        }
+        if(finished) {
+          close_finished();
+        }
+      }
+
+      /**
+       * Let the thread close the segments before the current one with no write in flight
+       */
+      void close_finished() {
+        pthread_mutex_lock(&mutex);
+        for(int i=0 ; i<current && i<(int)inflight.size() ; i++) {
+          if(inflight[i] == 0 && fds[i] != -1) {
+            to_close.push_back(fds[i]);
+            fds[i] = -1;
+          }
+        }
+        if(! to_close.empty()) {
+          pthread_cond_signal(&request);
+        }
+        pthread_mutex_unlock(&mutex);
+      }
+
+      static void * prepare_main(void * arg) {
+        reinterpret_cast<segmented_writer_t *>(arg)->prepare_loop();
+        return NULL;
+      }
+
+      /**
+       * Create (preallocate) the segments wanted, and close the finished ones
+       */
+      void prepare_loop() {
+        pthread_mutex_lock(&mutex);
+        for(;;) {
+          while(! stop && prepared >= wanted && ! dirty && to_close.empty()) {
+            pthread_cond_wait(&request, &mutex);
+          }
+          if(stop) {
+            break;
+          }
+
+          // creating a segment is the most urgent, since the capture may wait for it.
+          // the manifest and fsync() can take seconds while the disk is busy.
+          if(prepared < wanted) {
+            const int s = prepared;
+            pthread_mutex_unlock(&mutex);
+            const int fd = open_output(path(s).c_str(), layout.segment * buf_size);
+            pthread_mutex_lock(&mutex);
+
+            fds.push_back(fd);
+            layout.paths.push_back(relative_path(s));
+            prepared++;
+            dirty = true;
+            pthread_cond_broadcast(&ready);
+          } else if(dirty) {
+            const StripeLayout l = layout;
+            dirty = false;
+            pthread_mutex_unlock(&mutex);
+            save_manifest(l);
+            pthread_mutex_lock(&mutex);
+          } else {
+            const int fd = to_close.back();
+            to_close.pop_back();
+            pthread_mutex_unlock(&mutex);
+            fsync(fd);
+            close(fd);
+            pthread_mutex_lock(&mutex);
+          }
+        }
+        pthread_mutex_unlock(&mutex);
+      }
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   spill_writer.h
+ *
+ * @brief  Elastic RAM buffer in front of a writer to absorb disk stalls
+ *
+ * While the writer has a free slot, the frames go to the writer
+ * directly (zero copy).  When all its slots are being written (the disk
+ * stalls), the frames are spilled into a large pool of RAM slots, and a
+ * drain thread copies them to the writer in order when the disk catches
+ * up.  The frames coming meanwhile are spilled as well, so that the
+ * order of the writes is kept.
+ *
+ * The pool is pre-faulted and locked (mlock) at init(), so that
+ * spilling never waits for the kernel.  When the pool is exhausted,
+ * get_available_slot_id() follows the policy:
+ *
+ * - SPILL_BLOCK : wait for the drain thread (same as without the pool)
+ * - SPILL_DROP  : discard the frame and keep capturing (the block is left unwritten)
+ * - SPILL_ABORT : abort the recording
+ */
+#ifndef PFCMU_SPILL_WRITER_H
+#define PFCMU_SPILL_WRITER_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "linux_aio.h"
+
+namespace PFCMU {
+  namespace libaio {
+    class spill_writer_t : public writer_base_t {
+    public:
+      enum policy_t {
+        SPILL_BLOCK,
+        SPILL_DROP,
+        SPILL_ABORT,
+      };
+
+      struct stat_t {
+        /// frames given to the writer directly
+        unsigned long long direct;
+        /// frames spilled into the pool
+        unsigned long long spilled;
+        /// frames in the pool now
+        unsigned int backlog;
+        /// max of backlog
+        unsigned int high_water;
+        /// frames which found the pool exhausted
+        unsigned long long exhausted;
+        /// frames discarded by SPILL_DROP
+        unsigned long long dropped;
+        /// longest wait by SPILL_BLOCK in usec
+        unsigned long long max_block_usec;
+      };
+
+      /**
+       * @param text [in] "block", "drop" or "abort"
+       * @param policy [out] policy
+       * @return 0 on success, negative if unknown
+       */
+      static int parse_policy(const std::string & text, policy_t * policy) {
+        if(text == "block") {
+          *policy = SPILL_BLOCK;
+        } else if(text == "drop") {
+          *policy = SPILL_DROP;
+        } else if(text == "abort") {
+          *policy = SPILL_ABORT;
+        } else {
+          return -1;
+        }
+        return 0;
+      }
+
+      spill_writer_t() : writer(NULL), pool(MAP_FAILED), pool_bytes(0), n_slots(0), buf_size(0), policy(SPILL_BLOCK), running(false), stop(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&queued, NULL);
+        pthread_cond_init(&freed, NULL);
+        memset(&st, 0, sizeof(st));
+      }
+
+      ~spill_writer_t() {
+        clean();
+        pthread_cond_destroy(&freed);
+        pthread_cond_destroy(&queued);
+        pthread_mutex_destroy(&mutex);
+      }
+
+      /**
+       * Drain the pool, and finish writing of the writer
+       */
+      void clean() {
+        if(running) {
+          pthread_mutex_lock(&mutex);
+          stop = true;
+          pthread_cond_signal(&queued);
+          pthread_mutex_unlock(&mutex);
+          pthread_join(drainer, NULL);
+          running = false;
+        }
+
+        if(writer) {
+          writer->clean();
+          writer = NULL;
+        }
+
+        if(pool != MAP_FAILED) {
+          munlock(pool, pool_bytes);
+          munmap(pool, pool_bytes);
+          pool = MAP_FAILED;
+        }
+
+        queue.clear();
+        free_slots.clear();
+        n_slots = 0;
+      }
+
+      int is_initialized() const {
+        return writer ? writer->is_initialized() : 0;
+      }
+
+      /**
+       * Initialize and make the instance be ready to write
+       *
+       * @param writer [in] initialized writer (not owned)
+       * @param blocksize [in] bytes in a single write (same as the writer)
+       * @param slots [in] num of frames in the pool
+       * @param policy [in] what to do when the pool is exhausted
+       */
+      void init(writer_base_t * writer, size_t blocksize, int slots, policy_t policy) {
+        clean();
+
+        this->writer = writer;
+        this->buf_size = blocksize;
+        this->n_slots = slots;
+        this->policy = policy;
+        memset(&st, 0, sizeof(st));
+
+        // +1 for the frames discarded by SPILL_DROP
+        pool_bytes = blocksize * (slots + 1);
+        pool = mmap(NULL, pool_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+        if(pool == MAP_FAILED) {
+          perror("mmap");
+          fprintf(stderr, "Cannot allocate %zd bytes for the spill pool. Please check the available memory.\n", pool_bytes);
+          abort();
+        }
+        if(0 != mlock(pool, pool_bytes)) {
+          perror("mlock");
+          fprintf(stderr, "WARNING: Cannot lock %zd bytes of the spill pool. Please check ulimit -l.\n", pool_bytes);
+        }
+
+        for(int i=slots-1 ; i>=0 ; i--) {
+          free_slots.push_back(i);
+        }
+
+        stop = false;
+        if(0 != pthread_create(&drainer, NULL, drain_main, this)) {
+          perror("pthread_create");
+          abort();
+        }
+        running = true;
+      }
+
+      slot_id_t get_available_slot_id() {
+        pthread_mutex_lock(&mutex);
+
+        // directly, unless some frames are waiting in the pool
+        if(queue.empty()) {
+          slot_id_t id = writer->try_get_available_slot_id();
+          if(id >= 0) {
+            st.direct++;
+          }
+          if(id >= 0 || id == WRITE_FAILED) {
+            pthread_mutex_unlock(&mutex);
+            return id;
+          }
+        }
+
+        if(free_slots.empty()) {
+          st.exhausted++;
+          if(policy == SPILL_DROP) {
+            st.dropped++;
+            pthread_mutex_unlock(&mutex);
+            return DROP_ID;
+          }
+          if(policy == SPILL_ABORT) {
+            fprintf(stderr, "The spill pool of %d frames is exhausted. Abort.\n", n_slots);
+            abort();
+          }
+
+          struct timeval t0, t1;
+          gettimeofday(&t0, NULL);
+          while(free_slots.empty()) {
+            pthread_cond_wait(&freed, &mutex);
+          }
+          gettimeofday(&t1, NULL);
+          const unsigned long long usec = (t1.tv_sec - t0.tv_sec) * 1000000ULL + t1.tv_usec - t0.tv_usec;
+          st.max_block_usec = std::max(st.max_block_usec, usec);
+        }
+
+        slot_id_t k = free_slots.back();
+        free_slots.pop_back();
+        pthread_mutex_unlock(&mutex);
+        return SPILL_ID + k;
+      }
+
+      /**
+       * Never blocks, since the pool is used when the writer has no slot
+       *
+       * @return slot ID, or negative if the pool is exhausted as well
+       */
+      slot_id_t try_get_available_slot_id() {
+        pthread_mutex_lock(&mutex);
+        slot_id_t id = -1;
+        if(queue.empty()) {
+          id = writer->try_get_available_slot_id();
+          if(id >= 0) {
+            st.direct++;
+          }
+        }
+        if(id == -1 && ! free_slots.empty()) {
+          id = SPILL_ID + free_slots.back();
+          free_slots.pop_back();
+        }
+        pthread_mutex_unlock(&mutex);
+        return id;
+      }
+
+      byte_t * buf(slot_id_t id) {
+        if(id == DROP_ID) {
+          return slot(n_slots);
+        }
+        if(id >= SPILL_ID) {
+          return slot(id - SPILL_ID);
+        }
+        return writer->buf(id);
+      }
+
+      int write(slot_id_t id, int index) {
+        if(id == DROP_ID) {
+          return 0;
+        }
+
+        pthread_mutex_lock(&mutex);
+        int r = 0;
+        if(id >= SPILL_ID) {
+          entry_t e;
+          e.slot = id - SPILL_ID;
+          e.index = index;
+          queue.push_back(e);
+          st.spilled++;
+          st.high_water = std::max(st.high_water, (unsigned int)queue.size());
+          pthread_cond_signal(&queued);
+        } else {
+          r = writer->write(id, index);
+        }
+        pthread_mutex_unlock(&mutex);
+        return r;
+      }
+
+      void stat(stat_t * s) {
+        pthread_mutex_lock(&mutex);
+        *s = st;
+        s->backlog = queue.size();
+        pthread_mutex_unlock(&mutex);
+      }
+
+    private:
+      spill_writer_t(const spill_writer_t &); // to disable "object copy"
+
+      /// slot IDs of the pool are SPILL_ID + [0:n_slots-1]
+      static const slot_id_t SPILL_ID = 1 << 24;
+      static const slot_id_t DROP_ID = SPILL_ID - 1;
+      /// interval to poll the writer while the disk stalls
+      static const int POLL_USEC = 500;
+
+      struct entry_t {
+        int slot;
+        int index;
+      };
+
+      byte_t * slot(int k) {
+        return reinterpret_cast<byte_t *>(pool) + buf_size * k;
+      }
+
+      static void * drain_main(void * arg) {
+        reinterpret_cast<spill_writer_t *>(arg)->drain_loop();
+        return NULL;
+      }
+
+      /**
+       * Copy the spilled frames to the writer in order
+       */
+      void drain_loop() {
+        pthread_mutex_lock(&mutex);
+        for(;;) {
+          while(queue.empty() && ! stop) {
+            pthread_cond_wait(&queued, &mutex);
+          }
+          if(queue.empty()) {
+            break;
+          }
+
+          // the writer is shared with the capture thread, so do not block in it
+          slot_id_t id = writer->try_get_available_slot_id();
+          if(id == WRITE_FAILED) {
+            fprintf(stderr, "write failed while draining the spill RAM. Abort.\n");
+            abort();
+          }
+          if(id < 0) {
+            pthread_mutex_unlock(&mutex);
+            usleep(POLL_USEC);
+            pthread_mutex_lock(&mutex);
+            continue;
+          }
+
+          // the head stays in the queue until written, which keeps the capture thread spilling
+          const entry_t e = queue.front();
+          pthread_mutex_unlock(&mutex);
+          memcpy(writer->buf(id), slot(e.slot), buf_size);
+          pthread_mutex_lock(&mutex);
+
+          writer->write(id, e.index);
+          queue.pop_front();
+          free_slots.push_back(e.slot);
+          pthread_cond_signal(&freed);
+        }
+        pthread_mutex_unlock(&mutex);
+      }
+
+      writer_base_t * writer;
+      void * pool;
+      size_t pool_bytes;
+      int n_slots;
+      size_t buf_size;
+      policy_t policy;
+
+      pthread_t drainer;
+      bool running;
+
+      // the following are guarded by mutex
+      bool stop;
+      std::deque<entry_t> queue;
+      std::vector<int> free_slots;
+      stat_t st;
+
+      pthread_mutex_t mutex;
+      pthread_cond_t queued;
+      pthread_cond_t freed;
+    };
+  }
+}
+
+#endif
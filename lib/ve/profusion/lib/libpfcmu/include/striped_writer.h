@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   striped_writer.h
+ *
+ * @brief  Linux AIO writer striping the frames over several disks
+ *
+ * The chunks of frames are written round-robin to the stripes (see
+ * PFCMU::StripeLayout), so that the sustained rate is the sum of the
+ * disks instead of the slowest one.  Each stripe has its own file,
+ * preallocation and io_context, and the manifest written by init()
+ * lets PFCMU::RAWFile read the stripes as a single recording.
+ *
+ * The slots (buffers) are shared by all the stripes.  set_writeback()
+ * gives each stripe its own writeback_t, as the blocks of a stripe are
+ * written in order in its file.
+ */
+#ifndef PFCMU_STRIPED_WRITER_H
+#define PFCMU_STRIPED_WRITER_H
+
+#include <string>
+#include <vector>
+
+#include "linux_aio.h"
+#include "stripe_layout.h"
+
+namespace PFCMU {
+  namespace libaio {
+    class striped_writer_t : public writer_base_t {
+    private:
+      StripeLayout layout;
+      std::vector<int> fds;
+      std::vector<io_context_t> ctxs;
+      /// writeback of each stripe (see set_writeback())
+      std::vector<writeback_t *> wbs;
+      int n_slots;
+
+      struct iocb * obj;
+      byte_t ** buf_aligned;
+      size_t buf_size;
+
+      /// slots not in use
+      std::vector<slot_id_t> free_slots;
+      /// stripe of each slot in flight, or -1
+      std::vector<int> stripe_of_slot;
+      /// submission order of each slot
+      std::vector<unsigned long long> seq_of_slot;
+      unsigned long long seq;
+
+    public:
+      striped_writer_t() : n_slots(0), obj(NULL), buf_aligned(NULL), buf_size(0), seq(0) {
+      }
+
+      ~striped_writer_t() {
+        clean();
+        for(unsigned int i=0 ; i<wbs.size() ; i++) {
+          delete wbs[i];
+        }
+      }
+
+      void clean() {
+        for(unsigned int i=0 ; i<fds.size() ; i++) {
+          fsync(fds[i]);
+          wbs[i]->finish();
+          io_destroy(ctxs[i]);
+          close(fds[i]);
+        }
+        fds.clear();
+        ctxs.clear();
+
+        if(obj) {
+          free(obj);
+          obj = NULL;
+        }
+
+        if(buf_aligned) {
+          for(int i=0 ; i<n_slots ; i++) {
+            if(buf_aligned[i]) {
+              free(buf_aligned[i]);
+            }
+          }
+          free(buf_aligned);
+          buf_aligned = NULL;
+        }
+
+        free_slots.clear();
+        stripe_of_slot.clear();
+        seq_of_slot.clear();
+        n_slots = 0;
+      }
+
+      int is_initialized() const {
+        return n_slots;
+      }
+
+      /**
+       * Initialize and make the instance be ready to write
+       *
+       * @param manifest [in] filename of the manifest (read by RAWFile as the recording)
+       * @param paths [in] output filename of each stripe (should be on different disks)
+       * @param blocksize [in] bytes in a single write (= a frame)
+       * @param bufnum [in] ring buffer depth (shared by all the stripes)
+       * @param count [in] number of blocks to be written in total (can be 0, see writer_t::init())
+       * @param chunk [in] number of consecutive blocks written to a stripe
+       * @param align [in] memory alignment for O_DIRECT (do not modify unless you know what you are doing)
+       */
+      void init(const char * manifest, const std::vector<std::string> & paths, off64_t blocksize, off64_t bufnum, off64_t count, int chunk=1, off64_t align=4096) {
+        clean();
+
+        if(paths.empty() || chunk < 1) {
+          fprintf(stderr, "No stripe is given for %s.\n", manifest);
+          abort();
+        }
+
+        layout.blocksize = blocksize;
+        layout.chunk = chunk;
+        layout.paths = paths;
+        if(0 != layout.save(manifest)) {
+          perror("fopen");
+          fprintf(stderr, "Cannot write the manifest %s.\n", manifest);
+          abort();
+        }
+
+        this->n_slots = bufnum;
+        this->buf_size = blocksize;
+
+        fds.resize(paths.size());
+        ctxs.resize(paths.size());
+        // kept after clean() for writeback_stat()
+        for(unsigned int i=wbs.size() ; i<paths.size() ; i++) {
+          wbs.push_back(new writeback_t());
+        }
+        for(unsigned int i=0 ; i<paths.size() ; i++) {
+          fds[i] = open_output(paths[i].c_str(), blocksize * layout.blocks_on(i, count));
+
+          // every slot can be in flight on a single stripe
+          memset(&(ctxs[i]), 0, sizeof(io_context_t));
+          if( 0 != io_setup(n_slots, &(ctxs[i])) ) {
+            perror("io_setup");
+            abort();
+          }
+        }
+
+        obj = (struct iocb *)malloc(sizeof(struct iocb) * n_slots);
+        buf_aligned = (byte_t **)malloc(sizeof(byte_t *) * n_slots);
+        if(NULL == obj || NULL == buf_aligned) {
+          perror("malloc");
+          abort();
+        }
+
+        for(int i=0 ; i<n_slots ; i++) {
+          void * p = NULL;
+          if(0 != posix_memalign(&p, align, blocksize)) {
+            fprintf(stderr, "posix_memalign returned error\n"); // posix_memalign does not set errno.
+            abort();
+          }
+          buf_aligned[i] = reinterpret_cast<byte_t *>(p);
+        }
+
+        stripe_of_slot.assign(n_slots, -1);
+        seq_of_slot.assign(n_slots, 0);
+        for(int i=n_slots-1 ; i>=0 ; i--) {
+          free_slots.push_back(i);
+        }
+      }
+
+      /**
+       * Start the writeback of each stripe every `blocks` blocks of it (see writer_t::set_writeback())
+       *
+       * @param blocks [in] interval in blocks of a stripe (0 = leave it to the kernel)
+       */
+      void set_writeback(off64_t blocks) {
+        for(unsigned int i=0 ; i<fds.size() ; i++) {
+          wbs[i]->init(fds[i], buf_size, n_slots, blocks);
+        }
+      }
+
+      /**
+       * Statistics of the writeback summed over the stripes (max of each max)
+       */
+      writeback_t::stat_t writeback_stat() {
+        writeback_t::stat_t s;
+        memset(&s, 0, sizeof(s));
+        for(unsigned int i=0 ; i<layout.paths.size() ; i++) {
+          const writeback_t::stat_t t = wbs[i]->stat();
+          s.starts += t.starts;
+          s.start_max_usec = std::max(s.start_max_usec, t.start_max_usec);
+          s.start_total_usec += t.start_total_usec;
+          s.waits += t.waits;
+          s.wait_max_usec = std::max(s.wait_max_usec, t.wait_max_usec);
+          s.wait_total_usec += t.wait_total_usec;
+          s.max_dirty = std::max(s.max_dirty, t.max_dirty);
+        }
+        return s;
+      }
+
+      const StripeLayout & get_layout() const {
+        return layout;
+      }
+
+      slot_id_t get_available_slot_id() {
+        if(free_slots.empty()) {
+          // collect what have finished on any stripe
+          for(unsigned int i=0 ; i<ctxs.size() ; i++) {
+            reap(i, 0);
+          }
+        }
+        while(free_slots.empty()) {
+          // wait for the stripe of the oldest one, which should finish first
+          slot_id_t oldest = -1;
+          for(int i=0 ; i<n_slots ; i++) {
+            if(stripe_of_slot[i] >= 0 && (oldest < 0 || seq_of_slot[i] < seq_of_slot[oldest])) {
+              oldest = i;
+            }
+          }
+          assert(oldest >= 0); // all the slots are taken but not written
+          reap(stripe_of_slot[oldest], 1);
+        }
+
+        slot_id_t id = free_slots.back();
+        free_slots.pop_back();
+        return id;
+      }
+
+      slot_id_t try_get_available_slot_id() {
+        if(free_slots.empty()) {
+          for(unsigned int i=0 ; i<ctxs.size() ; i++) {
+            reap(i, 0);
+          }
+          if(free_slots.empty()) {
+            return -1;
+          }
+        }
+        slot_id_t id = free_slots.back();
+        free_slots.pop_back();
+        return id;
+      }
+
+      byte_t * buf(slot_id_t id) {
+        return buf_aligned[id];
+      }
+
+      int write(slot_id_t id, int index) {
+        const int s = layout.stripe_of(index);
+        const off64_t block = layout.offset_of(index);
+        struct iocb * cb[1] = { &(obj[id]) };
+        io_prep_pwrite(cb[0], fds[s], buf(id), buf_size, block*buf_size);
+        int r = io_submit(ctxs[s], 1, cb);
+        if( r == 1 ) {
+          wbs[s]->submitted(id, block);
+          stripe_of_slot[id] = s;
+          seq_of_slot[id] = seq++;
+          return 0;
+        } else {
+          free_slots.push_back(id);
+          return r;
+        }
+      }
+
+    private:
+      striped_writer_t(const striped_writer_t &); // to disable "object copy"
+
+      /**
+       * Return the finished slots of a stripe to free_slots
+       *
+       * @param stripe [in] stripe ID
+       * @param min_nr [in] num of events to wait for (0 = non-blocking)
+       */
+      void reap(int stripe, int min_nr) {
+        struct io_event events[64];
+        struct timespec zero = { 0, 0 };
+        int r = io_getevents(ctxs[stripe], min_nr, 64, events, min_nr ? NULL : &zero);
+        assert(r >= min_nr);
+        for(int i=0 ; i<r ; i++) {
+          slot_id_t id = ((intptr_t)(events[i].obj) - (intptr_t)(obj)) / sizeof(struct iocb);
+          assert(events[i].obj == &(obj[id]));
+          assert(events[i].res == buf_size);
+          assert(events[i].res2 == 0);
+          stripe_of_slot[id] = -1;
+          free_slots.push_back(id);
+          wbs[stripe]->completed(id);
+        }
+      }
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+/**
+ * @file   uring_writer.h
+ *
+ * @brief  io_uring version of libaio::writer_t
+ *
+ * Same slot API as libaio::writer_t, but
+ *
+ * - the slots and the file are registered once (IORING_OP_WRITE_FIXED),
+ * - the writes are submitted in batches of `batch` frames,
+ * - the completions are reaped from the shared ring without a syscall,
+ *   so get_available_slot_id() does not enter the kernel while some
+ *   slots are free, and
+ * - with `sqpoll`, a kernel thread submits the writes and the writer
+ *   needs no syscall at all in the steady state.
+ *
+ * Implemented by the raw syscalls (no liburing).
+ */
+#ifndef PFCMU_URING_WRITER_H
+#define PFCMU_URING_WRITER_H
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "linux_aio.h"
+
+namespace PFCMU {
+  namespace uring {
+    typedef libaio::slot_id_t slot_id_t;
+    typedef libaio::byte_t byte_t;
+
+    inline int sys_setup(unsigned int entries, struct io_uring_params * p) {
+      return syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    inline int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+      return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+    }
+
+    inline int sys_register(int fd, unsigned int opcode, const void * arg, unsigned int nr_args) {
+      return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    /**
+     * io_uring writer
+     */
+    class writer_t : public libaio::writer_base_t {
+    private:
+      int fd;
+      int ring_fd;
+      int n_slots;
+      int batch;
+      bool sqpoll;
+
+      byte_t ** buf_aligned;
+      size_t buf_size;
+      /// slots not in use
+      std::vector<slot_id_t> free_slots;
+      /// queued but not submitted to the kernel yet
+      unsigned int pending;
+      /// submitted but not completed
+      unsigned int in_flight;
+
+      libaio::writeback_t wb;
+
+      // the rings shared with the kernel
+      void * sq_ptr;
+      size_t sq_bytes;
+      void * cq_ptr;
+      size_t cq_bytes;
+      struct io_uring_sqe * sqes;
+      size_t sqes_bytes;
+
+      unsigned int * sq_head;
+      unsigned int * sq_tail;
+      unsigned int * sq_mask;
+      unsigned int * sq_flags;
+      unsigned int * sq_array;
+      unsigned int * cq_head;
+      unsigned int * cq_tail;
+      unsigned int * cq_mask;
+      struct io_uring_cqe * cqes;
+
+    public:
+      writer_t() : fd(-1), ring_fd(-1), n_slots(0), batch(1), sqpoll(false), buf_aligned(NULL), buf_size(0), pending(0), in_flight(0),
+                   sq_ptr(MAP_FAILED), sq_bytes(0), cq_ptr(MAP_FAILED), cq_bytes(0), sqes((struct io_uring_sqe *)MAP_FAILED), sqes_bytes(0) {
+      }
+
+      ~writer_t() {
+        clean();
+      }
+
+      /**
+       * Finish writing (waits until all current writing ends)
+       */
+      void clean() {
+        if(ring_fd != -1) {
+          flush();
+          while(in_flight > 0) {
+            wait(1);
+          }
+          sys_register(ring_fd, IORING_UNREGISTER_FILES, NULL, 0);
+          sys_register(ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        }
+
+        if(fd != -1) {
+          fsync(fd);
+          wb.finish();
+          close(fd);
+          fd = -1;
+        }
+
+        if(sqes != MAP_FAILED) {
+          munmap(sqes, sqes_bytes);
+          sqes = (struct io_uring_sqe *)MAP_FAILED;
+        }
+        if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+          munmap(cq_ptr, cq_bytes);
+        }
+        cq_ptr = MAP_FAILED;
+        if(sq_ptr != MAP_FAILED) {
+          munmap(sq_ptr, sq_bytes);
+          sq_ptr = MAP_FAILED;
+        }
+        if(ring_fd != -1) {
+          close(ring_fd);
+          ring_fd = -1;
+        }
+
+        if(buf_aligned) {
+          for(int i=0 ; i<n_slots ; i++) {
+            if(buf_aligned[i]) {
+              free(buf_aligned[i]);
+            }
+          }
+          free(buf_aligned);
+          buf_aligned = NULL;
+        }
+
+        free_slots.clear();
+        pending = 0;
+        in_flight = 0;
+        n_slots = 0;
+      }
+
+      int is_initialized() const {
+        return n_slots;
+      }
+
+      /**
+       * Initialize and make the instance be ready to write
+       *
+       * @param filename [in] output filename
+       * @param blocksize [in] bytes in a single write
+       * @param bufnum [in] ring buffer depth
+       * @param count [in] number of blocks to be written (see libaio::writer_t::init())
+       * @param batch [in] num of writes submitted at once
+       * @param sqpoll [in] let a kernel thread poll the submissions (needs root on older kernels)
+       * @param align [in] memory alignment for O_DIRECT (do not modify unless you know what you are doing)
+       */
+      void init(const char * filename, off64_t blocksize, off64_t bufnum, off64_t count, int batch=4, bool sqpoll=false, off64_t align=4096) {
+        clean();
+
+        this->n_slots = bufnum;
+        this->buf_size = blocksize;
+        this->batch = std::max(1, std::min(batch, (int)bufnum));
+        this->sqpoll = sqpoll;
+
+        this->fd = libaio::open_output(filename, blocksize*count);
+
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        if(sqpoll) {
+          p.flags |= IORING_SETUP_SQPOLL;
+          p.sq_thread_idle = 1000; // ms
+        }
+        ring_fd = sys_setup(n_slots, &p);
+        if(ring_fd < 0) {
+          perror("io_uring_setup");
+          fprintf(stderr, "Cannot setup io_uring%s. Please check the kernel version (5.1 or later).\n", sqpoll ? " with SQPOLL" : "");
+          abort();
+        }
+
+        // map the rings
+        sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if(p.features & IORING_FEAT_SINGLE_MMAP) {
+          sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+        }
+        sq_ptr = mmap(NULL, sq_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if(sq_ptr == MAP_FAILED) {
+          perror("mmap");
+          abort();
+        }
+        if(p.features & IORING_FEAT_SINGLE_MMAP) {
+          cq_ptr = sq_ptr;
+        } else {
+          cq_ptr = mmap(NULL, cq_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+          if(cq_ptr == MAP_FAILED) {
+            perror("mmap");
+            abort();
+          }
+        }
+        sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe *)mmap(NULL, sqes_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) {
+          perror("mmap");
+          abort();
+        }
+
+        byte_t * sq = (byte_t *)sq_ptr;
+        byte_t * cq = (byte_t *)cq_ptr;
+        sq_head = (unsigned int *)(sq + p.sq_off.head);
+        sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+        sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+        sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+        sq_array = (unsigned int *)(sq + p.sq_off.array);
+        cq_head = (unsigned int *)(cq + p.cq_off.head);
+        cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+        cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        // the buffers and the file are registered once
+        buf_aligned = (byte_t **)malloc(sizeof(byte_t *) * n_slots);
+        if(NULL == buf_aligned) {
+          perror("malloc");
+          abort();
+        }
+        std::vector<struct iovec> iov(n_slots);
+        for(int i=0 ; i<n_slots ; i++) {
+          void * ptr = NULL;
+          if(0 != posix_memalign(&ptr, align, blocksize)) {
+            fprintf(stderr, "posix_memalign returned error\n"); // posix_memalign does not set errno.
+            abort();
+          }
+          buf_aligned[i] = reinterpret_cast<byte_t *>(ptr);
+          iov[i].iov_base = ptr;
+          iov[i].iov_len = blocksize;
+        }
+        if(0 != sys_register(ring_fd, IORING_REGISTER_BUFFERS, &(iov[0]), n_slots)) {
+          perror("IORING_REGISTER_BUFFERS");
+          fprintf(stderr, "Cannot register %d x %zd bytes. Please check ulimit -l.\n", n_slots, blocksize);
+          abort();
+        }
+        if(0 != sys_register(ring_fd, IORING_REGISTER_FILES, &fd, 1)) {
+          perror("IORING_REGISTER_FILES");
+          abort();
+        }
+
+        for(int i=n_slots-1 ; i>=0 ; i--) {
+          free_slots.push_back(i);
+        }
+      }
+
+      /**
+       * See libaio::writer_t::set_writeback()
+       */
+      void set_writeback(off64_t blocks) {
+        wb.init(fd, buf_size, n_slots, blocks);
+      }
+
+      libaio::writeback_t::stat_t writeback_stat() {
+        return wb.stat();
+      }
+
+      /**
+       * Get a slot willing to serve.
+       *
+       * This function blocks only if all the slots are being written.
+       *
+       * @return slot ID
+       */
+      slot_id_t get_available_slot_id() {
+        reap();
+        if(free_slots.empty()) {
+          // the pending writes are the only ones which can free a slot
+          flush();
+          while(free_slots.empty()) {
+            wait(1);
+          }
+        }
+        slot_id_t id = free_slots.back();
+        free_slots.pop_back();
+        return id;
+      }
+
+      slot_id_t try_get_available_slot_id() {
+        reap();
+        if(free_slots.empty()) {
+          flush();
+          reap();
+          if(free_slots.empty()) {
+            return -1;
+          }
+        }
+        slot_id_t id = free_slots.back();
+        free_slots.pop_back();
+        return id;
+      }
+
+      byte_t * buf(slot_id_t id) {
+        return buf_aligned[id];
+      }
+
+      /**
+       * Queue the slot for writing
+       *
+       * The write is submitted to the kernel with the following ones
+       * when `batch` writes are queued (immediately if sqpoll).
+       *
+       * @param id [in] slot ID given by get_available_slot_id().
+       * @param index [in] block position in the output file
+       *
+       * @return 0 on success, negative on error.
+       */
+      int write(slot_id_t id, int index) {
+        // never full, since an entry per slot
+        const unsigned int tail = *sq_tail;
+        const unsigned int i = tail & *sq_mask;
+        struct io_uring_sqe * sqe = &(sqes[i]);
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0; // index in the registered files
+        sqe->addr = (unsigned long)buf_aligned[id];
+        sqe->len = buf_size;
+        sqe->off = (off64_t)index * buf_size;
+        sqe->buf_index = id;
+        sqe->user_data = id;
+        sq_array[i] = i;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pending++;
+        wb.submitted(id, index);
+
+        if(sqpoll || (int)pending >= batch) {
+          return flush();
+        }
+        return 0;
+      }
+
+      /**
+       * Submit the queued writes now
+       *
+       * @return 0 on success, negative on error.
+       */
+      int flush() {
+        if(pending == 0) {
+          return 0;
+        }
+        if(sqpoll) {
+          // the kernel thread takes them unless it sleeps
+          if(__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+            sys_enter(ring_fd, pending, 0, IORING_ENTER_SQ_WAKEUP);
+          }
+          in_flight += pending;
+          pending = 0;
+          return 0;
+        }
+        int r = sys_enter(ring_fd, pending, 0, 0);
+        if(r < 0) {
+          perror("io_uring_enter");
+          return -errno;
+        }
+        in_flight += r;
+        pending -= r;
+        return 0;
+      }
+
+    private:
+      writer_t(const writer_t &); // to disable "object copy"
+
+      /// collect the completions without a syscall
+      void reap() {
+        unsigned int head = *cq_head;
+        const unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for( ; head != tail ; head++) {
+          const struct io_uring_cqe * cqe = &(cqes[head & *cq_mask]);
+          if(cqe->res != (int)buf_size) {
+            fprintf(stderr, "write failed : %s\n", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+            abort();
+          }
+          free_slots.push_back(cqe->user_data);
+          in_flight--;
+          wb.completed(cqe->user_data);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+      }
+
+      /// wait for n completions
+      void wait(unsigned int n) {
+        if(sqpoll && (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)) {
+          sys_enter(ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        if(sys_enter(ring_fd, 0, n, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+          perror("io_uring_enter");
+          abort();
+        }
+        reap();
+      }
+    };
+  }
+}
+
+#endif
@@ -494,17 +494,21 @@ static void down_sample_debayer_5x5(unsigned char * dst,
 }
 
 void PFCMU::Capture::copy_thumb(void * buf, int widthStep) const {
-  const int dst_width = (m_image->width) / 5;
-  const int dst_height = (m_image->height) / 5;
+  make_thumb(buf, widthStep, m_image->imageArray, m_image->width, m_image->height, m_image->widthStep);
+}
+
+void PFCMU::make_thumb(void * buf, int widthStep, const unsigned char * const * images, int width, int height, int src_widthStep) {
+  const int dst_width = width / 5;
+  const int dst_height = height / 5;
 
-  for(int i=0 ; i<24 ; i++) {
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
     const int x = i%5;
     const int y = i/5;
     down_sample_debayer_5x5(((unsigned char *)buf) + y * dst_height * widthStep + x * dst_width * 3,
 			    dst_width,
 			    dst_height,
 			    widthStep,
-			    m_image->imageArray[i],
-			    m_image->widthStep);
+			    images[i],
+			    src_widthStep);
   }
 }
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <nmmintrin.h>
+
+#include "checksum.h"
+#include "trace.h"
+
+namespace {
+  using PFCMU::checksum::header_t;
+  using PFCMU::checksum::record_t;
+
+  const char MAGIC[8] = { 'P', 'F', 'C', 'R', 'C', '3', '2', 'C' };
+  const uint32_t VERSION = 1;
+  /// reflected polynomial of CRC32C
+  const uint32_t POLY = 0x82f63b78;
+
+  /**
+   * Tables of slicing-by-8, for the CPUs without SSE4.2
+   */
+  struct table_t {
+    uint32_t t[8][256];
+
+    table_t() {
+      for(int i=0 ; i<256 ; i++) {
+        uint32_t c = i;
+        for(int k=0 ; k<8 ; k++) {
+          c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        }
+        t[0][i] = c;
+      }
+      for(int i=0 ; i<256 ; i++) {
+        for(int j=1 ; j<8 ; j++) {
+          t[j][i] = (t[j-1][i] >> 8) ^ t[0][t[j-1][i] & 0xff];
+        }
+      }
+    }
+  };
+
+  const table_t s_table;
+  const bool s_sse42 = __builtin_cpu_supports("sse4.2");
+
+  uint32_t crc32c_sw(uint32_t crc, const unsigned char * p, size_t n) {
+    const uint32_t (*t)[256] = s_table.t;
+    for( ; n > 0 && ((uintptr_t)p & 7) ; n--) {
+      crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    for( ; n >= 8 ; n -= 8, p += 8) {
+      uint32_t lo, hi;
+      memcpy(&lo, p, 4);
+      memcpy(&hi, p + 4, 4);
+      lo ^= crc;
+      crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+        t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    for( ; n > 0 ; n--) {
+      crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+  }
+
+  __attribute__((target("sse4.2")))
+  uint32_t crc32c_hw(uint32_t crc, const unsigned char * p, size_t n) {
+    for( ; n > 0 && ((uintptr_t)p & 7) ; n--) {
+      crc = _mm_crc32_u8(crc, *p++);
+    }
+    uint64_t c = crc;
+    for( ; n >= 8 ; n -= 8, p += 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for( ; n > 0 ; n--) {
+      crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+  }
+
+  void put32(unsigned char * p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+  }
+
+  uint32_t get32(const unsigned char * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  void pack(const record_t & r, unsigned char * buf) {
+    put32(buf, r.framecount);
+    for(int i=0 ; i<PFCMU::CAMS ; i++) {
+      put32(buf + 4 + 4 * i, r.crc[i]);
+    }
+    put32(buf + record_t::SIZE - 4, PFCMU::checksum::crc32c(buf, record_t::SIZE - 4));
+  }
+}
+
+uint32_t PFCMU::checksum::crc32c(const void * buf, size_t bytes, uint32_t crc) {
+  const unsigned char * p = reinterpret_cast<const unsigned char *>(buf);
+  return ~(s_sse42 ? crc32c_hw(~crc, p, bytes) : crc32c_sw(~crc, p, bytes));
+}
+
+bool PFCMU::checksum::hardware() {
+  return s_sse42;
+}
+
+void PFCMU::checksum::compute(const void * frame, int width, int height, record_t * r) {
+  const unsigned char * p = reinterpret_cast<const unsigned char *>(frame);
+  const size_t bytes = (size_t)width * height;
+  r->framecount = PFCMU::get_timestamp(p);
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    r->crc[i] = crc32c(p + bytes * i, bytes);
+  }
+}
+
+PFCMU::checksum::index_writer_t::index_writer_t() : m_fd(-1) {
+}
+
+PFCMU::checksum::index_writer_t::~index_writer_t() {
+  close();
+}
+
+void PFCMU::checksum::index_writer_t::open(const char * filename, int width, int height) {
+  close();
+
+  m_fd = open64(filename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if(m_fd < 0) {
+    perror("open64");
+    DIE(1, "Cannot open %s for writing.\n", filename);
+  }
+
+  unsigned char buf[header_t::SIZE];
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, MAGIC, sizeof(MAGIC));
+  put32(buf + 8, VERSION);
+  put32(buf + 12, PFCMU::CAMS);
+  put32(buf + 16, width);
+  put32(buf + 20, height);
+  if(sizeof(buf) != pwrite64(m_fd, buf, sizeof(buf), 0)) {
+    perror("pwrite64");
+    DIE(1, "Cannot write %s.\n", filename);
+  }
+}
+
+int PFCMU::checksum::index_writer_t::put(off64_t index, const record_t & r) {
+  unsigned char buf[record_t::SIZE];
+  pack(r, buf);
+  return sizeof(buf) == pwrite64(m_fd, buf, sizeof(buf), header_t::SIZE + index * record_t::SIZE) ? 0 : -1;
+}
+
+void PFCMU::checksum::index_writer_t::close() {
+  if(m_fd >= 0) {
+    fsync(m_fd);
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+PFCMU::checksum::index_reader_t::index_reader_t() : m_fd(-1), m_size(0) {
+}
+
+PFCMU::checksum::index_reader_t::~index_reader_t() {
+  if(m_fd >= 0) {
+    ::close(m_fd);
+  }
+}
+
+int PFCMU::checksum::index_reader_t::open(const char * filename) {
+  m_fd = open64(filename, O_RDONLY|O_LARGEFILE);
+  if(m_fd < 0) {
+    return -1;
+  }
+
+  unsigned char buf[header_t::SIZE];
+  if(sizeof(buf) != pread64(m_fd, buf, sizeof(buf), 0) || 0 != memcmp(buf, MAGIC, sizeof(MAGIC)) || get32(buf + 8) != VERSION) {
+    return -1;
+  }
+  m_header.cams = get32(buf + 12);
+  m_header.width = get32(buf + 16);
+  m_header.height = get32(buf + 20);
+  if(m_header.cams != (uint32_t)PFCMU::CAMS) {
+    return -1;
+  }
+
+  struct stat64 st;
+  fstat64(m_fd, &st);
+  m_size = (st.st_size - header_t::SIZE) / record_t::SIZE;
+  return 0;
+}
+
+PFCMU::checksum::index_reader_t::status_t PFCMU::checksum::index_reader_t::get(off64_t index, record_t * r) const {
+  unsigned char buf[record_t::SIZE];
+  if(index >= m_size || sizeof(buf) != pread64(m_fd, buf, sizeof(buf), header_t::SIZE + index * record_t::SIZE)) {
+    return MISSING;
+  }
+  if(get32(buf + record_t::SIZE - 4) != crc32c(buf, record_t::SIZE - 4)) {
+    return MISSING;
+  }
+  r->framecount = get32(buf);
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    r->crc[i] = get32(buf + 4 + 4 * i);
+  }
+  return VALID;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <cstdio>
+#include <cstring>
+
+#include "chess_points.h"
+
+namespace {
+  using PFCMU::chess_points::header_t;
+  using PFCMU::chess_points::record_t;
+
+  const char MAGIC[8] = { 'P', 'F', 'C', 'H', 'E', 'S', 'S', 0 };
+  const uint32_t VERSION = 1;
+  const size_t RECORD_SIZE = 16;
+
+  void put32(unsigned char * p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+  }
+
+  uint32_t get32(const unsigned char * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  void encode_header(const header_t & h, unsigned char * buf) {
+    memset(buf, 0, header_t::SIZE);
+    memcpy(buf, MAGIC, sizeof(MAGIC));
+    put32(buf + 8, VERSION);
+    put32(buf + 12, h.cams);
+    put32(buf + 16, h.width);
+    put32(buf + 20, h.height);
+    put32(buf + 24, h.rows);
+    put32(buf + 28, h.cols);
+    uint32_t square;
+    memcpy(&square, &h.square, sizeof(square));
+    put32(buf + 32, square);
+    put32(buf + 36, h.detections);
+    put32(buf + 40, h.detections >> 32);
+  }
+
+  bool decode_header(const unsigned char * buf, header_t * h) {
+    if(0 != memcmp(buf, MAGIC, sizeof(MAGIC)) || get32(buf + 8) != VERSION) {
+      return false;
+    }
+    h->cams = get32(buf + 12);
+    h->width = get32(buf + 16);
+    h->height = get32(buf + 20);
+    h->rows = get32(buf + 24);
+    h->cols = get32(buf + 28);
+    const uint32_t square = get32(buf + 32);
+    memcpy(&h->square, &square, sizeof(square));
+    h->detections = get32(buf + 36) | ((uint64_t)get32(buf + 40) << 32);
+    return true;
+  }
+}
+
+int PFCMU::chess_points::load(const char * filename, set_t * set) {
+  FILE * fp = fopen(filename, "rb");
+  if(! fp) {
+    return -1;
+  }
+
+  unsigned char buf[header_t::SIZE];
+  if(1 != fread(buf, sizeof(buf), 1, fp) || ! decode_header(buf, &set->header)) {
+    fclose(fp);
+    return -1;
+  }
+
+  const size_t n = set->header.detections;
+  const size_t floats = 2 * set->header.corners();
+  set->records.resize(n);
+  set->points.resize(floats * n);
+  bool ok = true;
+  for(size_t i=0 ; ok && i<n ; i++) {
+    unsigned char r[RECORD_SIZE];
+    ok = 1 == fread(r, sizeof(r), 1, fp) && floats == fread(&set->points[floats * i], sizeof(float), floats, fp);
+    set->records[i].frame = (int64_t)(get32(r) | ((uint64_t)get32(r + 4) << 32));
+    set->records[i].framecount = get32(r + 8);
+    set->records[i].camera = (int32_t)get32(r + 12);
+  }
+  fclose(fp);
+  return ok ? 0 : -1;
+}
+
+PFCMU::chess_points::writer_t::writer_t() : m_fp(NULL) {
+  memset(&m_header, 0, sizeof(m_header));
+}
+
+PFCMU::chess_points::writer_t::~writer_t() {
+  close();
+}
+
+int PFCMU::chess_points::writer_t::open(const char * filename, const header_t & header) {
+  close();
+  m_fp = fopen(filename, "wb");
+  if(! m_fp) {
+    return -1;
+  }
+  m_header = header;
+  m_header.detections = 0;
+
+  unsigned char buf[header_t::SIZE];
+  encode_header(m_header, buf);
+  return 1 == fwrite(buf, sizeof(buf), 1, m_fp) ? 0 : -1;
+}
+
+int PFCMU::chess_points::writer_t::write(const record_t & record, const float * points) {
+  unsigned char r[RECORD_SIZE];
+  put32(r, (uint64_t)record.frame);
+  put32(r + 4, (uint64_t)record.frame >> 32);
+  put32(r + 8, record.framecount);
+  put32(r + 12, (uint32_t)record.camera);
+
+  // the points are written as is, assuming a little endian host
+  const size_t floats = 2 * m_header.corners();
+  if(1 != fwrite(r, sizeof(r), 1, m_fp) || floats != fwrite(points, sizeof(float), floats, m_fp)) {
+    return -1;
+  }
+  m_header.detections++;
+  return 0;
+}
+
+int PFCMU::chess_points::writer_t::close() {
+  if(! m_fp) {
+    return 0;
+  }
+  unsigned char buf[header_t::SIZE];
+  encode_header(m_header, buf);
+  const bool ok = 0 == fseek(m_fp, 0, SEEK_SET) && 1 == fwrite(buf, sizeof(buf), 1, m_fp);
+  const int ret = fclose(m_fp);
+  m_fp = NULL;
+  return (ok && ret == 0) ? 0 : -1;
+}
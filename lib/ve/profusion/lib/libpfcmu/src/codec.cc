@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <jpeglib.h>
+#include <lz4.h>
+
+#include "codec.h"
+#include "trace.h"
+
+namespace {
+  using PFCMU::codec::byte_t;
+
+  const char * const s_names[PFCMU::codec::ENC_NUM] = {
+    "raw",
+    "lz4",
+    "lz4d",
+    "jpeg",
+  };
+
+  // Rearrange the Bayer mosaic into four planes (even/even, even/odd,
+  // odd/even, odd/odd) so that LZ4 sees neighbours of the same color.
+  // If ref is given, the planes hold img-ref (mod 256).
+  void split_planes(const byte_t * img, const byte_t * ref, int width, int height, int widthStep, byte_t * planes) {
+    const int HW = width / 2;
+    const int HH = height / 2;
+    const int PLANE = HW * HH;
+    for(int y=0 ; y<height ; y++) {
+      const byte_t * p = img + widthStep * y;
+      byte_t * q0 = planes + PLANE * (2 * (y & 1)) + HW * (y / 2);
+      byte_t * q1 = q0 + PLANE;
+      if(ref) {
+        const byte_t * r = ref + widthStep * y;
+        for(int x=0 ; x<HW ; x++, p+=2, r+=2) {
+          q0[x] = p[0] - r[0];
+          q1[x] = p[1] - r[1];
+        }
+      } else {
+        for(int x=0 ; x<HW ; x++, p+=2) {
+          q0[x] = p[0];
+          q1[x] = p[1];
+        }
+      }
+    }
+  }
+
+  void merge_planes(const byte_t * planes, const byte_t * ref, int width, int height, byte_t * img) {
+    const int HW = width / 2;
+    const int HH = height / 2;
+    const int PLANE = HW * HH;
+    for(int y=0 ; y<height ; y++) {
+      byte_t * p = img + width * y;
+      const byte_t * q0 = planes + PLANE * (2 * (y & 1)) + HW * (y / 2);
+      const byte_t * q1 = q0 + PLANE;
+      if(ref) {
+        const byte_t * r = ref + width * y;
+        for(int x=0 ; x<HW ; x++, p+=2, r+=2) {
+          p[0] = q0[x] + r[0];
+          p[1] = q1[x] + r[1];
+        }
+      } else {
+        for(int x=0 ; x<HW ; x++, p+=2) {
+          p[0] = q0[x];
+          p[1] = q1[x];
+        }
+      }
+    }
+  }
+
+  void encode_lz4(const byte_t * img, const byte_t * ref, int width, int height, int widthStep, std::vector<byte_t> * out) {
+    const int N = width * height;
+    std::vector<byte_t> planes(N);
+    split_planes(img, ref, width, height, widthStep, &(planes[0]));
+
+    out->resize(LZ4_compressBound(N));
+    int len = LZ4_compress_default(reinterpret_cast<const char *>(&(planes[0])),
+                                   reinterpret_cast<char *>(&((*out)[0])),
+                                   N, out->size());
+    if(len <= 0) {
+      DIE(1, "LZ4_compress_default failed, ret=%d\n", len);
+    }
+    out->resize(len);
+  }
+
+  // libjpeg calls error_exit() on a corrupt image, which exit()s by
+  // default. Jump back to the decoder instead.
+  struct jpeg_error_t {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+  };
+
+  void jpeg_error_exit(j_common_ptr cinfo) {
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    TRACE(1, "jpeg: %s\n", msg);
+    longjmp(reinterpret_cast<jpeg_error_t *>(cinfo->err)->jump, 1);
+  }
+
+  // Same 2x2 downsample debayer as PFCMU::Capture::copy_ds(), i.e.,
+  //
+  //   GB
+  //   RG
+  //
+  void encode_jpeg(const byte_t * img, int width, int height, int widthStep, int quality, std::vector<byte_t> * out) {
+    const int HW = width / 2;
+    const int HH = height / 2;
+
+    std::vector<byte_t> rgb(HW * HH * 3);
+    for(int y=0 ; y<HH ; y++) {
+      byte_t * p = &(rgb[HW * 3 * y]);
+      const byte_t * q0 = img + widthStep * 2 * y;
+      const byte_t * q1 = img + widthStep * (2 * y + 1);
+      for(int x=0 ; x<HW ; x++, p+=3, q0+=2, q1+=2) {
+        p[0] = q1[0]; // R
+        p[1] = q0[0]; // G
+        p[2] = q0[1]; // B
+      }
+    }
+
+    PFCMU::codec::encode_rgb_jpeg(&(rgb[0]), HW, HH, HW * 3, quality, out);
+  }
+}
+
+const char * PFCMU::codec::to_string(encoding_t enc) {
+  if(enc < 0 || enc >= ENC_NUM) {
+    return "unknown";
+  }
+  return s_names[enc];
+}
+
+int PFCMU::codec::from_string(const std::string & name, encoding_t * enc) {
+  for(int i=0 ; i<ENC_NUM ; i++) {
+    if(name == s_names[i]) {
+      *enc = static_cast<encoding_t>(i);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int PFCMU::codec::negotiate(const std::string & preferred, encoding_t * enc) {
+  std::string list(preferred);
+  for(unsigned int i=0 ; i<list.length() ; i++) {
+    if(list[i] == ',') {
+      list[i] = ' ';
+    }
+  }
+
+  std::istringstream iss(list);
+  for(std::string name ; iss >> name ; ) {
+    if(0 == from_string(name, enc)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void PFCMU::codec::encode(encoding_t enc,
+                          const byte_t * img,
+                          const byte_t * ref,
+                          int width,
+                          int height,
+                          int widthStep,
+                          int quality,
+                          std::vector<byte_t> * out) {
+  ASSERT(width % 2 == 0 && height % 2 == 0, "width=%d, height=%d\n", width, height);
+
+  switch(enc) {
+  case ENC_RAW:
+    out->resize(width * height);
+    for(int y=0 ; y<height ; y++) {
+      memcpy(&((*out)[width * y]), img + widthStep * y, width);
+    }
+    break;
+  case ENC_LZ4:
+    encode_lz4(img, NULL, width, height, widthStep, out);
+    break;
+  case ENC_LZ4_DELTA:
+    encode_lz4(img, ref, width, height, widthStep, out);
+    break;
+  case ENC_JPEG:
+    encode_jpeg(img, width, height, widthStep, quality, out);
+    break;
+  default:
+    DIE(1, "unknown encoding %d\n", enc);
+  }
+}
+
+void PFCMU::codec::encode_rgb_jpeg(const byte_t * rgb,
+                                   int width,
+                                   int height,
+                                   int widthStep,
+                                   int quality,
+                                   std::vector<byte_t> * out) {
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+
+  unsigned char * buf = NULL;
+  unsigned long buf_size = 0;
+  jpeg_mem_dest(&cinfo, &buf, &buf_size);
+
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_compress(&cinfo, TRUE);
+
+  while(cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<byte_t *>(rgb + widthStep * cinfo.next_scanline);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  out->assign(buf, buf + buf_size);
+  free(buf);
+}
+
+int PFCMU::codec::decode_bayer(encoding_t enc,
+                               const byte_t * in,
+                               size_t len,
+                               const byte_t * ref,
+                               int width,
+                               int height,
+                               byte_t * out) {
+  const int N = width * height;
+
+  switch(enc) {
+  case ENC_RAW:
+    if(len != (size_t)N) {
+      return -1;
+    }
+    memcpy(out, in, N);
+    return 0;
+  case ENC_LZ4:
+  case ENC_LZ4_DELTA:
+    {
+      if(enc == ENC_LZ4_DELTA && ref == NULL) {
+        return -1;
+      }
+      std::vector<byte_t> planes(N);
+      int ret = LZ4_decompress_safe(reinterpret_cast<const char *>(in),
+                                    reinterpret_cast<char *>(&(planes[0])),
+                                    len, N);
+      if(ret != N) {
+        return -1;
+      }
+      merge_planes(&(planes[0]), enc == ENC_LZ4_DELTA ? ref : NULL, width, height, out);
+      return 0;
+    }
+  default:
+    return -1;
+  }
+}
+
+int PFCMU::codec::decode_jpeg(const byte_t * in,
+                              size_t len,
+                              int * width,
+                              int * height,
+                              std::vector<byte_t> * rgb) {
+  struct jpeg_decompress_struct cinfo;
+  jpeg_error_t jerr;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  if(setjmp(jerr.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, const_cast<byte_t *>(in), len);
+
+  if(JPEG_HEADER_OK != jpeg_read_header(&cinfo, TRUE)) {
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
+  }
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+
+  *width = cinfo.output_width;
+  *height = cinfo.output_height;
+  rgb->resize((*width) * (*height) * 3);
+  while(cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = &((*rgb)[cinfo.output_scanline * (*width) * 3]);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  // a truncated or damaged image is decoded with warnings, e.g., the missing rows in gray
+  const bool damaged = jerr.pub.num_warnings > 0;
+  jpeg_destroy_decompress(&cinfo);
+
+  return damaged ? -1 : 0;
+}
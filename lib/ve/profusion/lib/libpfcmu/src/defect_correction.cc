@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "defect_correction.h"
+#include "trace.h"
+
+namespace {
+  const bool s_avx2 = __builtin_cpu_supports("avx2");
+
+  /// bytes of the framecount at the beginning of each image
+  const uint32_t FRAMECOUNT_BYTES = 4;
+
+  /// the same colour in the Bayer pattern, axial first
+  const int NEIGHBOUR_DX[8] = { -2, 2, 0, 0, -2, 2, -2, 2 };
+  const int NEIGHBOUR_DY[8] = { 0, 0, -2, 2, -2, -2, 2, 2 };
+
+  /**
+   * v = v - neg + pos with saturation, for [begin:n)
+   */
+  void subtract_scalar(unsigned char * v, const uint8_t * pos, const uint8_t * neg, size_t begin, size_t n) {
+    for(size_t i=begin ; i<n ; i++) {
+      const int x = (int)v[i] - neg[i] + pos[i];
+      v[i] = (unsigned char)std::max(0, std::min(255, x));
+    }
+  }
+
+  void subtract_sse2(unsigned char * v, const uint8_t * pos, const uint8_t * neg, size_t n) {
+    size_t i = 0;
+    for( ; i + 16 <= n ; i += 16) {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+      a = _mm_subs_epu8(a, _mm_loadu_si128(reinterpret_cast<const __m128i *>(neg + i)));
+      a = _mm_adds_epu8(a, _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos + i)));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(v + i), a);
+    }
+    subtract_scalar(v, pos, neg, i, n);
+  }
+
+  __attribute__((target("avx2")))
+  void subtract_avx2(unsigned char * v, const uint8_t * pos, const uint8_t * neg, size_t n) {
+    size_t i = 0;
+    for( ; i + 32 <= n ; i += 32) {
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i));
+      a = _mm256_subs_epu8(a, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(neg + i)));
+      a = _mm256_adds_epu8(a, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos + i)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(v + i), a);
+    }
+    subtract_scalar(v, pos, neg, i, n);
+  }
+}
+
+int PFCMU::DefectCorrector::dark_from_string(const std::string & name, dark_t * dark) {
+  static const char * names[] = { "none", "fpn", "full" };
+  for(int i=0 ; i<3 ; i++) {
+    if(name == names[i]) {
+      *dark = static_cast<dark_t>(i);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+PFCMU::DefectCorrector::DefectCorrector() : m_width(0), m_height(0) {
+  std::fill(m_offsets, m_offsets + 8, 0);
+}
+
+void PFCMU::DefectCorrector::init(int width, int height) {
+  m_width = width;
+  m_height = height;
+  for(int i=0 ; i<8 ; i++) {
+    m_offsets[i] = NEIGHBOUR_DY[i] * width + NEIGHBOUR_DX[i];
+  }
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    m_defects[i].clear();
+  }
+  m_dark_pos.clear();
+  m_dark_neg.clear();
+}
+
+int PFCMU::DefectCorrector::load(const char * filename, dark_t dark, int flags) {
+  int n = load_pxs(filename, dark, flags);
+  if(n < 0) {
+    n = load_hpx(filename);
+  }
+  if(n >= 0) {
+    done();
+  }
+  return n;
+}
+
+int PFCMU::DefectCorrector::load_hpx(const char * filename) {
+  FILE * fp = fopen(filename, "r");
+  if(! fp) {
+    return -1;
+  }
+
+  int n = 0;
+  int cam, x, y;
+  int ret;
+  while(3 == (ret = fscanf(fp, "%d %d %d", &cam, &x, &y))) {
+    if(cam < 0 || cam >= PFCMU::CAMS || x < 0 || x >= m_width || y < 0 || y >= m_height) {
+      TRACE(1, "%s: (%d, %d) of camera %d is out of the image\n", filename, x, y, cam);
+      fclose(fp);
+      return -1;
+    }
+    add(cam, x, y);
+    n++;
+  }
+  fclose(fp);
+
+  // not a .hpx unless the whole file is parsed
+  return ret == EOF ? n : -1;
+}
+
+int PFCMU::DefectCorrector::load_pxs(const char * filename, dark_t dark, int flags) {
+  pixel_stats::map_t map;
+  if(0 != pixel_stats::load(filename, &map)) {
+    return -1;
+  }
+  if((int)map.header.width != m_width || (int)map.header.height != m_height) {
+    TRACE(1, "%s is of %ux%u, not %dx%d\n", filename, map.header.width, map.header.height, m_width, m_height);
+    return -1;
+  }
+
+  const size_t pixels = map.pixels();
+  int n = 0;
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    const uint8_t * f = &map.flags[pixels * i];
+    for(size_t j=0 ; j<pixels ; j++) {
+      if(f[j] & flags) {
+        add(i, j % m_width, j / m_width);
+        n++;
+      }
+    }
+  }
+
+  if(dark != DARK_NONE) {
+    const size_t total = pixels * PFCMU::CAMS;
+    m_dark_pos.assign(total, 0);
+    m_dark_neg.assign(total, 0);
+    for(size_t j=0 ; j<total ; j++) {
+      const int v = (int)floor((dark == DARK_FPN ? map.fpn[j] : map.dark[j]) / (double)pixel_stats::SCALE + 0.5);
+      if(v < 0) {
+        m_dark_pos[j] = (uint8_t)std::min(255, -v);
+      } else {
+        m_dark_neg[j] = (uint8_t)std::min(255, v);
+      }
+    }
+  }
+
+  return n;
+}
+
+void PFCMU::DefectCorrector::add(int camera, int x, int y) {
+  const uint32_t index = (uint32_t)y * m_width + x;
+  if(index < FRAMECOUNT_BYTES) {
+    return;
+  }
+  defect_t d;
+  d.index = index;
+  d.neighbours = 0;
+  m_defects[camera].push_back(d);
+}
+
+void PFCMU::DefectCorrector::done() {
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    std::vector<defect_t> & list = m_defects[i];
+    std::sort(list.begin(), list.end());
+    size_t n = 0;
+    for(size_t j=0 ; j<list.size() ; j++) {
+      if(n == 0 || list[n-1].index != list[j].index) {
+        list[n++] = list[j];
+      }
+    }
+    list.resize(n);
+
+    for(size_t j=0 ; j<list.size() ; j++) {
+      const int x = list[j].index % m_width;
+      const int y = list[j].index / m_width;
+      uint8_t axial = 0, diagonal = 0;
+      for(int k=0 ; k<8 ; k++) {
+        const int nx = x + NEIGHBOUR_DX[k];
+        const int ny = y + NEIGHBOUR_DY[k];
+        if(nx < 0 || nx >= m_width || ny < 0 || ny >= m_height) {
+          continue;
+        }
+        defect_t nd;
+        nd.index = (uint32_t)ny * m_width + nx;
+        if(nd.index < FRAMECOUNT_BYTES || std::binary_search(list.begin(), list.end(), nd)) {
+          continue;
+        }
+        (k < 4 ? axial : diagonal) |= 1 << k;
+      }
+      // the diagonals only if no axial neighbours are available
+      list[j].neighbours = axial ? axial : diagonal;
+    }
+  }
+}
+
+size_t PFCMU::DefectCorrector::isolated(int camera) const {
+  size_t n = 0;
+  for(size_t i=0 ; i<m_defects[camera].size() ; i++) {
+    if(m_defects[camera][i].neighbours == 0) {
+      n++;
+    }
+  }
+  return n;
+}
+
+void PFCMU::DefectCorrector::subtract_dark(unsigned char * image, int camera) const {
+  const size_t n = (size_t)m_width * m_height;
+  const uint8_t * pos = &m_dark_pos[n * camera];
+  const uint8_t * neg = &m_dark_neg[n * camera];
+
+  unsigned char framecount[FRAMECOUNT_BYTES];
+  memcpy(framecount, image, FRAMECOUNT_BYTES);
+  if(s_avx2) {
+    subtract_avx2(image, pos, neg, n);
+  } else {
+    subtract_sse2(image, pos, neg, n);
+  }
+  memcpy(image, framecount, FRAMECOUNT_BYTES);
+}
+
+void PFCMU::DefectCorrector::apply(unsigned char * image, int camera) const {
+  if(has_dark()) {
+    subtract_dark(image, camera);
+  }
+
+  // the neighbours are never defects, and hence the order does not matter
+  const std::vector<defect_t> & list = m_defects[camera];
+  for(size_t i=0 ; i<list.size() ; i++) {
+    const defect_t & d = list[i];
+    unsigned char * p = image + d.index;
+    int sum = 0, n = 0;
+    for(int k=0 ; k<8 ; k++) {
+      if(d.neighbours & (1 << k)) {
+        sum += p[m_offsets[k]];
+        n++;
+      }
+    }
+    if(n) {
+      *p = (unsigned char)((sum + n / 2) / n);
+    }
+  }
+}
+
+bool PFCMU::DefectCorrector::avx2() {
+  return s_avx2;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "hotpixel.h"
+#include "worker_pool.h"
+#include "trace.h"
+
+namespace {
+  const bool s_avx2 = __builtin_cpu_supports("avx2");
+
+  /**
+   * mask &= |cur - prev| <= threshold, and prev = cur, for [begin:n)
+   */
+  void compare_scalar(const unsigned char * cur, unsigned char * prev, unsigned char * mask, size_t begin, size_t n, int threshold) {
+    for(size_t i=begin ; i<n ; i++) {
+      if(abs(cur[i] - prev[i]) > threshold) {
+        mask[i] = 0;
+      }
+      prev[i] = cur[i];
+    }
+  }
+
+  void compare_sse2(const unsigned char * cur, unsigned char * prev, unsigned char * mask, size_t n, int threshold) {
+    const __m128i t = _mm_set1_epi8((char)threshold);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for( ; i + 16 <= n ; i += 16) {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cur + i));
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+      const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+      // |a - b| of unsigned bytes, and 0xff where it is not more than t
+      const __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+      const __m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(d, t), zero);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(mask + i), _mm_and_si128(m, still));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(prev + i), a);
+    }
+    compare_scalar(cur, prev, mask, i, n, threshold);
+  }
+
+  __attribute__((target("avx2")))
+  void compare_avx2(const unsigned char * cur, unsigned char * prev, unsigned char * mask, size_t n, int threshold) {
+    const __m256i t = _mm256_set1_epi8((char)threshold);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for( ; i + 32 <= n ; i += 32) {
+      const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cur + i));
+      const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(prev + i));
+      const __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+      const __m256i d = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+      const __m256i still = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, t), zero);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(mask + i), _mm256_and_si256(m, still));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(prev + i), a);
+    }
+    compare_scalar(cur, prev, mask, i, n, threshold);
+  }
+}
+
+PFCMU::HotPixelDetector::HotPixelDetector() : m_width(0), m_height(0), m_threshold(0), m_frames(0), m_pool(NULL) {
+}
+
+PFCMU::HotPixelDetector::~HotPixelDetector() {
+  delete m_pool;
+}
+
+void PFCMU::HotPixelDetector::init(int width, int height, int threshold, int threads) {
+  ASSERT(0 <= threshold && threshold < 256, "threshold=%d\n", threshold);
+
+  m_width = width;
+  m_height = height;
+  m_threshold = threshold;
+  m_frames = 0;
+  // all the pixels are hot until they change
+  m_mask.assign((size_t)width * height * PFCMU::CAMS, 255);
+  m_prev.assign((size_t)width * height * PFCMU::CAMS, 0);
+
+  delete m_pool;
+  m_pool = new WorkerPool(std::min(threads > 0 ? threads : (int)boost::thread::hardware_concurrency(), (int)PFCMU::CAMS));
+}
+
+void PFCMU::HotPixelDetector::compare(const unsigned char * frame, int camera) {
+  const size_t bytes = (size_t)m_width * m_height;
+  const size_t offset = bytes * camera;
+  if(s_avx2) {
+    compare_avx2(frame + offset, &m_prev[offset], &m_mask[offset], bytes, m_threshold);
+  } else {
+    compare_sse2(frame + offset, &m_prev[offset], &m_mask[offset], bytes, m_threshold);
+  }
+}
+
+void PFCMU::HotPixelDetector::feed(const void * frame) {
+  const unsigned char * p = reinterpret_cast<const unsigned char *>(frame);
+  if(m_frames++ == 0) {
+    memcpy(&m_prev[0], p, m_prev.size());
+    return;
+  }
+  m_pool->parallel_for(PFCMU::CAMS, boost::bind(&HotPixelDetector::compare, this, p, _1));
+}
+
+int PFCMU::HotPixelDetector::count(int camera) const {
+  const unsigned char * m = mask(camera);
+  return (int)m_width * m_height - std::count(m, m + (size_t)m_width * m_height, 0);
+}
+
+void PFCMU::HotPixelDetector::save_hpx(std::ostream & os) const {
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    const unsigned char * d = mask(i);
+    for(int y=0 ; y<m_height ; y++) {
+      for(int x=0 ; x<m_width ; x++, d++) {
+        if(*d) {
+          os << i << "\t" << x << "\t" << y << "\n";
+        }
+      }
+    }
+  }
+}
+
+bool PFCMU::HotPixelDetector::avx2() {
+  return s_avx2;
+}
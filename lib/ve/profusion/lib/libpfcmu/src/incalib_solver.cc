@@ -0,0 +1,702 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "incalib_solver.h"
+#include "worker_pool.h"
+#include "trace.h"
+
+namespace {
+  /// bands of the views per thread
+  const int BANDS_PER_THREAD = 4;
+  /// the intrinsic parameters f, u0, v0, k1, k2, p1, p2
+  const int NC = 7;
+  /// the pose, the rotation (left perturbation) and the translation
+  const int NP = 6;
+
+  const double LAMBDA_INIT = 1e-3;
+  const double LAMBDA_MAX = 1e16;
+  /// relative decrease of the error regarded as converged
+  const double TOLERANCE = 1e-12;
+
+  /**
+   * In-place Cholesky decomposition A = L L^t of the n x n symmetric
+   * A, where L is written into the lower triangle
+   *
+   * @return false if A is not positive definite
+   */
+  bool cholesky(double * A, int n) {
+    for(int j=0 ; j<n ; j++) {
+      double d = A[j*n+j];
+      for(int k=0 ; k<j ; k++) {
+        d -= A[j*n+k] * A[j*n+k];
+      }
+      if(! (d > 0)) {
+        return false;
+      }
+      d = std::sqrt(d);
+      A[j*n+j] = d;
+      for(int i=j+1 ; i<n ; i++) {
+        double s = A[i*n+j];
+        for(int k=0 ; k<j ; k++) {
+          s -= A[i*n+k] * A[j*n+k];
+        }
+        A[i*n+j] = s / d;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Solve L L^t x = b in place of b
+   */
+  void cholesky_solve(const double * L, int n, double * x) {
+    for(int i=0 ; i<n ; i++) {
+      double s = x[i];
+      for(int k=0 ; k<i ; k++) {
+        s -= L[i*n+k] * x[k];
+      }
+      x[i] = s / L[i*n+i];
+    }
+    for(int i=n-1 ; i>=0 ; i--) {
+      double s = x[i];
+      for(int k=i+1 ; k<n ; k++) {
+        s -= L[k*n+i] * x[k];
+      }
+      x[i] = s / L[i*n+i];
+    }
+  }
+
+  /**
+   * The Marquardt damping of the diagonal
+   */
+  void damp(double * A, int n, double lambda) {
+    for(int i=0 ; i<n ; i++) {
+      A[i*n+i] *= 1 + lambda;
+    }
+  }
+
+  /**
+   * Project (X, Y, 0) of the chessboard into (u, v), and the Jacobians
+   * of (u, v) by the intrinsic parameters (2 x NC) and by the pose
+   * (2 x NP) if Jc is not NULL
+   */
+  void project(const PFCMU::lens_t & lens, const double * R, const double * T, double X, double Y,
+               double * u, double * v, double * Jc = NULL, double * Jp = NULL) {
+    const double px = R[0] * X + R[1] * Y;
+    const double py = R[3] * X + R[4] * Y;
+    const double pz = R[6] * X + R[7] * Y;
+    const double iz = 1 / (pz + T[2]);
+    const double x = (px + T[0]) * iz;
+    const double y = (py + T[1]) * iz;
+
+    const double x2 = x * x, y2 = y * y, xy = x * y;
+    const double r2 = x2 + y2;
+    const double d = 1 + (lens.k1 + lens.k2 * r2) * r2;
+    const double xd = x * d + 2 * lens.p1 * xy + lens.p2 * (r2 + 2 * x2);
+    const double yd = y * d + lens.p1 * (r2 + 2 * y2) + 2 * lens.p2 * xy;
+    const double f = lens.fx;
+    *u = f * xd + lens.u0;
+    *v = f * yd + lens.v0;
+    if(! Jc) {
+      return;
+    }
+
+    const double Ju[NC] = { xd, 1, 0, f * x * r2, f * x * r2 * r2, f * 2 * xy, f * (r2 + 2 * x2) };
+    const double Jv[NC] = { yd, 0, 1, f * y * r2, f * y * r2 * r2, f * (r2 + 2 * y2), f * 2 * xy };
+    memcpy(Jc, Ju, sizeof(Ju));
+    memcpy(Jc + NC, Jv, sizeof(Jv));
+
+    // (u, v) by the normalized (x, y)
+    const double dd = 2 * (lens.k1 + 2 * lens.k2 * r2);
+    const double ux = f * (d + dd * x2 + 2 * lens.p1 * y + 6 * lens.p2 * x);
+    const double uy = f * (dd * xy + 2 * lens.p1 * x + 2 * lens.p2 * y);
+    const double vx = f * (dd * xy + 2 * lens.p1 * x + 2 * lens.p2 * y);
+    const double vy = f * (d + dd * y2 + 6 * lens.p1 * y + 2 * lens.p2 * x);
+
+    // (u, v) by the point in the camera
+    const double M[6] = {
+      ux * iz, uy * iz, -(ux * x + uy * y) * iz,
+      vx * iz, vy * iz, -(vx * x + vy * y) * iz,
+    };
+
+    // the point in the camera moves by -[R p]x w for the rotation w
+    for(int r=0 ; r<2 ; r++) {
+      const double * m = M + 3 * r;
+      double * j = Jp + NP * r;
+      j[0] = m[2] * py - m[1] * pz;
+      j[1] = m[0] * pz - m[2] * px;
+      j[2] = m[1] * px - m[0] * py;
+      j[3] = m[0];
+      j[4] = m[1];
+      j[5] = m[2];
+    }
+  }
+
+  /**
+   * R2 = exp([w]x) R of the row-major R
+   */
+  void rotate(const double * w, const double * R, double * R2) {
+    const double t = std::sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+    double a = 1, b = 0.5;
+    if(t > 1e-8) {
+      a = std::sin(t) / t;
+      b = (1 - std::cos(t)) / (t * t);
+    }
+    const double K[9] = {
+      0, -w[2], w[1],
+      w[2], 0, -w[0],
+      -w[1], w[0], 0,
+    };
+    double E[9];
+    for(int i=0 ; i<3 ; i++) {
+      for(int j=0 ; j<3 ; j++) {
+        const double k2 = K[3*i+0] * K[0*3+j] + K[3*i+1] * K[1*3+j] + K[3*i+2] * K[2*3+j];
+        E[3*i+j] = (i == j ? 1 : 0) + a * K[3*i+j] + b * k2;
+      }
+    }
+    for(int i=0 ; i<3 ; i++) {
+      for(int j=0 ; j<3 ; j++) {
+        R2[3*i+j] = E[3*i+0] * R[0*3+j] + E[3*i+1] * R[1*3+j] + E[3*i+2] * R[2*3+j];
+      }
+    }
+  }
+
+  /**
+   * Homography H (row-major, H[8] = 1) of (X, Y) to (u, v) by the
+   * normalized DLT
+   *
+   * @return false if degenerate
+   */
+  bool homography(const double * X, const double * Y, const double * u, const double * v, int n, double * H) {
+    // normalization of the centroid and the mean distance of sqrt(2)
+    double Ts[2][3];
+    const double * src[2][2] = { { X, Y }, { u, v } };
+    for(int k=0 ; k<2 ; k++) {
+      double cx = 0, cy = 0, s = 0;
+      for(int i=0 ; i<n ; i++) {
+        cx += src[k][0][i];
+        cy += src[k][1][i];
+      }
+      cx /= n;
+      cy /= n;
+      for(int i=0 ; i<n ; i++) {
+        s += std::sqrt((src[k][0][i] - cx) * (src[k][0][i] - cx) + (src[k][1][i] - cy) * (src[k][1][i] - cy));
+      }
+      if(! (s > 0)) {
+        return false;
+      }
+      s = std::sqrt(2.0) * n / s;
+      Ts[k][0] = s;
+      Ts[k][1] = cx;
+      Ts[k][2] = cy;
+    }
+
+    double A[64] = { 0 }, b[8] = { 0 };
+    for(int i=0 ; i<n ; i++) {
+      const double x = (X[i] - Ts[0][1]) * Ts[0][0];
+      const double y = (Y[i] - Ts[0][2]) * Ts[0][0];
+      const double p = (u[i] - Ts[1][1]) * Ts[1][0];
+      const double q = (v[i] - Ts[1][2]) * Ts[1][0];
+      const double r[2][8] = {
+        { x, y, 1, 0, 0, 0, -p * x, -p * y },
+        { 0, 0, 0, x, y, 1, -q * x, -q * y },
+      };
+      const double t[2] = { p, q };
+      for(int k=0 ; k<2 ; k++) {
+        for(int a=0 ; a<8 ; a++) {
+          b[a] += r[k][a] * t[k];
+          for(int c=0 ; c<=a ; c++) {
+            A[a*8+c] += r[k][a] * r[k][c];
+          }
+        }
+      }
+    }
+    if(! cholesky(A, 8)) {
+      return false;
+    }
+    cholesky_solve(A, 8, b);
+
+    // H = Tu^-1 Hn Tx
+    const double Hn[9] = { b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], 1 };
+    const double sx = Ts[0][0], cx = Ts[0][1], cy = Ts[0][2];
+    const double su = Ts[1][0], cu = Ts[1][1], cv = Ts[1][2];
+    double G[9];
+    for(int i=0 ; i<3 ; i++) {
+      G[3*i+0] = Hn[3*i+0] * sx;
+      G[3*i+1] = Hn[3*i+1] * sx;
+      G[3*i+2] = Hn[3*i+2] - (Hn[3*i+0] * cx + Hn[3*i+1] * cy) * sx;
+    }
+    for(int j=0 ; j<3 ; j++) {
+      H[0*3+j] = G[0*3+j] / su + cu * G[2*3+j];
+      H[1*3+j] = G[1*3+j] / su + cv * G[2*3+j];
+      H[2*3+j] = G[2*3+j];
+    }
+    return true;
+  }
+
+  void normalize(double * a) {
+    const double n = std::sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+    a[0] /= n;
+    a[1] /= n;
+    a[2] /= n;
+  }
+
+  /**
+   * The pose of the homography H of the chessboard to the normalized
+   * points, i.e., [r1 r2 T] ~ H
+   */
+  void decompose(const double * H, double * R, double * T) {
+    double r1[3] = { H[0], H[3], H[6] };
+    double r2[3] = { H[1], H[4], H[7] };
+    double s = 2 / (std::sqrt(r1[0] * r1[0] + r1[1] * r1[1] + r1[2] * r1[2]) +
+                    std::sqrt(r2[0] * r2[0] + r2[1] * r2[1] + r2[2] * r2[2]));
+    // the chessboard is in front of the camera
+    if(H[8] < 0) {
+      s = -s;
+    }
+    T[0] = s * H[2];
+    T[1] = s * H[5];
+    T[2] = s * H[8];
+
+    // the nearest orthonormal r1 and r2, symmetric around their bisector
+    normalize(r1);
+    normalize(r2);
+    double c[3] = { r1[0] + r2[0], r1[1] + r2[1], r1[2] + r2[2] };
+    double d[3] = { r1[0] - r2[0], r1[1] - r2[1], r1[2] - r2[2] };
+    normalize(c);
+    normalize(d);
+    const double h = std::sqrt(0.5);
+    for(int i=0 ; i<3 ; i++) {
+      r1[i] = (c[i] + d[i]) * h;
+      r2[i] = (c[i] - d[i]) * h;
+    }
+    const double r3[3] = {
+      r1[1] * r2[2] - r1[2] * r2[1],
+      r1[2] * r2[0] - r1[0] * r2[2],
+      r1[0] * r2[1] - r1[1] * r2[0],
+    };
+    for(int i=0 ; i<3 ; i++) {
+      R[3*i+0] = r1[i];
+      R[3*i+1] = r2[i];
+      R[3*i+2] = r3[i];
+    }
+  }
+}
+
+const int PFCMU::IncalibSolver::ITERATIONS;
+
+PFCMU::IncalibSolver::IncalibSolver() : m_width(0), m_height(0), m_placed(0), m_lambda(LAMBDA_INIT), m_rms(0), m_pool(NULL) {
+  memset(&m_lens, 0, sizeof(m_lens));
+  memset(&m_lens2, 0, sizeof(m_lens2));
+  memset(m_delta, 0, sizeof(m_delta));
+}
+
+PFCMU::IncalibSolver::~IncalibSolver() {
+  delete m_pool;
+}
+
+void PFCMU::IncalibSolver::init(int threads) {
+  delete m_pool;
+  m_pool = new WorkerPool(threads > 0 ? threads : (int)boost::thread::hardware_concurrency());
+}
+
+void PFCMU::IncalibSolver::setup(int width, int height, int rows, int cols, double square) {
+  m_width = width;
+  m_height = height;
+  // the object points of ChessboardDetector
+  m_X.clear();
+  m_Y.clear();
+  for(int r=0 ; r<rows ; r++) {
+    for(int c=0 ; c<cols ; c++) {
+      m_X.push_back((c - cols / 2) * square);
+      m_Y.push_back((r - rows / 2) * square);
+    }
+  }
+  m_u.clear();
+  m_v.clear();
+  m_views.clear();
+  m_placed = 0;
+  memset(&m_lens, 0, sizeof(m_lens));
+  m_rms = 0;
+}
+
+void PFCMU::IncalibSolver::add_view(const double * xy) {
+  const size_t N = m_X.size();
+  for(size_t i=0 ; i<N ; i++) {
+    m_u.push_back(xy[2*i+0]);
+    m_v.push_back(xy[2*i+1]);
+  }
+  view_t view;
+  memset(&view, 0, sizeof(view));
+  m_views.push_back(view);
+}
+
+void PFCMU::IncalibSolver::pose(int view, VM::matrix3_t * R, VM::vector3_t * T) const {
+  const view_t & v = m_views[view];
+  R->set(v.R[0], v.R[1], v.R[2],
+         v.R[3], v.R[4], v.R[5],
+         v.R[6], v.R[7], v.R[8]);
+  T->set(v.T[0], v.T[1], v.T[2]);
+}
+
+int PFCMU::IncalibSolver::save(const char * filename, int key_view) const {
+  VM::matrix3_t R;
+  VM::vector3_t T;
+  pose(key_view, &R, &T);
+  return save(filename, m_lens, R, T);
+}
+
+int PFCMU::IncalibSolver::save(const char * filename, const lens_t & lens, const VM::matrix3_t & R, const VM::vector3_t & T) {
+  FILE * fp = fopen(filename, "w");
+  if(! fp) {
+    return -1;
+  }
+  // no skew, as cvCalibrateCamera2
+  const int n = fprintf(fp,
+                        "%.16e %.16e %.16e %.16e %.16e\n"
+                        "\n"
+                        "%.16e %.16e %.16e %.16e\n"
+                        "\n"
+                        "%e %e %e\n"
+                        "%e %e %e\n"
+                        "%e %e %e\n"
+                        "%e %e %e\n"
+                        "\n",
+                        lens.fx, 0.0, lens.fy, lens.u0, lens.v0,
+                        lens.k1, lens.k2, lens.p1, lens.p2,
+                        R.m00, R.m01, R.m02,
+                        R.m10, R.m11, R.m12,
+                        R.m20, R.m21, R.m22,
+                        T.x, T.y, T.z);
+  const int ret = fclose(fp);
+  return (n > 0 && ret == 0) ? 0 : -1;
+}
+
+/**
+ * Place the view by the homography of its corners undistorted by the
+ * current lens
+ */
+void PFCMU::IncalibSolver::place(int view) {
+  const size_t N = m_X.size();
+  std::vector<double> x(N), y(N);
+  LensModel model;
+  model.undistort(m_lens, &m_u[N * view], &m_v[N * view], &x[0], &y[0], N);
+
+  view_t & v = m_views[view];
+  double H[9];
+  if(! homography(&m_X[0], &m_Y[0], &x[0], &y[0], N, H)) {
+    // degenerate corners, placed in front of the camera
+    const double R[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    memcpy(v.R, R, sizeof(R));
+    v.T[0] = v.T[1] = 0;
+    v.T[2] = 1;
+    return;
+  }
+  decompose(H, v.R, v.T);
+}
+
+/**
+ * The focal length by the homographies of all the views, where the
+ * principal point is the centre and no distortion.  Each view gives
+ * h1^t w h2 = 0 and h1^t w h1 = h2^t w h2 of w = K^-t K^-1, linear in
+ * 1/f^2.
+ */
+void PFCMU::IncalibSolver::initialize() {
+  const size_t N = m_X.size();
+  m_lens.u0 = m_width / 2.0;
+  m_lens.v0 = m_height / 2.0;
+  m_lens.k1 = m_lens.k2 = m_lens.p1 = m_lens.p2 = 0;
+
+  double aa = 0, ab = 0;
+  for(size_t i=0 ; i<m_views.size() ; i++) {
+    double H[9];
+    if(! homography(&m_X[0], &m_Y[0], &m_u[N * i], &m_v[N * i], N, H)) {
+      continue;
+    }
+    // shift the principal point to the origin
+    for(int j=0 ; j<3 ; j++) {
+      H[0*3+j] -= m_lens.u0 * H[2*3+j];
+      H[1*3+j] -= m_lens.v0 * H[2*3+j];
+    }
+    double n = 0;
+    for(int j=0 ; j<9 ; j++) {
+      n += H[j] * H[j];
+    }
+    n = std::sqrt(n);
+    const double a0 = H[0] / n, a1 = H[3] / n, a2 = H[6] / n;
+    const double b0 = H[1] / n, b1 = H[4] / n, b2 = H[7] / n;
+    const double A[2] = { a0 * b0 + a1 * b1, a0 * a0 + a1 * a1 - b0 * b0 - b1 * b1 };
+    const double B[2] = { a2 * b2, a2 * a2 - b2 * b2 };
+    for(int k=0 ; k<2 ; k++) {
+      aa += A[k] * A[k];
+      ab += A[k] * B[k];
+    }
+  }
+  const double w = aa > 0 ? -ab / aa : 0;
+  // fronto-parallel views only, a guess of the field of view of 53 deg.
+  const double f = w > 0 ? 1 / std::sqrt(w) : std::max(m_width, m_height);
+  TRACE(1, "incalib: initial f = %f of %zd views\n", f, m_views.size());
+  m_lens.fx = m_lens.fy = f;
+}
+
+double PFCMU::IncalibSolver::solve(int iterations) {
+  const size_t N = m_X.size();
+  const int V = m_views.size();
+  if(V == 0 || N == 0) {
+    return 0;
+  }
+  if(m_placed == 0) {
+    initialize();
+  }
+  for( ; m_placed<V ; m_placed++) {
+    place(m_placed);
+  }
+
+  const int B = m_pool ? std::min(V, m_pool->size() * BANDS_PER_THREAD) : 1;
+  m_bands.resize(B);
+
+  run(&IncalibSolver::linearize, B);
+  double U[NC*NC] = { 0 }, b[NC] = { 0 }, cost = 0;
+  for(int i=0 ; i<B ; i++) {
+    for(int j=0 ; j<NC*NC ; j++) {
+      U[j] += m_bands[i].U[j];
+    }
+    for(int j=0 ; j<NC ; j++) {
+      b[j] += m_bands[i].b[j];
+    }
+    cost += m_bands[i].cost;
+  }
+
+  m_lambda = LAMBDA_INIT;
+  for(int it=0 ; it<iterations ; it++) {
+    bool improved = false;
+    double cost2 = cost;
+    while(! improved && m_lambda < LAMBDA_MAX) {
+      // the reduced system (U - sum W V^-1 W^t) dc = b - sum W V^-1 bv
+      run(&IncalibSolver::reduce, B);
+      double S[NC*NC];
+      memcpy(S, U, sizeof(S));
+      damp(S, NC, m_lambda);
+      memcpy(m_delta, b, sizeof(m_delta));
+      for(int i=0 ; i<B ; i++) {
+        for(int j=0 ; j<NC*NC ; j++) {
+          S[j] -= m_bands[i].S[j];
+        }
+        for(int j=0 ; j<NC ; j++) {
+          m_delta[j] -= m_bands[i].s[j];
+        }
+      }
+      if(! cholesky(S, NC)) {
+        m_lambda *= 10;
+        continue;
+      }
+      cholesky_solve(S, NC, m_delta);
+
+      m_lens2 = m_lens;
+      m_lens2.fx = m_lens2.fy = m_lens.fx + m_delta[0];
+      m_lens2.u0 += m_delta[1];
+      m_lens2.v0 += m_delta[2];
+      m_lens2.k1 += m_delta[3];
+      m_lens2.k2 += m_delta[4];
+      m_lens2.p1 += m_delta[5];
+      m_lens2.p2 += m_delta[6];
+
+      run(&IncalibSolver::evaluate, B);
+      cost2 = 0;
+      for(int i=0 ; i<B ; i++) {
+        cost2 += m_bands[i].cost;
+      }
+      if(cost2 < cost) {
+        improved = true;
+        m_lambda = std::max(m_lambda / 10, 1e-12);
+      } else {
+        m_lambda *= 10;
+      }
+    }
+    if(! improved) {
+      break;
+    }
+
+    m_lens = m_lens2;
+    for(int i=0 ; i<V ; i++) {
+      memcpy(m_views[i].R, m_views[i].R2, sizeof(m_views[i].R));
+      memcpy(m_views[i].T, m_views[i].T2, sizeof(m_views[i].T));
+    }
+    const bool converged = cost - cost2 < cost * TOLERANCE;
+
+    run(&IncalibSolver::linearize, B);
+    memset(U, 0, sizeof(U));
+    memset(b, 0, sizeof(b));
+    cost = 0;
+    for(int i=0 ; i<B ; i++) {
+      for(int j=0 ; j<NC*NC ; j++) {
+        U[j] += m_bands[i].U[j];
+      }
+      for(int j=0 ; j<NC ; j++) {
+        b[j] += m_bands[i].b[j];
+      }
+      cost += m_bands[i].cost;
+    }
+    TRACE(2, "incalib: iteration %d, rms = %f, lambda = %e\n", it, std::sqrt(cost / (V * N)), m_lambda);
+    if(converged) {
+      break;
+    }
+  }
+
+  m_rms = std::sqrt(cost / (V * N));
+  return m_rms;
+}
+
+void PFCMU::IncalibSolver::run(void (IncalibSolver::*fn)(int), int n) {
+  if(m_pool && n > 1) {
+    m_pool->parallel_for(n, boost::bind(fn, this, _1));
+  } else {
+    for(int i=0 ; i<n ; i++) {
+      (this->*fn)(i);
+    }
+  }
+}
+
+/**
+ * The blocks of J^t J and J^t e of the views of the band, and the sums
+ * of the intrinsic parameters
+ */
+void PFCMU::IncalibSolver::linearize(int band) {
+  const int N = m_X.size();
+  const int V = m_views.size();
+  const int B = m_bands.size();
+  band_t & s = m_bands[band];
+  memset(&s, 0, sizeof(s));
+
+  for(int i=V*band/B ; i<V*(band+1)/B ; i++) {
+    view_t & view = m_views[i];
+    memset(view.V, 0, sizeof(view.V));
+    memset(view.W, 0, sizeof(view.W));
+    memset(view.b, 0, sizeof(view.b));
+    const double * u = &m_u[(size_t)N * i];
+    const double * v = &m_v[(size_t)N * i];
+
+    for(int j=0 ; j<N ; j++) {
+      double pu, pv, Jc[2*NC], Jp[2*NP];
+      project(m_lens, view.R, view.T, m_X[j], m_Y[j], &pu, &pv, Jc, Jp);
+      const double e[2] = { u[j] - pu, v[j] - pv };
+      s.cost += e[0] * e[0] + e[1] * e[1];
+
+      for(int r=0 ; r<2 ; r++) {
+        const double * jc = Jc + NC * r;
+        const double * jp = Jp + NP * r;
+        for(int a=0 ; a<NC ; a++) {
+          s.b[a] += jc[a] * e[r];
+          for(int c=0 ; c<=a ; c++) {
+            s.U[a*NC+c] += jc[a] * jc[c];
+          }
+          for(int c=0 ; c<NP ; c++) {
+            view.W[a*NP+c] += jc[a] * jp[c];
+          }
+        }
+        for(int a=0 ; a<NP ; a++) {
+          view.b[a] += jp[a] * e[r];
+          for(int c=0 ; c<=a ; c++) {
+            view.V[a*NP+c] += jp[a] * jp[c];
+          }
+        }
+      }
+    }
+    // the upper triangle of V
+    for(int a=0 ; a<NP ; a++) {
+      for(int c=a+1 ; c<NP ; c++) {
+        view.V[a*NP+c] = view.V[c*NP+a];
+      }
+    }
+  }
+  for(int a=0 ; a<NC ; a++) {
+    for(int c=a+1 ; c<NC ; c++) {
+      s.U[a*NC+c] = s.U[c*NC+a];
+    }
+  }
+}
+
+/**
+ * The sums of W V^-1 W^t and W V^-1 bv of the views of the band, by
+ * the damped V
+ */
+void PFCMU::IncalibSolver::reduce(int band) {
+  const int V = m_views.size();
+  const int B = m_bands.size();
+  band_t & s = m_bands[band];
+  memset(s.S, 0, sizeof(s.S));
+  memset(s.s, 0, sizeof(s.s));
+
+  for(int i=V*band/B ; i<V*(band+1)/B ; i++) {
+    view_t & view = m_views[i];
+    memcpy(view.L, view.V, sizeof(view.L));
+    damp(view.L, NP, m_lambda);
+    if(! cholesky(view.L, NP)) {
+      // not observable (e.g., behind the camera), left as is
+      memset(view.L, 0, sizeof(view.L));
+      continue;
+    }
+    for(int a=0 ; a<NC ; a++) {
+      // the row a of W V^-1
+      double y[NP];
+      memcpy(y, view.W + a * NP, sizeof(y));
+      cholesky_solve(view.L, NP, y);
+      for(int c=0 ; c<NC ; c++) {
+        double t = 0;
+        for(int k=0 ; k<NP ; k++) {
+          t += y[k] * view.W[c*NP+k];
+        }
+        s.S[a*NC+c] += t;
+      }
+      for(int k=0 ; k<NP ; k++) {
+        s.s[a] += y[k] * view.b[k];
+      }
+    }
+  }
+}
+
+/**
+ * The poses of the step of the views of the band by the back
+ * substitution of the intrinsic parameters, and the sum of the errors
+ */
+void PFCMU::IncalibSolver::evaluate(int band) {
+  const int N = m_X.size();
+  const int V = m_views.size();
+  const int B = m_bands.size();
+  band_t & s = m_bands[band];
+  s.cost = 0;
+
+  for(int i=V*band/B ; i<V*(band+1)/B ; i++) {
+    view_t & view = m_views[i];
+    double d[NP] = { 0 };
+    if(view.L[0] > 0) {
+      for(int a=0 ; a<NP ; a++) {
+        d[a] = view.b[a];
+        for(int c=0 ; c<NC ; c++) {
+          d[a] -= view.W[c*NP+a] * m_delta[c];
+        }
+      }
+      cholesky_solve(view.L, NP, d);
+    }
+    rotate(d, view.R, view.R2);
+    for(int k=0 ; k<3 ; k++) {
+      view.T2[k] = view.T[k] + d[3+k];
+    }
+
+    const double * u = &m_u[(size_t)N * i];
+    const double * v = &m_v[(size_t)N * i];
+    for(int j=0 ; j<N ; j++) {
+      double pu, pv;
+      project(m_lens2, view.R2, view.T2, m_X[j], m_Y[j], &pu, &pv);
+      s.cost += (u[j] - pu) * (u[j] - pu) + (v[j] - pv) * (v[j] - pv);
+    }
+  }
+}
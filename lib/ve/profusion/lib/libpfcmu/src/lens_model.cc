@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <algorithm>
+#include <vector>
+#include <immintrin.h>
+
+#include "lens_model.h"
+#include "worker_pool.h"
+#include "trace.h"
+
+namespace {
+  const bool s_avx2 = __builtin_cpu_supports("avx2");
+
+  /// row bands of a map per thread
+  const int BANDS_PER_THREAD = 4;
+
+  /**
+   * The parameters in float, as my_cvInitUndistortMap
+   */
+  struct coeffs_t {
+    float fx, fy, u0, v0;
+    float k1, k2, p1, p2;
+    // derived constants of the polynomials
+    float _2p1, _2p2, _3p1, _3p2;
+
+    explicit coeffs_t(const PFCMU::lens_t & l)
+      : fx((float)l.fx), fy((float)l.fy), u0((float)l.u0), v0((float)l.v0),
+        k1((float)l.k1), k2((float)l.k2), p1((float)l.p1), p2((float)l.p2),
+        _2p1(2 * p1), _2p2(2 * p2), _3p1(3 * p1), _3p2(3 * p2) {
+    }
+  };
+
+  /**
+   * Distort the normalized (xs[i], y) of [begin:n) of a row into pixels
+   */
+  void forward_scalar(const coeffs_t & c, const float * xs, float y, float * mapx, float * mapy, int begin, int n) {
+    const float y2 = y * y;
+    const float _2p1y = c._2p1 * y;
+    const float _3p1y2 = c._3p1 * y2;
+    const float p2y2 = c.p2 * y2;
+    for(int i=begin ; i<n ; i++) {
+      const float x = xs[i];
+      const float x2 = x * x;
+      const float r2 = x2 + y2;
+      const float d = 1 + (c.k1 + c.k2 * r2) * r2;
+      mapx[i] = c.fx * (x * (d + _2p1y) + p2y2 + c._3p2 * x2) + c.u0;
+      mapy[i] = c.fy * (y * (d + c._2p2 * x) + _3p1y2 + c.p1 * x2) + c.v0;
+    }
+  }
+
+  __attribute__((target("avx2")))
+  void forward_avx2(const coeffs_t & c, const float * xs, float y, float * mapx, float * mapy, int n) {
+    const float y2 = y * y;
+    const __m256 vy = _mm256_set1_ps(y);
+    const __m256 vy2 = _mm256_set1_ps(y2);
+    const __m256 v2p1y = _mm256_set1_ps(c._2p1 * y);
+    const __m256 v3p1y2 = _mm256_set1_ps(c._3p1 * y2);
+    const __m256 vp2y2 = _mm256_set1_ps(c.p2 * y2);
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 k1 = _mm256_set1_ps(c.k1), k2 = _mm256_set1_ps(c.k2);
+    const __m256 p1 = _mm256_set1_ps(c.p1), _2p2 = _mm256_set1_ps(c._2p2), _3p2 = _mm256_set1_ps(c._3p2);
+    const __m256 fx = _mm256_set1_ps(c.fx), fy = _mm256_set1_ps(c.fy);
+    const __m256 u0 = _mm256_set1_ps(c.u0), v0 = _mm256_set1_ps(c.v0);
+
+    int i = 0;
+    for( ; i + 8 <= n ; i += 8) {
+      const __m256 x = _mm256_loadu_ps(xs + i);
+      const __m256 x2 = _mm256_mul_ps(x, x);
+      const __m256 r2 = _mm256_add_ps(x2, vy2);
+      const __m256 d = _mm256_add_ps(one, _mm256_mul_ps(_mm256_add_ps(k1, _mm256_mul_ps(k2, r2)), r2));
+      const __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(d, v2p1y)), vp2y2), _mm256_mul_ps(_3p2, x2));
+      const __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vy, _mm256_add_ps(d, _mm256_mul_ps(_2p2, x))), v3p1y2),
+                                     _mm256_mul_ps(p1, x2));
+      _mm256_storeu_ps(mapx + i, _mm256_add_ps(_mm256_mul_ps(fx, u), u0));
+      _mm256_storeu_ps(mapy + i, _mm256_add_ps(_mm256_mul_ps(fy, v), v0));
+    }
+    forward_scalar(c, xs, y, mapx, mapy, i, n);
+  }
+
+  /**
+   * Undistort the normalized (xs[i], y) of [begin:n) of a row into pixels
+   */
+  void inverse_scalar(const coeffs_t & c, const float * xs, float y0, int iterations, float * mapx, float * mapy, int begin, int n) {
+    for(int i=begin ; i<n ; i++) {
+      const float x0 = xs[i];
+      float x = x0, y = y0;
+      for(int j=0 ; j<iterations ; j++) {
+        const float x2 = x * x;
+        const float y2 = y * y;
+        const float r2 = x2 + y2;
+        const float _2xy = 2 * x * y;
+        const float icdist = 1 / (1 + (c.k1 + c.k2 * r2) * r2);
+        const float dx = c.p1 * _2xy + c.p2 * (r2 + 2 * x2);
+        const float dy = c.p1 * (r2 + 2 * y2) + c.p2 * _2xy;
+        x = (x0 - dx) * icdist;
+        y = (y0 - dy) * icdist;
+      }
+      mapx[i] = c.fx * x + c.u0;
+      mapy[i] = c.fy * y + c.v0;
+    }
+  }
+
+  __attribute__((target("avx2")))
+  void inverse_avx2(const coeffs_t & c, const float * xs, float y0, int iterations, float * mapx, float * mapy, int n) {
+    const __m256 one = _mm256_set1_ps(1), two = _mm256_set1_ps(2);
+    const __m256 k1 = _mm256_set1_ps(c.k1), k2 = _mm256_set1_ps(c.k2);
+    const __m256 p1 = _mm256_set1_ps(c.p1), p2 = _mm256_set1_ps(c.p2);
+    const __m256 fx = _mm256_set1_ps(c.fx), fy = _mm256_set1_ps(c.fy);
+    const __m256 u0 = _mm256_set1_ps(c.u0), v0 = _mm256_set1_ps(c.v0);
+    const __m256 vy0 = _mm256_set1_ps(y0);
+
+    int i = 0;
+    for( ; i + 8 <= n ; i += 8) {
+      const __m256 x0 = _mm256_loadu_ps(xs + i);
+      __m256 x = x0, y = vy0;
+      for(int j=0 ; j<iterations ; j++) {
+        const __m256 x2 = _mm256_mul_ps(x, x);
+        const __m256 y2 = _mm256_mul_ps(y, y);
+        const __m256 r2 = _mm256_add_ps(x2, y2);
+        const __m256 _2xy = _mm256_mul_ps(_mm256_mul_ps(two, x), y);
+        const __m256 icdist = _mm256_div_ps(one, _mm256_add_ps(one, _mm256_mul_ps(_mm256_add_ps(k1, _mm256_mul_ps(k2, r2)), r2)));
+        const __m256 dx = _mm256_add_ps(_mm256_mul_ps(p1, _2xy), _mm256_mul_ps(p2, _mm256_add_ps(r2, _mm256_mul_ps(two, x2))));
+        const __m256 dy = _mm256_add_ps(_mm256_mul_ps(p1, _mm256_add_ps(r2, _mm256_mul_ps(two, y2))), _mm256_mul_ps(p2, _2xy));
+        x = _mm256_mul_ps(_mm256_sub_ps(x0, dx), icdist);
+        y = _mm256_mul_ps(_mm256_sub_ps(vy0, dy), icdist);
+      }
+      _mm256_storeu_ps(mapx + i, _mm256_add_ps(_mm256_mul_ps(fx, x), u0));
+      _mm256_storeu_ps(mapy + i, _mm256_add_ps(_mm256_mul_ps(fy, y), v0));
+    }
+    inverse_scalar(c, xs, y0, iterations, mapx, mapy, i, n);
+  }
+
+  /**
+   * The arguments of the point kernels: in and out are the arrays of
+   * the coordinates, R (row-major) and T the rotation and translation
+   */
+  struct point_args_t {
+    const PFCMU::lens_t * lens;
+    const double * R;
+    const double * T;
+    const double * in[3];
+    double * out[3];
+    int iterations;
+  };
+
+  inline void distort_point(const PFCMU::lens_t & l, double x, double y, double * u, double * v) {
+    const double x2 = x * x;
+    const double y2 = y * y;
+    const double r2 = x2 + y2;
+    const double _2xy = 2 * x * y;
+    const double d = 1 + (l.k1 + l.k2 * r2) * r2;
+    *u = l.fx * (x * d + l.p1 * _2xy + l.p2 * (r2 + 2 * x2)) + l.u0;
+    *v = l.fy * (y * d + l.p1 * (r2 + 2 * y2) + l.p2 * _2xy) + l.v0;
+  }
+
+  inline void undistort_point(const PFCMU::lens_t & l, double u, double v, int iterations, double * x, double * y) {
+    const double x0 = (u - l.u0) / l.fx;
+    const double y0 = (v - l.v0) / l.fy;
+    double px = x0, py = y0;
+    for(int j=0 ; j<iterations ; j++) {
+      const double x2 = px * px;
+      const double y2 = py * py;
+      const double r2 = x2 + y2;
+      const double _2xy = 2 * px * py;
+      const double icdist = 1 / (1 + (l.k1 + l.k2 * r2) * r2);
+      const double dx = l.p1 * _2xy + l.p2 * (r2 + 2 * x2);
+      const double dy = l.p1 * (r2 + 2 * y2) + l.p2 * _2xy;
+      px = (x0 - dx) * icdist;
+      py = (y0 - dy) * icdist;
+    }
+    *x = px;
+    *y = py;
+  }
+
+  /**
+   * The points of [begin:end) by the scalar code
+   */
+  void distort_scalar(const point_args_t & a, size_t begin, size_t end) {
+    for(size_t i=begin ; i<end ; i++) {
+      distort_point(*a.lens, a.in[0][i], a.in[1][i], a.out[0] + i, a.out[1] + i);
+    }
+  }
+
+  void undistort_scalar(const point_args_t & a, size_t begin, size_t end) {
+    for(size_t i=begin ; i<end ; i++) {
+      undistort_point(*a.lens, a.in[0][i], a.in[1][i], a.iterations, a.out[0] + i, a.out[1] + i);
+    }
+  }
+
+  void project_scalar(const point_args_t & a, size_t begin, size_t end) {
+    const double * R = a.R;
+    const double * T = a.T;
+    for(size_t i=begin ; i<end ; i++) {
+      const double X = a.in[0][i], Y = a.in[1][i], Z = a.in[2][i];
+      const double cx = R[0] * X + R[1] * Y + R[2] * Z + T[0];
+      const double cy = R[3] * X + R[4] * Y + R[5] * Z + T[1];
+      const double cz = R[6] * X + R[7] * Y + R[8] * Z + T[2];
+      distort_point(*a.lens, cx / cz, cy / cz, a.out[0] + i, a.out[1] + i);
+    }
+  }
+
+  void unproject_scalar(const point_args_t & a, size_t begin, size_t end) {
+    const double * R = a.R;
+    for(size_t i=begin ; i<end ; i++) {
+      double x, y;
+      undistort_point(*a.lens, a.in[0][i], a.in[1][i], a.iterations, &x, &y);
+      a.out[0][i] = R[0] * x + R[3] * y + R[6];
+      a.out[1][i] = R[1] * x + R[4] * y + R[7];
+      a.out[2][i] = R[2] * x + R[5] * y + R[8];
+    }
+  }
+
+  /**
+   * The lens broadcasted for 4 points
+   */
+  struct lens4_t {
+    __m256d fx, fy, u0, v0;
+    __m256d k1, k2, p1, p2;
+  };
+
+  __attribute__((target("avx2")))
+  inline void broadcast(const PFCMU::lens_t & l, lens4_t * L) {
+    L->fx = _mm256_set1_pd(l.fx);
+    L->fy = _mm256_set1_pd(l.fy);
+    L->u0 = _mm256_set1_pd(l.u0);
+    L->v0 = _mm256_set1_pd(l.v0);
+    L->k1 = _mm256_set1_pd(l.k1);
+    L->k2 = _mm256_set1_pd(l.k2);
+    L->p1 = _mm256_set1_pd(l.p1);
+    L->p2 = _mm256_set1_pd(l.p2);
+  }
+
+  __attribute__((target("avx2")))
+  inline void distort4(const lens4_t & L, __m256d x, __m256d y, double * u, double * v) {
+    const __m256d one = _mm256_set1_pd(1), two = _mm256_set1_pd(2);
+    const __m256d x2 = _mm256_mul_pd(x, x);
+    const __m256d y2 = _mm256_mul_pd(y, y);
+    const __m256d r2 = _mm256_add_pd(x2, y2);
+    const __m256d _2xy = _mm256_mul_pd(_mm256_mul_pd(two, x), y);
+    const __m256d d = _mm256_add_pd(one, _mm256_mul_pd(_mm256_add_pd(L.k1, _mm256_mul_pd(L.k2, r2)), r2));
+    const __m256d du = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x, d), _mm256_mul_pd(L.p1, _2xy)),
+                                     _mm256_mul_pd(L.p2, _mm256_add_pd(r2, _mm256_mul_pd(two, x2))));
+    const __m256d dv = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(y, d), _mm256_mul_pd(L.p1, _mm256_add_pd(r2, _mm256_mul_pd(two, y2)))),
+                                     _mm256_mul_pd(L.p2, _2xy));
+    _mm256_storeu_pd(u, _mm256_add_pd(_mm256_mul_pd(L.fx, du), L.u0));
+    _mm256_storeu_pd(v, _mm256_add_pd(_mm256_mul_pd(L.fy, dv), L.v0));
+  }
+
+  __attribute__((target("avx2")))
+  inline void undistort4(const lens4_t & L, const double * u, const double * v, int iterations, __m256d * x, __m256d * y) {
+    const __m256d one = _mm256_set1_pd(1), two = _mm256_set1_pd(2);
+    const __m256d x0 = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(u), L.u0), L.fx);
+    const __m256d y0 = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(v), L.v0), L.fy);
+    __m256d px = x0, py = y0;
+    for(int j=0 ; j<iterations ; j++) {
+      const __m256d x2 = _mm256_mul_pd(px, px);
+      const __m256d y2 = _mm256_mul_pd(py, py);
+      const __m256d r2 = _mm256_add_pd(x2, y2);
+      const __m256d _2xy = _mm256_mul_pd(_mm256_mul_pd(two, px), py);
+      const __m256d icdist = _mm256_div_pd(one, _mm256_add_pd(one, _mm256_mul_pd(_mm256_add_pd(L.k1, _mm256_mul_pd(L.k2, r2)), r2)));
+      const __m256d dx = _mm256_add_pd(_mm256_mul_pd(L.p1, _2xy), _mm256_mul_pd(L.p2, _mm256_add_pd(r2, _mm256_mul_pd(two, x2))));
+      const __m256d dy = _mm256_add_pd(_mm256_mul_pd(L.p1, _mm256_add_pd(r2, _mm256_mul_pd(two, y2))), _mm256_mul_pd(L.p2, _2xy));
+      px = _mm256_mul_pd(_mm256_sub_pd(x0, dx), icdist);
+      py = _mm256_mul_pd(_mm256_sub_pd(y0, dy), icdist);
+    }
+    *x = px;
+    *y = py;
+  }
+
+  /**
+   * R[i] * X + R[i+1] * Y + R[i+2] * Z + t
+   */
+  __attribute__((target("avx2")))
+  inline __m256d dot4(const double * R, __m256d X, __m256d Y, __m256d Z, double t) {
+    return _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(R[0]), X), _mm256_mul_pd(_mm256_set1_pd(R[1]), Y)),
+                                       _mm256_mul_pd(_mm256_set1_pd(R[2]), Z)),
+                         _mm256_set1_pd(t));
+  }
+
+  __attribute__((target("avx2")))
+  void distort_avx2(const point_args_t & a, size_t begin, size_t end) {
+    lens4_t L;
+    broadcast(*a.lens, &L);
+    size_t i = begin;
+    for( ; i + 4 <= end ; i += 4) {
+      distort4(L, _mm256_loadu_pd(a.in[0] + i), _mm256_loadu_pd(a.in[1] + i), a.out[0] + i, a.out[1] + i);
+    }
+    distort_scalar(a, i, end);
+  }
+
+  __attribute__((target("avx2")))
+  void undistort_avx2(const point_args_t & a, size_t begin, size_t end) {
+    lens4_t L;
+    broadcast(*a.lens, &L);
+    size_t i = begin;
+    for( ; i + 4 <= end ; i += 4) {
+      __m256d x, y;
+      undistort4(L, a.in[0] + i, a.in[1] + i, a.iterations, &x, &y);
+      _mm256_storeu_pd(a.out[0] + i, x);
+      _mm256_storeu_pd(a.out[1] + i, y);
+    }
+    undistort_scalar(a, i, end);
+  }
+
+  __attribute__((target("avx2")))
+  void project_avx2(const point_args_t & a, size_t begin, size_t end) {
+    lens4_t L;
+    broadcast(*a.lens, &L);
+    size_t i = begin;
+    for( ; i + 4 <= end ; i += 4) {
+      const __m256d X = _mm256_loadu_pd(a.in[0] + i);
+      const __m256d Y = _mm256_loadu_pd(a.in[1] + i);
+      const __m256d Z = _mm256_loadu_pd(a.in[2] + i);
+      const __m256d cz = dot4(a.R + 6, X, Y, Z, a.T[2]);
+      distort4(L, _mm256_div_pd(dot4(a.R, X, Y, Z, a.T[0]), cz), _mm256_div_pd(dot4(a.R + 3, X, Y, Z, a.T[1]), cz),
+               a.out[0] + i, a.out[1] + i);
+    }
+    project_scalar(a, i, end);
+  }
+
+  __attribute__((target("avx2")))
+  void unproject_avx2(const point_args_t & a, size_t begin, size_t end) {
+    lens4_t L;
+    broadcast(*a.lens, &L);
+    const double * R = a.R;
+    // R^t * (x, y, 1)
+    const double Rt[9] = { R[0], R[3], R[6], R[1], R[4], R[7], R[2], R[5], R[8] };
+    size_t i = begin;
+    for( ; i + 4 <= end ; i += 4) {
+      __m256d x, y;
+      undistort4(L, a.in[0] + i, a.in[1] + i, a.iterations, &x, &y);
+      for(int k=0 ; k<3 ; k++) {
+        const __m256d w = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(Rt[3*k]), x), _mm256_mul_pd(_mm256_set1_pd(Rt[3*k+1]), y)),
+                                        _mm256_set1_pd(Rt[3*k+2]));
+        _mm256_storeu_pd(a.out[k] + i, w);
+      }
+    }
+    unproject_scalar(a, i, end);
+  }
+}
+
+struct PFCMU::LensModel::job_t {
+  lens_t lens;
+  /// normalized x of the columns
+  std::vector<float> xs;
+  /// normalized y of the rows
+  std::vector<float> ys;
+  float * mapx;
+  float * mapy;
+  int step;
+  /// negative for forward()
+  int iterations;
+  int bands;
+
+  job_t(const lens_t & lens, const crop_t & crop, int width, int height, float * mapx, float * mapy, int step, int iterations)
+    : lens(lens), xs(width), ys(height), mapx(mapx), mapy(mapy), step(step > 0 ? step : width), iterations(iterations), bands(1) {
+    // the pixel centres of the maps on the crop
+    const double sx = crop.width / width;
+    const double sy = crop.height / height;
+    for(int i=0 ; i<width ; i++) {
+      xs[i] = (float)((crop.x + (i + 0.5) * sx - 0.5 - lens.u0) / lens.fx);
+    }
+    for(int i=0 ; i<height ; i++) {
+      ys[i] = (float)((crop.y + (i + 0.5) * sy - 0.5 - lens.v0) / lens.fy);
+    }
+  }
+};
+
+PFCMU::LensModel::LensModel() : m_pool(NULL) {
+}
+
+PFCMU::LensModel::~LensModel() {
+  delete m_pool;
+}
+
+void PFCMU::LensModel::init(int threads) {
+  delete m_pool;
+  m_pool = new WorkerPool(threads > 0 ? threads : (int)boost::thread::hardware_concurrency());
+}
+
+void PFCMU::LensModel::forward(const lens_t & lens, const crop_t & crop, int width, int height, float * mapx, float * mapy, int step) {
+  job_t job(lens, crop, width, height, mapx, mapy, step, -1);
+  run(job);
+}
+
+void PFCMU::LensModel::inverse(const lens_t & lens, const crop_t & crop, int width, int height, float * mapx, float * mapy, int step,
+                               int iterations) {
+  ASSERT(iterations >= 0);
+  job_t job(lens, crop, width, height, mapx, mapy, step, iterations);
+  run(job);
+}
+
+void PFCMU::LensModel::run(job_t & job) {
+  if(! m_pool) {
+    run_band(&job, 0);
+    return;
+  }
+  job.bands = std::max(1, std::min((int)job.ys.size(), m_pool->size() * BANDS_PER_THREAD));
+  m_pool->parallel_for(job.bands, boost::bind(&LensModel::run_band, this, &job, _1));
+}
+
+void PFCMU::LensModel::run_band(const job_t * job, int band) {
+  const int width = job->xs.size();
+  const int height = job->ys.size();
+  const int row_begin = height * band / job->bands;
+  const int row_end = height * (band + 1) / job->bands;
+  const coeffs_t coeffs(job->lens);
+  for(int y=row_begin ; y<row_end ; y++) {
+    float * mx = job->mapx + (size_t)y * job->step;
+    float * my = job->mapy + (size_t)y * job->step;
+    if(job->iterations < 0) {
+      if(s_avx2) {
+        forward_avx2(coeffs, &job->xs[0], job->ys[y], mx, my, width);
+      } else {
+        forward_scalar(coeffs, &job->xs[0], job->ys[y], mx, my, 0, width);
+      }
+    } else {
+      if(s_avx2) {
+        inverse_avx2(coeffs, &job->xs[0], job->ys[y], job->iterations, mx, my, width);
+      } else {
+        inverse_scalar(coeffs, &job->xs[0], job->ys[y], job->iterations, mx, my, 0, width);
+      }
+    }
+  }
+}
+
+struct PFCMU::LensModel::points_t {
+  enum op_t {
+    DISTORT,
+    UNDISTORT,
+    PROJECT,
+    UNPROJECT,
+  };
+
+  op_t op;
+  lens_t lens;
+  /// row-major
+  double R[9];
+  double T[3];
+  const double * in[3];
+  double * out[3];
+  size_t n;
+  int iterations;
+  int bands;
+
+  points_t(op_t op, const lens_t & lens, size_t n, int iterations)
+    : op(op), lens(lens), n(n), iterations(iterations), bands(1) {
+    VM::to_array(VM::matrix3_t(1, 0, 0, 0, 1, 0, 0, 0, 1), R);
+    T[0] = T[1] = T[2] = 0;
+    in[0] = in[1] = in[2] = NULL;
+    out[0] = out[1] = out[2] = NULL;
+  }
+};
+
+void PFCMU::LensModel::distort(const lens_t & lens, const double * x, const double * y, double * u, double * v, size_t n) {
+  points_t job(points_t::DISTORT, lens, n, 0);
+  job.in[0] = x;
+  job.in[1] = y;
+  job.out[0] = u;
+  job.out[1] = v;
+  run(job);
+}
+
+void PFCMU::LensModel::undistort(const lens_t & lens, const double * u, const double * v, double * x, double * y, size_t n,
+                                 int iterations) {
+  ASSERT(iterations >= 0);
+  points_t job(points_t::UNDISTORT, lens, n, iterations);
+  job.in[0] = u;
+  job.in[1] = v;
+  job.out[0] = x;
+  job.out[1] = y;
+  run(job);
+}
+
+void PFCMU::LensModel::project(const lens_t & lens, const VM::matrix3_t & R, const VM::vector3_t & T,
+                               const double * X, const double * Y, const double * Z, double * u, double * v, size_t n) {
+  points_t job(points_t::PROJECT, lens, n, 0);
+  VM::to_array(R, job.R);
+  VM::to_array(T, job.T);
+  job.in[0] = X;
+  job.in[1] = Y;
+  job.in[2] = Z;
+  job.out[0] = u;
+  job.out[1] = v;
+  run(job);
+}
+
+void PFCMU::LensModel::unproject(const lens_t & lens, const VM::matrix3_t & R, const VM::vector3_t & T,
+                                 const double * u, const double * v, double * dx, double * dy, double * dz, size_t n,
+                                 int iterations) {
+  ASSERT(iterations >= 0);
+  points_t job(points_t::UNPROJECT, lens, n, iterations);
+  VM::to_array(R, job.R);
+  VM::to_array(T, job.T);
+  job.in[0] = u;
+  job.in[1] = v;
+  job.out[0] = dx;
+  job.out[1] = dy;
+  job.out[2] = dz;
+  run(job);
+}
+
+void PFCMU::LensModel::run(points_t & job) {
+  if(! m_pool || job.n <= PARALLEL_POINTS) {
+    run_points(&job, 0);
+    return;
+  }
+  job.bands = (int)std::min((size_t)m_pool->size() * BANDS_PER_THREAD, job.n / (PARALLEL_POINTS / BANDS_PER_THREAD));
+  m_pool->parallel_for(job.bands, boost::bind(&LensModel::run_points, this, &job, _1));
+}
+
+void PFCMU::LensModel::run_points(const points_t * job, int band) {
+  // the bands of multiples of 4 points, but the last
+  const size_t begin = (job->n * band / job->bands) & ~(size_t)3;
+  const size_t end = band + 1 == job->bands ? job->n : (job->n * (band + 1) / job->bands) & ~(size_t)3;
+
+  point_args_t a;
+  a.lens = &job->lens;
+  a.R = job->R;
+  a.T = job->T;
+  std::copy(job->in, job->in + 3, a.in);
+  std::copy(job->out, job->out + 3, a.out);
+  a.iterations = job->iterations;
+
+  switch(job->op) {
+  case points_t::DISTORT:
+    s_avx2 ? distort_avx2(a, begin, end) : distort_scalar(a, begin, end);
+    break;
+  case points_t::UNDISTORT:
+    s_avx2 ? undistort_avx2(a, begin, end) : undistort_scalar(a, begin, end);
+    break;
+  case points_t::PROJECT:
+    s_avx2 ? project_avx2(a, begin, end) : project_scalar(a, begin, end);
+    break;
+  case points_t::UNPROJECT:
+    s_avx2 ? unproject_avx2(a, begin, end) : unproject_scalar(a, begin, end);
+    break;
+  }
+}
+
+bool PFCMU::LensModel::avx2() {
+  return s_avx2;
+}
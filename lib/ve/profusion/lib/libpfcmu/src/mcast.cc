@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "mcast.h"
+#include "trace.h"
+
+namespace {
+  using PFCMU::mcast::byte_t;
+
+  const size_t IP_UDP_HEADER = 20 + 8;
+  const int SOCKET_BUFFER = 4 * 1024 * 1024;
+
+  void put16(byte_t * p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, 2);
+  }
+
+  void put32(byte_t * p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+  }
+
+  uint16_t get16(const byte_t * p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+  }
+
+  uint32_t get32(const byte_t * p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+  }
+
+  void xor_into(byte_t * dst, const byte_t * src, size_t len) {
+    for(size_t i=0 ; i<len ; i++) {
+      dst[i] ^= src[i];
+    }
+  }
+
+  in_addr to_addr(const char * text) {
+    in_addr a;
+    if(1 != inet_pton(AF_INET, text, &a)) {
+      DIE(1, "invalid IPv4 address '%s'\n", text);
+    }
+    return a;
+  }
+}
+
+void PFCMU::mcast::header_t::pack(byte_t * buf) const {
+  put32(buf + 0, MAGIC);
+  buf[4] = version;
+  buf[5] = flags;
+  buf[6] = fec_group;
+  buf[7] = encoding;
+  put32(buf + 8, packet_seq);
+  put32(buf + 12, image_seq);
+  put32(buf + 16, framecount);
+  put32(buf + 20, image_bytes);
+  put16(buf + 24, width);
+  put16(buf + 26, height);
+  put16(buf + 28, camera);
+  put16(buf + 30, index);
+  put16(buf + 32, count);
+  put16(buf + 34, fragment_bytes);
+  put32(buf + 36, 0);
+}
+
+int PFCMU::mcast::header_t::unpack(const byte_t * buf, size_t len) {
+  if(len < SIZE || get32(buf) != MAGIC || buf[4] != VERSION) {
+    return -1;
+  }
+  version = buf[4];
+  flags = buf[5];
+  fec_group = buf[6];
+  encoding = buf[7];
+  packet_seq = get32(buf + 8);
+  image_seq = get32(buf + 12);
+  framecount = get32(buf + 16);
+  image_bytes = get32(buf + 20);
+  width = get16(buf + 24);
+  height = get16(buf + 26);
+  camera = get16(buf + 28);
+  index = get16(buf + 30);
+  count = get16(buf + 32);
+  fragment_bytes = get16(buf + 34);
+
+  // consistency of the fields, so that the receiver can trust them
+  if(fragment_bytes == 0 || count == 0 ||
+     (size_t)count * fragment_bytes < image_bytes ||
+     (size_t)(count - 1) * fragment_bytes >= image_bytes) {
+    return -1;
+  }
+  if(flags & FLAG_PARITY) {
+    if(fec_group == 0 || index >= (count + fec_group - 1) / fec_group || len - SIZE != fragment_bytes) {
+      return -1;
+    }
+  } else {
+    const size_t expected = std::min((size_t)fragment_bytes, (size_t)image_bytes - (size_t)index * fragment_bytes);
+    if(index >= count || len - SIZE != expected) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int PFCMU::mcast::parse_endpoint(const std::string & text, std::string * group, int * port) {
+  const size_t colon = text.rfind(':');
+  if(colon == std::string::npos) {
+    return -1;
+  }
+  *group = text.substr(0, colon);
+  *port = atoi(text.c_str() + colon + 1);
+  in_addr a;
+  if(*port <= 0 || *port > 65535 || 1 != inet_pton(AF_INET, group->c_str(), &a) || ! IN_MULTICAST(ntohl(a.s_addr))) {
+    return -1;
+  }
+  return 0;
+}
+
+PFCMU::mcast::Publisher::Publisher(const char * group, int port, const char * iface, int ttl, int mtu, int fec_group)
+  : m_fd(-1),
+    m_fragment_bytes(std::min(mtu - (int)IP_UDP_HEADER - (int)header_t::SIZE, 0xffff)),
+    m_fec_group(std::max(0, std::min(fec_group, 0xff))),
+    m_packet_seq(0),
+    m_image_seq(0),
+    m_images(0),
+    m_packets(0),
+    m_bytes(0),
+    m_packet(header_t::SIZE + std::max(m_fragment_bytes, 0)) {
+  ASSERT(m_fragment_bytes > 0, "mtu=%d is too small\n", mtu);
+
+  if((m_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    DIE(1, "socket() failed : %s\n", strerror(errno));
+  }
+
+  memset(&m_addr, 0, sizeof(m_addr));
+  m_addr.sin_family = AF_INET;
+  m_addr.sin_port = htons(port);
+  m_addr.sin_addr = to_addr(group);
+
+  const unsigned char ttl_ = ttl;
+  const unsigned char loop = 1;
+  if(0 != setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl_, sizeof(ttl_)) ||
+     0 != setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop))) {
+    DIE(1, "setsockopt() failed : %s\n", strerror(errno));
+  }
+  if(iface) {
+    const in_addr a = to_addr(iface);
+    if(0 != setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF, &a, sizeof(a))) {
+      DIE(1, "cannot send multicast via %s : %s\n", iface, strerror(errno));
+    }
+  }
+  // a thumbnail is sent as a burst of datagrams
+  setsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &SOCKET_BUFFER, sizeof(SOCKET_BUFFER));
+
+  // the first image_seq is random so that a restarted publisher is not taken as stale
+  m_image_seq = (getpid() << 16) ^ time(NULL);
+}
+
+PFCMU::mcast::Publisher::~Publisher() {
+  if(m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+int PFCMU::mcast::Publisher::send_packet(header_t & h, const byte_t * payload, size_t len) {
+  h.packet_seq = m_packet_seq++;
+  h.pack(&(m_packet[0]));
+  memcpy(&(m_packet[header_t::SIZE]), payload, len);
+
+  const ssize_t ret = sendto(m_fd, &(m_packet[0]), header_t::SIZE + len, 0, reinterpret_cast<const sockaddr *>(&m_addr), sizeof(m_addr));
+  if(ret < 0) {
+    TRACE(2, "sendto() failed : %s\n", strerror(errno));
+    return -1;
+  }
+  m_packets++;
+  m_bytes += ret;
+  return 0;
+}
+
+int PFCMU::mcast::Publisher::send(timestamp_t framecount, int camera, codec::encoding_t enc, int width, int height, const byte_t * data, size_t len) {
+  const size_t F = m_fragment_bytes;
+  const size_t count = (len + F - 1) / F;
+  if(len == 0 || count > 0xffff) {
+    TRACE(1, "cannot send %zd bytes by multicast\n", len);
+    return -1;
+  }
+
+  header_t h;
+  h.version = VERSION;
+  h.fec_group = m_fec_group;
+  h.encoding = enc;
+  h.image_seq = ++m_image_seq;
+  h.framecount = framecount;
+  h.image_bytes = len;
+  h.width = width;
+  h.height = height;
+  h.camera = camera;
+  h.count = count;
+  h.fragment_bytes = F;
+
+  m_images++;
+
+  int ret = 0;
+  std::vector<byte_t> parity(F);
+  for(size_t i=0 ; i<count ; i++) {
+    const size_t n = std::min(F, len - i * F);
+    h.flags = 0;
+    h.index = i;
+    ret |= send_packet(h, data + i * F, n);
+
+    if(m_fec_group > 0) {
+      // the last fragment is zero-padded in the parity
+      xor_into(&(parity[0]), data + i * F, n);
+      if((i + 1) % m_fec_group == 0 || i + 1 == count) {
+        h.flags = FLAG_PARITY;
+        h.index = i / m_fec_group;
+        ret |= send_packet(h, &(parity[0]), F);
+        std::fill(parity.begin(), parity.end(), 0);
+      }
+    }
+  }
+  return ret;
+}
+
+void PFCMU::mcast::Publisher::stat(unsigned long long * images, unsigned long long * packets, unsigned long long * bytes) const {
+  *images = m_images;
+  *packets = m_packets;
+  *bytes = m_bytes;
+}
+
+PFCMU::mcast::Receiver::Receiver(const char * group, int port, const char * iface, int window)
+  : m_fd(-1),
+    m_window(std::max(1, window)),
+    m_drop_rate(0),
+    m_seed(getpid()),
+    m_packet(0x10000) {
+  memset(&m_stat, 0, sizeof(m_stat));
+
+  if((m_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    DIE(1, "socket() failed : %s\n", strerror(errno));
+  }
+
+  // several receivers on the same host
+  const int one = 1;
+  setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &SOCKET_BUFFER, sizeof(SOCKET_BUFFER));
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr = to_addr(group);
+  if(0 != bind(m_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr))) {
+    DIE(1, "cannot bind %s:%d : %s\n", group, port, strerror(errno));
+  }
+
+  ip_mreq mreq;
+  mreq.imr_multiaddr = to_addr(group);
+  mreq.imr_interface.s_addr = iface ? to_addr(iface).s_addr : htonl(INADDR_ANY);
+  if(0 != setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+    DIE(1, "cannot join %s : %s\n", group, strerror(errno));
+  }
+}
+
+PFCMU::mcast::Receiver::~Receiver() {
+  if(m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+void PFCMU::mcast::Receiver::set_drop_rate(double rate) {
+  m_drop_rate = rate;
+}
+
+void PFCMU::mcast::Receiver::stat(stat_t * s) const {
+  *s = m_stat;
+}
+
+void PFCMU::mcast::Receiver::recover(partial_t & p, int group) {
+  const header_t & h = p.header;
+  const size_t F = h.fragment_bytes;
+  const int begin = group * h.fec_group;
+  const int end = std::min(begin + (int)h.fec_group, (int)h.count);
+
+  if(p.parity[group].empty()) {
+    return;
+  }
+  int missing = -1;
+  for(int i=begin ; i<end ; i++) {
+    if(! p.have[i]) {
+      if(missing >= 0) {
+        return;
+      }
+      missing = i;
+    }
+  }
+  if(missing < 0) {
+    return;
+  }
+
+  std::vector<byte_t> frag(p.parity[group]);
+  for(int i=begin ; i<end ; i++) {
+    if(i != missing) {
+      xor_into(&(frag[0]), &(p.data[i * F]), std::min(F, h.image_bytes - i * F));
+    }
+  }
+  memcpy(&(p.data[missing * F]), &(frag[0]), std::min(F, h.image_bytes - missing * F));
+  p.have[missing] = true;
+  p.remaining--;
+  p.recovered = true;
+}
+
+int PFCMU::mcast::Receiver::feed(sender_t & s, const header_t & h, const byte_t * payload, size_t len) {
+  // older than the last delivered image (signed distance, wraps around)
+  if(s.delivered && (int32_t)(h.image_seq - s.last_image) <= 0) {
+    return 0;
+  }
+
+  std::map<uint32_t, partial_t>::iterator itr = s.images.find(h.image_seq);
+  if(itr == s.images.end()) {
+    partial_t p;
+    p.header = h;
+    p.data.resize(h.image_bytes);
+    p.have.assign(h.count, false);
+    p.remaining = h.count;
+    p.parity.resize(h.fec_group ? (h.count + h.fec_group - 1) / h.fec_group : 0);
+    p.recovered = false;
+    itr = s.images.insert(std::make_pair(h.image_seq, p)).first;
+
+    // give up the oldest ones
+    while((int)s.images.size() > m_window) {
+      std::map<uint32_t, partial_t>::iterator oldest = s.images.begin();
+      for(std::map<uint32_t, partial_t>::iterator i=s.images.begin() ; i!=s.images.end() ; ++i) {
+        if((int32_t)(i->first - oldest->first) < 0) {
+          oldest = i;
+        }
+      }
+      if(oldest == itr) {
+        s.images.erase(itr);
+        m_stat.incomplete++;
+        return 0;
+      }
+      s.images.erase(oldest);
+      m_stat.incomplete++;
+    }
+  }
+
+  partial_t & p = itr->second;
+  if(p.header.image_bytes != h.image_bytes || p.header.count != h.count ||
+     p.header.fragment_bytes != h.fragment_bytes || p.header.fec_group != h.fec_group) {
+    m_stat.invalid++;
+    return 0;
+  }
+
+  int group;
+  if(h.flags & FLAG_PARITY) {
+    group = h.index;
+    if(! p.parity[group].empty()) {
+      return 0;
+    }
+    p.parity[group].assign(payload, payload + len);
+  } else {
+    if(p.have[h.index]) {
+      return 0;
+    }
+    memcpy(&(p.data[h.index * h.fragment_bytes]), payload, len);
+    p.have[h.index] = true;
+    p.remaining--;
+    group = h.fec_group ? h.index / h.fec_group : -1;
+  }
+  if(group >= 0) {
+    recover(p, group);
+  }
+
+  return p.remaining == 0 ? 1 : 0;
+}
+
+int PFCMU::mcast::Receiver::receive(image_t * image, int timeout_ms) {
+  for(;;) {
+    pollfd pfd;
+    pfd.fd = m_fd;
+    pfd.events = POLLIN;
+    const int ret = poll(&pfd, 1, timeout_ms);
+    if(ret < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if(ret == 0) {
+      return 0;
+    }
+
+    sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    const ssize_t len = recvfrom(m_fd, &(m_packet[0]), m_packet.size(), 0, reinterpret_cast<sockaddr *>(&from), &fromlen);
+    if(len < 0) {
+      if(errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -1;
+    }
+
+    if(m_drop_rate > 0 && rand_r(&m_seed) < m_drop_rate * RAND_MAX) {
+      continue;
+    }
+
+    header_t h;
+    if(0 != h.unpack(&(m_packet[0]), len)) {
+      m_stat.invalid++;
+      continue;
+    }
+    m_stat.packets++;
+
+    char text[64];
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(from.sin_addr), addr, sizeof(addr));
+    snprintf(text, sizeof(text), "%s:%d", addr, ntohs(from.sin_port));
+
+    std::map<std::string, sender_t>::iterator itr = m_senders.find(text);
+    if(itr == m_senders.end()) {
+      sender_t s;
+      s.started = false;
+      s.next_packet = 0;
+      s.delivered = false;
+      s.last_image = 0;
+      itr = m_senders.insert(std::make_pair(std::string(text), s)).first;
+    }
+    sender_t & s = itr->second;
+
+    // packets missing in the sequence (reordered ones are counted as lost, too)
+    const int32_t gap = s.started ? (int32_t)(h.packet_seq - s.next_packet) : 0;
+    if(gap >= 0) {
+      m_stat.lost += gap;
+      s.next_packet = h.packet_seq + 1;
+      s.started = true;
+    }
+
+    if(feed(s, h, &(m_packet[header_t::SIZE]), len - header_t::SIZE) == 0) {
+      continue;
+    }
+
+    // deliver, and forget the older ones which can no longer be delivered in order
+    partial_t & p = s.images[h.image_seq];
+    image->sender = itr->first;
+    image->image_seq = h.image_seq;
+    image->framecount = p.header.framecount;
+    image->camera = p.header.camera;
+    image->encoding = static_cast<codec::encoding_t>(p.header.encoding);
+    image->width = p.header.width;
+    image->height = p.header.height;
+    image->data.swap(p.data);
+
+    m_stat.images++;
+    if(p.recovered) {
+      m_stat.recovered++;
+    }
+    for(std::map<uint32_t, partial_t>::iterator i=s.images.begin() ; i!=s.images.end() ; ) {
+      if((int32_t)(i->first - h.image_seq) <= 0) {
+        if(i->first != h.image_seq) {
+          m_stat.incomplete++;
+        }
+        s.images.erase(i++);
+      } else {
+        ++i;
+      }
+    }
+    s.delivered = true;
+    s.last_image = h.image_seq;
+    return 1;
+  }
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "pixel_stats.h"
+#include "worker_pool.h"
+#include "trace.h"
+
+namespace {
+  using PFCMU::pixel_stats::header_t;
+  using PFCMU::pixel_stats::map_t;
+
+  const char MAGIC[8] = { 'P', 'F', 'P', 'X', 'S', 'T', 'A', 'T' };
+  const uint32_t VERSION = 1;
+
+  const bool s_avx2 = __builtin_cpu_supports("avx2");
+
+  /**
+   * sum += v, sq += v*v, min and max of [begin:n)
+   */
+  void add_scalar(const uint8_t * v, uint16_t * sum, uint32_t * sq, uint8_t * mn, uint8_t * mx, size_t begin, size_t n) {
+    for(size_t i=begin ; i<n ; i++) {
+      sum[i] += v[i];
+      sq[i] += v[i] * v[i];
+      mn[i] = std::min(mn[i], v[i]);
+      mx[i] = std::max(mx[i], v[i]);
+    }
+  }
+
+  void add_sse2(const uint8_t * v, uint16_t * sum, uint32_t * sq, uint8_t * mn, uint8_t * mx, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for( ; i + 16 <= n ; i += 16) {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+      __m128i * m = reinterpret_cast<__m128i *>(mn + i);
+      __m128i * M = reinterpret_cast<__m128i *>(mx + i);
+      _mm_storeu_si128(m, _mm_min_epu8(_mm_loadu_si128(m), a));
+      _mm_storeu_si128(M, _mm_max_epu8(_mm_loadu_si128(M), a));
+
+      for(int k=0 ; k<2 ; k++) {
+        const __m128i w = k ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+        __m128i * s = reinterpret_cast<__m128i *>(sum + i + 8 * k);
+        _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), w));
+
+        // 255 * 255 fits in 16 bits
+        const __m128i w2 = _mm_mullo_epi16(w, w);
+        __m128i * q = reinterpret_cast<__m128i *>(sq + i + 8 * k);
+        _mm_storeu_si128(q, _mm_add_epi32(_mm_loadu_si128(q), _mm_unpacklo_epi16(w2, zero)));
+        _mm_storeu_si128(q + 1, _mm_add_epi32(_mm_loadu_si128(q + 1), _mm_unpackhi_epi16(w2, zero)));
+      }
+    }
+    add_scalar(v, sum, sq, mn, mx, i, n);
+  }
+
+  __attribute__((target("avx2")))
+  void add_avx2(const uint8_t * v, uint16_t * sum, uint32_t * sq, uint8_t * mn, uint8_t * mx, size_t n) {
+    size_t i = 0;
+    for( ; i + 16 <= n ; i += 16) {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+      __m128i * m = reinterpret_cast<__m128i *>(mn + i);
+      __m128i * M = reinterpret_cast<__m128i *>(mx + i);
+      _mm_storeu_si128(m, _mm_min_epu8(_mm_loadu_si128(m), a));
+      _mm_storeu_si128(M, _mm_max_epu8(_mm_loadu_si128(M), a));
+
+      const __m256i w = _mm256_cvtepu8_epi16(a);
+      __m256i * s = reinterpret_cast<__m256i *>(sum + i);
+      _mm256_storeu_si256(s, _mm256_add_epi16(_mm256_loadu_si256(s), w));
+
+      const __m256i w2 = _mm256_mullo_epi16(w, w);
+      __m256i * q = reinterpret_cast<__m256i *>(sq + i);
+      _mm256_storeu_si256(q, _mm256_add_epi32(_mm256_loadu_si256(q), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(w2))));
+      _mm256_storeu_si256(q + 1, _mm256_add_epi32(_mm256_loadu_si256(q + 1), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(w2, 1))));
+    }
+    add_scalar(v, sum, sq, mn, mx, i, n);
+  }
+
+  void put32(unsigned char * p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+  }
+
+  uint32_t get32(const unsigned char * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  /**
+   * Summary of a camera from the planes of the map
+   */
+  void summarize(map_t * map, int camera) {
+    using namespace PFCMU::pixel_stats;
+    const size_t n = map->pixels();
+    const size_t o = n * camera;
+    summary_t & s = map->summary[camera];
+    memset(&s, 0, sizeof(s));
+    double sum = 0, sum2 = 0, noise2 = 0;
+    for(size_t i=o ; i<o+n ; i++) {
+      const double d = (double)map->dark[i] / SCALE;
+      const double e = (double)map->noise[i] / SCALE;
+      sum += d;
+      sum2 += d * d;
+      noise2 += e * e;
+      s.hot += (map->flags[i] & HOT) ? 1 : 0;
+      s.dead += (map->flags[i] & DEAD) ? 1 : 0;
+      s.stuck += (map->flags[i] & STUCK) ? 1 : 0;
+    }
+    s.level = (float)(map->dark[o] - map->fpn[o]) / SCALE;
+    s.dsnu = sqrt(std::max(0.0, sum2 / n - (sum / n) * (sum / n)));
+    s.noise = sqrt(noise2 / n);
+  }
+
+  template <typename T>
+  bool write_plane(FILE * fp, const std::vector<T> & v, size_t offset, size_t n) {
+    return n == fwrite(&v[offset], sizeof(T), n, fp);
+  }
+
+  template <typename T>
+  bool read_plane(FILE * fp, std::vector<T> * v, size_t offset, size_t n) {
+    return n == fread(&(*v)[offset], sizeof(T), n, fp);
+  }
+}
+
+bool PFCMU::pixel_stats::avx2() {
+  return s_avx2;
+}
+
+int PFCMU::pixel_stats::save(const char * filename, const map_t & map) {
+  FILE * fp = fopen(filename, "wb");
+  if(! fp) {
+    return -1;
+  }
+
+  unsigned char buf[header_t::SIZE];
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, MAGIC, sizeof(MAGIC));
+  put32(buf + 8, VERSION);
+  put32(buf + 12, map.header.cams);
+  put32(buf + 16, map.header.width);
+  put32(buf + 20, map.header.height);
+  put32(buf + 24, map.header.frames);
+  put32(buf + 28, map.header.frames >> 32);
+  put32(buf + 32, map.header.classify.hot_level);
+  put32(buf + 36, map.header.classify.dead_level);
+  put32(buf + 40, map.header.classify.stuck_range);
+  bool ok = 1 == fwrite(buf, sizeof(buf), 1, fp);
+
+  // the planes are written as is, assuming a little endian host
+  const size_t n = map.pixels();
+  for(unsigned int i=0 ; ok && i<map.header.cams ; i++) {
+    ok = write_plane(fp, map.dark, n * i, n) && write_plane(fp, map.fpn, n * i, n) && write_plane(fp, map.noise, n * i, n) &&
+      write_plane(fp, map.min, n * i, n) && write_plane(fp, map.max, n * i, n) && write_plane(fp, map.flags, n * i, n);
+  }
+  return (0 == fclose(fp) && ok) ? 0 : -1;
+}
+
+int PFCMU::pixel_stats::load(const char * filename, map_t * map) {
+  FILE * fp = fopen(filename, "rb");
+  if(! fp) {
+    return -1;
+  }
+
+  unsigned char buf[header_t::SIZE];
+  if(1 != fread(buf, sizeof(buf), 1, fp) || 0 != memcmp(buf, MAGIC, sizeof(MAGIC)) || get32(buf + 8) != VERSION ||
+     get32(buf + 12) != (uint32_t)PFCMU::CAMS) {
+    fclose(fp);
+    return -1;
+  }
+  map->header.cams = get32(buf + 12);
+  map->header.width = get32(buf + 16);
+  map->header.height = get32(buf + 20);
+  map->header.frames = get32(buf + 24) | ((uint64_t)get32(buf + 28) << 32);
+  map->header.classify.hot_level = get32(buf + 32);
+  map->header.classify.dead_level = get32(buf + 36);
+  map->header.classify.stuck_range = get32(buf + 40);
+
+  const size_t n = map->pixels();
+  const size_t total = n * PFCMU::CAMS;
+  map->dark.resize(total);
+  map->fpn.resize(total);
+  map->noise.resize(total);
+  map->min.resize(total);
+  map->max.resize(total);
+  map->flags.resize(total);
+  bool ok = true;
+  for(int i=0 ; ok && i<PFCMU::CAMS ; i++) {
+    ok = read_plane(fp, &map->dark, n * i, n) && read_plane(fp, &map->fpn, n * i, n) && read_plane(fp, &map->noise, n * i, n) &&
+      read_plane(fp, &map->min, n * i, n) && read_plane(fp, &map->max, n * i, n) && read_plane(fp, &map->flags, n * i, n);
+  }
+  fclose(fp);
+  if(! ok) {
+    return -1;
+  }
+
+  // the summary is not stored
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    summarize(map, i);
+  }
+  return 0;
+}
+
+PFCMU::pixel_stats::accumulator_t::accumulator_t() : m_width(0), m_height(0), m_frames(0), m_block(0), m_pool(NULL) {
+}
+
+PFCMU::pixel_stats::accumulator_t::~accumulator_t() {
+  delete m_pool;
+}
+
+void PFCMU::pixel_stats::accumulator_t::init(int width, int height, int threads) {
+  const size_t n = (size_t)width * height * PFCMU::CAMS;
+  m_width = width;
+  m_height = height;
+  m_frames = 0;
+  m_block = 0;
+  m_sum.assign(n, 0);
+  m_sq.assign(n, 0);
+  m_min.assign(n, 255);
+  m_max.assign(n, 0);
+  m_mean.assign(n, 0);
+  m_m2.assign(n, 0);
+
+  delete m_pool;
+  m_pool = new WorkerPool(std::min(threads > 0 ? threads : (int)boost::thread::hardware_concurrency(), (int)PFCMU::CAMS));
+}
+
+void PFCMU::pixel_stats::accumulator_t::add(const unsigned char * frame, int camera) {
+  const size_t n = (size_t)m_width * m_height;
+  const size_t o = n * camera;
+  if(s_avx2) {
+    add_avx2(frame + o, &m_sum[o], &m_sq[o], &m_min[o], &m_max[o], n);
+  } else {
+    add_sse2(frame + o, &m_sum[o], &m_sq[o], &m_min[o], &m_max[o], n);
+  }
+
+  // the last frame of the block (m_block is updated after all the cameras)
+  if(m_block + 1 == BLOCK) {
+    merge(camera, BLOCK);
+  }
+}
+
+void PFCMU::pixel_stats::accumulator_t::merge(int camera, int block) {
+  const size_t n = (size_t)m_width * m_height;
+  const size_t o = n * camera;
+  // frames merged so far (na) and in the block (nb)
+  const double nb = block;
+  const double na = m_frames - block;
+  const double rb = nb / (na + nb);
+  uint16_t * sum = &m_sum[o];
+  uint32_t * sq = &m_sq[o];
+  float * mean = &m_mean[o];
+  float * m2 = &m_m2[o];
+  for(size_t i=0 ; i<n ; i++) {
+    const double mb = sum[i] / nb;
+    const double m2b = sq[i] - sum[i] * mb;
+    const double delta = mb - mean[i];
+    mean[i] += delta * rb;
+    m2[i] += m2b + delta * delta * na * rb;
+    sum[i] = 0;
+    sq[i] = 0;
+  }
+}
+
+void PFCMU::pixel_stats::accumulator_t::feed(const void * frame) {
+  m_frames++;
+  m_pool->parallel_for(PFCMU::CAMS, boost::bind(&accumulator_t::add, this, reinterpret_cast<const unsigned char *>(frame), _1));
+  m_block = (m_block + 1) % BLOCK;
+}
+
+void PFCMU::pixel_stats::accumulator_t::make_camera_map(map_t * map, int camera) {
+  const size_t n = map->pixels();
+  const size_t o = n * camera;
+  const classify_t & c = map->header.classify;
+  const double frames = m_frames;
+
+  // the level is the median of the means in 1/SCALE
+  std::vector<size_t> hist(256 * SCALE, 0);
+  for(size_t i=o ; i<o+n ; i++) {
+    const int d = std::min((int)(m_mean[i] * SCALE + 0.5f), 256 * SCALE - 1);
+    map->dark[i] = d;
+    hist[d]++;
+
+    const double var = frames > 1 ? std::max(0.0, m_m2[i] / (frames - 1)) : 0;
+    map->noise[i] = (uint16_t)(sqrt(var) * SCALE + 0.5);
+  }
+  int level = 0;
+  size_t below = hist[0];
+  while(below * 2 < n) {
+    below += hist[++level];
+  }
+
+  for(size_t i=o ; i<o+n ; i++) {
+    const int fpn = map->dark[i] - level;
+    map->fpn[i] = fpn;
+    map->min[i] = m_min[i];
+    map->max[i] = m_max[i];
+
+    uint8_t f = 0;
+    if(fpn >= c.hot_level * SCALE) {
+      f |= HOT;
+    }
+    if(-fpn >= c.dead_level * SCALE) {
+      f |= DEAD;
+    }
+    if(m_max[i] - m_min[i] <= c.stuck_range) {
+      f |= STUCK;
+    }
+    map->flags[i] = f;
+  }
+
+  summarize(map, camera);
+}
+
+void PFCMU::pixel_stats::accumulator_t::make_map(const classify_t & classify, map_t * map) {
+  ASSERT(m_frames > 0);
+
+  // merge the frames of the current block
+  if(m_block > 0) {
+    m_pool->parallel_for(PFCMU::CAMS, boost::bind(&accumulator_t::merge, this, _1, m_block));
+    m_block = 0;
+  }
+
+  map->header.cams = PFCMU::CAMS;
+  map->header.width = m_width;
+  map->header.height = m_height;
+  map->header.frames = m_frames;
+  map->header.classify = classify;
+
+  const size_t total = map->pixels() * PFCMU::CAMS;
+  map->dark.resize(total);
+  map->fpn.resize(total);
+  map->noise.resize(total);
+  map->min.resize(total);
+  map->max.resize(total);
+  map->flags.resize(total);
+  m_pool->parallel_for(PFCMU::CAMS, boost::bind(&accumulator_t::make_camera_map, this, map, _1));
+}
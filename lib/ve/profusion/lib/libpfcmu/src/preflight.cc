@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+
+#include "preflight.h"
+#include "linux_aio.h"
+#include "mmapped_file.h"
+#include "my_memcpy.h"
+#include "pfcmu_config.h"
+#include "path_util.h"
+#include "stringf.h"
+
+namespace {
+  using PFCMU::preflight::check_t;
+  using PFCMU::preflight::config_t;
+  using PFCMU::preflight::report_t;
+  using PFCMU::preflight::status_t;
+
+  typedef unsigned char byte_t;
+
+  unsigned long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+  }
+
+  void add(report_t * report, const char * name, status_t status, const std::string & detail) {
+    check_t c;
+    c.name = name;
+    c.status = status;
+    c.detail = detail;
+    report->checks.push_back(c);
+  }
+
+  std::string bytes2str(double bytes) {
+    if(bytes >= (1ULL<<30)) {
+      return Tools::stringf("%.1f GB", bytes / (1ULL<<30));
+    }
+    return Tools::stringf("%.1f MB", bytes / (1ULL<<20));
+  }
+
+  std::string rlim2str(rlim_t v, bool bytes) {
+    if(v == RLIM_INFINITY) {
+      return "unlimited";
+    }
+    return bytes ? bytes2str(v) : Tools::stringf("%llu", (unsigned long long)v);
+  }
+
+  size_t frame_bytes(const config_t & config) {
+    return (size_t)config.width * config.height * PFCMU::CAMS;
+  }
+
+  void check_sched(report_t * report) {
+    struct rlimit rl;
+    getrlimit(RLIMIT_RTPRIO, &rl);
+    const std::string rtprio = "RLIMIT_RTPRIO " + rlim2str(rl.rlim_cur, false);
+
+    const int policy = sched_getscheduler(0);
+    if(policy == SCHED_FIFO) {
+      add(report, "SCHED_FIFO", PFCMU::preflight::OK, "enabled");
+      return;
+    }
+
+    // try as set_max_priority() does, and revert
+    struct sched_param orig, param;
+    sched_getparam(0, &orig);
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if(0 != sched_setscheduler(0, SCHED_FIFO, &param)) {
+      add(report, "SCHED_FIFO", PFCMU::preflight::FAIL,
+          std::string("cannot be enabled (") + strerror(errno) + ", " + rtprio + "). Check /etc/security/limits.d/pfcmu.conf or run as root");
+      return;
+    }
+    sched_setscheduler(0, policy, &orig);
+    add(report, "SCHED_FIFO", PFCMU::preflight::OK, "available");
+  }
+
+  void check_rlimits(const config_t & config, report_t * report) {
+    struct rlimit rl;
+    const double locked = (double)frame_bytes(config) * config.lock_frames;
+    getrlimit(RLIMIT_MEMLOCK, &rl);
+    if(locked > 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < locked) {
+      add(report, "RLIMIT_MEMLOCK", PFCMU::preflight::WARN,
+          rlim2str(rl.rlim_cur, true) + " < " + bytes2str(locked) + " to be locked. The RAM can be swapped out (ulimit -l)");
+    } else {
+      add(report, "RLIMIT_MEMLOCK", PFCMU::preflight::OK, rlim2str(rl.rlim_cur, true));
+    }
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    add(report, "RLIMIT_NOFILE", PFCMU::preflight::OK, rlim2str(rl.rlim_cur, false));
+  }
+
+  void check_hugepages(const config_t & config, report_t * report) {
+    FILE * fp = fopen("/proc/meminfo", "r");
+    if(! fp) {
+      add(report, "huge pages", PFCMU::preflight::WARN, "cannot read /proc/meminfo");
+      return;
+    }
+    long long total = 0, nfree = 0, size_kb = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), fp)) {
+      sscanf(line, "HugePages_Total: %lld", &total);
+      sscanf(line, "HugePages_Free: %lld", &nfree);
+      sscanf(line, "Hugepagesize: %lld kB", &size_kb);
+    }
+    fclose(fp);
+
+    const double available = (double)nfree * size_kb * 1024;
+    const double needed = (double)frame_bytes(config) * config.pre_frames;
+    const std::string detail = Tools::stringf("%lld / %lld free", nfree, total) + " (" + bytes2str(available) + ")";
+    if(needed > available) {
+      add(report, "huge pages", PFCMU::preflight::WARN,
+          detail + " < " + bytes2str(needed) + " of --pre. Reserve by /proc/sys/vm/nr_hugepages");
+    } else {
+      add(report, "huge pages", PFCMU::preflight::OK, detail);
+    }
+  }
+
+  /**
+   * Write a frame by O_DIRECT with the d_align buffer, as writer_t does
+   */
+  void check_disk(const config_t & config, report_t * report) {
+    const size_t bytes = frame_bytes(config);
+    const std::string dir = Util::dirname(config.out.c_str());
+
+    struct statvfs vfs;
+    if(0 != statvfs(dir.c_str(), &vfs)) {
+      add(report, "disk", PFCMU::preflight::FAIL, "cannot stat " + dir + ": " + strerror(errno));
+      return;
+    }
+    const double space = (double)vfs.f_bavail * vfs.f_frsize;
+    const double take = (double)bytes * config.num;
+    if(config.num > 0 && take > space) {
+      add(report, "free space", PFCMU::preflight::FAIL, bytes2str(space) + " < " + bytes2str(take) + " of the take");
+    } else {
+      add(report, "free space", PFCMU::preflight::OK, bytes2str(space) + (config.num > 0 ? " >= " + bytes2str(take) + " of the take" : std::string("")));
+    }
+
+    int fd = open64(config.out.c_str(), O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC|O_DIRECT, S_IRUSR|S_IWUSR);
+    if(fd < 0) {
+      add(report, "O_DIRECT", PFCMU::preflight::WARN, std::string("not available (") + strerror(errno) + "). The page cache is used, and the latency is not predictable");
+      return;
+    }
+
+    if(0 != posix_fallocate64(fd, 0, bytes)) {
+      add(report, "fallocate", PFCMU::preflight::FAIL, "not supported. writer_t aborts");
+    } else {
+      add(report, "fallocate", PFCMU::preflight::OK, "supported");
+    }
+
+    void * p = NULL;
+    if(0 != posix_memalign(&p, config.d_align, bytes)) {
+      add(report, "O_DIRECT", PFCMU::preflight::FAIL, "posix_memalign failed");
+    } else {
+      memset(p, 0, bytes);
+      if((ssize_t)bytes != pwrite64(fd, p, bytes, 0)) {
+        add(report, "O_DIRECT", PFCMU::preflight::FAIL,
+            Tools::stringf("write with d_align=%u failed (", config.d_align) + strerror(errno) + "). Check --d_align with the sector size");
+      } else {
+        add(report, "O_DIRECT", PFCMU::preflight::OK, Tools::stringf("d_align=%u", config.d_align));
+      }
+      free(p);
+    }
+    close(fd);
+    unlink(config.out.c_str());
+  }
+
+  void bench_memcpy(const config_t & config, report_t * report) {
+    const size_t bytes = frame_bytes(config);
+    std::vector<byte_t> src(bytes, 1), dst(bytes);
+    const unsigned long long t0 = now_usec();
+    unsigned long long t = t0;
+    int n = 0;
+    for( ; t - t0 < 500000 ; n++) {
+      my_memcpy<char>(&dst[0], &src[0], bytes);
+      t = now_usec();
+    }
+    report->memcpy_mbps = (double)bytes * n / (t - t0);
+
+    const double margin = report->memcpy_mbps / report->required_mbps;
+    add(report, "memcpy", margin < 2 ? PFCMU::preflight::WARN : PFCMU::preflight::OK,
+        Tools::stringf("%.0f MB/s (x%.1f of the frames)", report->memcpy_mbps, margin));
+  }
+
+  /**
+   * Live output files of capture (24 downsampled images, thumbnail, and info.json)
+   */
+  class LiveLoad {
+  public:
+    LiveLoad(const config_t & config) : m_ds(config.width / 2 * config.height / 2 * 3), m_thumb(config.width * config.height * 3) {
+      if(config.live.empty()) {
+        return;
+      }
+      for(int i=0 ; i<PFCMU::CAMS ; i++) {
+        m_files.push_back(new PFCMU::MMappedFile);
+        m_files.back()->open((config.live + Tools::stringf("/preflight-%02d.ppm", i+1)).c_str(), m_ds);
+        m_paths.push_back(config.live + Tools::stringf("/preflight-%02d.ppm", i+1));
+      }
+      m_files.push_back(new PFCMU::MMappedFile);
+      m_files.back()->open((config.live + "/preflight-thumb.ppm").c_str(), m_thumb);
+      m_paths.push_back(config.live + "/preflight-thumb.ppm");
+    }
+
+    ~LiveLoad() {
+      for(unsigned int i=0 ; i<m_files.size() ; i++) {
+        delete m_files[i];
+        unlink(m_paths[i].c_str());
+      }
+    }
+
+    void update(const byte_t * frame) {
+      for(unsigned int i=0 ; i<m_files.size() ; i++) {
+        my_memcpy<char>(m_files[i]->buf(), frame, m_files[i]->size());
+        m_files[i]->sync();
+      }
+    }
+
+  private:
+    const int m_ds;
+    const int m_thumb;
+    std::vector<PFCMU::MMappedFile *> m_files;
+    std::vector<std::string> m_paths;
+  };
+
+  double percentile(const std::vector<double> & sorted, double p) {
+    if(sorted.empty()) {
+      return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+  }
+
+  /**
+   * Write frames like capture
+   *
+   * @param paced [in] at the fps by the virtual camera, or as fast as possible
+   * @return MB/s including the final fsync
+   */
+  double bench_write(const config_t & config, int frames, bool paced, LiveLoad * live, report_t * report) {
+    const size_t bytes = frame_bytes(config);
+    const unsigned long long period = 1000000ULL / config.fps;
+
+    // random data, not to be compressed or deduplicated by the storage
+    std::vector<byte_t> camera(bytes);
+    for(size_t i=0 ; i<bytes ; i++) {
+      camera[i] = rand();
+    }
+
+    PFCMU::libaio::writer_t writer;
+    writer.init(config.out.c_str(), bytes, config.d_ringnum, frames, config.d_align);
+
+    std::vector<double> wait;
+    const unsigned long long t0 = now_usec();
+    for(int i=0 ; i<frames ; i++) {
+      if(paced) {
+        // the frame i arrives at t0 + i*period, and the camera ring keeps c_ringnum frames
+        const unsigned long long arrival = t0 + i * period;
+        unsigned long long t = now_usec();
+        if(t < arrival) {
+          usleep(arrival - t);
+          t = now_usec();
+        }
+        if(t - arrival >= config.c_ringnum * period) {
+          report->dropped_frames++;
+        } else if(t - arrival >= period) {
+          report->late_frames++;
+        }
+      }
+
+      const unsigned long long t = now_usec();
+      PFCMU::libaio::slot_id_t id = writer.get_available_slot_id();
+      if(id < 0) {
+        // the disk is broken or full, 0 MB/s fails the check
+        writer.clean();
+        unlink(config.out.c_str());
+        return 0;
+      }
+      wait.push_back(now_usec() - t);
+
+      my_memcpy<char>(writer.buf(id), &camera[0], bytes);
+      writer.write(id, i);
+
+      if(live) {
+        live->update(&camera[0]);
+      }
+    }
+    writer.clean();
+    const unsigned long long t1 = now_usec();
+    unlink(config.out.c_str());
+
+    if(paced) {
+      std::sort(wait.begin(), wait.end());
+      report->wait_p50 = percentile(wait, 0.5);
+      report->wait_p99 = percentile(wait, 0.99);
+      report->wait_p999 = percentile(wait, 0.999);
+      report->wait_max = wait.empty() ? 0 : wait.back();
+      report->frames = frames;
+    }
+
+    return (double)bytes * frames / (t1 - t0);
+  }
+}
+
+PFCMU::preflight::status_t PFCMU::preflight::report_t::status() const {
+  status_t s = OK;
+  for(unsigned int i=0 ; i<checks.size() ; i++) {
+    s = std::max(s, checks[i].status);
+  }
+  return s;
+}
+
+const char * PFCMU::preflight::status2str(status_t s) {
+  switch(s) {
+  case OK:
+    return "OK";
+  case WARN:
+    return "WARN";
+  default:
+    return "FAIL";
+  }
+}
+
+void PFCMU::preflight::check_system(const config_t & config, report_t * report) {
+  report->required_mbps = (double)frame_bytes(config) * config.fps / 1e6;
+  check_sched(report);
+  check_rlimits(config, report);
+  check_hugepages(config, report);
+  check_disk(config, report);
+}
+
+void PFCMU::preflight::run(const config_t & config, report_t * report) {
+  check_system(config, report);
+  bench_memcpy(config, report);
+
+  const int frames = std::max((int)(config.seconds * config.fps), (int)config.d_ringnum * 4);
+
+  report->burst_mbps = bench_write(config, frames, false, NULL, report);
+  report->margin = report->burst_mbps / report->required_mbps;
+  add(report, "burst", report->margin < 1 ? FAIL : report->margin < config.min_margin ? WARN : OK,
+      Tools::stringf("%.0f MB/s (x%.2f of %.0f MB/s required)", report->burst_mbps, report->margin, report->required_mbps));
+
+  LiveLoad live(config);
+  report->sustained_mbps = bench_write(config, frames, true, &live, report);
+  add(report, "paced", report->dropped_frames > 0 ? FAIL : report->late_frames > 0 ? WARN : OK,
+      Tools::stringf("%d frames at %u fps, %d late, %d dropped, wait p99 %.0f us, max %.0f us",
+                     report->frames, config.fps, report->late_frames, report->dropped_frames, report->wait_p99, report->wait_max));
+}
+
+std::string PFCMU::preflight::to_string(const report_t & report) {
+  std::ostringstream oss;
+  for(unsigned int i=0 ; i<report.checks.size() ; i++) {
+    const check_t & c = report.checks[i];
+    oss << Tools::stringf("  [%-4s] %-15s %s\n", status2str(c.status), c.name.c_str(), c.detail.c_str());
+  }
+  if(report.frames > 0) {
+    oss << Tools::stringf("  slot wait (us): p50 %.0f, p99 %.0f, p99.9 %.0f, max %.0f\n",
+                          report.wait_p50, report.wait_p99, report.wait_p999, report.wait_max);
+    oss << Tools::stringf("  throughput: required %.0f MB/s, burst %.0f MB/s (margin x%.2f), paced %.0f MB/s\n",
+                          report.required_mbps, report.burst_mbps, report.margin, report.sustained_mbps);
+  }
+  oss << "  result: " << status2str(report.status()) << "\n";
+  return oss.str();
+}
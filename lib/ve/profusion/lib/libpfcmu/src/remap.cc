@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2011. Shohei NOBUHARA, Kyoto University and Carnegie
+ * Mellon University. This code may be used, distributed, or modified
+ * only for research purposes or under license from Kyoto University or
+ * Carnegie Mellon University. This notice must be retained in all copies.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+
+#include "remap.h"
+#include "worker_pool.h"
+#include "trace.h"
+
+namespace {
+  const bool s_avx2 = __builtin_cpu_supports("avx2");
+
+  const char MAGIC[8] = { 'P', 'F', 'R', 'E', 'M', 'A', 'P', 0 };
+  /// 2: the tables of the p1 of forward() fixed, the older caches are rebuilt
+  const uint32_t VERSION = 2;
+  const size_t HEADER_SIZE = 64;
+
+  /// row bands of a camera remapped by a job
+  const int BANDS = 4;
+
+  /// bits of the result of the 2 weights of 1/ONE
+  const int SHIFT = 14;
+
+  /**
+   * for [begin:n) of a row
+   */
+  void remap_scalar(const unsigned char * src, int src_width, const int16_t * xs, const int16_t * ys,
+                    const uint8_t * wxs, const uint8_t * wys, unsigned char * dst, int begin, int n) {
+    const int ONE = PFCMU::RemapTable::ONE;
+    for(int i=begin ; i<n ; i++) {
+      if(wxs[i] == PFCMU::RemapTable::OUTLIER) {
+        dst[i] = 0;
+        continue;
+      }
+      const unsigned char * p = src + ys[i] * src_width + xs[i];
+      const int wx = wxs[i];
+      const int top = p[0] * (ONE - wx) + p[1] * wx;
+      const int bottom = p[src_width] * (ONE - wx) + p[src_width + 1] * wx;
+      dst[i] = (unsigned char)((top * (ONE - wys[i]) + bottom * wys[i] + (1 << (SHIFT - 1))) >> SHIFT);
+    }
+  }
+
+  /**
+   * The 2x2 pixels are gathered as 2 words: [p00 p01 . .] at y*W+x,
+   * and [. . p10 p11] at (y+1)*W+x-2, which does not read beyond the
+   * image at the bottom-right corner.  The weights are applied by
+   * madd of (p00, p01) * (ONE - wx, wx) and so on in 16 bits.
+   */
+  __attribute__((target("avx2")))
+  void remap_avx2(const unsigned char * src, int src_width, const int16_t * xs, const int16_t * ys,
+                  const uint8_t * wxs, const uint8_t * wys, unsigned char * dst, int n) {
+    const __m256i stride = _mm256_set1_epi32(src_width);
+    const __m256i bottom_offset = _mm256_set1_epi32(src_width - 2);
+    const __m256i one = _mm256_set1_epi32(PFCMU::RemapTable::ONE);
+    const __m256i outlier = _mm256_set1_epi32(PFCMU::RemapTable::OUTLIER);
+    const __m256i lo8 = _mm256_set1_epi32(0xff);
+    const __m256i hi8 = _mm256_set1_epi32(0xff00);
+    const __m256i lo16 = _mm256_set1_epi32(0xffff);
+    const __m256i round = _mm256_set1_epi32(1 << (SHIFT - 1));
+    const int * base = reinterpret_cast<const int *>(src);
+
+    int i = 0;
+    for( ; i + 8 <= n ; i += 8) {
+      const __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(xs + i)));
+      const __m256i y = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ys + i)));
+      const __m256i wx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(wxs + i)));
+      const __m256i wy = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(wys + i)));
+
+      const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(y, stride), x);
+      const __m256i top = _mm256_i32gather_epi32(base, offset, 1);
+      const __m256i bottom = _mm256_srli_epi32(_mm256_i32gather_epi32(base, _mm256_add_epi32(offset, bottom_offset), 1), 16);
+
+      // [p0 p1] as 2 int16 in each int32
+      const __m256i t = _mm256_or_si256(_mm256_and_si256(top, lo8), _mm256_slli_epi32(_mm256_and_si256(top, hi8), 8));
+      const __m256i b = _mm256_or_si256(_mm256_and_si256(bottom, lo8), _mm256_slli_epi32(_mm256_and_si256(bottom, hi8), 8));
+      const __m256i wxx = _mm256_or_si256(_mm256_sub_epi32(one, wx), _mm256_slli_epi32(wx, 16));
+      const __m256i wyy = _mm256_or_si256(_mm256_sub_epi32(one, wy), _mm256_slli_epi32(wy, 16));
+
+      // the rows are not more than 255*ONE, i.e., fit in int16
+      const __m256i rows = _mm256_or_si256(_mm256_and_si256(_mm256_madd_epi16(t, wxx), lo16),
+                                           _mm256_slli_epi32(_mm256_madd_epi16(b, wxx), 16));
+      __m256i v = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(rows, wyy), round), SHIFT);
+      v = _mm256_andnot_si256(_mm256_cmpeq_epi32(wx, outlier), v);
+
+      v = _mm256_packus_epi32(v, v);
+      v = _mm256_packus_epi16(v, v);
+      const uint32_t lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(v));
+      const uint32_t hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(v, 1));
+      memcpy(dst + i, &lo, 4);
+      memcpy(dst + i + 4, &hi, 4);
+    }
+    remap_scalar(src, src_width, xs, ys, wxs, wys, dst, i, n);
+  }
+
+  struct bayer_layout_t {
+    /// R at (rx + 2i, ry + 2j)
+    int rx, ry;
+    /// B at (bx + 2i, by + 2j)
+    int bx, by;
+    /// G at x + y = g (mod 2)
+    int g;
+  };
+
+  /// in the order of RemapTable::bayer_t, (1,1) and (2,1) are the colours of the name
+  const bayer_layout_t BAYER_LAYOUTS[4] = {
+    { 0, 0, 1, 1, 1 },
+    { 1, 0, 0, 1, 0 },
+    { 1, 1, 0, 0, 1 },
+    { 0, 1, 1, 0, 0 },
+  };
+
+  /**
+   * Pixels of the Bayer image, clamped into the image if CLAMP.  The
+   * weights are in 1/128 of the lattice, as the AVX2 kernel, and the
+   * results are in 1/(1 << SHIFT).
+   */
+  template <bool CLAMP>
+  struct bayer_source_t {
+    const unsigned char * src;
+    int width;
+    int height;
+
+    /**
+     * Bilinear on the lattice of (ox + 2i, oy + 2j) at (X, Y) in 1/ONE px
+     */
+    int lattice(int X, int Y, int ox, int oy) const {
+      const int tx = X - ox * PFCMU::RemapTable::ONE;
+      const int ty = Y - oy * PFCMU::RemapTable::ONE;
+      // the lattice is 2 px = 256 in 1/ONE
+      const int fx = (tx & 255) >> 1;
+      const int fy = (ty & 255) >> 1;
+      int x0 = ox + 2 * (tx >> 8);
+      int y0 = oy + 2 * (ty >> 8);
+      int x1 = x0 + 2;
+      int y1 = y0 + 2;
+      if(CLAMP) {
+        x0 = clamp(x0, ox, width);
+        x1 = clamp(x1, ox, width);
+        y0 = clamp(y0, oy, height);
+        y1 = clamp(y1, oy, height);
+      }
+      const unsigned char * r0 = src + y0 * width;
+      const unsigned char * r1 = src + y1 * width;
+      return (r0[x0] * (128 - fx) + r0[x1] * fx) * (128 - fy) + (r1[x0] * (128 - fx) + r1[x1] * fx) * fy;
+    }
+
+    /**
+     * Bilinear on the 45-degree lattice of x + y = g (mod 2).  The
+     * lattice is integer in p = (x - g + y) / 2 and q = (x - g - y) / 2.
+     */
+    int diamond(int X, int Y, int g) const {
+      const int P = X - g * PFCMU::RemapTable::ONE + Y;
+      const int Q = X - g * PFCMU::RemapTable::ONE - Y;
+      const int fp = (P & 255) >> 1;
+      const int fq = (Q & 255) >> 1;
+      const int x = (P >> 8) + (Q >> 8) + g;
+      const int y = (P >> 8) - (Q >> 8);
+      return (at(x, y, g) * (128 - fp) + at(x + 1, y + 1, g) * fp) * (128 - fq) +
+        (at(x + 1, y - 1, g) * (128 - fp) + at(x + 2, y, g) * fp) * fq;
+    }
+
+    int at(int x, int y, int g) const {
+      if(CLAMP) {
+        x = std::max(0, std::min(width - 1, x));
+        y = std::max(0, std::min(height - 1, y));
+        if((x + y + g) & 1) {
+          x += x == 0 ? 1 : -1;
+        }
+      }
+      return src[y * width + x];
+    }
+
+    /**
+     * o + 2i in [0:size-1]
+     */
+    static int clamp(int v, int o, int size) {
+      if(v < o) {
+        return o;
+      }
+      const int last = o + 2 * ((size - 1 - o) / 2);
+      return v > last ? last : v;
+    }
+  };
+
+  template <bool CLAMP>
+  void bayer_pixel(const bayer_source_t<CLAMP> & s, const bayer_layout_t & l, int X, int Y, unsigned char * bgr) {
+    const int r = 1 << (SHIFT - 1);
+    bgr[0] = (unsigned char)((s.lattice(X, Y, l.bx, l.by) + r) >> SHIFT);
+    bgr[1] = (unsigned char)((s.diamond(X, Y, l.g) + r) >> SHIFT);
+    bgr[2] = (unsigned char)((s.lattice(X, Y, l.rx, l.ry) + r) >> SHIFT);
+  }
+
+  /**
+   * true if all the pixels used for the source position are in the image
+   */
+  inline bool bayer_inside(int x, int y, int width, int height) {
+    return x >= 3 && x < width - 4 && y >= 3 && y < height - 4;
+  }
+
+  void remap_bayer_scalar(const unsigned char * src, int src_width, int src_height, const int16_t * xs, const int16_t * ys,
+                          const uint8_t * wxs, const uint8_t * wys, unsigned char * dst, int begin, int n, const bayer_layout_t & layout) {
+    const int ONE = PFCMU::RemapTable::ONE;
+    bayer_source_t<false> inside = { src, src_width, src_height };
+    bayer_source_t<true> border = { src, src_width, src_height };
+    for(int i=begin ; i<n ; i++) {
+      unsigned char * d = dst + i * 3;
+      if(wxs[i] == PFCMU::RemapTable::OUTLIER) {
+        d[0] = d[1] = d[2] = 0;
+        continue;
+      }
+      const int X = xs[i] * ONE + wxs[i];
+      const int Y = ys[i] * ONE + wys[i];
+      if(bayer_inside(xs[i], ys[i], src_width, src_height)) {
+        bayer_pixel(inside, layout, X, Y, d);
+      } else {
+        bayer_pixel(border, layout, X, Y, d);
+      }
+    }
+  }
+
+  /**
+   * 8 pixels of 2 taps (bytes 0 and 2 of the words gathered) weighted
+   * by w = (1 - f, f) in int16 pairs, in 1/128
+   */
+  __attribute__((target("avx2")))
+  inline __m256i bayer_taps(__m256i pairs, __m256i w) {
+    return _mm256_madd_epi16(pairs, w);
+  }
+
+  __attribute__((target("avx2")))
+  inline __m256i bayer_weights(__m256i f) {
+    return _mm256_or_si256(_mm256_sub_epi32(_mm256_set1_epi32(128), f), _mm256_slli_epi32(f, 16));
+  }
+
+  /**
+   * The lattice of R or B: the 2 taps of a row are bytes 0 and 2 of a word
+   */
+  __attribute__((target("avx2")))
+  inline __m256i bayer_lattice_avx2(const int * base, __m256i X, __m256i Y, __m256i stride, int ox, int oy) {
+    const __m256i m255 = _mm256_set1_epi32(255);
+    const __m256i even = _mm256_set1_epi32(0x00ff00ff);
+    const __m256i tx = _mm256_sub_epi32(X, _mm256_set1_epi32(ox * PFCMU::RemapTable::ONE));
+    const __m256i ty = _mm256_sub_epi32(Y, _mm256_set1_epi32(oy * PFCMU::RemapTable::ONE));
+    const __m256i wx = bayer_weights(_mm256_srli_epi32(_mm256_and_si256(tx, m255), 1));
+    const __m256i wy = bayer_weights(_mm256_srli_epi32(_mm256_and_si256(ty, m255), 1));
+    const __m256i x0 = _mm256_add_epi32(_mm256_set1_epi32(ox), _mm256_slli_epi32(_mm256_srai_epi32(tx, 8), 1));
+    const __m256i y0 = _mm256_add_epi32(_mm256_set1_epi32(oy), _mm256_slli_epi32(_mm256_srai_epi32(ty, 8), 1));
+    const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(y0, stride), x0);
+    const __m256i r0 = bayer_taps(_mm256_and_si256(_mm256_i32gather_epi32(base, offset, 1), even), wx);
+    const __m256i r1 = bayer_taps(_mm256_and_si256(_mm256_i32gather_epi32(base, _mm256_add_epi32(offset, _mm256_slli_epi32(stride, 1)), 1), even), wx);
+    // the rows are not more than 255*128, i.e., fit in int16
+    return _mm256_madd_epi16(_mm256_or_si256(r0, _mm256_slli_epi32(r1, 16)), wy);
+  }
+
+  /**
+   * The 45-degree lattice of G: (x, y) and (x+2, y) are bytes 0 and 2
+   * of a word, and (x+1, y+1), (x+1, y-1) are gathered separately
+   */
+  __attribute__((target("avx2")))
+  inline __m256i bayer_diamond_avx2(const int * base, __m256i X, __m256i Y, __m256i stride, int g) {
+    const __m256i m255 = _mm256_set1_epi32(255);
+    const __m256i Xg = _mm256_sub_epi32(X, _mm256_set1_epi32(g * PFCMU::RemapTable::ONE));
+    const __m256i P = _mm256_add_epi32(Xg, Y);
+    const __m256i Q = _mm256_sub_epi32(Xg, Y);
+    const __m256i wp = bayer_weights(_mm256_srli_epi32(_mm256_and_si256(P, m255), 1));
+    const __m256i wq = bayer_weights(_mm256_srli_epi32(_mm256_and_si256(Q, m255), 1));
+    const __m256i p0 = _mm256_srai_epi32(P, 8);
+    const __m256i q0 = _mm256_srai_epi32(Q, 8);
+    const __m256i x = _mm256_add_epi32(_mm256_add_epi32(p0, q0), _mm256_set1_epi32(g));
+    const __m256i y = _mm256_sub_epi32(p0, q0);
+    const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(y, stride), x);
+    const __m256i a = _mm256_i32gather_epi32(base, offset, 1);
+    const __m256i b = _mm256_i32gather_epi32(base, _mm256_add_epi32(offset, _mm256_add_epi32(stride, _mm256_set1_epi32(1))), 1);
+    const __m256i c = _mm256_i32gather_epi32(base, _mm256_sub_epi32(offset, _mm256_sub_epi32(stride, _mm256_set1_epi32(1))), 1);
+    // (x, y) and (x+1, y+1), (x+1, y-1) and (x+2, y)
+    const __m256i pair0 = _mm256_or_si256(_mm256_and_si256(a, m255), _mm256_slli_epi32(_mm256_and_si256(b, m255), 16));
+    const __m256i pair1 = _mm256_or_si256(_mm256_and_si256(c, m255), _mm256_and_si256(a, _mm256_set1_epi32(0x00ff0000)));
+    const __m256i r0 = bayer_taps(pair0, wp);
+    const __m256i r1 = bayer_taps(pair1, wp);
+    return _mm256_madd_epi16(_mm256_or_si256(r0, _mm256_slli_epi32(r1, 16)), wq);
+  }
+
+  /**
+   * 8 values of 1/(1 << SHIFT) in int32 to 8 bytes
+   */
+  __attribute__((target("avx2")))
+  inline __m128i bayer_pack(__m256i v) {
+    v = _mm256_srli_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(1 << (SHIFT - 1))), SHIFT);
+    const __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_packus_epi16(w, w);
+  }
+
+  __attribute__((target("avx2")))
+  void remap_bayer_avx2(const unsigned char * src, int src_width, int src_height, const int16_t * xs, const int16_t * ys,
+                        const uint8_t * wxs, const uint8_t * wys, unsigned char * dst, int n, const bayer_layout_t & layout) {
+    const int * base = reinterpret_cast<const int *>(src);
+    const __m256i stride = _mm256_set1_epi32(src_width);
+    const __m128i lo = _mm_set1_epi16(2);
+    const __m128i hi_x = _mm_set1_epi16(src_width - 4);
+    const __m128i hi_y = _mm_set1_epi16(src_height - 4);
+    const __m128i outlier = _mm_set1_epi8((char)PFCMU::RemapTable::OUTLIER);
+    // [B0..B7 G0..G7] and [R0..R7] to B G R interleaved
+    const __m128i bg0 = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+    const __m128i r0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i bg1 = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    int i = 0;
+    for( ; i + 8 <= n ; i += 8) {
+      const __m128i x16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(xs + i));
+      const __m128i y16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ys + i));
+      const __m128i wx8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(wxs + i));
+      const __m128i wy8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(wys + i));
+
+      // the border and the outliers by the scalar code
+      const __m128i inside = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi16(x16, lo), _mm_cmpgt_epi16(hi_x, x16)),
+                                           _mm_and_si128(_mm_cmpgt_epi16(y16, lo), _mm_cmpgt_epi16(hi_y, y16)));
+      if(_mm_movemask_epi8(inside) != 0xffff || _mm_movemask_epi8(_mm_cmpeq_epi8(wx8, outlier)) & 0xff) {
+        remap_bayer_scalar(src, src_width, src_height, xs, ys, wxs, wys, dst, i, i + 8, layout);
+        continue;
+      }
+
+      const __m256i X = _mm256_add_epi32(_mm256_slli_epi32(_mm256_cvtepi16_epi32(x16), 7), _mm256_cvtepu8_epi32(wx8));
+      const __m256i Y = _mm256_add_epi32(_mm256_slli_epi32(_mm256_cvtepi16_epi32(y16), 7), _mm256_cvtepu8_epi32(wy8));
+      const __m128i b = bayer_pack(bayer_lattice_avx2(base, X, Y, stride, layout.bx, layout.by));
+      const __m128i g = bayer_pack(bayer_diamond_avx2(base, X, Y, stride, layout.g));
+      const __m128i r = bayer_pack(bayer_lattice_avx2(base, X, Y, stride, layout.rx, layout.ry));
+
+      const __m128i bg = _mm_unpacklo_epi64(b, g);
+      unsigned char * d = dst + i * 3;
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(d), _mm_or_si128(_mm_shuffle_epi8(bg, bg0), _mm_shuffle_epi8(r, r0)));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(d + 16), _mm_or_si128(_mm_shuffle_epi8(bg, bg1), _mm_shuffle_epi8(r, r1)));
+    }
+    remap_bayer_scalar(src, src_width, src_height, xs, ys, wxs, wys, dst, i, n, layout);
+  }
+
+  /**
+   * Integer position and weight of a source coordinate in [0:size-1]
+   */
+  void quantize(float v, int size, int16_t * pos, uint8_t * weight) {
+    const int ONE = PFCMU::RemapTable::ONE;
+    int q = (int)floor(v * ONE + 0.5f);
+    int p = q / ONE;
+    int w = q % ONE;
+    // the last pixel is the right (bottom) one of the last pair
+    if(p >= size - 1) {
+      p = size - 2;
+      w = ONE;
+    }
+    *pos = (int16_t)p;
+    *weight = (uint8_t)w;
+  }
+}
+
+PFCMU::RemapTable::RemapTable()
+  : m_width(0), m_height(0), m_src_width(0), m_src_height(0),
+    m_x(NULL), m_y(NULL), m_wx(NULL), m_wy(NULL), m_map(NULL), m_map_bytes(0) {
+}
+
+PFCMU::RemapTable::~RemapTable() {
+  clear();
+}
+
+void PFCMU::RemapTable::clear() {
+  if(m_map) {
+    munmap(m_map, m_map_bytes);
+    m_map = NULL;
+    m_map_bytes = 0;
+  }
+  std::vector<unsigned char>().swap(m_buf);
+  m_x = m_y = NULL;
+  m_wx = m_wy = NULL;
+  m_width = m_height = 0;
+  m_src_width = m_src_height = 0;
+}
+
+void PFCMU::RemapTable::build(int width, int height, const float * mapx, const float * mapy, int src_width, int src_height) {
+  ASSERT(src_width >= 2 && src_height >= 2 && src_width <= 32767 && src_height <= 32767);
+  clear();
+
+  const size_t n = (size_t)width * height;
+  m_buf.resize(n * 6);
+  int16_t * xs = reinterpret_cast<int16_t *>(&m_buf[0]);
+  int16_t * ys = xs + n;
+  uint8_t * wxs = reinterpret_cast<uint8_t *>(ys + n);
+  uint8_t * wys = wxs + n;
+
+  for(size_t i=0 ; i<n ; i++) {
+    // NaN is an outlier as well
+    if(! (mapx[i] >= 0 && mapx[i] <= src_width - 1 && mapy[i] >= 0 && mapy[i] <= src_height - 1)) {
+      xs[i] = ys[i] = 0;
+      wxs[i] = OUTLIER;
+      wys[i] = 0;
+      continue;
+    }
+    quantize(mapx[i], src_width, &xs[i], &wxs[i]);
+    quantize(mapy[i], src_height, &ys[i], &wys[i]);
+  }
+
+  m_width = width;
+  m_height = height;
+  m_src_width = src_width;
+  m_src_height = src_height;
+  m_x = xs;
+  m_y = ys;
+  m_wx = wxs;
+  m_wy = wys;
+}
+
+int PFCMU::RemapTable::save(const char * filename, uint32_t key) const {
+  if(empty()) {
+    return -1;
+  }
+  unsigned char header[HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  const uint32_t v[6] = { VERSION, key, (uint32_t)m_width, (uint32_t)m_height, (uint32_t)m_src_width, (uint32_t)m_src_height };
+  memcpy(header, MAGIC, sizeof(MAGIC));
+  memcpy(header + sizeof(MAGIC), v, sizeof(v));
+
+  FILE * fp = fopen(filename, "wb");
+  if(! fp) {
+    return -1;
+  }
+  const size_t n = (size_t)m_width * m_height;
+  bool ok = 1 == fwrite(header, sizeof(header), 1, fp) &&
+    1 == fwrite(m_x, n * sizeof(int16_t), 1, fp) &&
+    1 == fwrite(m_y, n * sizeof(int16_t), 1, fp) &&
+    1 == fwrite(m_wx, n, 1, fp) &&
+    1 == fwrite(m_wy, n, 1, fp);
+  ok = (0 == fclose(fp)) && ok;
+  return ok ? 0 : -1;
+}
+
+int PFCMU::RemapTable::load(const char * filename, uint32_t key) {
+  clear();
+
+  const int fd = open(filename, O_RDONLY);
+  if(fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  unsigned char header[HEADER_SIZE];
+  uint32_t v[6];
+  if(0 != fstat(fd, &st) || (ssize_t)sizeof(header) != pread(fd, header, sizeof(header), 0) ||
+     0 != memcmp(header, MAGIC, sizeof(MAGIC))) {
+    close(fd);
+    return -1;
+  }
+  memcpy(v, header + sizeof(MAGIC), sizeof(v));
+  const size_t n = (size_t)v[2] * v[3];
+  if(v[0] != VERSION || v[1] != key || v[4] < 2 || v[5] < 2 || (size_t)st.st_size != HEADER_SIZE + n * 6) {
+    close(fd);
+    return -1;
+  }
+
+  void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    return -1;
+  }
+
+  m_map = map;
+  m_map_bytes = st.st_size;
+  m_width = v[2];
+  m_height = v[3];
+  m_src_width = v[4];
+  m_src_height = v[5];
+  m_x = reinterpret_cast<const int16_t *>(static_cast<const unsigned char *>(map) + HEADER_SIZE);
+  m_y = m_x + n;
+  m_wx = reinterpret_cast<const uint8_t *>(m_y + n);
+  m_wy = m_wx + n;
+  return 0;
+}
+
+void PFCMU::RemapTable::apply(const unsigned char * src, unsigned char * dst, int dst_step, int row_begin, int row_end) const {
+  for(int y=row_begin ; y<row_end ; y++) {
+    const size_t o = (size_t)y * m_width;
+    if(s_avx2) {
+      remap_avx2(src, m_src_width, m_x + o, m_y + o, m_wx + o, m_wy + o, dst + (size_t)y * dst_step, m_width);
+    } else {
+      remap_scalar(src, m_src_width, m_x + o, m_y + o, m_wx + o, m_wy + o, dst + (size_t)y * dst_step, 0, m_width);
+    }
+  }
+}
+
+void PFCMU::RemapTable::apply_bayer(const unsigned char * src, unsigned char * dst, int dst_step, bayer_t pattern, int row_begin, int row_end) const {
+  for(int y=row_begin ; y<row_end ; y++) {
+    const size_t o = (size_t)y * m_width;
+    if(s_avx2) {
+      remap_bayer_avx2(src, m_src_width, m_src_height, m_x + o, m_y + o, m_wx + o, m_wy + o, dst + (size_t)y * dst_step, m_width,
+                       BAYER_LAYOUTS[pattern]);
+    } else {
+      remap_bayer_scalar(src, m_src_width, m_src_height, m_x + o, m_y + o, m_wx + o, m_wy + o, dst + (size_t)y * dst_step, 0, m_width,
+                         BAYER_LAYOUTS[pattern]);
+    }
+  }
+}
+
+bool PFCMU::RemapTable::avx2() {
+  return s_avx2;
+}
+
+PFCMU::Remapper::Remapper() : m_pool(NULL) {
+}
+
+PFCMU::Remapper::~Remapper() {
+  delete m_pool;
+}
+
+void PFCMU::Remapper::init(int threads) {
+  delete m_pool;
+  m_pool = new WorkerPool(threads > 0 ? threads : (int)boost::thread::hardware_concurrency());
+}
+
+void PFCMU::Remapper::check() const {
+  for(int i=0 ; i<PFCMU::CAMS ; i++) {
+    ASSERT(! m_tables[i].empty());
+    ASSERT(m_tables[i].width() == m_tables[0].width() && m_tables[i].height() == m_tables[0].height());
+    ASSERT(m_tables[i].src_width() == m_tables[0].src_width() && m_tables[i].src_height() == m_tables[0].src_height());
+  }
+}
+
+void PFCMU::Remapper::apply_band(const unsigned char * frame, unsigned char * out, int bayer, int job) {
+  const int camera = job / BANDS;
+  const int band = job % BANDS;
+  const RemapTable & t = m_tables[camera];
+  const int channels = bayer < 0 ? 1 : 3;
+  const size_t src_bytes = (size_t)t.src_width() * t.src_height();
+  const size_t dst_bytes = (size_t)t.width() * t.height() * channels;
+  const int row_begin = t.height() * band / BANDS;
+  const int row_end = t.height() * (band + 1) / BANDS;
+  if(bayer < 0) {
+    t.apply(frame + src_bytes * camera, out + dst_bytes * camera, t.width(), row_begin, row_end);
+  } else {
+    t.apply_bayer(frame + src_bytes * camera, out + dst_bytes * camera, t.width() * 3, static_cast<RemapTable::bayer_t>(bayer),
+                  row_begin, row_end);
+  }
+}
+
+void PFCMU::Remapper::apply(const void * frame, void * out) {
+  check();
+  m_pool->parallel_for(PFCMU::CAMS * BANDS, boost::bind(&Remapper::apply_band, this,
+                                                        static_cast<const unsigned char *>(frame),
+                                                        static_cast<unsigned char *>(out), -1, _1));
+}
+
+void PFCMU::Remapper::apply_bayer(const void * frame, void * out, RemapTable::bayer_t pattern) {
+  check();
+  m_pool->parallel_for(PFCMU::CAMS * BANDS, boost::bind(&Remapper::apply_band, this,
+                                                        static_cast<const unsigned char *>(frame),
+                                                        static_cast<unsigned char *>(out), (int)pattern, _1));
+}